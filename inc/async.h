@@ -0,0 +1,212 @@
+#pragma once
+
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Resumes coroutines, so completions arriving on a library's network thread
+// never run application code there
+class Executor {
+ public:
+  virtual ~Executor() {}
+  virtual void post(std::coroutine_handle<> handle) = 0;
+
+  // co_await executor.schedule() continues the coroutine on the executor
+  auto schedule() {
+    struct Awaiter {
+      Executor &executor;
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> handle) { executor.post(handle); }
+      void await_resume() const noexcept {}
+    };
+    return Awaiter{*this};
+  }
+};
+
+// A fixed set of threads resuming coroutines in the order they were posted.
+// Thousands of suspended flows cost their coroutine frames, not threads.
+class ThreadPoolExecutor : public Executor {
+ public:
+  explicit ThreadPoolExecutor(size_t threads = 1);
+  ThreadPoolExecutor(const ThreadPoolExecutor &) = delete;
+  ~ThreadPoolExecutor() override;
+
+  void post(std::coroutine_handle<> handle) override;
+  // Resumes what is already posted, then joins the threads
+  void stop();
+
+ private:
+  std::mutex mutex;
+  std::condition_variable condition;
+  std::deque<std::coroutine_handle<>> ready;
+  std::vector<std::thread> threads;
+  bool stopping;
+
+  void run();
+};
+
+template <typename T>
+class Task;
+
+namespace detail {
+
+// Symmetric transfer back to the awaiting coroutine, no stack growth
+struct FinalAwaiter {
+  bool await_ready() const noexcept { return false; }
+  template <typename Promise>
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+    std::coroutine_handle<> continuation = handle.promise().continuation;
+    return continuation ? continuation : std::noop_coroutine();
+  }
+  void await_resume() const noexcept {}
+};
+
+struct TaskPromiseBase {
+  std::coroutine_handle<> continuation;
+  std::exception_ptr exception;
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+  std::optional<T> value;
+
+  Task<T> get_return_object();
+  void return_value(T result) { value = std::move(result); }
+  T result() {
+    if (exception) std::rethrow_exception(exception);
+    return std::move(*value);
+  }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+  Task<void> get_return_object();
+  void return_void() {}
+  void result() {
+    if (exception) std::rethrow_exception(exception);
+  }
+};
+
+}  // namespace detail
+
+// Lazy coroutine: it starts when awaited, and resumes its awaiter when done
+template <typename T = void>
+class Task {
+ public:
+  using promise_type = detail::TaskPromise<T>;
+
+  Task() = default;
+  explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+  Task(Task &&other) noexcept : handle(std::exchange(other.handle, {})) {}
+  Task &operator=(Task &&other) noexcept {
+    if (this != &other) {
+      if (handle) handle.destroy();
+      handle = std::exchange(other.handle, {});
+    }
+    return *this;
+  }
+  Task(const Task &) = delete;
+  ~Task() {
+    if (handle) handle.destroy();
+  }
+
+  auto operator co_await() && noexcept {
+    struct Awaiter {
+      std::coroutine_handle<promise_type> handle;
+      bool await_ready() const noexcept { return !handle || handle.done(); }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+      }
+      T await_resume() { return handle.promise().result(); }
+    };
+    return Awaiter{handle};
+  }
+
+ private:
+  std::coroutine_handle<promise_type> handle;
+};
+
+namespace detail {
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object() {
+  return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+  return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// Fire and forget coroutine, its frame frees itself when it ends
+struct DetachedTask {
+  struct promise_type {
+    DetachedTask get_return_object() { return {std::coroutine_handle<promise_type>::from_promise(*this)}; }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+  std::coroutine_handle<promise_type> handle;
+};
+
+template <typename T>
+struct SyncWaitState {
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool done = false;
+  std::optional<T> value;
+  std::exception_ptr exception;
+};
+
+template <>
+struct SyncWaitState<void> {
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool done = false;
+  std::exception_ptr exception;
+};
+
+template <typename T>
+DetachedTask runAndSignal(Task<T> task, SyncWaitState<T> *state) {
+  try {
+    if constexpr (std::is_void_v<T>)
+      co_await std::move(task);
+    else
+      state->value = co_await std::move(task);
+  } catch (...) {
+    state->exception = std::current_exception();
+  }
+  std::unique_lock<std::mutex> lck(state->mutex);
+  state->done = true;
+  state->condition.notify_one();
+}
+
+}  // namespace detail
+
+// Starts a task on the executor and lets it run to completion on its own;
+// an exception escaping it is logged
+void spawn(Executor &executor, Task<void> task);
+
+// Runs a task to completion, blocking the calling thread: the bridge from
+// main() or a test into coroutine code
+template <typename T>
+T syncWait(Task<T> task) {
+  detail::SyncWaitState<T> state;
+  detail::runAndSignal(std::move(task), &state).handle.resume();
+  std::unique_lock<std::mutex> lck(state.mutex);
+  state.condition.wait(lck, [&]() { return state.done; });
+  if (state.exception) std::rethrow_exception(state.exception);
+  if constexpr (!std::is_void_v<T>) return std::move(*state.value);
+}
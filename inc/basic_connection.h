@@ -0,0 +1,38 @@
+#pragma once
+
+#include <concepts>
+
+// A backend exposes its concrete message type and a non-virtual publish()
+template <typename Backend>
+concept ConnectionBackend = requires(Backend &backend, const typename Backend::MessageType &message) {
+  { backend.publish(message) } -> std::same_as<bool>;
+  backend.connect();
+  backend.disconnect();
+  backend.getStatus();
+};
+
+// Statically typed front-end over a connection backend. Every call resolves
+// at compile time: no vtable, no message type check, and publish() can be
+// inlined into the caller. The virtual Connection interface stays available
+// on the same object for code that needs to mix connection types.
+//
+//   MQTTConnection connection(parameters);
+//   BasicConnection<MQTTConnection> fast(connection);
+//   fast.send(MQTTMessage("topic", "payload"));
+template <ConnectionBackend Backend>
+class BasicConnection {
+ public:
+  using MessageType = typename Backend::MessageType;
+
+  explicit BasicConnection(Backend &backend) : backend(backend) {}
+
+  void connect() { backend.connect(); }
+  void disconnect() { backend.disconnect(); }
+  bool send(const MessageType &message) { return backend.publish(message); }
+  auto getStatus() const { return backend.getStatus(); }
+
+  Backend &getBackend() { return backend; }
+
+ private:
+  Backend &backend;
+};
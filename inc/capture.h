@@ -0,0 +1,133 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Messages between two index entries of a closed capture
+#define CAPTURE_INDEX_INTERVAL 1024
+
+enum CaptureDirection { CAPTURE_RECEIVED = 0, CAPTURE_SENT };
+
+// One captured message. topic and payload point into the reader's mapping
+// and stay valid while it is open.
+struct CaptureRecord {
+  CaptureDirection direction;
+  uint32_t topicId;
+  std::string_view topic;
+  std::string_view payload;
+  int qos;
+  bool retain;
+  // system_clock, nanoseconds since the epoch
+  int64_t timestampNs;
+};
+
+// Append-only capture of a session's traffic, for replaying it later with
+// CaptureReplayer. The file is mapped once at its full capacity (sparse
+// until written): write() reserves its record with one atomic add and
+// copies into the mapping, so taps on several threads never lock each other
+// out. Topics are stored once, a record carries the topic's id.
+//
+// close() appends an index (one entry every CAPTURE_INDEX_INTERVAL records)
+// and the topic table, and truncates the file to what was written. A
+// capture that was never closed (crash) still reads back, sequentially.
+// Records that do not fit in capacity are counted and dropped.
+class CaptureWriter {
+ public:
+  explicit CaptureWriter(const std::string &path, size_t capacity = (size_t)256 << 20);
+  ~CaptureWriter();
+
+  CaptureWriter(const CaptureWriter &) = delete;
+  CaptureWriter &operator=(const CaptureWriter &) = delete;
+
+  // False if the file could not be created or mapped
+  bool isOpen() const { return map != nullptr; }
+  // Safe from any thread, but not concurrently with close()
+  bool write(CaptureDirection direction, std::string_view topic, std::string_view payload, int qos, bool retain,
+             std::chrono::system_clock::time_point timestamp = std::chrono::system_clock::now());
+  void close();
+
+  const std::string &getPath() const { return path; }
+  uint64_t getRecords() const { return records.load(std::memory_order_relaxed); }
+  uint64_t getDropped() const { return dropped.load(std::memory_order_relaxed); }
+  // Bytes written so far
+  size_t getSize() const;
+
+ private:
+  std::string path;
+  int fd = -1;
+  char *map = nullptr;
+  size_t capacity = 0;
+  std::atomic<uint64_t> offset;
+  std::atomic<uint64_t> records;
+  std::atomic<uint64_t> dropped;
+
+  // Finds a std::string key from a string_view without building one
+  struct TopicHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view topic) const { return std::hash<std::string_view>()(topic); }
+  };
+
+  std::shared_mutex topicsMutex;
+  std::unordered_map<std::string, uint32_t, TopicHash, std::equal_to<>> topicIds;
+  std::vector<std::string> topics;
+
+  // -1 when the topic's record did not fit
+  int64_t topicId(std::string_view topic, int64_t timestampNs);
+  bool append(uint8_t kind, uint32_t topicId, std::string_view payload, int qos, bool retain, int64_t timestampNs);
+};
+
+// Reads a capture back, closed or not
+class CaptureReader {
+ public:
+  explicit CaptureReader(const std::string &path);
+  ~CaptureReader();
+
+  CaptureReader(const CaptureReader &) = delete;
+  CaptureReader &operator=(const CaptureReader &) = delete;
+
+  bool isOpen() const { return map != nullptr; }
+  // Whether the writer closed it, with the index and topic table
+  bool isComplete() const { return complete; }
+
+  // The next message, false at the end
+  bool next(CaptureRecord &record);
+  void rewind();
+  // Positions next() on the first message at or after timestamp, through
+  // the index when the capture is complete
+  void seek(std::chrono::system_clock::time_point timestamp);
+
+  std::chrono::system_clock::time_point getStart() const;
+  // Messages in the capture, 0 when it was not closed
+  uint64_t getRecordCount() const { return recordCount; }
+  size_t getTopicCount() const { return topics.size(); }
+  // Empty for an unknown id
+  std::string_view getTopic(uint32_t topicId) const;
+
+ private:
+  struct IndexEntry {
+    int64_t timestampNs;
+    uint64_t offset;
+  };
+
+  int fd = -1;
+  char *map = nullptr;
+  size_t size = 0;
+  size_t end = 0;
+  size_t position = 0;
+  bool complete = false;
+  int64_t startNs = 0;
+  uint64_t recordCount = 0;
+  std::vector<std::string_view> topics;
+  std::vector<IndexEntry> index;
+
+  // Reads the record at position, topic records included; false at the end
+  bool read(uint8_t &kind, CaptureRecord &record);
+};
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "capture.h"
+#include "connection.h"
+#include "mqtt_connection.h"
+#include "udp_connection.h"
+#include "websocket_connection.h"
+
+enum CaptureReplayMode {
+  // Messages keep the spacing they were captured with, scaled by speed
+  CAPTURE_REPLAY_TIMED = 0,
+  // As fast as the connection takes them
+  CAPTURE_REPLAY_MAX_SPEED
+};
+
+struct CaptureReplayOptions {
+  CaptureReplayMode mode = CAPTURE_REPLAY_TIMED;
+  // Timed mode only, 2 replays twice as fast as captured
+  double speed = 1.0;
+  bool sent = true;
+  bool received = true;
+  // Only topics matching this MQTT filter are replayed
+  std::string filter = "#";
+  // How long one message may wait for room in the connection, see
+  // Connection::sendFor(); the message counts as failed after it
+  std::chrono::milliseconds sendTimeout = std::chrono::milliseconds(1000);
+};
+
+struct CaptureReplayResult {
+  uint64_t sent;
+  uint64_t failed;
+  // Filtered out
+  uint64_t skipped;
+  double seconds;
+  double rate;
+  // Timed mode: how late messages were handed to the connection compared
+  // with the capture, in microseconds
+  double meanLagUs;
+  double maxLagUs;
+};
+
+// Turns a record into the message to send, nullptr skips it. The message
+// must stay valid until the next call.
+typedef const Message *(*CaptureMessageBuilder)(void *userData, const CaptureRecord &record);
+
+// Sends a capture again through any Connection, from the reader's position
+// to the end, for load tests and regression benchmarks built from real
+// sessions. Messages go through sendFor(), so a connection that falls
+// behind paces the replay instead of dropping. Without a builder, records
+// become the message type of the connection: MQTTMessage (topic, payload,
+// QoS, retain), WebSocketMessage (payload) or UDPMessage (the capture's
+// topic id, payload).
+class CaptureReplayer {
+ public:
+  CaptureReplayer(CaptureReader &reader, Connection &connection, const CaptureReplayOptions &options = {});
+
+  void setMessageBuilder(CaptureMessageBuilder builder, void *userData);
+
+  // Replays on the calling thread, returns at the end of the capture or
+  // after stop()
+  CaptureReplayResult run();
+  // From any thread
+  void stop() { running.store(false, std::memory_order_relaxed); }
+
+ private:
+  CaptureReader &reader;
+  Connection &connection;
+  CaptureReplayOptions options;
+  CaptureMessageBuilder builder = nullptr;
+  void *builderData = nullptr;
+  std::atomic<bool> running{false};
+
+  // Filter result per topic id: -1 unknown, 0 skipped, 1 replayed
+  std::vector<int8_t> matches;
+
+  MQTTMessage mqttMessage;
+  WebSocketMessage webSocketMessage;
+  UDPMessage udpMessage;
+
+  bool selected(const CaptureRecord &record);
+  const Message *build(const CaptureRecord &record);
+};
@@ -1,16 +1,59 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <mutex>
 #include <queue>
 #include <condition_variable>
 
+#include "connection_error.h"
+#include "object_pool.h"
+#include "shared_payload.h"
+
+// Tags messages and parameters with the connection type they belong to, so
+// the virtual interface can check them without RTTI
+enum ConnectionType {
+	CONNECTION_TYPE_GENERIC = 0,
+	CONNECTION_TYPE_MQTT,
+	CONNECTION_TYPE_WEBSOCKET,
+	CONNECTION_TYPE_UDP,
+	CONNECTION_TYPE_COUNT
+};
+
 class Message {
 public:
+	Message() : type(CONNECTION_TYPE_GENERIC){};
 	virtual ~Message(){};
+
+	ConnectionType getType() const { return type; };
+
+protected:
+	// Tagged and copied only as part of a subclass: send() casts by the tag,
+	// a sliced copy would keep it without the subclass's members
+	explicit Message(ConnectionType type) : type(type){};
+	Message(const Message &) = default;
+	Message &operator=(const Message &) = default;
+
+private:
+	ConnectionType type;
 };
 class ConnectionParameters {
 public:
+	ConnectionParameters() : type(CONNECTION_TYPE_GENERIC){};
+	explicit ConnectionParameters(ConnectionType type) : type(type){};
 	virtual ~ConnectionParameters(){};
+
+	ConnectionType getType() const { return type; };
+
+protected:
+	// Copied only as part of a subclass: a sliced copy would keep the
+	// subclass's tag without its members
+	ConnectionParameters(const ConnectionParameters &) = default;
+	ConnectionParameters &operator=(const ConnectionParameters &) = default;
+
+private:
+	ConnectionType type;
 };
 
 enum ConnectionStatus {
@@ -21,10 +64,119 @@ enum ConnectionStatus {
 	CONNECTION_STATUS_COUNT
 };
 
+// Told about every status change, from the thread making it
+typedef void (*StatusWatcher)(void *context, int id, ConnectionStatus previous, ConnectionStatus status);
+
+// Connection status as an atomic state: every change bumps a counter, wakes
+// the threads in waitFor() and makes the event fd readable. Assigning a
+// ConnectionStatus goes through transition(), so subclasses keep writing
+// "status = CONNECTION_STATUS_..." and an illegal edge is ignored.
+class ConnectionState {
+public:
+	explicit ConnectionState(ConnectionStatus status = CONNECTION_STATUS_DISCONNECTED);
+	ConnectionState(const ConnectionState &) = delete;
+	~ConnectionState();
+
+	ConnectionState &operator=(ConnectionStatus status) {
+		transition(status);
+		return *this;
+	}
+	operator ConnectionStatus() const { return load(); }
+
+	ConnectionStatus load() const { return status.load(std::memory_order_acquire); }
+	// Moves to status unless the edge from the current one is illegal (see
+	// connection.cpp), waiters are only woken if it changed
+	bool transition(ConnectionStatus status);
+	// Same, only from from
+	bool transition(ConnectionStatus from, ConnectionStatus to);
+	uint64_t getChanges() const { return changes.load(std::memory_order_acquire); }
+
+	bool waitFor(ConnectionStatus status, std::chrono::milliseconds timeout);
+	// Returns once the status is no longer from, or at the timeout
+	ConnectionStatus waitForChange(ConnectionStatus from, std::chrono::milliseconds timeout);
+
+	// Created on first use. Readable after a change until it is read (8 bytes
+	// on Linux where it is an eventfd, a pipe elsewhere).
+	int getEventFd();
+	// Returns once a call to the previous watcher in progress on another
+	// thread is over
+	void setWatcher(StatusWatcher watcher, void *context, int id);
+
+private:
+	std::atomic<ConnectionStatus> status;
+	std::atomic<uint64_t> changes;
+	std::mutex mutex;
+	std::condition_variable condition;
+	int eventFds[2];
+	StatusWatcher watcher;
+	void *watcherContext;
+	int watcherId;
+	// Calls to the watcher in progress, under mutex
+	int notifying;
+
+	void notify(ConnectionStatus previous, ConnectionStatus status);
+};
+
+// High/low watermarks on a connection's backlog (see getBacklog()). The
+// connection is blocked from the update that finds the backlog at high or
+// above until one finds it back at low or below; unblocking wakes the
+// waiters and makes the event fd readable. Threads waiting in waitFreed()
+// are also woken by any update that finds the backlog smaller, so sendFor()
+// works with watermarks disabled.
+class Watermarks {
+public:
+	Watermarks();
+	Watermarks(const Watermarks &) = delete;
+	~Watermarks();
+
+	// high 0 disables them; low is capped to high
+	void set(size_t high, size_t low);
+	size_t getHigh() const { return high.load(std::memory_order_relaxed); }
+	size_t getLow() const { return low.load(std::memory_order_relaxed); }
+	// Whether updates have anything to do, checked before computing the backlog
+	bool isActive() const { return high.load(std::memory_order_relaxed) > 0 || waiters.load(std::memory_order_acquire) > 0; }
+	bool isBlocked() const { return blocked.load(std::memory_order_acquire); }
+
+	// 1 when this update blocked, -1 when it unblocked, 0 otherwise. Callers
+	// serialize reading the backlog and updating, see updateWatermarks().
+	int update(size_t backlog);
+	uint64_t getFreed() const { return freed.load(std::memory_order_acquire); }
+	// Waits until the backlog shrank since getFreed() returned seen and the
+	// connection is not blocked, false at the deadline. Only woken by a
+	// shrinking backlog while a Waiter is alive.
+	bool waitFreed(uint64_t seen, std::chrono::steady_clock::time_point deadline);
+	// Created on first use, as ConnectionState's
+	int getEventFd();
+
+	// Counts a thread about to wait, for as long as it lives
+	struct Waiter {
+		Watermarks &watermarks;
+		explicit Waiter(Watermarks &watermarks) : watermarks(watermarks) { watermarks.waiters.fetch_add(1, std::memory_order_acq_rel); }
+		~Waiter() { watermarks.waiters.fetch_sub(1, std::memory_order_acq_rel); }
+	};
+
+private:
+	std::atomic<size_t> high;
+	std::atomic<size_t> low;
+	std::atomic<size_t> backlog;
+	std::atomic<bool> blocked;
+	std::atomic<uint64_t> freed;
+	std::atomic<int> waiters;
+	std::mutex mutex;
+	std::condition_variable condition;
+	int eventFds[2];
+};
+
 typedef void (*OnConnectCallback)(void *userData, int id);
 typedef void (*OnDisconnectCallback)(void *userData, int id);
 typedef void (*OnMessageCallback)(void *userData, int id, const Message &message);
-typedef void (*OnErrorCallback)(void *userData, int id, const char *error);
+typedef void (*OnErrorCallback)(void *userData, int id, const ConnectionError &error);
+// messageId is the backend's id of a completed publish (PUBACK/PUBCOMP, or
+// written to the socket for QoS 0)
+typedef void (*OnPublishCallback)(void *userData, int id, int messageId);
+// blocked is true when the backlog reached the high watermark, false once it
+// drained to the low one
+typedef void (*OnBackpressureCallback)(void *userData, int id, bool blocked);
 
 class Connection {
 public:
@@ -38,7 +190,8 @@ public:
 	int getInstanceID() { return id; };
 
 	virtual void setConnectionParameters(const ConnectionParameters &parameters) = 0;
-	const ConnectionParameters &getConnectionParameters() const { return parameters; };
+	// The connection's own parameters subclass, tagged with its type
+	virtual const ConnectionParameters &getConnectionParameters() const = 0;
 	void setUserData(void *userData); // used for callbacks
 
 	virtual void connect() = 0;
@@ -47,14 +200,54 @@ public:
 	virtual bool send(const Message &message) = 0;
 	virtual void receive(Message &message) = 0;
 	virtual bool queueSend(const Message &message) = 0;
+	// queueSend() unless the backlog is above the watermarks; false without
+	// queueing the message when blocked
+	bool trySend(const Message &message);
+	// queueSend(), parking the caller while the connection is blocked or its
+	// queue is full, up to timeout. False if it timed out.
+	bool sendFor(const Message &message, std::chrono::milliseconds timeout);
+	// Sends a shared buffer without copying it, false if the connection type
+	// does not support it
+	virtual bool sendShared(const SharedMessage &message) { return false; }
 
 	void setOnConnectCallback(OnConnectCallback callback);
 	void setOnDisconnectCallback(OnDisconnectCallback callback);
 	void setOnMessageCallback(OnMessageCallback callback);
 	void setOnErrorCallback(OnErrorCallback callback);
+	void setOnPublishCallback(OnPublishCallback callback);
+	// Aggregates repeated errors into one callback per interval, 0 disables it
+	void setErrorRateLimit(std::chrono::milliseconds interval);
+	void setOnBackpressureCallback(OnBackpressureCallback callback);
+	// Reports what the error rate limit held back once its interval is over,
+	// called by the managers on every tick
+	void flushErrors();
 
 	ConnectionStatus getStatus() const;
+	// Blocks until the status is reached (true) or the timeout expires,
+	// instead of polling getStatus()
+	bool waitForStatus(ConnectionStatus status, std::chrono::milliseconds timeout);
+	// Blocks while the status is from, returns the status it changed to (or
+	// from at the timeout). E.g. waitForStatusChange(CONNECTION_STATUS_CONNECTING, ...)
+	ConnectionStatus waitForStatusChange(ConnectionStatus from, std::chrono::milliseconds timeout);
+	// For the caller's own epoll loop: readable after each status change,
+	// read it to rearm, then getStatus()
+	int getStatusEventFd();
+	// One watcher per connection, used by the supervising manager. Waits for
+	// a call to the previous one in progress on another thread.
+	void setStatusWatcher(StatusWatcher watcher, void *context);
 	virtual size_t getQueueSize() = 0;
+	// Messages queued or in flight, what the watermarks are compared with.
+	// Must not wait on the connection's locks: it is read from its network
+	// thread.
+	virtual size_t getBacklog() { return 0; }
+
+	// Outbound backpressure, disabled (high 0) by default. Reaching high
+	// calls the backpressure callback with blocked, draining back to low
+	// calls it again and makes getWritableEventFd() readable.
+	void setWatermarks(size_t high, size_t low);
+	bool isBlocked() const { return watermarks.isBlocked(); }
+	// Read it to rearm, then trySend() again
+	int getWritableEventFd();
 
 protected:
 	static int connectionCount;
@@ -62,17 +255,39 @@ protected:
 	void *userData;
 	size_t maxQueueSize;
 
-	ConnectionParameters parameters;
-	ConnectionStatus status;
+	ConnectionState status;
 
 	OnConnectCallback onConnectCallback;
 	OnDisconnectCallback onDisconnectCallback;
 	OnMessageCallback onMessageCallback;
 	OnErrorCallback onErrorCallback;
+	OnPublishCallback onPublishCallback;
+	OnBackpressureCallback onBackpressureCallback;
+
+	Watermarks watermarks;
+	// Orders updates with the backlog each one read: a stale reading above
+	// high cannot land after the one that found it drained to low
+	std::mutex watermarksMutex;
 
 	std::mutex messageQueueMutex;
 	std::condition_variable messageQueueCondition;
-	std::queue<Message *> messageQueue;
+	std::queue<PoolHandle<Message>> messageQueue;
+	// messageQueue.size() as of the last change, readable without the lock
+	std::atomic<size_t> queueLength{0};
+
+	ErrorRateLimiter errorLimiter;
+
+	void reportError(ConnectionErrorCode code, int backendCode, const char *backendMessage);
+	// Subclasses call it wherever their backlog may have changed
+	void updateWatermarks() {
+		if (!watermarks.isActive()) return;
+		int change;
+		{
+			std::unique_lock<std::mutex> lck(watermarksMutex);
+			change = watermarks.update(getBacklog());
+		}
+		if (change != 0 && onBackpressureCallback) onBackpressureCallback(userData, id, change > 0);
+	}
 
 	virtual void loop() = 0;
 };
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+enum ConnectionErrorCode {
+  CONNECTION_ERROR_NONE = 0,
+  CONNECTION_ERROR_NOMEM,
+  CONNECTION_ERROR_AUTH,
+  CONNECTION_ERROR_TLS,
+  CONNECTION_ERROR_WILL,
+  CONNECTION_ERROR_LOOP,
+  CONNECTION_ERROR_CONNECT,
+  CONNECTION_ERROR_REFUSED,
+  CONNECTION_ERROR_DISCONNECT,
+  CONNECTION_ERROR_PUBLISH,
+  CONNECTION_ERROR_SUBSCRIBE,
+  CONNECTION_ERROR_UNSUBSCRIBE,
+  CONNECTION_ERROR_COUNT
+};
+
+// Every string is static storage, nothing has to be freed and the error can
+// be copied freely. backendMessage may be NULL.
+struct ConnectionError {
+  ConnectionErrorCode code;
+  int backendCode;
+  const char *message;
+  const char *backendMessage;
+  int connectionId;
+  // Number of occurrences summarised by this report, 1 when not rate limited
+  uint32_t count;
+};
+
+const char *connectionErrorString(ConnectionErrorCode code);
+
+// Lets one report per error code through every interval, the following ones
+// are counted and folded into the next report, or into a summary from
+// flush() once the interval is over. Disabled when the interval is 0.
+class ErrorRateLimiter {
+ public:
+  ErrorRateLimiter();
+
+  void setInterval(std::chrono::milliseconds interval);
+  std::chrono::milliseconds getInterval() const;
+
+  // Returns true if the error has to be delivered, updating its count
+  bool admit(ConnectionError &error);
+  // Summaries of the reports suppressed in windows that are over, so the
+  // end of an error storm is reported without waiting for the next error.
+  // At most one per code, count set to the reports it stands for. Returns
+  // how many were written.
+  size_t flush(ConnectionError *errors, size_t maxErrors, int connectionId);
+
+ private:
+  std::atomic<int64_t> intervalNs;
+  std::atomic<int64_t> windowStart[CONNECTION_ERROR_COUNT];
+  std::atomic<uint32_t> suppressed[CONNECTION_ERROR_COUNT];
+  // Of the last suppressed report, for the flushed summary
+  std::atomic<int> lastBackendCode[CONNECTION_ERROR_COUNT];
+  std::atomic<const char *> lastBackendMessage[CONNECTION_ERROR_COUNT];
+
+  static int64_t now();
+};
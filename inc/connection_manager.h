@@ -1,9 +1,54 @@
 #pragma once
 
 #include "connection.h"
+#include "connection_registry.h"
+#include "supervisor_thread.h"
 
 namespace ConnectionManager
 {
+  // Supervises a group of connections with its own thread, reconnecting
+  // the ones that dropped. Several managers can run side by side, e.g. one
+  // pinned to an isolated core for the car-side links.
+  class Manager {
+  public:
+    explicit Manager(const SupervisorOptions& options = SupervisorOptions());
+    ~Manager();
+
+    Manager(const Manager&) = delete;
+    Manager& operator=(const Manager&) = delete;
+
+    // Takes effect on the next start()
+    void setOptions(const SupervisorOptions& options);
+    const SupervisorOptions& getOptions() const;
+
+    void start();
+    void stop();
+
+    bool addConnection(Connection* connection);
+    // Returns once no tick or sendAll() uses the connection any more, so it
+    // may be deleted right after (unless called from a tick itself)
+    bool removeConnection(Connection* connection);
+
+    void connect_all();
+    void disconnect_all();
+
+    // Publishes the same shared buffers on every connection, returns how many
+    // accepted the message
+    size_t sendAll(const SharedMessage& message);
+
+  private:
+    ConnectionRegistry<Connection*> connections;
+    SupervisorThread supervisor;
+
+    size_t tick();
+    // A connection that was up and dropped is retried right away instead of
+    // at the next tick; failed attempts keep following the tick policy
+    static void onStatusChange(void* context, int id, ConnectionStatus previous, ConnectionStatus status);
+  };
+
+  // The functions below act on a process wide default manager
+  Manager& defaultManager();
+
   void start();
   void stop();
 
@@ -12,4 +57,5 @@ namespace ConnectionManager
 
   void connect_all();
   void disconnect_all();
-};
\ No newline at end of file
+  size_t sendAll(const SharedMessage& message);
+};
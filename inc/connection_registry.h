@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Connections keyed by their ID. Writers update a hash map under a mutex
+// and publish an immutable snapshot of it before returning; readers only
+// load the current snapshot atomically, so the supervisor tick never takes
+// the writer mutex nor waits for addConnection/removeConnection.
+//
+// A reader may still be iterating a snapshot taken before a remove().
+// synchronize() waits until every such snapshot has been released, after
+// which a removed value is no longer reachable through the registry.
+template <typename T>
+class ConnectionRegistry {
+ public:
+  using Entry = std::pair<int, T>;
+  using Snapshot = std::vector<Entry>;
+
+  ConnectionRegistry() : published(std::make_shared<const Snapshot>()) {}
+
+  bool add(int id, const T &value) {
+    std::unique_lock<std::mutex> lck(writeMutex);
+    if (!entries.emplace(id, value).second) return false;
+    publish();
+    return true;
+  }
+
+  bool remove(int id) {
+    std::unique_lock<std::mutex> lck(writeMutex);
+    if (entries.erase(id) == 0) return false;
+    publish();
+    return true;
+  }
+
+  std::optional<T> find(int id) const {
+    std::unique_lock<std::mutex> lck(writeMutex);
+    auto it = entries.find(id);
+    if (it == entries.end()) return std::nullopt;
+    return it->second;
+  }
+
+  bool contains(int id) const {
+    std::unique_lock<std::mutex> lck(writeMutex);
+    return entries.count(id) > 0;
+  }
+
+  size_t size() const {
+    std::unique_lock<std::mutex> lck(writeMutex);
+    return entries.size();
+  }
+
+  // The returned snapshot stays valid (and unchanged) for as long as the
+  // caller holds it, even if connections are added or removed meanwhile.
+  std::shared_ptr<const Snapshot> snapshot() const { return published.load(std::memory_order_acquire); }
+
+  // Blocks until no reader holds a snapshot replaced before the call. Must
+  // not be called while holding a snapshot.
+  void synchronize() {
+    std::vector<std::weak_ptr<const Snapshot>> waiting;
+    {
+      std::unique_lock<std::mutex> lck(writeMutex);
+      waiting.swap(retired);
+    }
+    for (auto &snapshot : waiting)
+      while (!snapshot.expired()) std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+
+ private:
+  mutable std::mutex writeMutex;
+  std::unordered_map<int, T> entries;
+  std::atomic<std::shared_ptr<const Snapshot>> published;
+  // Replaced snapshots readers may still hold, for synchronize()
+  std::vector<std::weak_ptr<const Snapshot>> retired;
+
+  // Under writeMutex
+  void publish() {
+    auto next = std::make_shared<const Snapshot>(entries.begin(), entries.end());
+    std::shared_ptr<const Snapshot> previous = published.exchange(std::move(next), std::memory_order_acq_rel);
+    std::erase_if(retired, [](const std::weak_ptr<const Snapshot> &snapshot) { return snapshot.expired(); });
+    retired.push_back(previous);
+  }
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct LastValue {
+  std::string topic;
+  std::string payload;
+  int qos = 0;
+  bool retain = false;
+  std::chrono::system_clock::time_point timestamp;
+  // Messages seen on the topic since it was first cached
+  uint64_t updates = 0;
+};
+
+// Last message of each topic, for consumers that need the current state
+// without subscribing or waiting for the next update. Fixed capacity: every
+// entry lives in one arena allocated by the constructor, and a topic keeps
+// its entry (and its interned id) for the cache's lifetime.
+//
+// The index is an open addressing table written under a lock only when a
+// new topic shows up; lookups never lock. Each entry is a seqlock: update()
+// rewrites it in place and readers copy it, retrying if a write overlapped,
+// so readers never block the receive path. Payloads over maxPayloadSize, and
+// topics beyond maxTopics, are counted and not cached.
+class LastValueCache {
+ public:
+  LastValueCache(size_t maxTopics = 4096, size_t maxTopicSize = 128, size_t maxPayloadSize = 1024);
+  ~LastValueCache();
+
+  LastValueCache(const LastValueCache &) = delete;
+  LastValueCache &operator=(const LastValueCache &) = delete;
+
+  // Returns false if the message could not be cached
+  bool update(std::string_view topic, std::string_view payload, int qos, bool retain,
+              std::chrono::system_clock::time_point timestamp);
+
+  // Id of the topic's entry, adding it if needed; -1 when the cache is full
+  // or the topic too long
+  int intern(std::string_view topic);
+  // -1 if the topic was never cached
+  int find(std::string_view topic) const;
+
+  // O(1). The value's strings are reused, so polling the same LastValue
+  // does not allocate once they are large enough.
+  bool getLast(std::string_view topic, LastValue &value) const;
+  bool getLast(int topicId, LastValue &value) const;
+  std::optional<LastValue> getLast(std::string_view topic) const;
+
+  // Copy of every cached topic matching the MQTT filter. Each entry is
+  // consistent on its own; entries updated while the snapshot is taken may
+  // be newer than others.
+  std::vector<LastValue> snapshot(std::string_view filter = "#") const;
+
+  size_t size() const { return entryCount.load(std::memory_order_acquire); }
+  size_t getCapacity() const { return maxTopics; }
+  // Messages that were not cached: cache full, topic or payload too large
+  uint64_t getDropped() const { return dropped.load(std::memory_order_relaxed); }
+
+ private:
+  struct EntryHeader {
+    // Odd while an update is being written
+    std::atomic<uint64_t> sequence;
+    uint32_t topicSize;
+    uint32_t payloadSize;
+    uint8_t qos;
+    bool retain;
+    // A message has been stored, an interned topic may have none yet
+    bool valid;
+    int64_t timestampNs;
+    uint64_t updates;
+  };
+
+  const size_t maxTopics;
+  const size_t maxTopicSize;
+  const size_t maxPayloadSize;
+  const size_t stride;
+  std::unique_ptr<char[]> arena;
+
+  // Entry id + 1 per slot, 0 for an empty slot
+  const size_t indexMask;
+  std::unique_ptr<std::atomic<uint32_t>[]> index;
+  std::mutex insertMutex;
+  std::atomic<size_t> entryCount;
+  std::atomic<uint64_t> dropped;
+
+  EntryHeader *entry(size_t id) const { return (EntryHeader *)(arena.get() + id * stride); }
+  const char *entryTopic(size_t id) const { return (const char *)(entry(id) + 1); }
+  char *entryPayload(size_t id) const { return (char *)(entry(id) + 1) + maxTopicSize; }
+  int lookup(std::string_view topic, uint64_t hash, size_t *emptySlot) const;
+};
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+enum LogLevel {
+  LOG_LEVEL_TRACE = 0,
+  LOG_LEVEL_DEBUG,
+  LOG_LEVEL_INFO,
+  LOG_LEVEL_WARNING,
+  LOG_LEVEL_ERROR,
+  LOG_LEVEL_OFF
+};
+
+// Statements below this level are compiled out entirely
+#ifndef COMMUNICATION_LOG_LEVEL
+#define COMMUNICATION_LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Sinks are invoked only from the logger thread, never from the caller
+typedef void (*LogSink)(void *userData, LogLevel level, const char *message);
+
+enum LogArgumentType {
+  LOG_ARGUMENT_INT = 0,
+  LOG_ARGUMENT_UINT,
+  LOG_ARGUMENT_DOUBLE,
+  LOG_ARGUMENT_STRING,
+  LOG_ARGUMENT_POINTER
+};
+
+struct LogArgument {
+  LogArgumentType type;
+  union {
+    int64_t i;
+    uint64_t u;
+    double d;
+    const void *p;
+    struct {
+      const char *data;
+      size_t size;
+    } s;
+  };
+};
+
+namespace Logger {
+// Replaces the default stderr sink, pass NULL to restore it
+void setSink(LogSink sink, void *userData);
+void setLevel(LogLevel level);
+LogLevel getLevel();
+
+// Blocks until every record pushed so far has reached the sink
+void flush();
+// Records dropped because the ring buffer was full
+size_t getDroppedCount();
+
+// Copies the binary arguments into the ring buffer, formatting happens on the
+// logger thread. Never blocks, returns false if the record was dropped.
+bool push(LogLevel level, const char *format, const LogArgument *args, size_t count);
+
+inline LogArgument makeArgument(const char *value) {
+  LogArgument arg;
+  arg.type = LOG_ARGUMENT_STRING;
+  arg.s.data = value ? value : "(null)";
+  arg.s.size = strlen(arg.s.data);
+  return arg;
+}
+inline LogArgument makeArgument(const std::string &value) {
+  LogArgument arg;
+  arg.type = LOG_ARGUMENT_STRING;
+  arg.s.data = value.data();
+  arg.s.size = value.size();
+  return arg;
+}
+inline LogArgument makeArgument(std::string_view value) {
+  LogArgument arg;
+  arg.type = LOG_ARGUMENT_STRING;
+  arg.s.data = value.data();
+  arg.s.size = value.size();
+  return arg;
+}
+template <typename T>
+LogArgument makeArgument(const T &value) {
+  LogArgument arg;
+  if constexpr (std::is_floating_point_v<T>) {
+    arg.type = LOG_ARGUMENT_DOUBLE;
+    arg.d = value;
+  } else if constexpr (std::is_enum_v<T>) {
+    arg.type = LOG_ARGUMENT_INT;
+    arg.i = static_cast<int64_t>(value);
+  } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+    arg.type = LOG_ARGUMENT_INT;
+    arg.i = value;
+  } else if constexpr (std::is_integral_v<T>) {
+    arg.type = LOG_ARGUMENT_UINT;
+    arg.u = value;
+  } else {
+    static_assert(std::is_pointer_v<T>, "unsupported log argument type");
+    arg.type = LOG_ARGUMENT_POINTER;
+    arg.p = value;
+  }
+  return arg;
+}
+
+// The format uses "{}" as placeholder for each argument
+template <typename... Args>
+bool log(LogLevel level, const char *format, const Args &...args) {
+  if (level < getLevel()) return false;
+  if constexpr (sizeof...(Args) == 0) {
+    return push(level, format, nullptr, 0);
+  } else {
+    const LogArgument arguments[] = {makeArgument(args)...};
+    return push(level, format, arguments, sizeof...(Args));
+  }
+}
+};  // namespace Logger
+
+#define COMMUNICATION_LOG(level, ...)                               \
+  do {                                                              \
+    if constexpr ((level) >= COMMUNICATION_LOG_LEVEL)               \
+      Logger::log(level, __VA_ARGS__);                              \
+  } while (0)
+
+#define LOG_TRACE(...) COMMUNICATION_LOG(LOG_LEVEL_TRACE, __VA_ARGS__)
+#define LOG_DEBUG(...) COMMUNICATION_LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) COMMUNICATION_LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARNING(...) COMMUNICATION_LOG(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define LOG_ERROR(...) COMMUNICATION_LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
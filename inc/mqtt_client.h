@@ -0,0 +1,392 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "async.h"
+#include "capture.h"
+#include "connection.h"
+#include "last_value_cache.h"
+#include "mqtt_connection.h"
+#include "rate_controller.h"
+#include "topic_router.h"
+
+enum MQTTBackendType { MQTT_BACKEND_MOSQUITTO = 0, MQTT_BACKEND_PAHO };
+
+// Backend used by MQTTClient when none is given, set from CMake
+#ifndef COMMUNICATION_DEFAULT_MQTT_BACKEND
+#define COMMUNICATION_DEFAULT_MQTT_BACKEND MQTT_BACKEND_MOSQUITTO
+#endif
+
+struct MQTTClientMetrics {
+  uint64_t published;
+  uint64_t publishFailed;
+  uint64_t completed;
+  uint64_t received;
+  uint64_t queued;
+  uint64_t dropped;
+  uint64_t connects;
+  uint64_t disconnects;
+  uint64_t errors;
+  uint64_t failovers;
+};
+
+struct MQTTEndpointStatus {
+  MQTTEndpoint endpoint;
+  bool active;
+  bool healthy;
+  // Last PINGREQ round trip, and the PUBACK latency average while active,
+  // in milliseconds; negative when unknown
+  double pingMs;
+  double ackMs;
+};
+
+// Common interface implemented by each MQTT library, see mqtt_client.cpp
+class MQTTClientBackend {
+ public:
+  virtual ~MQTTClientBackend() {}
+
+  virtual void setConnectionParameters(const MQTTConnectionParameters &parameters) = 0;
+  // Bound for QoS 0 messages handed to the library, QoS 1/2 follow the
+  // parameters' sendMaximum
+  virtual void setMaxInFlight(size_t count) = 0;
+  virtual void connect() = 0;
+  virtual void disconnect() = 0;
+  // messageId receives the id the completion is reported with, 0 when the
+  // library reports none (Paho QoS 0)
+  virtual bool publish(const MQTTMessage &message, int *messageId = nullptr) = 0;
+  virtual bool publishShared(const SharedMessage &message) = 0;
+  virtual void subscribe(const std::string &topic, int qos) = 0;
+  virtual void subscribeMany(const std::vector<std::string> &topics, int qos) = 0;
+  virtual void unsubscribe(const std::string &topic) = 0;
+  virtual ConnectionStatus getStatus() const = 0;
+  virtual size_t getInFlight() const = 0;
+  // Whether the library connection subscribes again by itself after a
+  // reconnect, only where the broker did not keep the session
+  virtual bool restoresSubscriptions() const = 0;
+  // Whether the next connect() sends what the library had in flight again
+  // by itself: same session, same broker, parameters unchanged since
+  virtual bool resendsInFlight() const = 0;
+};
+
+class MQTTClient;
+
+// Messages matching one subscription, read from a coroutine:
+//   while (auto message = co_await stream.next()) handle(*message);
+// next() yields nullopt once the stream is closed. Messages arriving while
+// nobody awaits are buffered up to capacity, the oldest are dropped first.
+// One consumer at a time.
+class MQTTMessageStream {
+ public:
+  MQTTMessageStream() = default;
+  MQTTMessageStream(MQTTMessageStream &&other) noexcept;
+  MQTTMessageStream &operator=(MQTTMessageStream &&other) noexcept;
+  MQTTMessageStream(const MQTTMessageStream &) = delete;
+  // Closes the stream
+  ~MQTTMessageStream();
+
+  auto next() {
+    struct Awaiter {
+      State *state;
+      bool await_ready() const noexcept { return false; }
+      bool await_suspend(std::coroutine_handle<> handle) { return state->wait(handle); }
+      std::optional<MQTTMessage> await_resume() { return state->pop(); }
+    };
+    return Awaiter{state.get()};
+  }
+  // Ends the stream and unsubscribes unless the topic was subscribed before,
+  // a pending next() resumes with nullopt
+  void close();
+
+  const std::string &getFilter() const { return state->filter; }
+  size_t getDropped() const;
+
+ private:
+  friend class MQTTClient;
+
+  struct State {
+    MQTTClient *client;
+    std::string filter;
+    bool ownsSubscription;
+    size_t capacity;
+
+    std::mutex mutex;
+    std::deque<MQTTMessage> buffer;
+    std::coroutine_handle<> waiter;
+    bool closed = false;
+    size_t dropped = 0;
+
+    // false when a message (or the end) is already there
+    bool wait(std::coroutine_handle<> handle);
+    std::optional<MQTTMessage> pop();
+    void push(const MQTTMessage &message);
+    void finish();
+  };
+
+  std::shared_ptr<State> state;
+
+  explicit MQTTMessageStream(std::shared_ptr<State> state) : state(std::move(state)) {}
+};
+
+// One MQTT client over either libmosquitto or Paho, chosen at construction
+// (or at compile time through COMMUNICATION_DEFAULT_MQTT_BACKEND). Whatever
+// the backend, the client shares the same:
+//  - queueing: queueSend() keeps pooled messages until the backend accepts them
+//  - metrics: getMetrics()
+//  - reconnect: it is a Connection, so ConnectionManager supervises it, and
+//    subscriptions are restored on every connect
+//  - routing: addRoute() dispatches received messages by topic filter
+//  - coroutines: connectAsync(), publishAsync() and subscribeAsync() can be
+//    awaited, resumed on the executor given to setExecutor()
+//  - failover: with several endpoints in the parameters, a thread probes
+//    them and moves the client to the best one when the broker in use drops
+//    or degrades, and back to a preferred one once it has recovered.
+//    Messages from queueSend() are kept until acknowledged (QoS 1/2) and
+//    sent again on the new broker, so a switch loses none of them.
+//  - rate control: with parameters.rateControl enabled, a RateController
+//    sizes the in-flight window of queueSend() from acknowledgement latency
+//    and spaces its flushes by the batching delay; getRateControl() gives
+//    producers the target rate to downsample to.
+//  - last values: with parameters.lastValueCache, the last message of every
+//    received topic is kept, for getLast() and snapshot() without waiting
+//    for the next update.
+//  - capture: with parameters.capturePath, every message sent or received
+//    is recorded to the file, for CaptureReplayer.
+class MQTTClient : public Connection {
+ public:
+  using MessageType = MQTTMessage;
+
+  explicit MQTTClient(const MQTTConnectionParameters &parameters,
+                      MQTTBackendType backendType = COMMUNICATION_DEFAULT_MQTT_BACKEND);
+  MQTTClient(const MQTTClient &) = delete;
+  ~MQTTClient() override;
+
+  MQTTBackendType getBackendType() const { return backendType; }
+
+  void setConnectionParameters(const ConnectionParameters &parameters) override;
+  const ConnectionParameters &getConnectionParameters() const override { return mqttParameters; }
+  const MQTTConnectionParameters &getMQTTConnectionParameters() const { return mqttParameters; }
+
+  void connect() override;
+  void disconnect() override;
+
+  bool send(const Message &message) override;
+  void receive(Message &message) override;
+  bool queueSend(const Message &message) override;
+  bool sendShared(const SharedMessage &message) override;
+  bool publish(const MQTTMessage &message);
+
+  void subscribe(const std::string &topic, int qos = 0);
+  // Batched, see MQTTConnection::subscribeMany
+  void subscribeMany(const std::vector<std::string> &topics, int qos = 0);
+  void unsubscribe(const std::string &topic);
+
+  int addRoute(const std::string &filter, OnMessageCallback callback, void *userData);
+  bool removeRoute(int routeId);
+
+  // Coroutines awaiting the client are resumed on the executor, or on the
+  // backend's network thread without one. Set it before awaiting anything.
+  void setExecutor(Executor *executor) { this->executor = executor; }
+
+  // co_await client.connectAsync(): true once connected, false if the
+  // attempt failed
+  auto connectAsync() {
+    struct Awaiter {
+      MQTTClient *client;
+      bool result = false;
+      bool await_ready() const noexcept { return client->getStatus() == CONNECTION_STATUS_CONNECTED; }
+      void await_suspend(std::coroutine_handle<> handle) { client->startConnect(handle, &result); }
+      bool await_resume() const noexcept { return result || client->getStatus() == CONNECTION_STATUS_CONNECTED; }
+    };
+    return Awaiter{this};
+  }
+  // co_await client.publishAsync(message): true on PUBACK (QoS 1), PUBCOMP
+  // (QoS 2) or once written (QoS 0), false if the connection was lost first.
+  // Waits for room when the in-flight window is full, no polling.
+  auto publishAsync(const MQTTMessage &message) {
+    struct Awaiter {
+      MQTTClient *client;
+      MQTTMessage message;
+      PendingPublish pending;
+      bool await_ready() const noexcept { return false; }
+      bool await_suspend(std::coroutine_handle<> handle) {
+        pending.handle = handle;
+        pending.message = &message;
+        return client->startPublish(&pending);
+      }
+      bool await_resume() const noexcept { return pending.result; }
+    };
+    return Awaiter{this, message, {}};
+  }
+  // Subscribes and routes the matching messages to the returned stream
+  MQTTMessageStream subscribeAsync(const std::string &filter, int qos = 0, size_t capacity = 1024);
+
+  // Messages waiting in the client queue plus the ones in flight
+  size_t getQueueSize() override;
+  size_t getBacklog() override { return queueLength.load(std::memory_order_relaxed) + backend->getInFlight(); }
+  MQTTClientMetrics getMetrics() const;
+  // One entry per endpoint of the parameters, empty without endpoints
+  std::vector<MQTTEndpointStatus> getEndpointStatus() const;
+  size_t getActiveEndpoint() const;
+  // Current window, batching delay, compression level and target rate;
+  // targetRate is negative until the first acknowledgement, or without rate
+  // control
+  RateControlSignal getRateControl() const;
+  double getTargetRate() const { return rateControlled ? rateController.getTargetRate() : -1; }
+
+  // The last message received on a topic, or on every topic matching the
+  // filter; empty without parameters.lastValueCache. Lock free, safe from
+  // any thread.
+  std::optional<LastValue> getLast(const std::string &topic) const;
+  std::vector<LastValue> snapshot(const std::string &filter = "#") const;
+  // nullptr without parameters.lastValueCache
+  const LastValueCache *getLastValueCache() const { return lastValues.get(); }
+  // nullptr without parameters.capturePath; closed when the client is
+  // destroyed
+  const CaptureWriter *getCapture() const { return capture.get(); }
+
+  // Entry points for the backends
+  void handleConnected();
+  void handleDisconnected();
+  void handleMessage(const MQTTMessage &message);
+  void handlePublished(int messageId);
+  void handleError(const ConnectionError &error);
+
+ protected:
+  MQTTBackendType backendType;
+  MQTTConnectionParameters mqttParameters;
+  std::unique_ptr<MQTTClientBackend> backend;
+
+  TopicRouter router;
+
+  std::mutex subscriptionsMutex;
+  std::unordered_map<std::string, int> subscriptions;
+
+  MQTTMessagePool messagePool;
+  // Created by the constructor only, readers may hold on to it
+  std::unique_ptr<LastValueCache> lastValues;
+  // Created by the constructor only, as lastValues
+  std::unique_ptr<CaptureWriter> capture;
+
+  struct {
+    std::atomic<uint64_t> published{0};
+    std::atomic<uint64_t> publishFailed{0};
+    std::atomic<uint64_t> completed{0};
+    std::atomic<uint64_t> received{0};
+    std::atomic<uint64_t> queued{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> connects{0};
+    std::atomic<uint64_t> disconnects{0};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<uint64_t> failovers{0};
+  } metrics;
+
+  // A publishAsync() in flight, lives in the awaiting coroutine's frame
+  struct PendingPublish {
+    std::coroutine_handle<> handle;
+    const MQTTMessage *message = nullptr;
+    bool result = false;
+  };
+
+  Executor *executor = nullptr;
+
+  // Awaiting coroutines. pendingCount is raised before publishing so a
+  // completion racing with the registration still takes asyncMutex.
+  std::mutex asyncMutex;
+  std::atomic<size_t> pendingCount{0};
+  std::unordered_map<int, PendingPublish *> pendingPublishes;
+  std::deque<PendingPublish *> blockedPublishes;
+  // A thread is handing blocked publishes to the backend, outside
+  // asyncMutex; completions wait for it to register their message ids
+  bool publishing = false;
+  std::condition_variable publishingCondition;
+  std::vector<std::pair<std::coroutine_handle<>, bool *>> connectWaiters;
+
+  std::mutex streamsMutex;
+  std::atomic<size_t> streamCount{0};
+  std::vector<std::shared_ptr<MQTTMessageStream::State>> streams;
+
+  // Serializes connect(), disconnect() and endpoint switches, which may come
+  // from the application, ConnectionManager and the failover thread
+  std::mutex connectMutex;
+  bool connectRequested = false;
+  std::atomic<bool> switching{false};
+
+  struct EndpointHealth {
+    bool healthy = true;
+    int goodProbes = 0;
+    double pingMs = -1;
+  };
+  mutable std::mutex endpointsMutex;
+  std::vector<EndpointHealth> endpointHealth;
+  size_t activeEndpoint = 0;
+  // Endpoint the backend's parameters point at
+  size_t appliedEndpoint = SIZE_MAX;
+  std::atomic<int64_t> ackLatencyUs{-1};
+  // Send time of each message id, for the acknowledgement latency. QoS 0
+  // messages are tracked too under rate control, libmosquitto reports them
+  // once written.
+  std::unique_ptr<std::atomic<int64_t>[]> publishTimes;
+  std::atomic<bool> failoverEnabled{false};
+
+  RateController rateController;
+  std::atomic<bool> rateControlled{false};
+  // Last time queueSend() handed messages to the backend, microseconds
+  std::atomic<int64_t> lastFlushUs{0};
+  // Set by a flushQueue() that found the queue lock taken
+  std::atomic<bool> flushRequested{false};
+  // Messages handed to the backend whose completion is still to come
+  std::atomic<size_t> awaitingCompletions{0};
+
+  std::mutex failoverMutex;
+  std::condition_variable failoverCondition;
+  std::thread failoverThread;
+  bool failoverRunning = false;
+  bool failoverWake = false;
+
+  // Queued QoS 1/2 messages handed to the backend and not acknowledged yet,
+  // in send order
+  std::mutex unackedMutex;
+  std::deque<std::pair<int, PoolHandle<Message>>> unacked;
+
+  void loop() override;
+  void flushQueue(bool wait = false);
+  // One pass over the queue, messageQueueMutex held
+  void flushLocked();
+  void resume(std::coroutine_handle<> handle);
+  void startConnect(std::coroutine_handle<> handle, bool *result);
+  void finishConnect(bool connected);
+  bool startPublish(PendingPublish *pending);
+  void drainPublishes(std::vector<PendingPublish *> &done);
+  void completePublishes(int messageId);
+  void failPublishes();
+  void closeStream(MQTTMessageStream::State *state);
+
+  void connectLocked();
+  void setupEndpoints();
+  void setupRateControl();
+  void allocatePublishTimes();
+  void applyEndpoint();
+  void startFailover();
+  void stopFailover();
+  void failoverLoop();
+  void probeEndpoints();
+  size_t chooseEndpoint();
+  void switchEndpoint(size_t index);
+  void reportEndpointFailure();
+  void trackPublish(int messageId, int qos);
+  void requeueUnacked();
+
+  friend class MQTTMessageStream;
+};
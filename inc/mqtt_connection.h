@@ -3,7 +3,18 @@
 #include "connection.h"
 
 #include <atomic>
+#include <chrono>
+#include <memory>
 #include <mosquitto.h>
+#include <shared_mutex>
+#include <string_view>
+#include <vector>
+
+#include "object_pool.h"
+#include "rate_controller.h"
+#include "realtime_publisher.h"
+#include "subscription_batch.h"
+#include "tls_context.h"
 
 class MQTTMessage : public Message {
 public:
@@ -20,28 +31,113 @@ public:
 	~MQTTMessage() override = default;
 };
 
+// Pooled messages keep this much topic and payload capacity, so reusing one
+// for a payload up to this size never allocates
+#define MQTT_MESSAGE_INLINE_SIZE 256
+
+// Slab pool of MQTTMessage, handles are intrusively reference counted so one
+// message can be queued on several connections without copies
+class MQTTMessagePool : public ObjectPool<MQTTMessage> {
+public:
+	explicit MQTTMessagePool(size_t slabSize = 256, size_t maxMessages = 0);
+
+	PoolHandle<MQTTMessage> acquire(const MQTTMessage &message);
+	PoolHandle<MQTTMessage> acquire(std::string_view topic, std::string_view payload, int qos = 0, bool retain = false);
+
+private:
+	static void recycleMessage(MQTTMessage &message);
+};
+
+// One broker MQTTClient can fail over to, socketPath for a unix socket
+struct MQTTEndpoint {
+	std::string host;
+	int port = 1883;
+	std::string socketPath;
+};
+
 class MQTTConnectionParameters : public ConnectionParameters {
 public:
 	int port;
 	std::string host;
+	// Unix domain socket of a broker on the same host, used instead of
+	// host/port when set. Needs libmosquitto 2.0 built with unix sockets;
+	// TLS and auth options apply as over TCP. WebSocket brokers need the
+	// Paho backend, libmosquitto has no client side WebSocket transport.
+	std::string socketPath;
 	std::string username;
 	std::string password;
 	bool tls;
 	std::string cafile;
 	std::string capath;
+	// Client certificate and key for mutual TLS, keyPassword for an
+	// encrypted key
 	std::string certfile;
 	std::string keyfile;
+	std::string keyPassword;
+	// Lowest version offered ("tlsv1.2" or "tlsv1.3"), cipher list for TLS
+	// 1.2 and TLS 1.3 suites; empty for OpenSSL's defaults
+	std::string tlsVersion;
+	std::string ciphers;
+	std::string ciphersuites;
+	// Reconnects offer the last session ticket and skip the full handshake
+	bool tlsSessionResumption = true;
   bool will_message_set;
   MQTTMessage will;
+	// Real-time mode: sendRealtime() copies into slots preallocated at
+	// construction and never touches the heap
+	bool realtime = false;
+	size_t realtimeQueueSlots = 1024;
+	size_t realtimeMaxTopicSize = 128;
+	size_t realtimeMaxPayloadSize = 1024;
+	// MQTT_PROTOCOL_V31, MQTT_PROTOCOL_V311 or MQTT_PROTOCOL_V5
+	int protocolVersion = MQTT_PROTOCOL_V311;
+	int keepalive = 5; // seconds
+	// Flow control: QoS 1/2 messages in flight towards the broker (capped
+	// further by the broker's receive maximum on MQTT v5) and from it. QoS 0
+	// messages are bounded by the connection's max queue size instead.
+	int sendMaximum = 20;
+	int receiveMaximum = 20;
+	// subscribeMany/unsubscribeMany split their filters over packets of at
+	// most this size
+	size_t maxSubscribePacketSize = 65536;
+	// Brokers MQTTClient fails over between, in order of preference; used
+	// instead of host/port/socketPath when not empty. Each one is probed
+	// every probeInterval with a PINGREQ on a connection of its own (only the
+	// TCP connect with TLS). An endpoint whose PINGREQ or PUBACK latency is
+	// above failoverLatency is degraded, and a preferred endpoint is failed
+	// back to after failbackProbes good probes in a row.
+	std::vector<MQTTEndpoint> endpoints;
+	std::chrono::milliseconds probeInterval = std::chrono::milliseconds(1000);
+	std::chrono::milliseconds failoverLatency = std::chrono::milliseconds(500);
+	int failbackProbes = 3;
+	// MQTTClient sizes its in-flight window and batching from acknowledgement
+	// latency when enabled, see RateController
+	RateControlOptions rateControl;
+	// MQTTClient keeps the last message of every topic it receives, see
+	// LastValueCache; sized once, at construction
+	bool lastValueCache = false;
+	size_t lastValueCacheTopics = 4096;
+	size_t lastValueCacheMaxTopicSize = 128;
+	size_t lastValueCacheMaxPayloadSize = 1024;
+	// MQTTClient records every message it sends and receives to this file
+	// when set, see CaptureWriter; captureSize bytes at most
+	std::string capturePath;
+	size_t captureSize = (size_t)256 << 20;
 
-	MQTTConnectionParameters() : ConnectionParameters(){};
+	MQTTConnectionParameters() : ConnectionParameters(CONNECTION_TYPE_MQTT){};
 	~MQTTConnectionParameters() override = default;
 
   static MQTTConnectionParameters get_default();
 };
 
+// Called once every packet of a subscribeMany/unsubscribeMany batch was
+// acknowledged, refused counts the filters the broker did not accept
+typedef void (*OnBatchCallback)(void *userData, int id, int batchId, size_t count, size_t refused);
+
 class MQTTConnection : public Connection {
 public:
+	using MessageType = MQTTMessage;
+
 	explicit MQTTConnection();
 	explicit MQTTConnection(const MQTTConnectionParameters &parameters);
 	MQTTConnection(MQTTConnection &&);
@@ -49,30 +145,90 @@ public:
 	~MQTTConnection() override;
 
 	void setConnectionParameters(const ConnectionParameters &parameters) override;
+	const ConnectionParameters &getConnectionParameters() const override { return mqttParameters; }
 	const MQTTConnectionParameters &getMQTTConnectionParameters() const { return mqttParameters; }
 
 	void connect() override;
 	void disconnect() override;
 
+	// Adapter for the virtual interface, checks the message type tag and
+	// forwards to publish()
 	bool send(const Message &message) override;
+	// Statically typed send path, see BasicConnection. messageId receives the
+	// id later passed to the publish callback.
+	inline bool publish(const MQTTMessage &message, int *messageId = nullptr);
 	void receive(Message &message) override;
+	// Copies the message into the connection's pool and queues it, it is
+	// published as soon as the in-flight count allows
 	bool queueSend(const Message &message) override;
+	// The pool that owns the message must outlive this connection's queue
+	bool queueSend(const PoolHandle<MQTTMessage> &message);
+	bool sendShared(const SharedMessage &message) override;
+	MQTTMessagePool &getMessagePool() { return *messagePool; }
+	// Only available in real-time mode, returns false when the slots are full
+	bool sendRealtime(std::string_view topic, const void *payload, size_t size, int qos = 0, bool retain = false);
 
-	void subscribe(const std::string &topic);
+	void subscribe(const std::string &topic, int qos = 0);
 	void unsubscribe(const std::string &topic);
+	// Sends the filters in as few packets as maxSubscribePacketSize allows,
+	// callback is called once for the whole batch. Returns the batch id, -1 if
+	// nothing could be sent
+	int subscribeMany(const std::vector<std::string> &topics, int qos = 0, OnBatchCallback callback = nullptr);
+	int unsubscribeMany(const std::vector<std::string> &topics, OnBatchCallback callback = nullptr);
 
+	// Messages handed to libmosquitto and not completed yet, all levels or
+	// one QoS level
 	size_t getQueueSize() override;
+	// Queued plus in flight
+	size_t getBacklog() override { return queueLength.load(std::memory_order_relaxed) + getQueueSize(); }
+	size_t getInFlight(int qos) const;
+	// Effective QoS 1/2 window, min(sendMaximum, broker receive maximum)
+	size_t getSendWindow() const { return sendWindow.load(std::memory_order_relaxed); }
+	// Full and resumed handshakes since the client was set up
+	TLSStatistics getTLSStatistics() const;
 
 private:
 	static int mqttInstances;
-	std::atomic<size_t> queueSize;
+	// In-flight messages per QoS level, and the QoS of each pending message id
+	// so on_publish releases the right level
+	std::atomic<size_t> inFlight[3];
+	std::unique_ptr<std::atomic<uint8_t>[]> inFlightQos;
+	std::atomic<size_t> sendWindow;
+	// Set by a flushQueue() that found the queue lock taken
+	std::atomic<bool> flushRequested{false};
 
+	// Kept across reconnects with its options, credentials, TLS context and
+	// callbacks: connect() only re-dials. Rebuilt when the parameters change.
 	struct mosquitto *mosq;
+	// Exclusive while mosq is created or destroyed, shared by the real-time
+	// publisher thread while it uses the handle
+	std::shared_mutex clientMutex;
+	std::unique_ptr<TLSClientContext> tlsContext;
+	bool clientStale;
+	bool loopRunning;
+	bool dialed;
 	MQTTConnectionParameters mqttParameters;
+	std::unique_ptr<RealtimePublisher> realtimePublisher;
+	std::unique_ptr<MQTTMessagePool> messagePool;
+	std::mutex batchMutex;
+	SubscriptionBatches<OnBatchCallback> batches;
 
+	bool setupClient();
+	void destroyClient();
 	void loop() override;
+	void flushQueue(bool wait = false);
+	void setupRealtime();
+	void reportPublishError(int err);
+	inline bool reserveInFlight(int qos);
+	void releaseInFlight(int qos);
+	void trackInFlight(int mid, int qos);
+	void resetInFlight();
+	void resetSendWindow();
+	int sendBatch(const std::vector<std::string> &topics, int qos, OnBatchCallback callback, bool subscribe);
+	void completeBatch(int mid, size_t refused);
+	static bool publishRealtime(void *obj, const char *topic, const void *payload, size_t size, int qos, bool retain);
 
-	static void on_connect(struct mosquitto *mosq, void *obj, int rc);
+	static void on_connect(struct mosquitto *mosq, void *obj, int rc, int flags, const mosquitto_property *properties);
 	static void on_disconnect(struct mosquitto *mosq, void *obj, int rc);
 	static void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message);
 	static void on_publish(struct mosquitto *mosq, void *obj, int mid);
@@ -82,6 +238,38 @@ private:
   static void throw_error(const int err);
 };
 
+bool MQTTConnection::reserveInFlight(int qos) {
+	if (qos < 0 || qos > 2) {
+		reportPublishError(MOSQ_ERR_INVAL);
+		return false;
+	}
+	if (qos == 0) {
+		if (inFlight[0].fetch_add(1) < maxQueueSize) return true;
+	} else {
+		inFlight[qos].fetch_add(1);
+		if (inFlight[1].load() + inFlight[2].load() <= sendWindow.load(std::memory_order_relaxed)) return true;
+	}
+	inFlight[qos].fetch_sub(1);
+	return false;
+}
+
+bool MQTTConnection::publish(const MQTTMessage &message, int *messageId) {
+	if (!mosq) return false;
+	if (!reserveInFlight(message.qos)) return false;
+
+	int mid = 0;
+	int ret = mosquitto_publish(mosq, &mid, message.topic.c_str(), message.payload.size(), message.payload.c_str(),
+															message.qos, message.retain);
+	if (ret != MOSQ_ERR_SUCCESS) {
+		releaseInFlight(message.qos);
+		reportPublishError(ret);
+		return false;
+	}
+	trackInFlight(mid, message.qos);
+	if (messageId) *messageId = mid;
+	return true;
+}
+
 class MQTTMessageBuilder {
 private:
   MQTTMessage message;
@@ -106,6 +294,7 @@ public:
 
   MQTTConnectionParametersBuilder &host(const std::string &host);
   MQTTConnectionParametersBuilder &port(int port);
+  MQTTConnectionParametersBuilder &socketPath(const std::string &path);
   MQTTConnectionParametersBuilder &username(const std::string &username);
   MQTTConnectionParametersBuilder &password(const std::string &password);
   MQTTConnectionParametersBuilder &tls(bool tls);
@@ -113,7 +302,28 @@ public:
   MQTTConnectionParametersBuilder &capath(const std::string &capath);
   MQTTConnectionParametersBuilder &certfile(const std::string &certfile);
   MQTTConnectionParametersBuilder &keyfile(const std::string &keyfile);
+  MQTTConnectionParametersBuilder &keyPassword(const std::string &password);
+  MQTTConnectionParametersBuilder &tlsVersion(const std::string &version);
+  MQTTConnectionParametersBuilder &ciphers(const std::string &ciphers);
+  MQTTConnectionParametersBuilder &ciphersuites(const std::string &ciphersuites);
+  MQTTConnectionParametersBuilder &tlsSessionResumption(bool enabled);
   MQTTConnectionParametersBuilder &will(const MQTTMessage &will);
+  MQTTConnectionParametersBuilder &realtime(size_t slots, size_t maxTopicSize, size_t maxPayloadSize);
+  MQTTConnectionParametersBuilder &protocolVersion(int version);
+  MQTTConnectionParametersBuilder &keepalive(int seconds);
+  MQTTConnectionParametersBuilder &sendMaximum(int count);
+  MQTTConnectionParametersBuilder &receiveMaximum(int count);
+  MQTTConnectionParametersBuilder &maxSubscribePacketSize(size_t size);
+  // Appends a broker to fail over to, the first one is preferred
+  MQTTConnectionParametersBuilder &endpoint(const std::string &host, int port);
+  // Same for a broker on this host's unix socket
+  MQTTConnectionParametersBuilder &socketEndpoint(const std::string &path);
+  MQTTConnectionParametersBuilder &probeInterval(std::chrono::milliseconds interval);
+  MQTTConnectionParametersBuilder &failoverLatency(std::chrono::milliseconds latency);
+  MQTTConnectionParametersBuilder &failbackProbes(int probes);
+  MQTTConnectionParametersBuilder &rateControl(const RateControlOptions &options);
+  MQTTConnectionParametersBuilder &lastValueCache(size_t topics, size_t maxTopicSize, size_t maxPayloadSize);
+  MQTTConnectionParametersBuilder &capture(const std::string &path, size_t size);
 
   MQTTConnectionParameters build();
 };
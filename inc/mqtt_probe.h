@@ -0,0 +1,14 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#include "mqtt_connection.h"
+
+// Health probe of a broker on a short lived connection of its own: MQTT
+// 3.1.1 CONNECT (clean session, no client id, parameters' credentials),
+// then PINGREQ. Returns the PINGREQ round trip in microseconds, or -1 when
+// the broker cannot be reached, refuses the CONNECT or does not answer
+// within timeout. With tcpOnly (TLS brokers) it is the TCP connect time.
+int64_t probeMQTTEndpoint(const MQTTEndpoint &endpoint, const MQTTConnectionParameters &parameters, bool tcpOnly,
+                          std::chrono::milliseconds timeout);
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+
+// Header shared by every pooled object, the reference count is intrusive so a
+// handle is two pointers and copying it never allocates.
+struct PoolNodeHeader {
+  std::atomic<uint32_t> refs;
+  void (*release)(void *pool, PoolNodeHeader *node);
+  void *pool;
+};
+
+// Reference counted handle to a pooled object. The object goes back to its
+// pool when the last handle is dropped; handles to a derived type convert to
+// handles to its base (e.g. PoolHandle<MQTTMessage> -> PoolHandle<Message>).
+template <typename T>
+class PoolHandle {
+ public:
+  PoolHandle() : header(nullptr), object(nullptr) {}
+  PoolHandle(PoolNodeHeader *header, T *object) : header(header), object(object) { retain(); }
+  PoolHandle(const PoolHandle &other) : header(other.header), object(other.object) { retain(); }
+  PoolHandle(PoolHandle &&other) noexcept : header(other.header), object(other.object) {
+    other.header = nullptr;
+    other.object = nullptr;
+  }
+  template <typename U, typename = std::enable_if_t<std::is_convertible_v<U *, T *>>>
+  PoolHandle(const PoolHandle<U> &other) : header(other.header), object(other.object) {
+    retain();
+  }
+  ~PoolHandle() { reset(); }
+
+  PoolHandle &operator=(PoolHandle other) noexcept {
+    std::swap(header, other.header);
+    std::swap(object, other.object);
+    return *this;
+  }
+
+  void reset() {
+    if (header && header->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) header->release(header->pool, header);
+    header = nullptr;
+    object = nullptr;
+  }
+
+  T *get() const { return object; }
+  T &operator*() const { return *object; }
+  T *operator->() const { return object; }
+  explicit operator bool() const { return object != nullptr; }
+  uint32_t useCount() const { return header ? header->refs.load(std::memory_order_relaxed) : 0; }
+
+ private:
+  template <typename U>
+  friend class PoolHandle;
+
+  PoolNodeHeader *header;
+  T *object;
+
+  void retain() {
+    if (header) header->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+};
+
+// Slab allocator for objects of type T. Objects are constructed once when
+// their slab is created and recycled afterwards, so steady state acquire and
+// release never touch the heap. Free objects sit in a lock-free stack.
+template <typename T>
+class ObjectPool {
+ public:
+  // Called on every object when its slab is created and again whenever it
+  // goes back to the pool, e.g. to reserve or trim its buffers
+  using Recycle = std::function<void(T &)>;
+
+  // maxObjects == 0 means the pool may keep growing by one slab at a time
+  explicit ObjectPool(size_t slabSize = 256, size_t maxObjects = 0, Recycle recycle = nullptr)
+      : slabSize(slabSize ? slabSize : 1),
+        maxSlabs(maxObjects ? (maxObjects + this->slabSize - 1) / this->slabSize : MAX_SLABS),
+        recycle(std::move(recycle)),
+        slabCount(0),
+        freeHead(packHead(NIL, 0)),
+        freeObjects(0) {
+    if (maxSlabs > MAX_SLABS) maxSlabs = MAX_SLABS;
+  }
+
+  // Every handle must be gone before the pool is destroyed
+  ~ObjectPool() {
+    for (size_t i = 0; i < slabCount.load(); i++) delete[] slabs[i];
+  }
+
+  ObjectPool(const ObjectPool &) = delete;
+  ObjectPool &operator=(const ObjectPool &) = delete;
+
+  // Preallocates enough slabs for count objects
+  void reserve(size_t count) {
+    while (capacity() < count && grow()) {
+    }
+  }
+
+  // Returns an empty handle if the pool is exhausted and may not grow
+  PoolHandle<T> acquire() {
+    Node *n = pop();
+    if (!n) {
+      if (!grow()) return PoolHandle<T>();
+      n = pop();
+      if (!n) return PoolHandle<T>();
+    }
+    n->refs.store(0, std::memory_order_relaxed);
+    return PoolHandle<T>(n, &n->object);
+  }
+
+  size_t capacity() const { return slabCount.load(std::memory_order_acquire) * slabSize; }
+  size_t available() const { return freeObjects.load(std::memory_order_relaxed); }
+
+ private:
+  static constexpr size_t MAX_SLABS = 4096;
+  static constexpr uint32_t NIL = UINT32_MAX;
+
+  struct Node : PoolNodeHeader {
+    uint32_t index;
+    std::atomic<uint32_t> next;
+    T object;
+  };
+
+  const size_t slabSize;
+  size_t maxSlabs;
+  Recycle recycle;
+
+  std::mutex growMutex;
+  Node *slabs[MAX_SLABS];
+  std::atomic<size_t> slabCount;
+
+  // Index of the first free node in the low half, ABA tag in the high half
+  std::atomic<uint64_t> freeHead;
+  std::atomic<size_t> freeObjects;
+
+  static uint64_t packHead(uint32_t index, uint32_t tag) { return ((uint64_t)tag << 32) | index; }
+
+  Node *node(uint32_t index) { return &slabs[index / slabSize][index % slabSize]; }
+
+  bool grow() {
+    std::unique_lock<std::mutex> lck(growMutex);
+    size_t count = slabCount.load(std::memory_order_relaxed);
+    if (count >= maxSlabs) return false;
+    Node *slab = new Node[slabSize];
+    slabs[count] = slab;
+    slabCount.store(count + 1, std::memory_order_release);
+    for (size_t i = 0; i < slabSize; i++) {
+      slab[i].release = &ObjectPool::releaseNode;
+      slab[i].pool = this;
+      slab[i].index = count * slabSize + i;
+      if (recycle) recycle(slab[i].object);
+      push(&slab[i]);
+    }
+    return true;
+  }
+
+  void push(Node *n) {
+    uint64_t head = freeHead.load(std::memory_order_relaxed);
+    do {
+      n->next.store((uint32_t)head, std::memory_order_relaxed);
+    } while (!freeHead.compare_exchange_weak(head, packHead(n->index, (head >> 32) + 1), std::memory_order_release,
+                                             std::memory_order_relaxed));
+    freeObjects.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  Node *pop() {
+    uint64_t head = freeHead.load(std::memory_order_acquire);
+    while ((uint32_t)head != NIL) {
+      Node *n = node((uint32_t)head);
+      uint32_t next = n->next.load(std::memory_order_relaxed);
+      if (freeHead.compare_exchange_weak(head, packHead(next, (head >> 32) + 1), std::memory_order_acquire,
+                                         std::memory_order_acquire)) {
+        freeObjects.fetch_sub(1, std::memory_order_relaxed);
+        return n;
+      }
+    }
+    return nullptr;
+  }
+
+  static void releaseNode(void *pool, PoolNodeHeader *header) {
+    ObjectPool *self = static_cast<ObjectPool *>(pool);
+    Node *n = static_cast<Node *>(header);
+    if (self->recycle) self->recycle(n->object);
+    self->push(n);
+  }
+};
@@ -1,8 +1,50 @@
 #pragma once
 
+#include "connection_registry.h"
 #include "paho_mqtt_connection.hpp"
+#include "supervisor_thread.h"
 
 namespace PAHOConnectionManager {
+// Supervises a group of connections with its own thread, reconnecting the
+// ones that dropped. Connections are held weakly and forgotten once expired.
+class Manager {
+ public:
+  explicit Manager(const SupervisorOptions &options = SupervisorOptions());
+  ~Manager();
+
+  Manager(const Manager &) = delete;
+  Manager &operator=(const Manager &) = delete;
+
+  // Takes effect on the next start()
+  void setOptions(const SupervisorOptions &options);
+  const SupervisorOptions &getOptions() const;
+
+  void start();
+  void stop();
+
+  bool addConnection(std::shared_ptr<PAHOMQTTConnection> connection);
+  // Returns once no tick or sendAll() uses the connection any more, so it
+  // is not reconnected after (unless called from a tick itself)
+  bool removeConnection(std::shared_ptr<PAHOMQTTConnection> connection);
+
+  void connect_all();
+  void disconnect_all();
+
+  // Publishes the same shared buffers on every connection, returns how many
+  // accepted the message
+  size_t sendAll(const SharedMessage &message);
+
+ private:
+  ConnectionRegistry<std::weak_ptr<PAHOMQTTConnection>> connections;
+  SupervisorThread supervisor;
+  std::vector<int> expired;
+
+  size_t tick();
+};
+
+// The functions below act on a process wide default manager
+Manager &defaultManager();
+
 void start();
 void stop();
 
@@ -11,4 +53,5 @@ bool removeConnection(std::shared_ptr<PAHOMQTTConnection> connection);
 
 void connect_all();
 void disconnect_all();
+size_t sendAll(const SharedMessage &message);
 }; // namespace PAHOConnectionManager
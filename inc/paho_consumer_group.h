@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "paho_connection_manager.h"
+#include "paho_mqtt_connection.hpp"
+#include "supervisor_thread.h"
+
+// Called on the member's dispatch thread, never on Paho's
+typedef void (*on_group_message_callback)(void *userData, size_t member, const PAHOMQTTMessage &message);
+
+struct PAHOConsumerGroupOptions {
+  // Share name, the members subscribe to $share/<group>/<filter>
+  std::string group = "consumers";
+  std::vector<std::string> filters;
+  int qos = 1;
+  size_t members = 4;
+  // CPU of each member's dispatch thread, member i takes cpus[i % size];
+  // empty leaves them unpinned
+  std::vector<int> cpus;
+  SupervisorSchedulingPolicy schedulingPolicy = SUPERVISOR_SCHED_OTHER;
+  int priority = 1;
+  // Messages a member buffers between Paho's callback and its dispatch
+  // thread, newer ones are dropped (and counted) beyond that
+  size_t queueCapacity = 65536;
+};
+
+struct PAHOConsumerGroupMetrics {
+  uint64_t received;
+  uint64_t dispatched;
+  uint64_t dropped;
+  // Dispatched per second since the previous getMetrics() call, overall and
+  // per member
+  double rate;
+  std::vector<double> memberRates;
+  std::vector<uint64_t> memberDispatched;
+};
+
+// N Paho connections sharing one MQTT v5 shared subscription, so the broker
+// load-balances the messages over them. Each member hands what Paho delivers
+// to a dispatch thread of its own, which runs the callback: the work on
+// messages is spread over N threads (pinned to cores if asked) instead of
+// one Paho callback thread.
+//
+// Members are ordinary PAHOMQTTConnections: with clientId set, member i uses
+// "<clientId>-<i>", and they restore the subscription on reconnect.
+// supervise() hands them to a PAHOConnectionManager.
+class PAHOConsumerGroup {
+ public:
+  PAHOConsumerGroup(const PAHOMQTTConnectionParameters &parameters, const PAHOConsumerGroupOptions &options);
+  ~PAHOConsumerGroup();
+
+  PAHOConsumerGroup(const PAHOConsumerGroup &) = delete;
+  PAHOConsumerGroup &operator=(const PAHOConsumerGroup &) = delete;
+
+  // Set before start()
+  void setOnMessageCallback(on_group_message_callback callback, void *userData);
+
+  // Starts the dispatch threads, subscribes and connects every member
+  void start();
+  // Takes the members back from the supervising manager, disconnects, then
+  // lets the dispatch threads finish what they hold
+  void stop();
+  // Until stop(), call it again after a restart
+  void supervise(PAHOConnectionManager::Manager &manager);
+
+  size_t getMemberCount() const { return members.size(); }
+  std::shared_ptr<PAHOMQTTConnection> getConnection(size_t member) const;
+  // Members currently connected
+  size_t getConnectedCount() const;
+  PAHOConsumerGroupMetrics getMetrics();
+
+ private:
+  struct Member {
+    PAHOConsumerGroup *group;
+    size_t index;
+    std::shared_ptr<PAHOMQTTConnection> connection;
+    std::thread thread;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<PAHOMQTTMessage> queue;
+    bool running = false;
+
+    std::atomic<uint64_t> received{0};
+    std::atomic<uint64_t> dispatched{0};
+    std::atomic<uint64_t> dropped{0};
+    uint64_t lastDispatched = 0;
+  };
+
+  PAHOConsumerGroupOptions options;
+  std::vector<std::unique_ptr<Member>> members;
+  on_group_message_callback onMessageCallback = nullptr;
+  void *userData = nullptr;
+  bool started = false;
+  PAHOConnectionManager::Manager *manager = nullptr;
+
+  std::mutex metricsMutex;
+  std::chrono::steady_clock::time_point lastMetrics;
+
+  void dispatch(Member &member);
+  static void onMessage(PAHOMQTTConnection *connection, void *userData, const PAHOMQTTMessage &message);
+};
@@ -1,12 +1,22 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <queue>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <vector>
 
+#include "connection_error.h"
 #include "mqtt/async_client.h"
+#include "realtime_publisher.h"
+#include "shared_payload.h"
+#include "subscription_batch.h"
 
 class PAHOMQTTConnection;
 
@@ -50,15 +60,48 @@ class PAHOMQTTConnectionParameters {
 
   static PAHOMQTTConnectionParameters get_localhost_default();
 
+  // 0 leaves the limit to Paho
   size_t maxPendingMessages = 10;
+  // tcp://host:port, ssl://, ws://host:port/path, wss:// or unix:///path for
+  // a broker on the same host. mqtt:// and mqtts:// are accepted as aliases;
+  // with tls set, tcp:// and ws:// are upgraded to ssl:// and wss://.
   std::string uri;
   std::string username;
   std::string password;
   bool tls;
   std::string cafile;
   std::string capath;
+  // Client certificate and key for mutual TLS, keyPassword for an
+  // encrypted key
   std::string certfile;
   std::string keyfile;
+  std::string keyPassword;
+  // Lowest version offered ("tlsv1", "tlsv1.1" or "tlsv1.2") and the cipher
+  // list, empty for the defaults. Paho builds a new SSL context for every
+  // connection: its reconnects always do a full handshake and TLS 1.3 suites
+  // cannot be chosen. The mosquitto backend resumes sessions.
+  std::string tlsVersion;
+  std::string ciphers;
+
+  // Real-time mode: sendRealtime() copies into slots preallocated at
+  // construction and never touches the heap
+  bool realtime = false;
+  size_t realtimeQueueSlots = 1024;
+  size_t realtimeMaxTopicSize = 128;
+  size_t realtimeMaxPayloadSize = 1024;
+
+  // Persistent session: clean start is off and the broker keeps the
+  // subscriptions and QoS 1/2 state for sessionExpiry after a disconnect.
+  // The session is found again by clientId, and in-flight messages are
+  // stored under persistDir so they survive a restart (in memory if empty).
+  bool persistentSession = false;
+  std::string clientId;  // generated when empty
+  std::chrono::seconds sessionExpiry = std::chrono::seconds(3600);
+  std::string persistDir;
+
+  // subscribeMany/unsubscribeMany split their filters over packets of at
+  // most this size
+  size_t maxSubscribePacketSize = 65536;
 };
 
 enum class PAHOMQTTConnectionStatus { CONNECTED, CONNECTING, DISCONNECTED };
@@ -66,10 +109,17 @@ enum class PAHOMQTTConnectionStatus { CONNECTED, CONNECTING, DISCONNECTED };
 typedef void (*on_connect_callback)(PAHOMQTTConnection *connection, void *userData);
 typedef void (*on_disconnect_callback)(PAHOMQTTConnection *connection, void *userData);
 typedef void (*on_message_callback)(PAHOMQTTConnection *connection, void *userData, const PAHOMQTTMessage &message);
-typedef void (*on_error_callback)(PAHOMQTTConnection *connection, void *userData, const mqtt::token &tok);
+typedef void (*on_publish_callback)(PAHOMQTTConnection *connection, void *userData, int messageId);
+// Called once every packet of a subscribeMany/unsubscribeMany batch was
+// acknowledged, refused counts the filters the broker did not accept
+typedef void (*on_batch_callback)(PAHOMQTTConnection *connection, void *userData, int batchId, size_t count,
+                                  size_t refused);
+typedef void (*on_error_callback)(PAHOMQTTConnection *connection, void *userData, const ConnectionError &error);
 
 class PAHOMQTTConnection : public virtual mqtt::callback, public virtual mqtt::iaction_listener {
  public:
+  using MessageType = PAHOMQTTMessage;
+
   PAHOMQTTConnection();
   PAHOMQTTConnection(const PAHOMQTTConnectionParameters &parameters);
   PAHOMQTTConnection(const PAHOMQTTConnection &other) = delete;
@@ -83,21 +133,46 @@ class PAHOMQTTConnection : public virtual mqtt::callback, public virtual mqtt::i
   void connect();
   void disconnect();
 
-  bool send(const PAHOMQTTMessage &message);
+  // messageId receives the id later passed to the publish callback, 0 for
+  // QoS 0 messages
+  bool send(const PAHOMQTTMessage &message, int *messageId = nullptr);
+  // Same as send(), lets BasicConnection drive this backend
+  bool publish(const PAHOMQTTMessage &message) { return send(message); }
+  // Hands the shared buffers to Paho as buffer_refs, nothing is copied
+  bool sendShared(const SharedMessage &message);
+  // Only available in real-time mode, returns false when the slots are full
+  bool sendRealtime(std::string_view topic, const void *payload, size_t size, int qos = 0, bool retain = false);
 
   void setWillMessage(const PAHOMQTTMessage &message);
   void disableWillMessage();
 
   PAHOMQTTConnectionStatus getStatus() const;
+  // Publishes handed to Paho that have not completed yet
+  size_t getPendingCount() const;
 
+  // Active filters are remembered and restored in one SUBSCRIBE after a
+  // reconnect, unless the broker still has them in the session
   void subscribe(const std::string &topic, int qos = 0);
   void unsubscribe(const std::string &topic);
-
+  // Sends the filters in as few packets as maxSubscribePacketSize allows,
+  // callback is called once for the whole batch. Returns the batch id, -1 if
+  // nothing could be sent
+  int subscribeMany(const std::vector<std::string> &topics, int qos = 0, on_batch_callback callback = nullptr);
+  int unsubscribeMany(const std::vector<std::string> &topics, on_batch_callback callback = nullptr);
+
+  // Both return once a message callback in progress on another thread is
+  // over, so the previous user data can be freed after
   void setUserData(void *userData);
+  void setOnMessageCallback(on_message_callback callback);
   void setOnConnectCallback(on_connect_callback callback);
   void setOnDisconnectCallback(on_disconnect_callback callback);
-  void setOnMessageCallback(on_message_callback callback);
   void setOnErrorCallback(on_error_callback callback);
+  void setOnPublishCallback(on_publish_callback callback);
+  // Aggregates repeated errors into one callback per interval, 0 disables it
+  void setErrorRateLimit(std::chrono::milliseconds interval);
+  // Reports what the error rate limit held back once its interval is over,
+  // called by the manager on every tick
+  void flushErrors();
 
  private:
   int id;
@@ -109,14 +184,51 @@ class PAHOMQTTConnection : public virtual mqtt::callback, public virtual mqtt::i
 
   std::queue<PAHOMQTTMessage> sendQueue;
 
-  void *userData;
+  std::mutex subscriptionsMutex;
+  std::map<std::string, int> subscriptions;
+  void resubscribe();
+
+  std::mutex batchMutex;
+  SubscriptionBatches<on_batch_callback> batches;
+  int nextPacketId = 0;
+  int sendBatch(const std::vector<std::string> &topics, const mqtt::qos_collection &qos, on_batch_callback callback,
+                bool subscribe);
+  void completeBatch(const mqtt::token &tok, bool success);
+  void drainBatches();
+
+  // Changed while Paho's callback thread delivers messages
+  std::atomic<void *> userData;
+  std::atomic<on_message_callback> onMessageCallback;
+  // message_arrived() calls in progress
+  std::atomic<int> dispatching{0};
+  void waitForDispatch();
   on_connect_callback onConnectCallback;
   on_disconnect_callback onDisconnectCallback;
-  on_message_callback onMessageCallback;
   on_error_callback onErrorCallback;
+  on_publish_callback onPublishCallback;
+  ErrorRateLimiter errorLimiter;
 
-  // paho
+  // paho. The client and its connect options are kept across reconnects,
+  // connect() only re-dials; they are rebuilt when the parameters or the
+  // will change.
   std::shared_ptr<mqtt::async_client> cli;
+  // Exclusive while cli is replaced, shared while the real-time publisher
+  // thread takes its reference
+  std::shared_mutex clientMutex;
+  // Pending deliveries at which publishing is refused, from the parameters;
+  // read by the real-time publisher thread
+  std::atomic<size_t> pendingLimit;
+  mqtt::connect_options connectOptions;
+  std::string clientUri;
+  std::string generatedClientId;
+  bool clientStale = true;
+  bool optionsStale = true;
+  void setupClient();
+  void buildConnectOptions();
+
+  std::unique_ptr<RealtimePublisher> realtimePublisher;
+  void setupRealtime();
+  static bool publishRealtime(void *obj, const char *topic, const void *payload, size_t size, int qos, bool retain);
 
  private:
   void on_failure(const mqtt::token &tok) override;
@@ -127,4 +239,5 @@ class PAHOMQTTConnection : public virtual mqtt::callback, public virtual mqtt::i
   void delivery_complete(mqtt::delivery_token_ptr token) override;
 
   void on_disconnect(const mqtt::properties &, mqtt::ReasonCode);
+  void reportError(ConnectionErrorCode code, int backendCode);
 };
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+struct RateControlOptions {
+  bool enabled = false;
+  // Bounds of the in-flight window, in messages
+  size_t minWindow = 1;
+  size_t maxWindow = 1000;
+  // Queueing delay, the acknowledgement latency above the lowest one seen,
+  // tolerated before the window shrinks
+  std::chrono::microseconds targetDelay = std::chrono::milliseconds(20);
+  std::chrono::microseconds maxBatchDelay = std::chrono::milliseconds(50);
+  // The lowest latency is forgotten after this long, so a slower route is
+  // not mistaken for congestion forever
+  std::chrono::milliseconds minLatencyWindow = std::chrono::seconds(10);
+};
+
+// What the controller currently allows. Producers that can downsample, or
+// compress their payloads, follow targetRate and compressionLevel.
+struct RateControlSignal {
+  size_t window;
+  std::chrono::microseconds batchDelay;
+  // 0 when compressing is not worth it, else a zlib level up to 9
+  int compressionLevel;
+  // Messages per second the window sustains at the current latency, and the
+  // rate actually acknowledged
+  double targetRate;
+  double deliveryRate;
+  double latencyMs;
+  double minLatencyMs;
+};
+
+// AIMD congestion control driven by acknowledgement latency, as in
+// delay-based TCP variants: the window grows by one message per ack while
+// the queueing delay is well under the target, by one per round trip near
+// it, and is cut by 30% at most once per round trip above it or when the
+// connection drops. The batching delay is the spacing of acks at the current
+// window, and the compression level rises as the window shrinks towards its
+// minimum. Updates take a lock, reading the outputs does not.
+class RateController {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit RateController(const RateControlOptions &options = RateControlOptions());
+
+  // Restarts from the minimum window with the new options
+  void setOptions(const RateControlOptions &options);
+  const RateControlOptions &getOptions() const { return options; }
+  void reset();
+
+  void onAck(int64_t latencyUs, Clock::time_point now = Clock::now());
+  void onLoss(Clock::time_point now = Clock::now());
+
+  size_t getWindow() const { return window.load(std::memory_order_relaxed); }
+  std::chrono::microseconds getBatchDelay() const {
+    return std::chrono::microseconds(batchDelayUs.load(std::memory_order_relaxed));
+  }
+  int getCompressionLevel() const { return compressionLevel.load(std::memory_order_relaxed); }
+  double getTargetRate() const { return targetRate.load(std::memory_order_relaxed); }
+  RateControlSignal getSignal() const;
+
+ private:
+  RateControlOptions options;
+
+  mutable std::mutex mutex;
+  double congestionWindow;
+  double smoothedLatencyUs;
+  double minLatencyUs;
+  Clock::time_point minLatencyTime;
+  Clock::time_point recoveryEnd;
+  double measuredRate;
+  size_t ackedSinceSample;
+  Clock::time_point sampleStart;
+
+  std::atomic<size_t> window;
+  std::atomic<int64_t> batchDelayUs;
+  std::atomic<int> compressionLevel;
+  std::atomic<double> targetRate;
+  std::atomic<double> deliveryRate;
+
+  void decrease(Clock::time_point now);
+  void publish();
+};
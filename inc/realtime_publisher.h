@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <thread>
+
+// Called on the publisher thread. Returns false if the message could not be
+// handed to the backend yet (e.g. not connected), it is retried later.
+typedef bool (*RealtimePublishFunction)(void *context, const char *topic, const void *payload, size_t size,
+                                        int qos, bool retain);
+
+// Fixed capacity hand-off between a real-time producer and the backend.
+// Every buffer lives in one arena allocated by the constructor: push() copies
+// topic and payload into a free slot and never allocates, locks or blocks.
+// A dedicated thread drains the slots into the backend, which may allocate.
+class RealtimePublisher {
+ public:
+  RealtimePublisher(size_t slots, size_t maxTopicSize, size_t maxPayloadSize, RealtimePublishFunction publish,
+                    void *context);
+  ~RealtimePublisher();
+
+  RealtimePublisher(const RealtimePublisher &) = delete;
+  RealtimePublisher &operator=(const RealtimePublisher &) = delete;
+
+  // Returns false if the queue is full or the message exceeds the slot size
+  bool push(std::string_view topic, const void *payload, size_t size, int qos, bool retain);
+
+  size_t getQueueSize() const;
+  size_t getCapacity() const { return slots; }
+  size_t getMaxTopicSize() const { return maxTopicSize; }
+  size_t getMaxPayloadSize() const { return maxPayloadSize; }
+
+  // Asks the publisher thread to retry messages the backend refused
+  void wake();
+
+ private:
+  struct SlotHeader {
+    std::atomic<size_t> sequence;
+    uint32_t topicSize;
+    uint32_t payloadSize;
+    uint8_t qos;
+    bool retain;
+  };
+
+  const size_t slots;
+  const size_t maxTopicSize;
+  const size_t maxPayloadSize;
+  const size_t stride;
+  std::unique_ptr<char[]> arena;
+
+  alignas(64) std::atomic<size_t> enqueuePosition;
+  alignas(64) std::atomic<size_t> dequeuePosition;
+  alignas(64) std::atomic<uint32_t> pending;
+
+  RealtimePublishFunction publish;
+  void *context;
+
+  std::atomic<bool> running;
+  std::unique_ptr<std::thread> thread;
+
+  SlotHeader *slot(size_t position) const;
+  void threadFunction();
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Immutable, reference counted byte buffer. Copies share the same storage,
+// so one encoded frame can be handed to any number of connections; the Paho
+// backend wraps the very same buffer in its buffer_ref without copying.
+class SharedPayload {
+ public:
+  SharedPayload() = default;
+  // Takes ownership of data, the only allocation is the control block
+  explicit SharedPayload(std::string &&data) : buffer(std::make_shared<const std::string>(std::move(data))) {}
+  explicit SharedPayload(std::string_view data) : buffer(std::make_shared<const std::string>(data)) {}
+
+  const char *data() const { return buffer ? buffer->data() : ""; }
+  size_t size() const { return buffer ? buffer->size() : 0; }
+  bool empty() const { return size() == 0; }
+  std::string_view view() const { return std::string_view(data(), size()); }
+  long useCount() const { return buffer.use_count(); }
+
+  const std::shared_ptr<const std::string> &getBuffer() const { return buffer; }
+
+ private:
+  std::shared_ptr<const std::string> buffer;
+};
+
+// Message whose topic and payload are shared buffers. Topics are stored NUL
+// terminated (std::string), so data() can be passed to C APIs directly.
+struct SharedMessage {
+  SharedPayload topic;
+  SharedPayload payload;
+  int qos = 0;
+  bool retain = false;
+
+  SharedMessage() = default;
+  SharedMessage(SharedPayload topic, SharedPayload payload, int qos = 0, bool retain = false)
+      : topic(std::move(topic)), payload(std::move(payload)), qos(qos), retain(retain) {}
+};
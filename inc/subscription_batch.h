@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Splits topic filters into consecutive chunks whose SUBSCRIBE (or
+// UNSUBSCRIBE) packet stays under maxPacketSize. Returns the index where each
+// chunk ends; a chunk always holds at least one filter.
+inline std::vector<size_t> chunkTopicFilters(const std::vector<std::string> &topics, size_t maxPacketSize,
+                                             bool subscribe) {
+  // Fixed header, packet id and an empty property list
+  static const size_t HEADER_SIZE = 5 + 2 + 1;
+  std::vector<size_t> ends;
+  size_t size = HEADER_SIZE;
+  for (size_t i = 0; i < topics.size(); i++) {
+    // Length prefix, the filter and, for SUBSCRIBE, its options byte
+    size_t filterSize = 2 + topics[i].size() + (subscribe ? 1 : 0);
+    if (size + filterSize > maxPacketSize && size > HEADER_SIZE) {
+      ends.push_back(i);
+      size = HEADER_SIZE;
+    }
+    size += filterSize;
+  }
+  if (!topics.empty()) ends.push_back(topics.size());
+  return ends;
+}
+
+// Tracks subscribeMany/unsubscribeMany calls sent as several packets, a batch
+// completes once each of its packets was acknowledged. Not thread safe: the
+// connection holds its own lock while a batch is sent so no acknowledgement is
+// processed for a packet that was not added yet.
+template <typename Callback>
+class SubscriptionBatches {
+ public:
+  struct Result {
+    int batchId;
+    Callback callback;
+    size_t count;    // filters in the batch
+    size_t refused;  // filters refused by the broker or never acknowledged
+  };
+
+  SubscriptionBatches() : nextBatchId(1) {}
+
+  int open(Callback callback) {
+    int batchId = nextBatchId++;
+    batches[batchId] = {callback, 0, 0, 0};
+    return batchId;
+  }
+
+  void addPacket(int batchId, int packetId, size_t filters) {
+    auto batch = batches.find(batchId);
+    if (batch == batches.end()) return;
+    batch->second.count += filters;
+    batch->second.packets++;
+    packets[packetId] = {batchId, filters};
+  }
+
+  // Returns true with the result when packetId was the last pending packet of
+  // its batch. refused is capped to the packet's filters, pass SIZE_MAX when
+  // the whole packet failed.
+  bool acknowledge(int packetId, size_t refused, Result &result) {
+    auto packet = packets.find(packetId);
+    if (packet == packets.end()) return false;
+    auto [batchId, filters] = packet->second;
+    packets.erase(packet);
+
+    auto batch = batches.find(batchId);
+    if (batch == batches.end()) return false;
+    batch->second.refused += refused < filters ? refused : filters;
+    if (--batch->second.packets > 0) return false;
+    result = {batchId, batch->second.callback, batch->second.count, batch->second.refused};
+    batches.erase(batch);
+    return true;
+  }
+
+  // Drops a batch none of whose packets could be sent
+  void discard(int batchId) { batches.erase(batchId); }
+
+  // Completes every pending batch, unacknowledged filters count as refused.
+  // Used when the connection is lost and no acknowledgement will come.
+  std::vector<Result> drain() {
+    for (auto &[packetId, packet] : packets) {
+      auto batch = batches.find(packet.first);
+      if (batch != batches.end()) batch->second.refused += packet.second;
+    }
+    std::vector<Result> results;
+    for (auto &[batchId, batch] : batches) results.push_back({batchId, batch.callback, batch.count, batch.refused});
+    packets.clear();
+    batches.clear();
+    return results;
+  }
+
+ private:
+  struct Batch {
+    Callback callback;
+    size_t count;
+    size_t packets;
+    size_t refused;
+  };
+
+  int nextBatchId;
+  std::unordered_map<int, Batch> batches;
+  // Packet id -> (batch id, filters in the packet)
+  std::unordered_map<int, std::pair<int, size_t>> packets;
+};
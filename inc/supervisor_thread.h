@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+enum SupervisorSchedulingPolicy { SUPERVISOR_SCHED_OTHER = 0, SUPERVISOR_SCHED_FIFO };
+
+enum SupervisorTickPolicy {
+  // Tick every tickInterval
+  SUPERVISOR_TICK_FIXED = 0,
+  // Double the interval (up to maxTickInterval) while ticks keep retrying
+  // connections, go back to tickInterval as soon as a tick finds nothing to do
+  SUPERVISOR_TICK_BACKOFF
+};
+
+struct SupervisorOptions {
+  // CPUs the thread may run on, empty leaves the affinity untouched
+  std::vector<int> cpuAffinity;
+  SupervisorSchedulingPolicy schedulingPolicy = SUPERVISOR_SCHED_OTHER;
+  // Only used with SUPERVISOR_SCHED_FIFO
+  int priority = 1;
+  SupervisorTickPolicy tickPolicy = SUPERVISOR_TICK_FIXED;
+  std::chrono::milliseconds tickInterval = std::chrono::milliseconds(100);
+  std::chrono::milliseconds maxTickInterval = std::chrono::milliseconds(2000);
+};
+
+// Applies affinity and scheduling policy to the calling thread, returns false
+// (and logs) if any of them could not be set, e.g. missing CAP_SYS_NICE
+bool applyThreadPlacement(const std::vector<int> &cpuAffinity, SupervisorSchedulingPolicy policy, int priority);
+
+// Thread that calls tick() periodically. tick() returns the number of
+// connections it had to (re)connect, which drives the backoff tick policy.
+class SupervisorThread {
+ public:
+  explicit SupervisorThread(std::function<size_t()> tick);
+  ~SupervisorThread();
+
+  // Takes effect on the next start()
+  void setOptions(const SupervisorOptions &options);
+  const SupervisorOptions &getOptions() const;
+
+  void start();
+  void stop();
+  bool isRunning() const;
+  // Whether the caller is running on this thread, i.e. inside tick()
+  bool isCurrentThread() const { return threadId.load(std::memory_order_acquire) == std::this_thread::get_id(); }
+
+  // Runs a tick as soon as possible instead of waiting for the interval
+  void wake();
+
+ private:
+  std::function<size_t()> tick;
+  SupervisorOptions options;
+
+  std::unique_ptr<std::thread> thread;
+  std::atomic<bool> running;
+  std::atomic<std::thread::id> threadId;
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool woken;
+
+  void threadFunction();
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+
+typedef struct ssl_ctx_st SSL_CTX;
+typedef struct ssl_session_st SSL_SESSION;
+typedef struct ssl_st SSL;
+
+struct TLSOptions {
+  std::string cafile;  // both empty: the system's trust store
+  std::string capath;
+  // Client certificate (PEM, may hold the chain) and its key, for brokers
+  // requiring mutual TLS
+  std::string certfile;
+  std::string keyfile;
+  std::string keyPassword;
+  // Lowest version offered, "tlsv1.2" or "tlsv1.3"; empty for OpenSSL's
+  // default
+  std::string tlsVersion;
+  // OpenSSL cipher list for TLS 1.2 and lower, and TLS 1.3 suites
+  // (e.g. "TLS_AES_128_GCM_SHA256"); empty for the defaults
+  std::string ciphers;
+  std::string ciphersuites;
+  // Name the server certificate must match, or its address for an IP
+  // literal; empty skips the check
+  std::string verifyHost;
+  // Offers the last session ticket on the next handshake, which skips the
+  // certificate exchange and verification
+  bool sessionResumption = true;
+};
+
+// Per connection: later handshake messages on the same one are not counted
+struct TLSStatistics {
+  size_t handshakes = 0;
+  size_t resumed = 0;
+};
+
+// Client SSL_CTX built once from TLSOptions and kept across reconnects,
+// together with the session of the last connection. Handed to libmosquitto
+// through MOSQ_OPT_SSL_CTX; libmosquitto creates the SSL object itself, so
+// the session is attached when the handshake starts.
+class TLSClientContext {
+ public:
+  // nullptr when the options cannot be applied, error says why
+  static std::unique_ptr<TLSClientContext> create(const TLSOptions &options, std::string *error = nullptr);
+  TLSClientContext(const TLSClientContext &) = delete;
+  ~TLSClientContext();
+
+  SSL_CTX *get() const { return ctx; }
+  const TLSOptions &getOptions() const { return options; }
+  // The next handshake is a full one
+  void forgetSession();
+  TLSStatistics getStatistics() const;
+
+ private:
+  TLSOptions options;
+  SSL_CTX *ctx;
+  std::mutex sessionMutex;
+  SSL_SESSION *session;
+  std::atomic<size_t> handshakes;
+  std::atomic<size_t> resumed;
+
+  TLSClientContext(const TLSOptions &options, SSL_CTX *ctx);
+
+  static int onNewSession(SSL *ssl, SSL_SESSION *session);
+  static void onInfo(const SSL *ssl, int where, int ret);
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "connection.h"
+
+// True if topic matches the MQTT subscription filter (with + and #)
+bool topicMatches(std::string_view filter, std::string_view topic);
+
+// Dispatches received messages to the callbacks whose filter matches. The
+// route table is copy-on-write: dispatch() reads an immutable snapshot and
+// never contends with addRoute/removeRoute.
+class TopicRouter {
+ public:
+  TopicRouter();
+
+  // Returns the route id, used to remove it
+  int addRoute(const std::string &filter, OnMessageCallback callback, void *userData);
+  bool removeRoute(int routeId);
+  void clear();
+
+  // Returns the number of routes that matched
+  size_t dispatch(int connectionId, std::string_view topic, const Message &message) const;
+
+ private:
+  struct Route {
+    int id;
+    std::string filter;
+    OnMessageCallback callback;
+    void *userData;
+  };
+  using RouteTable = std::vector<Route>;
+
+  std::mutex writeMutex;
+  int nextRouteId;
+  std::atomic<std::shared_ptr<const RouteTable>> routes;
+};
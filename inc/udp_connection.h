@@ -0,0 +1,172 @@
+#pragma once
+
+#include "connection.h"
+
+#include <sys/socket.h>
+
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "shared_payload.h"
+
+class UDPMessage : public Message {
+public:
+	uint16_t topicId;
+	// Sender's sequence number, filled in on receive
+	uint32_t sequence;
+	std::string payload;
+	std::chrono::system_clock::time_point timestamp;
+
+	UDPMessage();
+	UDPMessage(uint16_t topicId, const std::string &payload);
+	~UDPMessage() override = default;
+};
+
+class UDPConnectionParameters : public ConnectionParameters {
+public:
+	// Where datagrams are sent, unicast or a multicast group. Empty for a
+	// receive only connection.
+	std::string remoteHost = "127.0.0.1";
+	int remotePort = 9000;
+	// Bound for receiving, empty address for every interface and port 0 for
+	// an ephemeral port
+	std::string localAddress;
+	int localPort = 0;
+	// Group joined for receiving, on multicastInterface (an IPv4 address or
+	// an IPv6 interface name, empty for the default one)
+	std::string multicastGroup;
+	std::string multicastInterface;
+	int multicastTtl = 1;
+	bool multicastLoop = true;
+	// Datagrams per sendmmsg/recvmmsg call
+	size_t batchSize = 32;
+	// UDP generic segmentation offload: queued datagrams of the same size are
+	// sent as one buffer split by the kernel (Linux 4.18+)
+	bool gso = false;
+	// Header included, keep it under the path MTU to avoid fragmentation
+	size_t maxDatagramSize = 1472;
+	int socketBufferSize = 0; // SO_SNDBUF/SO_RCVBUF, 0 keeps the default
+	// Topic names sendShared() accepts and the ids they are sent as
+	std::map<std::string, uint16_t> topicIds;
+
+	UDPConnectionParameters() : ConnectionParameters(CONNECTION_TYPE_UDP){};
+	~UDPConnectionParameters() override = default;
+};
+
+struct UDPStatistics {
+	size_t sent = 0;
+	size_t received = 0;
+	// Gaps in a sender's sequence numbers; a late datagram is counted as
+	// reordered and no longer as lost, one seen before as a duplicate
+	size_t lost = 0;
+	size_t reordered = 0;
+	size_t duplicates = 0;
+	size_t malformed = 0;
+	size_t sendErrors = 0;
+};
+
+// Datagram transport for high rate signals where a late sample is worthless:
+// no broker, no retransmission and no head-of-line blocking. Each datagram
+// is an 8 byte header (version, flags, topic id, sequence number) followed
+// by the payload. send() writes right away; queueSend() queues for the I/O
+// thread, which writes the queue with sendmmsg (or GSO) and reads with
+// recvmmsg.
+class UDPConnection : public Connection {
+public:
+	explicit UDPConnection(const UDPConnectionParameters &parameters);
+	UDPConnection(const UDPConnection &) = delete;
+	~UDPConnection() override;
+
+	void setConnectionParameters(const ConnectionParameters &parameters) override;
+	const ConnectionParameters &getConnectionParameters() const override { return udpParameters; }
+	const UDPConnectionParameters &getUDPConnectionParameters() const { return udpParameters; }
+
+	void connect() override;
+	void disconnect() override;
+
+	bool send(const Message &message) override;
+	void receive(Message &message) override;
+	bool queueSend(const Message &message) override;
+	// The topic is looked up in topicIds, false when it has no id
+	bool sendShared(const SharedMessage &message) override;
+
+	size_t getQueueSize() override;
+	size_t getBacklog() override { return queueSize.load(); }
+	UDPStatistics getStatistics() const;
+	int getBoundPort() const { return boundPort.load(); }
+
+private:
+	struct Datagram {
+		uint8_t header[8];
+		std::string payload;
+
+		size_t size() const { return sizeof(header) + payload.size(); }
+	};
+	// A sender's address and port, compared without building a string
+	struct SourceAddress {
+		uint8_t address[16];
+		uint16_t port;
+		uint16_t family;
+
+		bool operator==(const SourceAddress &other) const = default;
+	};
+	struct SourceAddressHash {
+		size_t operator()(const SourceAddress &source) const;
+	};
+	struct Source {
+		// Sequence numbers received below nextSequence, to tell a late
+		// datagram from a duplicate
+		static constexpr uint32_t HISTORY = 1024;
+
+		uint32_t nextSequence;
+		std::bitset<HISTORY> seen;
+	};
+
+	UDPConnectionParameters udpParameters;
+
+	std::unique_ptr<std::thread> ioThread = NULL;
+	std::atomic<bool> running;
+	int fd;
+	int wakeFds[2];
+	std::atomic<bool> wakePending;
+	std::atomic<int> boundPort;
+	struct sockaddr_storage remote;
+	socklen_t remoteLength;
+
+	std::atomic<uint32_t> nextSequence;
+	std::mutex queueMutex;
+	std::vector<Datagram> queue;
+	std::atomic<size_t> queueSize;
+
+	// I/O thread only: receive buffers for one recvmmsg call and the
+	// senders' sequence numbers, keyed by their address
+	std::vector<char> receiveBuffer;
+	std::unordered_map<SourceAddress, Source, SourceAddressHash> sources;
+
+	std::atomic<size_t> sent;
+	std::atomic<size_t> received;
+	std::atomic<size_t> lost;
+	std::atomic<size_t> reordered;
+	std::atomic<size_t> duplicates;
+	std::atomic<size_t> malformed;
+	std::atomic<size_t> sendErrors;
+
+	bool openSocket();
+	void closeSocket();
+	bool sendNow(uint16_t topicId, const char *data, size_t size);
+	bool enqueue(uint16_t topicId, const char *data, size_t size);
+	void wake();
+	void loop() override;
+	void flushQueue(std::vector<Datagram> &datagrams);
+	size_t sendSegmented(std::vector<Datagram> &datagrams, size_t first);
+	void readDatagrams();
+	void trackSequence(const struct sockaddr_storage &address, uint32_t sequence);
+};
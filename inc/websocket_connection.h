@@ -0,0 +1,129 @@
+#pragma once
+
+#include "connection.h"
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "shared_payload.h"
+
+class WebSocketMessage : public Message {
+public:
+	std::string payload;
+	bool binary;
+	// Server mode: the peer it came from, or the peer to send it to (-1 sends
+	// it to every peer). Always -1 in client mode.
+	int peer;
+	std::chrono::system_clock::time_point timestamp;
+
+	WebSocketMessage();
+	explicit WebSocketMessage(const std::string &payload, bool binary = false, int peer = -1);
+	~WebSocketMessage() override = default;
+};
+
+enum WebSocketMode { WEBSOCKET_MODE_CLIENT = 0, WEBSOCKET_MODE_SERVER };
+
+class WebSocketConnectionParameters : public ConnectionParameters {
+public:
+	WebSocketMode mode = WEBSOCKET_MODE_CLIENT;
+	// Client: the server to connect to. Server: the address to listen on,
+	// empty for every interface
+	std::string host = "localhost";
+	int port = 8080;
+	std::string path = "/";
+	// permessage-deflate without context takeover, so a message is
+	// compressed once whatever the number of peers. Needs zlib.
+	bool deflate = true;
+	size_t deflateThreshold = 256; // smaller messages are sent as they are
+	// Outgoing frames are written with one gather write per peer. Under load,
+	// waiting up to batchDelay between flushes gathers more frames per
+	// syscall; a frame sent after an idle period still goes out at once.
+	std::chrono::milliseconds batchDelay = std::chrono::milliseconds(0);
+	size_t maxMessageSize = 16 * 1024 * 1024;
+	int maxPeers = 64;
+
+	WebSocketConnectionParameters() : ConnectionParameters(CONNECTION_TYPE_WEBSOCKET){};
+	~WebSocketConnectionParameters() override = default;
+};
+
+// RFC 6455 WebSocket over TCP, as a client or as a server broadcasting to its
+// peers. One I/O thread per connection polls the sockets; send() only frames
+// the message and queues it, payloads are shared between peers and written
+// with one gather write without being copied (client frames are masked, so copied).
+class WebSocketConnection : public Connection {
+public:
+	explicit WebSocketConnection(const WebSocketConnectionParameters &parameters);
+	WebSocketConnection(const WebSocketConnection &) = delete;
+	~WebSocketConnection() override;
+
+	void setConnectionParameters(const ConnectionParameters &parameters) override;
+	const ConnectionParameters &getConnectionParameters() const override { return wsParameters; }
+	const WebSocketConnectionParameters &getWebSocketConnectionParameters() const { return wsParameters; }
+
+	void connect() override;
+	void disconnect() override;
+
+	bool send(const Message &message) override;
+	void receive(Message &message) override;
+	// Sent directly, the I/O thread already queues and batches frames
+	bool queueSend(const Message &message) override;
+	// Sends the payload as a binary message to every peer without copying it
+	bool sendShared(const SharedMessage &message) override;
+	bool sendBinary(const SharedPayload &payload, int peer = -1);
+	bool sendText(const SharedPayload &payload, int peer = -1);
+
+	// Frames queued and not written yet, over every peer
+	size_t getQueueSize() override;
+	size_t getBacklog() override { return queuedFrames.load(); }
+	size_t getPeerCount() const { return peerCount.load(); }
+	// The port actually bound, useful when listening on port 0
+	int getBoundPort() const { return boundPort.load(); }
+
+private:
+	struct Frame;
+	struct Peer;
+	class Deflater;
+
+	WebSocketConnectionParameters wsParameters;
+
+	std::unique_ptr<std::thread> ioThread = NULL;
+	std::atomic<bool> running;
+	int listenFd;
+	int wakeFds[2];
+	std::atomic<bool> wakePending;
+	std::atomic<int> boundPort;
+
+	// The I/O thread adds and removes peers under peersMutex, send() only
+	// appends to their pending queues under the same lock
+	std::mutex peersMutex;
+	std::vector<std::unique_ptr<Peer>> peers;
+	std::atomic<size_t> peerCount;
+	std::atomic<size_t> queuedFrames;
+	std::atomic<int> deflatePeers;
+	std::atomic<bool> closeRequested;
+	int nextPeerId;
+
+	std::mutex deflateMutex;
+	std::unique_ptr<Deflater> deflater;
+
+	bool sendFrame(int opcode, const SharedPayload &payload, int peer);
+	void wake();
+	void loop() override;
+	bool startClient();
+	bool startServer();
+	void stop();
+	void acceptPeers();
+	void readPeer(Peer &peer);
+	bool processHandshake(Peer &peer);
+	void processFrames(Peer &peer);
+	void handleMessage(Peer &peer, int opcode, std::string &payload, bool compressed);
+	void queueControl(Peer &peer, int opcode, const std::string &payload);
+	void closePeer(Peer &peer, uint16_t code);
+	bool flushPeer(Peer &peer);
+	void removeClosedPeers();
+};
@@ -0,0 +1,55 @@
+#include "async.h"
+
+#include "logger.h"
+
+ThreadPoolExecutor::ThreadPoolExecutor(size_t threadCount) : stopping(false) {
+  for (size_t i = 0; i < std::max<size_t>(threadCount, 1); i++) threads.emplace_back(&ThreadPoolExecutor::run, this);
+}
+
+ThreadPoolExecutor::~ThreadPoolExecutor() { stop(); }
+
+void ThreadPoolExecutor::post(std::coroutine_handle<> handle) {
+  {
+    std::unique_lock<std::mutex> lck(mutex);
+    ready.push_back(handle);
+  }
+  condition.notify_one();
+}
+
+void ThreadPoolExecutor::stop() {
+  {
+    std::unique_lock<std::mutex> lck(mutex);
+    stopping = true;
+  }
+  condition.notify_all();
+  for (std::thread &thread : threads)
+    if (thread.joinable()) thread.join();
+  threads.clear();
+}
+
+void ThreadPoolExecutor::run() {
+  while (true) {
+    std::coroutine_handle<> handle;
+    {
+      std::unique_lock<std::mutex> lck(mutex);
+      condition.wait(lck, [this]() { return stopping || !ready.empty(); });
+      if (ready.empty()) return;
+      handle = ready.front();
+      ready.pop_front();
+    }
+    handle.resume();
+  }
+}
+
+static detail::DetachedTask runDetached(Executor &executor, Task<void> task) {
+  co_await executor.schedule();
+  try {
+    co_await std::move(task);
+  } catch (const std::exception &e) {
+    LOG_ERROR("Spawned task failed: {}", e.what());
+  } catch (...) {
+    LOG_ERROR("Spawned task failed");
+  }
+}
+
+void spawn(Executor &executor, Task<void> task) { runDetached(executor, std::move(task)).handle.resume(); }
@@ -0,0 +1,321 @@
+#include "capture.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+
+#include "logger.h"
+
+static const char CAPTURE_MAGIC[8] = {'C', 'O', 'M', 'M', 'C', 'A', 'P', 'T'};
+static const uint32_t CAPTURE_VERSION = 1;
+
+// Records start after it
+static const size_t CAPTURE_HEADER_SIZE = 128;
+
+struct CaptureFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t headerSize;
+  int64_t startNs;
+  // Set by close(), 0 while the capture is being written
+  uint64_t end;
+  uint64_t recordCount;
+  uint64_t dropped;
+  uint64_t indexOffset;
+  uint64_t indexCount;
+  uint64_t topicsOffset;
+  uint64_t topicCount;
+};
+
+// Kinds above the CaptureDirections
+static const uint8_t CAPTURE_KIND_TOPIC = 2;
+
+struct CaptureRecordHeader {
+  // Whole record padded to 8 bytes. Stored last, so a reader of a capture
+  // being written stops at 0.
+  uint32_t size;
+  uint8_t kind;
+  uint8_t qos;
+  uint8_t retain;
+  uint8_t reserved;
+  uint32_t topicId;
+  // The topic itself for a topic record
+  uint32_t payloadSize;
+  int64_t timestampNs;
+};
+
+struct CaptureIndexEntry {
+  int64_t timestampNs;
+  uint64_t offset;
+};
+
+struct CaptureTopicEntry {
+  uint32_t topicId;
+  uint32_t size;
+};
+
+static size_t padded(size_t size) { return (size + 7) & ~(size_t)7; }
+
+static uint32_t recordSize(const CaptureRecordHeader *header) {
+  return std::atomic_ref<uint32_t>(const_cast<uint32_t &>(header->size)).load(std::memory_order_acquire);
+}
+
+static int64_t toNanoseconds(std::chrono::system_clock::time_point timestamp) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(timestamp.time_since_epoch()).count();
+}
+
+CaptureWriter::CaptureWriter(const std::string &path, size_t capacity)
+    : path(path), capacity(std::max(capacity, CAPTURE_HEADER_SIZE)), offset(CAPTURE_HEADER_SIZE), records(0), dropped(0) {
+  fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    LOG_ERROR("CaptureWriter: cannot create {}: {}", path, strerror(errno));
+    return;
+  }
+  // Sparse, pages are only allocated as records reach them
+  void *mapped = MAP_FAILED;
+  if (ftruncate(fd, this->capacity) == 0)
+    mapped = mmap(nullptr, this->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapped == MAP_FAILED) {
+    LOG_ERROR("CaptureWriter: cannot map {} bytes of {}: {}", this->capacity, path, strerror(errno));
+    ::close(fd);
+    fd = -1;
+    return;
+  }
+  map = static_cast<char *>(mapped);
+  madvise(map, this->capacity, MADV_SEQUENTIAL);
+
+  CaptureFileHeader *header = reinterpret_cast<CaptureFileHeader *>(map);
+  memcpy(header->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+  header->version = CAPTURE_VERSION;
+  header->headerSize = CAPTURE_HEADER_SIZE;
+  header->startNs = toNanoseconds(std::chrono::system_clock::now());
+}
+
+CaptureWriter::~CaptureWriter() { close(); }
+
+size_t CaptureWriter::getSize() const { return std::min<size_t>(offset.load(std::memory_order_relaxed), capacity); }
+
+bool CaptureWriter::write(CaptureDirection direction, std::string_view topic, std::string_view payload, int qos,
+                          bool retain, std::chrono::system_clock::time_point timestamp) {
+  if (!map) return false;
+  int64_t timestampNs = toNanoseconds(timestamp);
+  int64_t id = topicId(topic, timestampNs);
+  if (id < 0 || !append((uint8_t)direction, (uint32_t)id, payload, qos, retain, timestampNs)) {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  records.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+int64_t CaptureWriter::topicId(std::string_view topic, int64_t timestampNs) {
+  {
+    std::shared_lock<std::shared_mutex> lck(topicsMutex);
+    auto found = topicIds.find(topic);
+    if (found != topicIds.end()) return found->second;
+  }
+  std::unique_lock<std::shared_mutex> lck(topicsMutex);
+  auto found = topicIds.find(topic);
+  if (found != topicIds.end()) return found->second;
+  uint32_t id = (uint32_t)topics.size();
+  // Written before the id is visible, so it precedes every record using it
+  if (!append(CAPTURE_KIND_TOPIC, id, topic, 0, false, timestampNs)) return -1;
+  topics.emplace_back(topic);
+  topicIds.emplace(topics.back(), id);
+  return id;
+}
+
+bool CaptureWriter::append(uint8_t kind, uint32_t topicId, std::string_view payload, int qos, bool retain,
+                           int64_t timestampNs) {
+  size_t size = padded(sizeof(CaptureRecordHeader) + payload.size());
+  uint64_t at = offset.fetch_add(size, std::memory_order_relaxed);
+  // Every later record is refused too, the records stay contiguous
+  if (at + size > capacity) return false;
+  CaptureRecordHeader *header = reinterpret_cast<CaptureRecordHeader *>(map + at);
+  header->kind = kind;
+  header->qos = (uint8_t)qos;
+  header->retain = retain;
+  header->reserved = 0;
+  header->topicId = topicId;
+  header->payloadSize = (uint32_t)payload.size();
+  header->timestampNs = timestampNs;
+  memcpy(header + 1, payload.data(), payload.size());
+  std::atomic_ref<uint32_t>(header->size).store((uint32_t)size, std::memory_order_release);
+  return true;
+}
+
+void CaptureWriter::close() {
+  if (!map) return;
+  // Walk the records for the index, they end at the first one not written
+  std::vector<CaptureIndexEntry> index;
+  uint64_t count = 0;
+  size_t end = CAPTURE_HEADER_SIZE;
+  while (end + sizeof(CaptureRecordHeader) <= capacity) {
+    const CaptureRecordHeader *record = reinterpret_cast<const CaptureRecordHeader *>(map + end);
+    uint32_t size = recordSize(record);
+    if (size == 0) break;
+    if (record->kind != CAPTURE_KIND_TOPIC) {
+      if (count % CAPTURE_INDEX_INTERVAL == 0) index.push_back({record->timestampNs, end});
+      count++;
+    }
+    end += size;
+  }
+
+  std::string trailer(index.size() * sizeof(CaptureIndexEntry), '\0');
+  if (!index.empty()) memcpy(trailer.data(), index.data(), trailer.size());
+  size_t topicsOffset = end + trailer.size();
+  for (uint32_t id = 0; id < topics.size(); id++) {
+    CaptureTopicEntry entry = {id, (uint32_t)topics[id].size()};
+    trailer.append(reinterpret_cast<const char *>(&entry), sizeof(entry));
+    trailer.append(topics[id]);
+    trailer.resize(padded(trailer.size()));
+  }
+
+  // The trailer goes in first, only the header is touched past the truncation
+  if (ftruncate(fd, end + trailer.size()) != 0 ||
+      pwrite(fd, trailer.data(), trailer.size(), end) != (ssize_t)trailer.size())
+    LOG_ERROR("CaptureWriter: cannot finish {}: {}", path, strerror(errno));
+  CaptureFileHeader *header = reinterpret_cast<CaptureFileHeader *>(map);
+  header->recordCount = count;
+  header->dropped = dropped.load(std::memory_order_relaxed);
+  header->indexOffset = end;
+  header->indexCount = index.size();
+  header->topicsOffset = topicsOffset;
+  header->topicCount = topics.size();
+  // Last, it marks the capture complete
+  std::atomic_ref<uint64_t>(header->end).store(end, std::memory_order_release);
+  munmap(map, capacity);
+  map = nullptr;
+  ::close(fd);
+  fd = -1;
+}
+
+CaptureReader::CaptureReader(const std::string &path) {
+  fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    LOG_ERROR("CaptureReader: cannot open {}: {}", path, strerror(errno));
+    return;
+  }
+  struct stat st;
+  void *mapped = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= CAPTURE_HEADER_SIZE)
+    mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapped == MAP_FAILED) {
+    LOG_ERROR("CaptureReader: cannot map {}", path);
+    ::close(fd);
+    fd = -1;
+    return;
+  }
+  map = static_cast<char *>(mapped);
+  size = st.st_size;
+  madvise(map, size, MADV_SEQUENTIAL);
+
+  const CaptureFileHeader *header = reinterpret_cast<const CaptureFileHeader *>(map);
+  if (memcmp(header->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0 || header->version != CAPTURE_VERSION) {
+    LOG_ERROR("CaptureReader: {} is not a capture", path);
+    munmap(map, size);
+    map = nullptr;
+    ::close(fd);
+    fd = -1;
+    return;
+  }
+  startNs = header->startNs;
+  end = size;
+  position = CAPTURE_HEADER_SIZE;
+  if (header->end == 0 || header->end > size ||
+      header->indexOffset + header->indexCount * sizeof(CaptureIndexEntry) > size || header->topicsOffset > size)
+    return;
+
+  // Closed: the index and topic table are trusted, topic records skipped
+  complete = true;
+  end = header->end;
+  recordCount = header->recordCount;
+  index.resize(header->indexCount);
+  if (!index.empty()) memcpy(index.data(), map + header->indexOffset, index.size() * sizeof(CaptureIndexEntry));
+  topics.resize(header->topicCount);
+  size_t at = header->topicsOffset;
+  for (uint64_t i = 0; i < header->topicCount && at + sizeof(CaptureTopicEntry) <= size; i++) {
+    CaptureTopicEntry entry;
+    memcpy(&entry, map + at, sizeof(entry));
+    if (entry.topicId >= topics.size() || at + sizeof(entry) + entry.size > size) break;
+    topics[entry.topicId] = std::string_view(map + at + sizeof(entry), entry.size);
+    at = padded(at + sizeof(entry) + entry.size);
+  }
+}
+
+CaptureReader::~CaptureReader() {
+  if (map) munmap(map, size);
+  if (fd >= 0) ::close(fd);
+}
+
+bool CaptureReader::read(uint8_t &kind, CaptureRecord &record) {
+  if (!map || position + sizeof(CaptureRecordHeader) > end) return false;
+  const CaptureRecordHeader *header = reinterpret_cast<const CaptureRecordHeader *>(map + position);
+  uint32_t size = recordSize(header);
+  if (size < sizeof(CaptureRecordHeader) || position + size > end ||
+      sizeof(CaptureRecordHeader) + header->payloadSize > size)
+    return false;
+  position += size;
+  kind = header->kind;
+  std::string_view payload(reinterpret_cast<const char *>(header + 1), header->payloadSize);
+  if (kind == CAPTURE_KIND_TOPIC) {
+    if (!complete) {
+      if (header->topicId >= topics.size()) topics.resize(header->topicId + 1);
+      topics[header->topicId] = payload;
+    }
+    return true;
+  }
+  record.direction = kind == CAPTURE_SENT ? CAPTURE_SENT : CAPTURE_RECEIVED;
+  record.topicId = header->topicId;
+  record.topic = getTopic(header->topicId);
+  record.payload = payload;
+  record.qos = header->qos;
+  record.retain = header->retain;
+  record.timestampNs = header->timestampNs;
+  return true;
+}
+
+bool CaptureReader::next(CaptureRecord &record) {
+  uint8_t kind;
+  while (read(kind, record))
+    if (kind != CAPTURE_KIND_TOPIC) return true;
+  return false;
+}
+
+void CaptureReader::rewind() { position = CAPTURE_HEADER_SIZE; }
+
+void CaptureReader::seek(std::chrono::system_clock::time_point timestamp) {
+  int64_t timestampNs = toNanoseconds(timestamp);
+  position = CAPTURE_HEADER_SIZE;
+  // Threads tapping concurrently leave timestamps slightly out of order, the
+  // scan from the entry before settles it
+  auto entry = std::upper_bound(index.begin(), index.end(), timestampNs,
+                                [](int64_t t, const IndexEntry &entry) { return t < entry.timestampNs; });
+  if (entry != index.begin()) position = std::prev(entry)->offset;
+
+  CaptureRecord record;
+  uint8_t kind;
+  while (true) {
+    size_t at = position;
+    if (!read(kind, record)) break;
+    if (kind != CAPTURE_KIND_TOPIC && record.timestampNs >= timestampNs) {
+      position = at;
+      break;
+    }
+  }
+}
+
+std::chrono::system_clock::time_point CaptureReader::getStart() const {
+  return std::chrono::system_clock::time_point(
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(startNs)));
+}
+
+std::string_view CaptureReader::getTopic(uint32_t topicId) const {
+  return topicId < topics.size() ? topics[topicId] : std::string_view();
+}
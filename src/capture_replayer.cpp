@@ -0,0 +1,101 @@
+#include "capture_replayer.h"
+
+#include <algorithm>
+#include <thread>
+
+#include "topic_router.h"
+
+CaptureReplayer::CaptureReplayer(CaptureReader &reader, Connection &connection, const CaptureReplayOptions &options)
+    : reader(reader), connection(connection), options(options) {}
+
+void CaptureReplayer::setMessageBuilder(CaptureMessageBuilder builder, void *userData) {
+  this->builder = builder;
+  builderData = userData;
+}
+
+bool CaptureReplayer::selected(const CaptureRecord &record) {
+  if (!(record.direction == CAPTURE_SENT ? options.sent : options.received)) return false;
+  if (record.topicId >= matches.size()) matches.resize(record.topicId + 1, -1);
+  int8_t &match = matches[record.topicId];
+  if (match < 0) match = topicMatches(options.filter, record.topic) ? 1 : 0;
+  return match > 0;
+}
+
+const Message *CaptureReplayer::build(const CaptureRecord &record) {
+  if (builder) return builder(builderData, record);
+  // The reused messages keep their capacity, steady state does not allocate
+  switch (connection.getConnectionParameters().getType()) {
+    case CONNECTION_TYPE_MQTT:
+      mqttMessage.topic.assign(record.topic);
+      mqttMessage.payload.assign(record.payload);
+      mqttMessage.qos = record.qos;
+      mqttMessage.retain = record.retain;
+      return &mqttMessage;
+    case CONNECTION_TYPE_WEBSOCKET:
+      webSocketMessage.payload.assign(record.payload);
+      return &webSocketMessage;
+    case CONNECTION_TYPE_UDP:
+      udpMessage.topicId = (uint16_t)record.topicId;
+      udpMessage.payload.assign(record.payload);
+      return &udpMessage;
+    default:
+      return nullptr;
+  }
+}
+
+CaptureReplayResult CaptureReplayer::run() {
+  CaptureReplayResult result = {0, 0, 0, 0, 0, 0, 0};
+  running.store(true, std::memory_order_relaxed);
+  double totalLagUs = 0;
+  int64_t firstNs = 0;
+  bool first = true;
+  auto start = std::chrono::steady_clock::now();
+
+  CaptureRecord record;
+  while (running.load(std::memory_order_relaxed) && reader.next(record)) {
+    if (!selected(record)) {
+      result.skipped++;
+      continue;
+    }
+    const Message *message = build(record);
+    if (!message) {
+      result.skipped++;
+      continue;
+    }
+    if (options.mode == CAPTURE_REPLAY_TIMED) {
+      if (first) {
+        firstNs = record.timestampNs;
+        first = false;
+      }
+      // Threads tapping concurrently may have captured slightly out of
+      // order, such a record goes out right away
+      auto due = start + std::chrono::nanoseconds((int64_t)(std::max<int64_t>(record.timestampNs - firstNs, 0) /
+                                                            std::max(options.speed, 1e-9)));
+      auto now = std::chrono::steady_clock::now();
+      // The scheduler's wakeup is late by tens of microseconds, the end of
+      // the wait is spun
+      if (due - now > std::chrono::microseconds(200)) {
+        std::this_thread::sleep_until(due - std::chrono::microseconds(100));
+        now = std::chrono::steady_clock::now();
+      }
+      while (now < due) {
+        std::this_thread::yield();
+        now = std::chrono::steady_clock::now();
+      }
+      double lagUs = std::chrono::duration<double, std::micro>(now - due).count();
+      totalLagUs += lagUs;
+      result.maxLagUs = std::max(result.maxLagUs, lagUs);
+    }
+    if (connection.sendFor(*message, options.sendTimeout))
+      result.sent++;
+    else
+      result.failed++;
+  }
+
+  result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  uint64_t handled = result.sent + result.failed;
+  if (result.seconds > 0) result.rate = result.sent / result.seconds;
+  if (options.mode == CAPTURE_REPLAY_TIMED && handled > 0) result.meanLagUs = totalLagUs / handled;
+  running.store(false, std::memory_order_relaxed);
+  return result;
+}
@@ -1,22 +1,207 @@
 #include "connection.h"
 #include <mutex>
 
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
 int Connection::connectionCount = 0;
 
+// An eventfd on Linux, a non-blocking pipe elsewhere; both fds -1 on failure
+static void openEventFds(int eventFds[2]) {
+#ifdef __linux__
+	eventFds[0] = eventFds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+	if (pipe(eventFds) == 0) {
+		for (int i = 0; i < 2; i++) fcntl(eventFds[i], F_SETFL, fcntl(eventFds[i], F_GETFL, 0) | O_NONBLOCK);
+	} else {
+		eventFds[0] = eventFds[1] = -1;
+	}
+#endif
+}
+
+static void signalEventFds(const int eventFds[2]) {
+	if (eventFds[1] < 0) return;
+	// An eventfd takes an 8 byte counter; a full pipe is already readable
+	uint64_t one = 1;
+	ssize_t written = write(eventFds[1], &one, eventFds[0] == eventFds[1] ? sizeof(one) : 1);
+	(void)written;
+}
+
+static void closeEventFds(const int eventFds[2]) {
+	if (eventFds[0] >= 0) close(eventFds[0]);
+	if (eventFds[1] >= 0 && eventFds[1] != eventFds[0]) close(eventFds[1]);
+}
+
+ConnectionState::ConnectionState(ConnectionStatus status)
+		: status(status), changes(0), eventFds{-1, -1}, watcher(nullptr), watcherContext(nullptr), watcherId(-1),
+			notifying(0) {}
+
+ConnectionState::~ConnectionState() { closeEventFds(eventFds); }
+
+// Edges a status may take, [from][to]. Libraries reconnecting on their own
+// after a drop go straight back to connected. Only an attempt or a link can
+// fail: an error reported after disconnect() leaves the connection
+// disconnected, so it is not reconnected against the application's will.
+static const bool legalTransitions[CONNECTION_STATUS_COUNT][CONNECTION_STATUS_COUNT] = {
+		// CONNECTED, CONNECTING, DISCONNECTED, ERROR
+		{true, true, true, true},   // from CONNECTED
+		{true, true, true, true},   // from CONNECTING
+		{true, true, true, false},  // from DISCONNECTED
+		{true, true, true, true},   // from ERROR
+};
+
+static bool isLegal(ConnectionStatus from, ConnectionStatus to) {
+	return from >= 0 && from < CONNECTION_STATUS_COUNT && to >= 0 && to < CONNECTION_STATUS_COUNT &&
+				 legalTransitions[from][to];
+}
+
+// The state whose watcher this thread is calling, so setWatcher() from the
+// watcher does not wait for itself
+static thread_local const ConnectionState *notifyingState = nullptr;
+
+bool ConnectionState::transition(ConnectionStatus to) {
+	ConnectionStatus from = load();
+	do {
+		if (from == to) return true;
+		if (!isLegal(from, to)) return false;
+	} while (!status.compare_exchange_weak(from, to, std::memory_order_acq_rel));
+	notify(from, to);
+	return true;
+}
+
+bool ConnectionState::transition(ConnectionStatus from, ConnectionStatus to) {
+	if (from != to && !isLegal(from, to)) return false;
+	if (!status.compare_exchange_strong(from, to, std::memory_order_acq_rel)) return false;
+	if (from != to) notify(from, to);
+	return true;
+}
+
+void ConnectionState::notify(ConnectionStatus previous, ConnectionStatus next) {
+	changes.fetch_add(1, std::memory_order_acq_rel);
+	StatusWatcher currentWatcher;
+	void *context;
+	int id;
+	{
+		// Taken so a waiter cannot miss the change between its check and its wait
+		std::unique_lock<std::mutex> lck(mutex);
+		currentWatcher = watcher;
+		context = watcherContext;
+		id = watcherId;
+		if (currentWatcher) notifying++;
+		signalEventFds(eventFds);
+	}
+	condition.notify_all();
+	if (!currentWatcher) return;
+	const ConnectionState *outer = notifyingState;
+	notifyingState = this;
+	currentWatcher(context, id, previous, next);
+	notifyingState = outer;
+	{
+		std::unique_lock<std::mutex> lck(mutex);
+		notifying--;
+	}
+	condition.notify_all();
+}
+
+bool ConnectionState::waitFor(ConnectionStatus target, std::chrono::milliseconds timeout) {
+	if (load() == target) return true;
+	std::unique_lock<std::mutex> lck(mutex);
+	return condition.wait_for(lck, timeout, [&]() { return load() == target; });
+}
+
+ConnectionStatus ConnectionState::waitForChange(ConnectionStatus from, std::chrono::milliseconds timeout) {
+	std::unique_lock<std::mutex> lck(mutex);
+	condition.wait_for(lck, timeout, [&]() { return load() != from; });
+	return load();
+}
+
+int ConnectionState::getEventFd() {
+	std::unique_lock<std::mutex> lck(mutex);
+	if (eventFds[0] < 0) openEventFds(eventFds);
+	return eventFds[0];
+}
+
+void ConnectionState::setWatcher(StatusWatcher watcher, void *context, int id) {
+	std::unique_lock<std::mutex> lck(mutex);
+	this->watcher = watcher;
+	this->watcherContext = context;
+	this->watcherId = id;
+	// The old watcher's context may be freed once this returns
+	int own = notifyingState == this ? 1 : 0;
+	condition.wait(lck, [&]() { return notifying <= own; });
+}
+
+Watermarks::Watermarks() : high(0), low(0), backlog(0), blocked(false), freed(0), waiters(0), eventFds{-1, -1} {}
+
+Watermarks::~Watermarks() { closeEventFds(eventFds); }
+
+void Watermarks::set(size_t high, size_t low) {
+	this->low = low < high ? low : high;
+	this->high = high;
+	if (high == 0 && blocked.exchange(false)) {
+		std::unique_lock<std::mutex> lck(mutex);
+		freed.fetch_add(1, std::memory_order_acq_rel);
+		signalEventFds(eventFds);
+	}
+	condition.notify_all();
+}
+
+int Watermarks::update(size_t current) {
+	size_t previous = backlog.exchange(current, std::memory_order_acq_rel);
+	size_t highMark = high.load(std::memory_order_relaxed);
+	int change = 0;
+	if (highMark > 0) {
+		if (current >= highMark && !blocked.load(std::memory_order_relaxed) && !blocked.exchange(true)) change = 1;
+		if (current <= low.load(std::memory_order_relaxed) && blocked.load(std::memory_order_relaxed) &&
+				blocked.exchange(false))
+			change = -1;
+	}
+	if (change < 0 || (current < previous && waiters.load(std::memory_order_acquire) > 0)) {
+		{
+			// Taken so a waiter cannot miss it between its check and its wait
+			std::unique_lock<std::mutex> lck(mutex);
+			freed.fetch_add(1, std::memory_order_acq_rel);
+			if (change < 0) signalEventFds(eventFds);
+		}
+		condition.notify_all();
+	}
+	return change;
+}
+
+bool Watermarks::waitFreed(uint64_t seen, std::chrono::steady_clock::time_point deadline) {
+	std::unique_lock<std::mutex> lck(mutex);
+	return condition.wait_until(lck, deadline, [&]() { return getFreed() != seen && !isBlocked(); });
+}
+
+int Watermarks::getEventFd() {
+	std::unique_lock<std::mutex> lck(mutex);
+	if (eventFds[0] < 0) openEventFds(eventFds);
+	return eventFds[0];
+}
+
 Connection::Connection() : Connection(ConnectionParameters()) {}
 Connection::Connection(const ConnectionParameters &parameters) {
 	this->status = CONNECTION_STATUS_DISCONNECTED;
 	this->id = connectionCount++;
 	this->userData = NULL;
 	this->maxQueueSize = 1500;
-	this->parameters = parameters;
+	this->onConnectCallback = nullptr;
+	this->onDisconnectCallback = nullptr;
+	this->onMessageCallback = nullptr;
+	this->onErrorCallback = nullptr;
+	this->onPublishCallback = nullptr;
+	this->onBackpressureCallback = nullptr;
 }
 Connection::Connection(Connection &&other)
-		: id(other.id), userData(other.userData), maxQueueSize(other.maxQueueSize), parameters(std::move(other.parameters)),
-			status(other.status), onConnectCallback(other.onConnectCallback),
+		: id(other.id), userData(other.userData), maxQueueSize(other.maxQueueSize),
+			status(other.status.load()), onConnectCallback(other.onConnectCallback),
 			onDisconnectCallback(other.onDisconnectCallback), onMessageCallback(other.onMessageCallback),
-			onErrorCallback(other.onErrorCallback), messageQueueMutex(), messageQueueCondition(),
-			messageQueue(std::move(other.messageQueue)) {
+			onErrorCallback(other.onErrorCallback), onPublishCallback(other.onPublishCallback),
+			onBackpressureCallback(other.onBackpressureCallback), messageQueueMutex(), messageQueueCondition(),
+			messageQueue(std::move(other.messageQueue)), queueLength(other.queueLength.load()) {
 	// Reset the other object's data
 	other.id = -1;
 	other.userData = nullptr;
@@ -26,13 +211,15 @@ Connection::Connection(Connection &&other)
 	other.onDisconnectCallback = nullptr;
 	other.onMessageCallback = nullptr;
 	other.onErrorCallback = nullptr;
+	other.onPublishCallback = nullptr;
+	other.onBackpressureCallback = nullptr;
+	watermarks.set(other.watermarks.getHigh(), other.watermarks.getLow());
+	errorLimiter.setInterval(other.errorLimiter.getInterval());
 }
 
 Connection::~Connection() {
-	while (messageQueue.size() > 0) {
-		delete messageQueue.front();
-		messageQueue.pop();
-	}
+	// Pooled messages go back to their pool as the handles are dropped
+	while (messageQueue.size() > 0) messageQueue.pop();
 }
 
 size_t Connection::getMaxQueueSize() { return this->maxQueueSize; }
@@ -49,4 +236,65 @@ void Connection::setOnMessageCallback(OnMessageCallback callback) { this->onMess
 
 void Connection::setOnErrorCallback(OnErrorCallback callback) { this->onErrorCallback = callback; }
 
+void Connection::setOnPublishCallback(OnPublishCallback callback) { this->onPublishCallback = callback; }
+
+void Connection::setOnBackpressureCallback(OnBackpressureCallback callback) {
+	this->onBackpressureCallback = callback;
+}
+
+void Connection::setWatermarks(size_t high, size_t low) {
+	watermarks.set(high, low);
+	updateWatermarks();
+}
+
+int Connection::getWritableEventFd() { return watermarks.getEventFd(); }
+
+bool Connection::trySend(const Message &message) {
+	if (watermarks.isBlocked()) return false;
+	return queueSend(message);
+}
+
+bool Connection::sendFor(const Message &message, std::chrono::milliseconds timeout) {
+	if (!watermarks.isBlocked() && queueSend(message)) return true;
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+	// Registered before trying again, so whatever frees space after that
+	// attempt bumps the counter read below. Updates are skipped while nobody
+	// waits, the backlog they compare with is refreshed first.
+	Watermarks::Waiter waiter(watermarks);
+	updateWatermarks();
+	while (true) {
+		uint64_t seen = watermarks.getFreed();
+		if (!watermarks.isBlocked() && queueSend(message)) return true;
+		if (!watermarks.waitFreed(seen, deadline)) return false;
+	}
+}
+
+void Connection::setErrorRateLimit(std::chrono::milliseconds interval) { errorLimiter.setInterval(interval); }
+
+void Connection::reportError(ConnectionErrorCode code, int backendCode, const char *backendMessage) {
+	if (!onErrorCallback) return;
+	ConnectionError error = {code, backendCode, connectionErrorString(code), backendMessage, id, 1};
+	if (!errorLimiter.admit(error)) return;
+	onErrorCallback(userData, id, error);
+}
+
+void Connection::flushErrors() {
+	if (!onErrorCallback) return;
+	ConnectionError errors[CONNECTION_ERROR_COUNT];
+	size_t count = errorLimiter.flush(errors, CONNECTION_ERROR_COUNT, id);
+	for (size_t i = 0; i < count; i++) onErrorCallback(userData, id, errors[i]);
+}
+
 ConnectionStatus Connection::getStatus() const { return this->status; }
+
+bool Connection::waitForStatus(ConnectionStatus status, std::chrono::milliseconds timeout) {
+	return this->status.waitFor(status, timeout);
+}
+
+ConnectionStatus Connection::waitForStatusChange(ConnectionStatus from, std::chrono::milliseconds timeout) {
+	return this->status.waitForChange(from, timeout);
+}
+
+int Connection::getStatusEventFd() { return this->status.getEventFd(); }
+
+void Connection::setStatusWatcher(StatusWatcher watcher, void *context) { this->status.setWatcher(watcher, context, id); }
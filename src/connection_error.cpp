@@ -0,0 +1,86 @@
+#include "connection_error.h"
+
+static const char *errorStrings[CONNECTION_ERROR_COUNT] = {
+    "No error",
+    "Out of memory",
+    "Authentication setup failed",
+    "TLS setup failed",
+    "Will message setup failed",
+    "Network loop failed",
+    "Connection to broker failed",
+    "Connection refused by broker",
+    "Disconnection failed",
+    "Publish failed",
+    "Subscribe failed",
+    "Unsubscribe failed",
+};
+
+const char *connectionErrorString(ConnectionErrorCode code) {
+  if (code < 0 || code >= CONNECTION_ERROR_COUNT) return "Unknown error";
+  return errorStrings[code];
+}
+
+ErrorRateLimiter::ErrorRateLimiter() : intervalNs(0) {
+  for (int i = 0; i < CONNECTION_ERROR_COUNT; i++) {
+    windowStart[i].store(INT64_MIN);
+    suppressed[i].store(0);
+    lastBackendCode[i].store(0);
+    lastBackendMessage[i].store(nullptr);
+  }
+}
+
+int64_t ErrorRateLimiter::now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void ErrorRateLimiter::setInterval(std::chrono::milliseconds interval) {
+  intervalNs.store(std::chrono::duration_cast<std::chrono::nanoseconds>(interval).count());
+}
+
+std::chrono::milliseconds ErrorRateLimiter::getInterval() const {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::nanoseconds(intervalNs.load()));
+}
+
+bool ErrorRateLimiter::admit(ConnectionError &error) {
+  int64_t interval = intervalNs.load(std::memory_order_relaxed);
+  if (interval <= 0 || error.code < 0 || error.code >= CONNECTION_ERROR_COUNT) return true;
+
+  int64_t time = now();
+  int64_t start = windowStart[error.code].load(std::memory_order_relaxed);
+  // Another thread may open the new window first
+  if ((start != INT64_MIN && time - start < interval) ||
+      !windowStart[error.code].compare_exchange_strong(start, time, std::memory_order_relaxed)) {
+    lastBackendCode[error.code].store(error.backendCode, std::memory_order_relaxed);
+    lastBackendMessage[error.code].store(error.backendMessage, std::memory_order_relaxed);
+    suppressed[error.code].fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  error.count = suppressed[error.code].exchange(0, std::memory_order_relaxed) + 1;
+  return true;
+}
+
+size_t ErrorRateLimiter::flush(ConnectionError *errors, size_t maxErrors, int connectionId) {
+  int64_t interval = intervalNs.load(std::memory_order_relaxed);
+  if (interval <= 0) return 0;
+  int64_t time = now();
+  size_t count = 0;
+  for (int code = 0; code < CONNECTION_ERROR_COUNT && count < maxErrors; code++) {
+    if (suppressed[code].load(std::memory_order_relaxed) == 0) continue;
+    int64_t start = windowStart[code].load(std::memory_order_relaxed);
+    if (start == INT64_MIN || time - start < interval) continue;
+    // Opens a new window as an admitted report would, a racing admit() that
+    // wins it folds the count in instead
+    if (!windowStart[code].compare_exchange_strong(start, time, std::memory_order_relaxed)) continue;
+    uint32_t suppressedCount = suppressed[code].exchange(0, std::memory_order_relaxed);
+    if (suppressedCount == 0) continue;
+    ConnectionErrorCode errorCode = (ConnectionErrorCode)code;
+    errors[count++] = {errorCode,
+                       lastBackendCode[code].load(std::memory_order_relaxed),
+                       connectionErrorString(errorCode),
+                       lastBackendMessage[code].load(std::memory_order_relaxed),
+                       connectionId,
+                       suppressedCount};
+  }
+  return count;
+}
@@ -1,70 +1,102 @@
 #include "connection_manager.h"
 
-#include <atomic>
-#include <condition_variable>
-#include <mutex>
-#include <thread>
-#include <vector>
-
 namespace ConnectionManager {
-std::vector<Connection*> connections;
-std::unique_ptr<std::thread> connectionThread = NULL;
-std::mutex connectionMutex;
-std::condition_variable connectionCondition;
-std::atomic<bool> connectionThreadRunning = false;
-
-static void connectionThreadFunction() {
-  connectionThreadRunning = true;
-  while (connectionThreadRunning.load()) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
-    std::unique_lock<std::mutex> lck(connectionMutex);
-    for (auto connection : connections) {
-      if (connection->getStatus() == CONNECTION_STATUS_CONNECTED ||
-          connection->getStatus() == CONNECTION_STATUS_CONNECTING)
-        continue;
-      connection->connect();
-    }
+Manager::Manager(const SupervisorOptions& options)
+    : supervisor([this]() { return tick(); }) {
+  supervisor.setOptions(options);
+}
+
+Manager::~Manager() { stop(); }
+
+void Manager::setOptions(const SupervisorOptions& options) {
+  supervisor.setOptions(options);
+}
+
+const SupervisorOptions& Manager::getOptions() const {
+  return supervisor.getOptions();
+}
+
+size_t Manager::tick() {
+  size_t reconnecting = 0;
+  auto snapshot = connections.snapshot();
+  for (auto& [id, connection] : *snapshot) {
+    connection->flushErrors();
+    if (connection->getStatus() == CONNECTION_STATUS_CONNECTED ||
+        connection->getStatus() == CONNECTION_STATUS_CONNECTING)
+      continue;
+    connection->connect();
+    reconnecting++;
   }
+  return reconnecting;
+}
+
+void Manager::start() { supervisor.start(); }
+
+void Manager::stop() { supervisor.stop(); }
+
+bool Manager::addConnection(Connection* connection) {
+  if (!connections.add(connection->getInstanceID(), connection)) return false;
+  connection->setStatusWatcher(onStatusChange, this);
+  return true;
+}
+
+bool Manager::removeConnection(Connection* connection) {
+  auto registered = connections.find(connection->getInstanceID());
+  if (!registered || *registered != connection) return false;
+  // Waits for a status change being reported to this manager
+  connection->setStatusWatcher(nullptr, nullptr);
+  if (!connections.remove(connection->getInstanceID())) return false;
+  // A tick still iterating the previous snapshot would wait for itself
+  if (!supervisor.isCurrentThread()) connections.synchronize();
+  return true;
+}
+
+void Manager::onStatusChange(void* context, int id, ConnectionStatus previous, ConnectionStatus status) {
+  if (previous != CONNECTION_STATUS_CONNECTED) return;
+  if (status == CONNECTION_STATUS_DISCONNECTED || status == CONNECTION_STATUS_ERROR)
+    static_cast<Manager*>(context)->supervisor.wake();
+}
+
+void Manager::connect_all() {
+  auto snapshot = connections.snapshot();
+  for (auto& [id, connection] : *snapshot) connection->connect();
+}
+
+void Manager::disconnect_all() {
+  auto snapshot = connections.snapshot();
+  for (auto& [id, connection] : *snapshot) connection->disconnect();
 }
 
-void start() {
-  if (connectionThreadRunning) return;
-  connectionThread = std::make_unique<std::thread>(connectionThreadFunction);
+size_t Manager::sendAll(const SharedMessage& message) {
+  size_t sent = 0;
+  auto snapshot = connections.snapshot();
+  for (auto& [id, connection] : *snapshot)
+    if (connection->sendShared(message)) sent++;
+  return sent;
 }
 
-void stop() {
-  if (!connectionThreadRunning) return;
-  connectionThreadRunning = false;
-  if (connectionThread != NULL && connectionThread->joinable())
-    connectionThread->join();
+Manager& defaultManager() {
+  static Manager manager;
+  return manager;
 }
 
+void start() { defaultManager().start(); }
+
+void stop() { defaultManager().stop(); }
+
 bool addConnection(Connection* connection) {
-  std::unique_lock<std::mutex> lck(connectionMutex);
-  for (const auto* conn : connections)
-    if (conn == connection) return false;
-  connections.push_back(connection);
-  return true;
+  return defaultManager().addConnection(connection);
 }
 
 bool removeConnection(Connection* connection) {
-  std::unique_lock<std::mutex> lck(connectionMutex);
-  for (size_t i = 0; i < connections.size(); i++) {
-    if (connections[i] == connection) {
-      connections.erase(connections.begin() + i);
-      return true;
-    }
-  }
-  return false;
+  return defaultManager().removeConnection(connection);
 }
 
-void connect_all() {
-  std::unique_lock<std::mutex> lck(connectionMutex);
-  for (auto connection : connections) connection->connect();
-}
+void connect_all() { defaultManager().connect_all(); }
+
+void disconnect_all() { defaultManager().disconnect_all(); }
 
-void disconnect_all() {
-  std::unique_lock<std::mutex> lck(connectionMutex);
-  for (auto connection : connections) connection->disconnect();
+size_t sendAll(const SharedMessage& message) {
+  return defaultManager().sendAll(message);
 }
 }  // namespace ConnectionManager
@@ -0,0 +1,154 @@
+#include "last_value_cache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <thread>
+
+#include "topic_router.h"
+
+static size_t indexSize(size_t maxTopics) {
+  // Load factor at most one half, so probes stay short
+  size_t size = 16;
+  while (size < maxTopics * 2) size *= 2;
+  return size;
+}
+
+static size_t alignedStride(size_t size) { return (size + 63) & ~(size_t)63; }
+
+LastValueCache::LastValueCache(size_t maxTopics, size_t maxTopicSize, size_t maxPayloadSize)
+    : maxTopics(maxTopics),
+      maxTopicSize(maxTopicSize),
+      maxPayloadSize(maxPayloadSize),
+      stride(alignedStride(sizeof(EntryHeader) + maxTopicSize + maxPayloadSize)),
+      arena(new char[stride * maxTopics]),
+      indexMask(indexSize(maxTopics) - 1),
+      index(new std::atomic<uint32_t>[indexMask + 1]),
+      entryCount(0),
+      dropped(0) {
+  for (size_t i = 0; i <= indexMask; i++) index[i].store(0, std::memory_order_relaxed);
+  for (size_t id = 0; id < maxTopics; id++) {
+    EntryHeader *header = new (arena.get() + id * stride) EntryHeader();
+    header->sequence.store(0, std::memory_order_relaxed);
+    header->valid = false;
+  }
+}
+
+LastValueCache::~LastValueCache() {
+  for (size_t id = 0; id < maxTopics; id++) entry(id)->~EntryHeader();
+}
+
+int LastValueCache::lookup(std::string_view topic, uint64_t hash, size_t *emptySlot) const {
+  for (size_t slot = hash & indexMask;; slot = (slot + 1) & indexMask) {
+    uint32_t value = index[slot].load(std::memory_order_acquire);
+    if (value == 0) {
+      if (emptySlot) *emptySlot = slot;
+      return -1;
+    }
+    // The topic of a published entry never changes
+    size_t id = value - 1;
+    const EntryHeader *header = entry(id);
+    if (header->topicSize == topic.size() && memcmp(entryTopic(id), topic.data(), topic.size()) == 0) return (int)id;
+  }
+}
+
+int LastValueCache::find(std::string_view topic) const {
+  return lookup(topic, std::hash<std::string_view>()(topic), nullptr);
+}
+
+int LastValueCache::intern(std::string_view topic) {
+  uint64_t hash = std::hash<std::string_view>()(topic);
+  int id = lookup(topic, hash, nullptr);
+  if (id >= 0) return id;
+  if (topic.size() > maxTopicSize) return -1;
+
+  std::unique_lock<std::mutex> lck(insertMutex);
+  // Another thread may have added it meanwhile
+  size_t slot = 0;
+  id = lookup(topic, hash, &slot);
+  if (id >= 0) return id;
+  size_t count = entryCount.load(std::memory_order_relaxed);
+  if (count >= maxTopics) return -1;
+  EntryHeader *header = entry(count);
+  memcpy((char *)entryTopic(count), topic.data(), topic.size());
+  header->topicSize = (uint32_t)topic.size();
+  entryCount.store(count + 1, std::memory_order_release);
+  index[slot].store((uint32_t)count + 1, std::memory_order_release);
+  return (int)count;
+}
+
+bool LastValueCache::update(std::string_view topic, std::string_view payload, int qos, bool retain,
+                            std::chrono::system_clock::time_point timestamp) {
+  int id = payload.size() <= maxPayloadSize ? intern(topic) : -1;
+  if (id < 0) {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  EntryHeader *header = entry(id);
+  // Writers of one topic take turns by making the sequence odd
+  uint64_t sequence = header->sequence.load(std::memory_order_relaxed);
+  while ((sequence & 1) ||
+         !header->sequence.compare_exchange_weak(sequence, sequence + 1, std::memory_order_acquire))
+    sequence = header->sequence.load(std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  memcpy(entryPayload(id), payload.data(), payload.size());
+  header->payloadSize = (uint32_t)payload.size();
+  header->qos = (uint8_t)qos;
+  header->retain = retain;
+  header->valid = true;
+  header->timestampNs = std::chrono::duration_cast<std::chrono::nanoseconds>(timestamp.time_since_epoch()).count();
+  header->updates++;
+
+  header->sequence.store(sequence + 2, std::memory_order_release);
+  return true;
+}
+
+bool LastValueCache::getLast(int topicId, LastValue &value) const {
+  if (topicId < 0 || (size_t)topicId >= entryCount.load(std::memory_order_acquire)) return false;
+  const EntryHeader *header = entry(topicId);
+  value.topic.assign(entryTopic(topicId), header->topicSize);
+  while (true) {
+    uint64_t before = header->sequence.load(std::memory_order_acquire);
+    if (before & 1) {
+      // A preempted writer cannot finish while we spin
+      std::this_thread::yield();
+      continue;
+    }
+    bool valid = header->valid;
+    // Sizes are only trusted once the sequence confirms them, a torn read
+    // is clamped and thrown away below
+    size_t payloadSize = std::min<size_t>(header->payloadSize, maxPayloadSize);
+    value.payload.resize(payloadSize);
+    memcpy(value.payload.data(), entryPayload(topicId), payloadSize);
+    value.qos = header->qos;
+    value.retain = header->retain;
+    int64_t timestampNs = header->timestampNs;
+    value.updates = header->updates;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header->sequence.load(std::memory_order_relaxed) != before) continue;
+    value.timestamp = std::chrono::system_clock::time_point(
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(timestampNs)));
+    return valid;
+  }
+}
+
+bool LastValueCache::getLast(std::string_view topic, LastValue &value) const { return getLast(find(topic), value); }
+
+std::optional<LastValue> LastValueCache::getLast(std::string_view topic) const {
+  LastValue value;
+  if (!getLast(topic, value)) return std::nullopt;
+  return value;
+}
+
+std::vector<LastValue> LastValueCache::snapshot(std::string_view filter) const {
+  std::vector<LastValue> values;
+  size_t count = entryCount.load(std::memory_order_acquire);
+  LastValue value;
+  for (size_t id = 0; id < count; id++) {
+    if (!topicMatches(filter, std::string_view(entryTopic(id), entry(id)->topicSize))) continue;
+    if (getLast((int)id, value)) values.push_back(value);
+  }
+  return values;
+}
@@ -0,0 +1,205 @@
+#include "logger.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#define LOG_RING_SIZE 1024
+#define LOG_MAX_ARGUMENTS 8
+#define LOG_STRING_STORAGE 192
+#define LOG_LINE_SIZE 512
+
+namespace Logger {
+struct LogRecord {
+  std::atomic<size_t> sequence;
+  LogLevel level;
+  uint8_t count;
+  const char *format;
+  LogArgument arguments[LOG_MAX_ARGUMENTS];
+  char strings[LOG_STRING_STORAGE];
+};
+
+// One per LogLevel: a record logged at OFF passes an OFF threshold
+static const char *levelNames[] = {"TRACE", "DEBUG", "INFO", "WARNING", "ERROR", "OFF"};
+static_assert(sizeof(levelNames) / sizeof(levelNames[0]) == LOG_LEVEL_OFF + 1, "a name for every LogLevel");
+
+static void defaultSink(void *userData, LogLevel level, const char *message) {
+  fprintf(stderr, "[%s] %s\n", level >= LOG_LEVEL_TRACE && level <= LOG_LEVEL_OFF ? levelNames[level] : "?", message);
+}
+
+// Bounded multi-producer ring, one consumer (the logger thread)
+static LogRecord ring[LOG_RING_SIZE];
+static std::atomic<size_t> enqueuePosition = 0;
+static size_t dequeuePosition = 0;
+static std::atomic<size_t> dropped = 0;
+static std::atomic<size_t> consumed = 0;
+static std::atomic<int> minLevel = COMMUNICATION_LOG_LEVEL;
+
+static std::atomic<LogSink> sink = defaultSink;
+static std::atomic<void *> sinkUserData = nullptr;
+
+static std::once_flag startFlag;
+static std::atomic<bool> running = false;
+static std::unique_ptr<std::thread> loggerThread = NULL;
+static std::mutex loggerMutex;
+static std::condition_variable loggerCondition;
+
+static void initRing() {
+  for (size_t i = 0; i < LOG_RING_SIZE; i++) ring[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+static size_t format(const LogRecord &record, char *out, size_t size) {
+  size_t len = 0;
+  size_t arg = 0;
+  const char *f = record.format;
+  auto append = [&](const char *data, size_t n) {
+    if (len + 1 >= size) return;
+    if (n > size - len - 1) n = size - len - 1;
+    memcpy(out + len, data, n);
+    len += n;
+  };
+  while (*f) {
+    if (f[0] == '{' && f[1] == '}' && arg < record.count) {
+      const LogArgument &a = record.arguments[arg++];
+      char tmp[32];
+      int n = 0;
+      switch (a.type) {
+        case LOG_ARGUMENT_INT:
+          n = snprintf(tmp, sizeof(tmp), "%lld", (long long)a.i);
+          break;
+        case LOG_ARGUMENT_UINT:
+          n = snprintf(tmp, sizeof(tmp), "%llu", (unsigned long long)a.u);
+          break;
+        case LOG_ARGUMENT_DOUBLE:
+          n = snprintf(tmp, sizeof(tmp), "%g", a.d);
+          break;
+        case LOG_ARGUMENT_POINTER:
+          n = snprintf(tmp, sizeof(tmp), "%p", a.p);
+          break;
+        case LOG_ARGUMENT_STRING:
+          append(record.strings + (size_t)a.s.data, a.s.size);
+          break;
+      }
+      if (n > 0) append(tmp, (size_t)n < sizeof(tmp) ? n : sizeof(tmp) - 1);
+      f += 2;
+      continue;
+    }
+    append(f, 1);
+    f++;
+  }
+  out[len] = '\0';
+  return len;
+}
+
+static bool drainOne() {
+  LogRecord &record = ring[dequeuePosition % LOG_RING_SIZE];
+  size_t seq = record.sequence.load(std::memory_order_acquire);
+  if (seq != dequeuePosition + 1) return false;
+
+  char line[LOG_LINE_SIZE];
+  format(record, line, sizeof(line));
+  LogSink s = sink.load(std::memory_order_acquire);
+  if (s) s(sinkUserData.load(std::memory_order_acquire), record.level, line);
+
+  record.sequence.store(dequeuePosition + LOG_RING_SIZE, std::memory_order_release);
+  dequeuePosition++;
+  consumed.fetch_add(1, std::memory_order_release);
+  return true;
+}
+
+static void loggerThreadFunction() {
+  while (true) {
+    while (drainOne()) {
+    }
+    if (!running.load()) break;
+    // Producers never notify, the thread polls so push() stays syscall free
+    std::unique_lock<std::mutex> lck(loggerMutex);
+    loggerCondition.wait_for(lck, std::chrono::milliseconds(5));
+  }
+  while (drainOne()) {
+  }
+}
+
+struct LoggerShutdown {
+  ~LoggerShutdown() {
+    if (!running.load()) return;
+    running = false;
+    loggerCondition.notify_all();
+    if (loggerThread != NULL && loggerThread->joinable()) loggerThread->join();
+  }
+};
+static LoggerShutdown loggerShutdown;
+
+static void start() {
+  std::call_once(startFlag, []() {
+    initRing();
+    running = true;
+    loggerThread = std::make_unique<std::thread>(loggerThreadFunction);
+  });
+}
+
+void setSink(LogSink newSink, void *userData) {
+  start();
+  flush();
+  sinkUserData.store(userData, std::memory_order_release);
+  sink.store(newSink ? newSink : defaultSink, std::memory_order_release);
+}
+
+void setLevel(LogLevel level) { minLevel.store(level, std::memory_order_relaxed); }
+
+LogLevel getLevel() { return (LogLevel)minLevel.load(std::memory_order_relaxed); }
+
+void flush() {
+  if (!running.load()) return;
+  size_t target = enqueuePosition.load(std::memory_order_acquire);
+  while (consumed.load(std::memory_order_acquire) < target) {
+    loggerCondition.notify_all();
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+}
+
+size_t getDroppedCount() { return dropped.load(); }
+
+bool push(LogLevel level, const char *format, const LogArgument *args, size_t count) {
+  if (!running.load(std::memory_order_relaxed)) start();
+
+  size_t pos = enqueuePosition.load(std::memory_order_relaxed);
+  LogRecord *record;
+  while (true) {
+    record = &ring[pos % LOG_RING_SIZE];
+    size_t seq = record->sequence.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (enqueuePosition.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+    } else if (diff < 0) {
+      dropped++;
+      return false;
+    } else {
+      pos = enqueuePosition.load(std::memory_order_relaxed);
+    }
+  }
+
+  record->level = level;
+  record->format = format;
+  record->count = count < LOG_MAX_ARGUMENTS ? count : LOG_MAX_ARGUMENTS;
+  size_t used = 0;
+  for (size_t i = 0; i < record->count; i++) {
+    record->arguments[i] = args[i];
+    if (args[i].type != LOG_ARGUMENT_STRING) continue;
+    // Strings are copied since the caller's buffer may be gone by format time
+    size_t n = args[i].s.size;
+    if (n > LOG_STRING_STORAGE - used) n = LOG_STRING_STORAGE - used;
+    memcpy(record->strings + used, args[i].s.data, n);
+    record->arguments[i].s.data = (const char *)used;
+    record->arguments[i].s.size = n;
+    used += n;
+  }
+
+  record->sequence.store(pos + 1, std::memory_order_release);
+  return true;
+}
+};  // namespace Logger
@@ -0,0 +1,972 @@
+#include "mqtt_client.h"
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "logger.h"
+#include "mqtt_probe.h"
+#include "paho_mqtt_connection.hpp"
+
+static int64_t steadyMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// libmosquitto backend, the MQTTConnection reports to the client through the
+// regular Connection callbacks
+class MosquittoClientBackend : public MQTTClientBackend {
+ public:
+  MosquittoClientBackend(MQTTClient *client, const MQTTConnectionParameters &parameters) : connection(parameters) {
+    connection.setUserData(client);
+    connection.setOnConnectCallback(onConnect);
+    connection.setOnDisconnectCallback(onDisconnect);
+    connection.setOnMessageCallback(onMessage);
+    connection.setOnPublishCallback(onPublish);
+    connection.setOnErrorCallback(onError);
+  }
+
+  void setConnectionParameters(const MQTTConnectionParameters &parameters) override {
+    connection.setConnectionParameters(parameters);
+    reconfigured = true;
+  }
+  void setMaxInFlight(size_t count) override { connection.setMaxQueueSize(count); }
+  void connect() override {
+    reconfigured = false;
+    connection.connect();
+  }
+  void disconnect() override { connection.disconnect(); }
+  bool publish(const MQTTMessage &message, int *messageId) override { return connection.publish(message, messageId); }
+  bool publishShared(const SharedMessage &message) override { return connection.sendShared(message); }
+  void subscribe(const std::string &topic, int qos) override { connection.subscribe(topic, qos); }
+  void subscribeMany(const std::vector<std::string> &topics, int qos) override {
+    connection.subscribeMany(topics, qos);
+  }
+  void unsubscribe(const std::string &topic) override { connection.unsubscribe(topic); }
+  ConnectionStatus getStatus() const override { return connection.getStatus(); }
+  size_t getInFlight() const override { return const_cast<MQTTConnection &>(connection).getQueueSize(); }
+  // libmosquitto always starts a clean session
+  bool restoresSubscriptions() const override { return false; }
+  // Its handle keeps the QoS 1/2 messages in flight and sends them again on
+  // reconnecting, new parameters build a new handle
+  bool resendsInFlight() const override { return !reconfigured; }
+
+ private:
+  MQTTConnection connection;
+  bool reconfigured = false;
+
+  static void onConnect(void *userData, int id) { static_cast<MQTTClient *>(userData)->handleConnected(); }
+  static void onDisconnect(void *userData, int id) { static_cast<MQTTClient *>(userData)->handleDisconnected(); }
+  static void onMessage(void *userData, int id, const Message &message) {
+    static_cast<MQTTClient *>(userData)->handleMessage(static_cast<const MQTTMessage &>(message));
+  }
+  static void onPublish(void *userData, int id, int messageId) {
+    static_cast<MQTTClient *>(userData)->handlePublished(messageId);
+  }
+  static void onError(void *userData, int id, const ConnectionError &error) {
+    static_cast<MQTTClient *>(userData)->handleError(error);
+  }
+};
+
+// Paho backend, the connection parameters are mapped onto a tcp://, ssl:// or
+// unix:// uri and the will message
+class PahoClientBackend : public MQTTClientBackend {
+ public:
+  PahoClientBackend(MQTTClient *client, const MQTTConnectionParameters &parameters)
+      : connection(std::make_shared<PAHOMQTTConnection>()) {
+    setConnectionParameters(parameters);
+    connection->setUserData(client);
+    connection->setOnConnectCallback(onConnect);
+    connection->setOnDisconnectCallback(onDisconnect);
+    connection->setOnMessageCallback(onMessage);
+    connection->setOnPublishCallback(onPublish);
+    connection->setOnErrorCallback(onError);
+  }
+  ~PahoClientBackend() override { connection->disconnect(); }
+
+  void setConnectionParameters(const MQTTConnectionParameters &parameters) override {
+    PAHOMQTTConnectionParameters pahoParameters = connection->getMQTTConnectionParameters();
+    if (parameters.socketPath.empty())
+      pahoParameters.uri = (parameters.tls ? "ssl://" : "tcp://") + parameters.host + ":" + std::to_string(parameters.port);
+    else
+      pahoParameters.uri = "unix://" + parameters.socketPath;
+    pahoParameters.username = parameters.username;
+    pahoParameters.password = parameters.password;
+    pahoParameters.tls = parameters.tls;
+    pahoParameters.cafile = parameters.cafile;
+    pahoParameters.capath = parameters.capath;
+    pahoParameters.certfile = parameters.certfile;
+    pahoParameters.keyfile = parameters.keyfile;
+    pahoParameters.keyPassword = parameters.keyPassword;
+    pahoParameters.tlsVersion = parameters.tlsVersion;
+    pahoParameters.ciphers = parameters.ciphers;
+    // send() keeps one token spare
+    pahoParameters.maxPendingMessages = parameters.sendMaximum + 1;
+    connection->setConnectionParameters(pahoParameters);
+    reconfigured = true;
+
+    if (parameters.will_message_set)
+      connection->setWillMessage(
+          PAHOMQTTMessage(parameters.will.topic, parameters.will.payload, parameters.will.qos, parameters.will.retain));
+    else
+      connection->disableWillMessage();
+  }
+  // Paho bounds every QoS level by maxPendingMessages, set from sendMaximum
+  void setMaxInFlight(size_t count) override {}
+  void connect() override {
+    reconfigured = false;
+    connection->connect();
+  }
+  void disconnect() override { connection->disconnect(); }
+  bool publish(const MQTTMessage &message, int *messageId) override {
+    return connection->send(PAHOMQTTMessage(message.topic, message.payload, message.qos, message.retain), messageId);
+  }
+  bool publishShared(const SharedMessage &message) override { return connection->sendShared(message); }
+  void subscribe(const std::string &topic, int qos) override { connection->subscribe(topic, qos); }
+  void subscribeMany(const std::vector<std::string> &topics, int qos) override {
+    connection->subscribeMany(topics, qos);
+  }
+  void unsubscribe(const std::string &topic) override { connection->unsubscribe(topic); }
+  ConnectionStatus getStatus() const override {
+    switch (connection->getStatus()) {
+      case PAHOMQTTConnectionStatus::CONNECTED:
+        return CONNECTION_STATUS_CONNECTED;
+      case PAHOMQTTConnectionStatus::CONNECTING:
+        return CONNECTION_STATUS_CONNECTING;
+      default:
+        return CONNECTION_STATUS_DISCONNECTED;
+    }
+  }
+  size_t getInFlight() const override { return connection->getPendingCount(); }
+  // Checks session_present, see PAHOMQTTConnection::subscribe()
+  bool restoresSubscriptions() const override { return true; }
+  // A clean session drops what was in flight, a persistent one sends it
+  // again from Paho's persistence
+  bool resendsInFlight() const override {
+    return !reconfigured && connection->getMQTTConnectionParameters().persistentSession;
+  }
+
+ private:
+  std::shared_ptr<PAHOMQTTConnection> connection;
+  bool reconfigured = false;
+
+  static void onConnect(PAHOMQTTConnection *connection, void *userData) {
+    static_cast<MQTTClient *>(userData)->handleConnected();
+  }
+  static void onDisconnect(PAHOMQTTConnection *connection, void *userData) {
+    static_cast<MQTTClient *>(userData)->handleDisconnected();
+  }
+  static void onMessage(PAHOMQTTConnection *connection, void *userData, const PAHOMQTTMessage &message) {
+    MQTTMessage mqttMessage(message.getTopic(), message.getPayload(), message.getQos(), message.getRetain());
+    mqttMessage.timestamp = std::chrono::system_clock::now();
+    static_cast<MQTTClient *>(userData)->handleMessage(mqttMessage);
+  }
+  static void onPublish(PAHOMQTTConnection *connection, void *userData, int messageId) {
+    static_cast<MQTTClient *>(userData)->handlePublished(messageId);
+  }
+  static void onError(PAHOMQTTConnection *connection, void *userData, const ConnectionError &error) {
+    static_cast<MQTTClient *>(userData)->handleError(error);
+  }
+};
+
+MQTTClient::MQTTClient(const MQTTConnectionParameters &parameters, MQTTBackendType backendType)
+    : Connection(parameters), backendType(backendType), mqttParameters(parameters) {
+  if (backendType == MQTT_BACKEND_PAHO)
+    backend = std::make_unique<PahoClientBackend>(this, parameters);
+  else
+    backend = std::make_unique<MosquittoClientBackend>(this, parameters);
+  if (parameters.lastValueCache)
+    lastValues = std::make_unique<LastValueCache>(parameters.lastValueCacheTopics, parameters.lastValueCacheMaxTopicSize,
+                                                  parameters.lastValueCacheMaxPayloadSize);
+  if (!parameters.capturePath.empty())
+    capture = std::make_unique<CaptureWriter>(parameters.capturePath, parameters.captureSize);
+  setupEndpoints();
+  setupRateControl();
+}
+
+MQTTClient::~MQTTClient() {
+  stopFailover();
+  // No callbacks may arrive while the members go away, and the queued
+  // handles must go back to the pool before it is destroyed
+  backend->disconnect();
+  backend.reset();
+  if (capture) capture->close();
+  failPublishes();
+  finishConnect(false);
+  std::vector<std::shared_ptr<MQTTMessageStream::State>> open;
+  {
+    std::unique_lock<std::mutex> lck(streamsMutex);
+    open.swap(streams);
+  }
+  for (auto &state : open) state->finish();
+  {
+    std::unique_lock<std::mutex> unackedLck(unackedMutex);
+    unacked.clear();
+  }
+  std::unique_lock<std::mutex> lck(messageQueueMutex);
+  while (!messageQueue.empty()) messageQueue.pop();
+  queueLength = 0;
+}
+
+void MQTTClient::setConnectionParameters(const ConnectionParameters &parameters) {
+  if (parameters.getType() != CONNECTION_TYPE_MQTT) return;
+  stopFailover();
+  {
+    std::unique_lock<std::mutex> lck(connectMutex);
+    mqttParameters = static_cast<const MQTTConnectionParameters &>(parameters);
+    backend->setConnectionParameters(mqttParameters);
+  }
+  setupEndpoints();
+  setupRateControl();
+}
+
+void MQTTClient::connect() {
+  std::unique_lock<std::mutex> lck(connectMutex);
+  connectRequested = true;
+  connectLocked();
+}
+
+void MQTTClient::connectLocked() {
+  status = CONNECTION_STATUS_CONNECTING;
+  applyEndpoint();
+  // Whatever the last session did not acknowledge goes out first, unless
+  // the library sends it again itself: a second copy would be a duplicate
+  // at QoS 1 and break the exactly once handshake at QoS 2. A failover
+  // changes the parameters, the new broker gets them from the queue.
+  if (!backend->resendsInFlight()) requeueUnacked();
+  backend->setMaxInFlight(maxQueueSize);
+  backend->connect();
+  // The backend may have failed synchronously. Only from CONNECTING: the
+  // network thread's handleConnected() may already have run, a snapshot
+  // taken before it must not overwrite it.
+  status.transition(CONNECTION_STATUS_CONNECTING, backend->getStatus());
+}
+
+void MQTTClient::disconnect() {
+  {
+    std::unique_lock<std::mutex> lck(connectMutex);
+    connectRequested = false;
+    backend->disconnect();
+  }
+  status = CONNECTION_STATUS_DISCONNECTED;
+  failPublishes();
+  finishConnect(false);
+}
+
+bool MQTTClient::send(const Message &message) {
+  if (message.getType() != CONNECTION_TYPE_MQTT) return false;
+  return publish(static_cast<const MQTTMessage &>(message));
+}
+
+bool MQTTClient::publish(const MQTTMessage &message) {
+  int messageId = 0;
+  if (status != CONNECTION_STATUS_CONNECTED || !backend->publish(message, &messageId)) {
+    metrics.publishFailed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  trackPublish(messageId, message.qos);
+  metrics.published.fetch_add(1, std::memory_order_relaxed);
+  if (capture) capture->write(CAPTURE_SENT, message.topic, message.payload, message.qos, message.retain);
+  updateWatermarks();
+  return true;
+}
+
+bool MQTTClient::sendShared(const SharedMessage &message) {
+  if (status != CONNECTION_STATUS_CONNECTED || !backend->publishShared(message)) {
+    metrics.publishFailed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  metrics.published.fetch_add(1, std::memory_order_relaxed);
+  if (capture) capture->write(CAPTURE_SENT, message.topic.view(), message.payload.view(), message.qos, message.retain);
+  return true;
+}
+
+void MQTTClient::receive(Message &message) {}
+
+bool MQTTClient::queueSend(const Message &message) {
+  if (message.getType() != CONNECTION_TYPE_MQTT) return false;
+  const MQTTMessage &mqttMessage = static_cast<const MQTTMessage &>(message);
+  PoolHandle<MQTTMessage> pooled = messagePool.acquire(mqttMessage);
+  if (!pooled) {
+    metrics.dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  {
+    std::unique_lock<std::mutex> lck(messageQueueMutex);
+    if (messageQueue.size() >= maxQueueSize) {
+      metrics.dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    messageQueue.push(std::move(pooled));
+    queueLength.store(messageQueue.size(), std::memory_order_relaxed);
+  }
+  metrics.queued.fetch_add(1, std::memory_order_relaxed);
+  // Captured when the application hands it over, flushQueue() only sends
+  if (capture) capture->write(CAPTURE_SENT, mqttMessage.topic, mqttMessage.payload, mqttMessage.qos, mqttMessage.retain);
+  if (rateControlled) {
+    // Messages gather for the batching delay while a completion is still to
+    // come, handlePublished() flushes the queue. The count is the client's
+    // own, taken after the push: the backend's may still include a message
+    // whose completion already ran its flush.
+    int64_t batchDelay = rateController.getBatchDelay().count();
+    if (batchDelay > 0 && steadyMicros() - lastFlushUs.load(std::memory_order_relaxed) < batchDelay &&
+        awaitingCompletions.load() > 0) {
+      updateWatermarks();
+      return true;
+    }
+  }
+  flushQueue(true);
+  updateWatermarks();
+  return true;
+}
+
+void MQTTClient::flushQueue(bool wait) {
+  // Same as MQTTConnection: the backend threads never wait for the lock,
+  // they leave a request the holder checks after unlocking
+  flushRequested.store(true);
+  std::unique_lock<std::mutex> lck(messageQueueMutex, std::defer_lock);
+  if (wait)
+    lck.lock();
+  else if (!lck.try_lock())
+    return;
+  do {
+    flushRequested.store(false);
+    flushLocked();
+    lck.unlock();
+  } while (flushRequested.load() && lck.try_lock());
+}
+
+void MQTTClient::flushLocked() {
+  // Under rate control the window is the controller's, else the backend's
+  size_t window = SIZE_MAX, inFlight = 0;
+  if (rateControlled) {
+    window = rateController.getWindow();
+    inFlight = backend->getInFlight();
+    lastFlushUs.store(steadyMicros(), std::memory_order_relaxed);
+  }
+  while (!messageQueue.empty() && status == CONNECTION_STATUS_CONNECTED && inFlight < window) {
+    const MQTTMessage &message = static_cast<const MQTTMessage &>(*messageQueue.front());
+    int messageId = 0;
+    if (!backend->publish(message, &messageId)) break;
+    trackPublish(messageId, message.qos);
+    inFlight++;
+    if (failoverEnabled && message.qos > 0 && messageId != 0) {
+      // Kept until acknowledged, a failover sends it again
+      std::unique_lock<std::mutex> unackedLck(unackedMutex);
+      unacked.emplace_back(messageId, messageQueue.front());
+    }
+    metrics.published.fetch_add(1, std::memory_order_relaxed);
+    messageQueue.pop();
+  }
+  queueLength.store(messageQueue.size(), std::memory_order_relaxed);
+}
+
+void MQTTClient::subscribe(const std::string &topic, int qos) {
+  {
+    std::unique_lock<std::mutex> lck(subscriptionsMutex);
+    subscriptions[topic] = qos;
+  }
+  if (status == CONNECTION_STATUS_CONNECTED) backend->subscribe(topic, qos);
+}
+
+void MQTTClient::subscribeMany(const std::vector<std::string> &topics, int qos) {
+  {
+    std::unique_lock<std::mutex> lck(subscriptionsMutex);
+    for (const std::string &topic : topics) subscriptions[topic] = qos;
+  }
+  if (status == CONNECTION_STATUS_CONNECTED) backend->subscribeMany(topics, qos);
+}
+
+void MQTTClient::unsubscribe(const std::string &topic) {
+  {
+    std::unique_lock<std::mutex> lck(subscriptionsMutex);
+    subscriptions.erase(topic);
+  }
+  if (status == CONNECTION_STATUS_CONNECTED) backend->unsubscribe(topic);
+}
+
+int MQTTClient::addRoute(const std::string &filter, OnMessageCallback callback, void *userData) {
+  return router.addRoute(filter, callback, userData);
+}
+
+bool MQTTClient::removeRoute(int routeId) { return router.removeRoute(routeId); }
+
+size_t MQTTClient::getQueueSize() {
+  size_t queued;
+  {
+    std::unique_lock<std::mutex> lck(messageQueueMutex);
+    queued = messageQueue.size();
+  }
+  return queued + backend->getInFlight();
+}
+
+MQTTClientMetrics MQTTClient::getMetrics() const {
+  return {metrics.published.load(std::memory_order_relaxed),   metrics.publishFailed.load(std::memory_order_relaxed),
+          metrics.completed.load(std::memory_order_relaxed),   metrics.received.load(std::memory_order_relaxed),
+          metrics.queued.load(std::memory_order_relaxed),      metrics.dropped.load(std::memory_order_relaxed),
+          metrics.connects.load(std::memory_order_relaxed),    metrics.disconnects.load(std::memory_order_relaxed),
+          metrics.errors.load(std::memory_order_relaxed),      metrics.failovers.load(std::memory_order_relaxed)};
+}
+
+void MQTTClient::resume(std::coroutine_handle<> handle) {
+  if (executor)
+    executor->post(handle);
+  else
+    handle.resume();
+}
+
+void MQTTClient::startConnect(std::coroutine_handle<> handle, bool *result) {
+  {
+    std::unique_lock<std::mutex> lck(asyncMutex);
+    connectWaiters.push_back({handle, result});
+  }
+  // The coroutine may be resumed from here on, only the client is touched
+  if (status != CONNECTION_STATUS_CONNECTING && status != CONNECTION_STATUS_CONNECTED) connect();
+  if (status == CONNECTION_STATUS_CONNECTED)
+    finishConnect(true);
+  else if (status != CONNECTION_STATUS_CONNECTING)
+    finishConnect(false);
+}
+
+void MQTTClient::finishConnect(bool connected) {
+  std::vector<std::pair<std::coroutine_handle<>, bool *>> waiters;
+  {
+    std::unique_lock<std::mutex> lck(asyncMutex);
+    waiters.swap(connectWaiters);
+  }
+  for (auto &[handle, result] : waiters) {
+    *result = connected;
+    resume(handle);
+  }
+}
+
+bool MQTTClient::startPublish(PendingPublish *pending) {
+  pendingCount.fetch_add(1);
+  {
+    std::unique_lock<std::mutex> lck(asyncMutex);
+    if (status != CONNECTION_STATUS_CONNECTED) {
+      pendingCount.fetch_sub(1);
+      metrics.publishFailed.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    // Behind the blocked ones, so publishes keep their order
+    blockedPublishes.push_back(pending);
+    if (publishing) return true;
+    publishing = true;
+  }
+  std::vector<PendingPublish *> done;
+  drainPublishes(done);
+  // Settled right away when the backend reports no message id or the
+  // connection was lost, the caller does not suspend then
+  bool settled = false;
+  for (PendingPublish *finished : done) {
+    if (finished == pending)
+      settled = true;
+    else
+      resume(finished->handle);
+  }
+  return !settled;
+}
+
+void MQTTClient::drainPublishes(std::vector<PendingPublish *> &done) {
+  // The caller set publishing. The backend is called without asyncMutex: a
+  // failed publish reports its error, which takes it again.
+  std::unique_lock<std::mutex> lck(asyncMutex);
+  while (!blockedPublishes.empty() && status == CONNECTION_STATUS_CONNECTED) {
+    PendingPublish *pending = blockedPublishes.front();
+    blockedPublishes.pop_front();
+    lck.unlock();
+    int messageId = 0;
+    bool published = backend->publish(*pending->message, &messageId);
+    if (published) {
+      trackPublish(messageId, pending->message->qos);
+      metrics.published.fetch_add(1, std::memory_order_relaxed);
+      if (capture)
+        capture->write(CAPTURE_SENT, pending->message->topic, pending->message->payload, pending->message->qos,
+                       pending->message->retain);
+    }
+    lck.lock();
+    if (status != CONNECTION_STATUS_CONNECTED) {
+      // failPublishes() did not see it, completions are not matched across
+      // connections
+      pending->result = false;
+      pendingCount.fetch_sub(1);
+      metrics.publishFailed.fetch_add(1, std::memory_order_relaxed);
+      done.push_back(pending);
+    } else if (!published) {
+      // The window is full, a completion drains again
+      blockedPublishes.push_front(pending);
+      break;
+    } else if (messageId == 0) {
+      pending->result = true;
+      pendingCount.fetch_sub(1);
+      done.push_back(pending);
+    } else {
+      pendingPublishes[messageId] = pending;
+    }
+  }
+  publishing = false;
+  publishingCondition.notify_all();
+}
+
+void MQTTClient::completePublishes(int messageId) {
+  if (pendingCount.load() == 0) return;
+  std::vector<PendingPublish *> done;
+  bool drain = false;
+  {
+    std::unique_lock<std::mutex> lck(asyncMutex);
+    // The id may come from a drain that has not registered it yet
+    publishingCondition.wait(lck, [&]() { return !publishing; });
+    auto pending = pendingPublishes.find(messageId);
+    if (pending != pendingPublishes.end()) {
+      pending->second->result = true;
+      done.push_back(pending->second);
+      pendingPublishes.erase(pending);
+      pendingCount.fetch_sub(1);
+    }
+    // A completion frees room in the window for the blocked ones
+    if (!blockedPublishes.empty() && status == CONNECTION_STATUS_CONNECTED) drain = publishing = true;
+  }
+  if (drain) drainPublishes(done);
+  for (PendingPublish *pending : done) resume(pending->handle);
+}
+
+void MQTTClient::failPublishes() {
+  std::vector<PendingPublish *> failed;
+  {
+    std::unique_lock<std::mutex> lck(asyncMutex);
+    for (auto &[messageId, pending] : pendingPublishes) failed.push_back(pending);
+    failed.insert(failed.end(), blockedPublishes.begin(), blockedPublishes.end());
+    pendingPublishes.clear();
+    blockedPublishes.clear();
+    pendingCount.fetch_sub(failed.size());
+  }
+  metrics.publishFailed.fetch_add(failed.size(), std::memory_order_relaxed);
+  for (PendingPublish *pending : failed) {
+    pending->result = false;
+    resume(pending->handle);
+  }
+}
+
+MQTTMessageStream MQTTClient::subscribeAsync(const std::string &filter, int qos, size_t capacity) {
+  auto state = std::make_shared<MQTTMessageStream::State>();
+  state->client = this;
+  state->filter = filter;
+  state->capacity = std::max<size_t>(capacity, 1);
+  {
+    std::unique_lock<std::mutex> lck(subscriptionsMutex);
+    state->ownsSubscription = subscriptions.find(filter) == subscriptions.end();
+  }
+  {
+    std::unique_lock<std::mutex> lck(streamsMutex);
+    streams.push_back(state);
+    streamCount = streams.size();
+  }
+  if (state->ownsSubscription) subscribe(filter, qos);
+  return MQTTMessageStream(state);
+}
+
+void MQTTClient::closeStream(MQTTMessageStream::State *state) {
+  bool shared = false;
+  {
+    std::unique_lock<std::mutex> lck(streamsMutex);
+    auto found = std::find_if(streams.begin(), streams.end(), [state](auto &stream) { return stream.get() == state; });
+    if (found == streams.end()) return;
+    streams.erase(found);
+    streamCount = streams.size();
+    for (auto &stream : streams) shared |= stream->filter == state->filter;
+  }
+  if (state->ownsSubscription && !shared) unsubscribe(state->filter);
+}
+
+MQTTMessageStream::MQTTMessageStream(MQTTMessageStream &&other) noexcept : state(std::move(other.state)) {}
+
+MQTTMessageStream &MQTTMessageStream::operator=(MQTTMessageStream &&other) noexcept {
+  if (this != &other) {
+    close();
+    state = std::move(other.state);
+  }
+  return *this;
+}
+
+MQTTMessageStream::~MQTTMessageStream() { close(); }
+
+void MQTTMessageStream::close() {
+  if (!state) return;
+  {
+    std::unique_lock<std::mutex> lck(state->mutex);
+    if (state->closed) return;
+  }
+  state->client->closeStream(state.get());
+  state->finish();
+}
+
+size_t MQTTMessageStream::getDropped() const {
+  std::unique_lock<std::mutex> lck(state->mutex);
+  return state->dropped;
+}
+
+bool MQTTMessageStream::State::wait(std::coroutine_handle<> handle) {
+  std::unique_lock<std::mutex> lck(mutex);
+  if (!buffer.empty() || closed) return false;
+  waiter = handle;
+  return true;
+}
+
+std::optional<MQTTMessage> MQTTMessageStream::State::pop() {
+  std::unique_lock<std::mutex> lck(mutex);
+  if (buffer.empty()) return std::nullopt;
+  std::optional<MQTTMessage> message(std::move(buffer.front()));
+  buffer.pop_front();
+  return message;
+}
+
+void MQTTMessageStream::State::push(const MQTTMessage &message) {
+  std::coroutine_handle<> handle;
+  {
+    std::unique_lock<std::mutex> lck(mutex);
+    if (closed) return;
+    if (buffer.size() >= capacity) {
+      buffer.pop_front();
+      dropped++;
+    }
+    buffer.push_back(message);
+    handle = std::exchange(waiter, {});
+  }
+  if (handle) client->resume(handle);
+}
+
+void MQTTMessageStream::State::finish() {
+  std::coroutine_handle<> handle;
+  {
+    std::unique_lock<std::mutex> lck(mutex);
+    closed = true;
+    handle = std::exchange(waiter, {});
+  }
+  if (handle) client->resume(handle);
+}
+
+void MQTTClient::handleConnected() {
+  status = CONNECTION_STATUS_CONNECTED;
+  metrics.connects.fetch_add(1, std::memory_order_relaxed);
+
+  // Clean sessions start without subscriptions, restore them in one batch
+  // per QoS level. A backend that restores them itself knows whether the
+  // broker kept them, subscribing again would duplicate retained messages.
+  std::vector<std::string> restore[3];
+  size_t restored = 0;
+  if (!backend->restoresSubscriptions()) {
+    std::unique_lock<std::mutex> lck(subscriptionsMutex);
+    for (auto &[topic, qos] : subscriptions)
+      if (qos >= 0 && qos <= 2) restore[qos].push_back(topic);
+  }
+  for (int qos = 0; qos < 3; qos++) {
+    if (restore[qos].empty()) continue;
+    backend->subscribeMany(restore[qos], qos);
+    restored += restore[qos].size();
+  }
+  LOG_DEBUG("MQTTClient {}: connected, {} subscriptions restored", id, restored);
+
+  if (onConnectCallback) onConnectCallback(userData, id);
+  finishConnect(true);
+  flushQueue();
+  // 0 is never a pending message id, this only retries the blocked ones
+  completePublishes(0);
+}
+
+void MQTTClient::handleDisconnected() {
+  status = CONNECTION_STATUS_DISCONNECTED;
+  metrics.disconnects.fetch_add(1, std::memory_order_relaxed);
+  reportEndpointFailure();
+  if (rateControlled) rateController.onLoss();
+  if (onDisconnectCallback) onDisconnectCallback(userData, id);
+  // Completions are not matched across connections
+  awaitingCompletions.store(0);
+  failPublishes();
+  finishConnect(false);
+}
+
+void MQTTClient::handleMessage(const MQTTMessage &message) {
+  metrics.received.fetch_add(1, std::memory_order_relaxed);
+  // Cached first, so a route reading the cache sees this message
+  if (lastValues) lastValues->update(message.topic, message.payload, message.qos, message.retain, message.timestamp);
+  if (capture) capture->write(CAPTURE_RECEIVED, message.topic, message.payload, message.qos, message.retain);
+  router.dispatch(id, message.topic, message);
+  if (streamCount.load() > 0) {
+    // Pushed outside the lock, a resumed consumer may close its stream
+    std::vector<std::shared_ptr<MQTTMessageStream::State>> matched;
+    {
+      std::unique_lock<std::mutex> lck(streamsMutex);
+      for (auto &stream : streams)
+        if (topicMatches(stream->filter, message.topic)) matched.push_back(stream);
+    }
+    for (auto &stream : matched) stream->push(message);
+  }
+  if (onMessageCallback) onMessageCallback(userData, id, message);
+}
+
+void MQTTClient::handlePublished(int messageId) {
+  metrics.completed.fetch_add(1, std::memory_order_relaxed);
+  // Before the flush below, see queueSend(). Completions of a previous
+  // connection may come after the reset.
+  size_t awaiting = awaitingCompletions.load();
+  while (awaiting > 0 && !awaitingCompletions.compare_exchange_weak(awaiting, awaiting - 1)) {
+  }
+  if (publishTimes) {
+    int64_t sent = publishTimes[messageId & 0xffff].exchange(0, std::memory_order_relaxed);
+    if (sent != 0) {
+      int64_t latency = steadyMicros() - sent;
+      // Only this thread writes it: an average over the last few acks
+      int64_t average = ackLatencyUs.load(std::memory_order_relaxed);
+      ackLatencyUs.store(average < 0 ? latency : average - average / 8 + latency / 8, std::memory_order_relaxed);
+      if (rateControlled) rateController.onAck(latency);
+    }
+  }
+  if (failoverEnabled) {
+    std::unique_lock<std::mutex> lck(unackedMutex);
+    // Acknowledgements mostly come in send order
+    auto found = std::find_if(unacked.begin(), unacked.end(), [&](auto &entry) { return entry.first == messageId; });
+    if (found != unacked.end()) unacked.erase(found);
+  }
+  if (onPublishCallback) onPublishCallback(userData, id, messageId);
+  completePublishes(messageId);
+  flushQueue();
+  updateWatermarks();
+}
+
+void MQTTClient::handleError(const ConnectionError &error) {
+  metrics.errors.fetch_add(1, std::memory_order_relaxed);
+  if (!backend) return;
+  ConnectionStatus backendStatus = backend->getStatus();
+  if (backendStatus != CONNECTION_STATUS_CONNECTED && backendStatus != CONNECTION_STATUS_CONNECTING) {
+    status = backendStatus;
+    finishConnect(false);
+    reportEndpointFailure();
+  }
+  if (!onErrorCallback) return;
+  ConnectionError clientError = error;
+  clientError.connectionId = id;
+  if (!errorLimiter.admit(clientError)) return;
+  onErrorCallback(userData, id, clientError);
+}
+
+void MQTTClient::loop() {}
+
+void MQTTClient::setupEndpoints() {
+  {
+    std::unique_lock<std::mutex> lck(endpointsMutex);
+    endpointHealth.assign(mqttParameters.endpoints.size(), EndpointHealth());
+    activeEndpoint = 0;
+    appliedEndpoint = SIZE_MAX;
+  }
+  ackLatencyUs = -1;
+  failoverEnabled = mqttParameters.endpoints.size() > 1;
+  if (failoverEnabled) startFailover();
+}
+
+void MQTTClient::setupRateControl() {
+  rateControlled = false;
+  rateController.setOptions(mqttParameters.rateControl);
+  if (!mqttParameters.rateControl.enabled) return;
+  allocatePublishTimes();
+  rateControlled = true;
+}
+
+void MQTTClient::allocatePublishTimes() {
+  if (publishTimes) return;
+  publishTimes = std::make_unique<std::atomic<int64_t>[]>(65536);
+  for (size_t i = 0; i < 65536; i++) publishTimes[i].store(0, std::memory_order_relaxed);
+}
+
+void MQTTClient::applyEndpoint() {
+  std::unique_lock<std::mutex> lck(endpointsMutex);
+  if (mqttParameters.endpoints.empty() || appliedEndpoint == activeEndpoint) return;
+  const MQTTEndpoint &endpoint = mqttParameters.endpoints[activeEndpoint];
+  MQTTConnectionParameters parameters = mqttParameters;
+  parameters.host = endpoint.host;
+  parameters.port = endpoint.port;
+  parameters.socketPath = endpoint.socketPath;
+  backend->setConnectionParameters(parameters);
+  appliedEndpoint = activeEndpoint;
+}
+
+void MQTTClient::startFailover() {
+  allocatePublishTimes();
+  std::unique_lock<std::mutex> lck(failoverMutex);
+  if (failoverRunning) return;
+  failoverRunning = true;
+  failoverWake = false;
+  failoverThread = std::thread(&MQTTClient::failoverLoop, this);
+}
+
+void MQTTClient::stopFailover() {
+  {
+    std::unique_lock<std::mutex> lck(failoverMutex);
+    if (!failoverRunning) return;
+    failoverRunning = false;
+  }
+  failoverCondition.notify_one();
+  failoverThread.join();
+}
+
+void MQTTClient::failoverLoop() {
+  auto nextProbe = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lck(failoverMutex);
+  while (failoverRunning) {
+    failoverCondition.wait_until(lck, nextProbe, [&]() { return !failoverRunning || failoverWake; });
+    if (!failoverRunning) break;
+    // Woken by a dropped connection: decide on the last probes, now
+    bool woken = std::exchange(failoverWake, false);
+    lck.unlock();
+    if (!woken) {
+      probeEndpoints();
+      nextProbe = std::chrono::steady_clock::now() + mqttParameters.probeInterval;
+    }
+    size_t chosen = chooseEndpoint();
+    if (chosen != getActiveEndpoint()) switchEndpoint(chosen);
+    lck.lock();
+  }
+}
+
+void MQTTClient::probeEndpoints() {
+  std::vector<int64_t> rtts;
+  for (const MQTTEndpoint &endpoint : mqttParameters.endpoints)
+    rtts.push_back(probeMQTTEndpoint(endpoint, mqttParameters, mqttParameters.tls, mqttParameters.failoverLatency));
+
+  int64_t limitUs = std::chrono::duration_cast<std::chrono::microseconds>(mqttParameters.failoverLatency).count();
+  std::unique_lock<std::mutex> lck(endpointsMutex);
+  for (size_t i = 0; i < rtts.size() && i < endpointHealth.size(); i++) {
+    EndpointHealth &health = endpointHealth[i];
+    health.pingMs = rtts[i] < 0 ? -1 : rtts[i] / 1000.0;
+    health.healthy = rtts[i] >= 0 && rtts[i] <= limitUs;
+    health.goodProbes = health.healthy ? health.goodProbes + 1 : 0;
+  }
+}
+
+size_t MQTTClient::chooseEndpoint() {
+  int64_t limitUs = std::chrono::duration_cast<std::chrono::microseconds>(mqttParameters.failoverLatency).count();
+  int64_t nowUs = steadyMicros();
+  // The broker in use degrades when its acknowledgements slow down, or stop
+  // while messages wait for them
+  bool degraded = ackLatencyUs.load() > limitUs;
+  {
+    std::unique_lock<std::mutex> lck(unackedMutex);
+    if (!unacked.empty()) {
+      int64_t sent = publishTimes[unacked.front().first & 0xffff].load(std::memory_order_relaxed);
+      degraded |= sent != 0 && nowUs - sent > limitUs;
+    }
+  }
+
+  std::unique_lock<std::mutex> lck(endpointsMutex);
+  size_t current = activeEndpoint;
+  if (current >= endpointHealth.size()) return current;
+  // Fail back to a preferred endpoint once it has been fine for a while
+  for (size_t i = 0; i < current; i++)
+    if (endpointHealth[i].healthy && endpointHealth[i].goodProbes >= mqttParameters.failbackProbes) return i;
+  if (endpointHealth[current].healthy && !degraded) return current;
+  // Fail over to the first healthy endpoint, or else the fastest one that
+  // answers at all
+  size_t fastest = current;
+  for (size_t i = 0; i < endpointHealth.size(); i++) {
+    if (i == current) continue;
+    if (endpointHealth[i].healthy) return i;
+    if (endpointHealth[i].pingMs >= 0 &&
+        (fastest == current || endpointHealth[i].pingMs < endpointHealth[fastest].pingMs))
+      fastest = i;
+  }
+  return fastest;
+}
+
+void MQTTClient::switchEndpoint(size_t index) {
+  std::unique_lock<std::mutex> lck(connectMutex);
+  // Nothing to move while the application keeps the client disconnected
+  if (!connectRequested) return;
+  {
+    std::unique_lock<std::mutex> endpointsLck(endpointsMutex);
+    if (index >= mqttParameters.endpoints.size() || index == activeEndpoint) return;
+    const MQTTEndpoint &from = mqttParameters.endpoints[activeEndpoint];
+    const MQTTEndpoint &to = mqttParameters.endpoints[index];
+    LOG_WARNING("MQTTClient {}: switching from {}:{} to {}:{}", id, from.socketPath.empty() ? from.host : from.socketPath,
+                from.port, to.socketPath.empty() ? to.host : to.socketPath, to.port);
+    activeEndpoint = index;
+  }
+  metrics.failovers.fetch_add(1, std::memory_order_relaxed);
+  ackLatencyUs = -1;
+  switching = true;
+  backend->disconnect();
+  switching = false;
+  connectLocked();
+}
+
+void MQTTClient::reportEndpointFailure() {
+  if (!failoverEnabled || switching) return;
+  {
+    std::unique_lock<std::mutex> lck(endpointsMutex);
+    if (activeEndpoint < endpointHealth.size()) {
+      endpointHealth[activeEndpoint].healthy = false;
+      endpointHealth[activeEndpoint].goodProbes = 0;
+    }
+  }
+  {
+    std::unique_lock<std::mutex> lck(failoverMutex);
+    failoverWake = true;
+  }
+  failoverCondition.notify_one();
+}
+
+void MQTTClient::trackPublish(int messageId, int qos) {
+  if (messageId != 0) awaitingCompletions.fetch_add(1);
+  if (!publishTimes || messageId == 0 || (qos == 0 && !rateControlled)) return;
+  publishTimes[messageId & 0xffff].store(steadyMicros(), std::memory_order_relaxed);
+}
+
+void MQTTClient::requeueUnacked() {
+  std::deque<std::pair<int, PoolHandle<Message>>> resend;
+  {
+    std::unique_lock<std::mutex> lck(unackedMutex);
+    resend.swap(unacked);
+  }
+  if (resend.empty()) return;
+  LOG_INFO("MQTTClient {}: sending {} unacknowledged messages again", id, resend.size());
+  std::unique_lock<std::mutex> lck(messageQueueMutex);
+  std::queue<PoolHandle<Message>> queue;
+  for (auto &[messageId, message] : resend) queue.push(message);
+  while (!messageQueue.empty()) {
+    queue.push(std::move(messageQueue.front()));
+    messageQueue.pop();
+  }
+  messageQueue.swap(queue);
+  queueLength.store(messageQueue.size(), std::memory_order_relaxed);
+}
+
+size_t MQTTClient::getActiveEndpoint() const {
+  std::unique_lock<std::mutex> lck(endpointsMutex);
+  return activeEndpoint;
+}
+
+std::vector<MQTTEndpointStatus> MQTTClient::getEndpointStatus() const {
+  std::vector<MQTTEndpointStatus> result;
+  std::unique_lock<std::mutex> lck(endpointsMutex);
+  for (size_t i = 0; i < endpointHealth.size() && i < mqttParameters.endpoints.size(); i++) {
+    int64_t ack = ackLatencyUs.load();
+    bool active = i == activeEndpoint;
+    result.push_back({mqttParameters.endpoints[i], active, endpointHealth[i].healthy, endpointHealth[i].pingMs,
+                      active && ack >= 0 ? ack / 1000.0 : -1});
+  }
+  return result;
+}
+
+RateControlSignal MQTTClient::getRateControl() const {
+  if (!rateControlled) return {0, std::chrono::microseconds(0), 0, -1, -1, -1, -1};
+  return rateController.getSignal();
+}
+
+std::optional<LastValue> MQTTClient::getLast(const std::string &topic) const {
+  if (!lastValues) return std::nullopt;
+  return lastValues->getLast(topic);
+}
+
+std::vector<LastValue> MQTTClient::snapshot(const std::string &filter) const {
+  if (!lastValues) return {};
+  return lastValues->snapshot(filter);
+}
@@ -1,25 +1,21 @@
 #include "mqtt_connection.h"
-#include <iostream>
+#include "logger.h"
 #include <mosquitto.h>
+#include <mqtt_protocol.h>
 #include <mutex>
 #include <string>
 
 int MQTTConnection::mqttInstances = 0;
 
-#define MQTT_ERROR(inst, err, message)                         \
-  if (inst->onErrorCallback) {                                 \
-    char *err_msg = NULL;                                      \
-    asprintf(&err_msg, message "%s", mosquitto_strerror(err)); \
-    inst->onErrorCallback(inst->userData, inst->id, err_msg);  \
-    free(err_msg);                                             \
-  }
+// mosquitto_strerror returns static strings, nothing is allocated here
+#define MQTT_ERROR(inst, code, err) inst->reportError(code, err, mosquitto_strerror(err));
 
-MQTTMessage::MQTTMessage() : Message() {
+MQTTMessage::MQTTMessage() : Message(CONNECTION_TYPE_MQTT) {
   this->qos = 0;
   this->retain = false;
 };
 MQTTMessage::MQTTMessage(const std::string &topic, const std::string &payload)
-    : Message() {
+    : Message(CONNECTION_TYPE_MQTT) {
   this->topic = topic;
   this->payload = payload;
   this->retain = false;
@@ -27,21 +23,62 @@ MQTTMessage::MQTTMessage(const std::string &topic, const std::string &payload)
 }
 MQTTMessage::MQTTMessage(const std::string &topic, const std::string &payload,
                          int qos, bool retain)
-    : Message() {
+    : Message(CONNECTION_TYPE_MQTT) {
   this->qos = qos;
   this->retain = retain;
   this->topic = topic;
   this->payload = payload;
 }
-MQTTMessage::MQTTMessage(const Message &message) : Message() {
-  if (typeid(message) != typeid(MQTTMessage)) return;
-  MQTTMessage *msg = (MQTTMessage *)&message;
+MQTTMessage::MQTTMessage(const Message &message) : MQTTMessage() {
+  if (message.getType() != CONNECTION_TYPE_MQTT) return;
+  const MQTTMessage *msg = static_cast<const MQTTMessage *>(&message);
   this->qos = msg->qos;
   this->retain = msg->retain;
   this->topic = msg->topic;
   this->payload = msg->payload;
 }
 
+MQTTMessagePool::MQTTMessagePool(size_t slabSize, size_t maxMessages)
+    : ObjectPool<MQTTMessage>(slabSize, maxMessages,
+                              MQTTMessagePool::recycleMessage) {}
+
+void MQTTMessagePool::recycleMessage(MQTTMessage &message) {
+  message.qos = 0;
+  message.retain = false;
+  // Give back buffers grown by oversized messages, keep the inline capacity
+  if (message.topic.capacity() > 4 * MQTT_MESSAGE_INLINE_SIZE)
+    std::string().swap(message.topic);
+  if (message.payload.capacity() > 4 * MQTT_MESSAGE_INLINE_SIZE)
+    std::string().swap(message.payload);
+  message.topic.clear();
+  message.payload.clear();
+  message.topic.reserve(MQTT_MESSAGE_INLINE_SIZE);
+  message.payload.reserve(MQTT_MESSAGE_INLINE_SIZE);
+}
+
+PoolHandle<MQTTMessage> MQTTMessagePool::acquire(const MQTTMessage &message) {
+  PoolHandle<MQTTMessage> handle = ObjectPool<MQTTMessage>::acquire();
+  if (!handle) return handle;
+  handle->qos = message.qos;
+  handle->retain = message.retain;
+  handle->topic.assign(message.topic);
+  handle->payload.assign(message.payload);
+  handle->timestamp = message.timestamp;
+  return handle;
+}
+
+PoolHandle<MQTTMessage> MQTTMessagePool::acquire(std::string_view topic,
+                                                 std::string_view payload,
+                                                 int qos, bool retain) {
+  PoolHandle<MQTTMessage> handle = ObjectPool<MQTTMessage>::acquire();
+  if (!handle) return handle;
+  handle->qos = qos;
+  handle->retain = retain;
+  handle->topic.assign(topic);
+  handle->payload.assign(payload);
+  return handle;
+}
+
 void libInit() { mosquitto_lib_init(); }
 
 void libCleanup() { mosquitto_lib_cleanup(); }
@@ -53,89 +90,183 @@ MQTTConnection::MQTTConnection(const MQTTConnectionParameters &parameters_)
   mqttInstances++;
 
   mqttParameters = parameters_;
-  parameters = mqttParameters;
   mosq = NULL;
-  queueSize.store(0);
+  clientStale = false;
+  loopRunning = false;
+  dialed = false;
+  // Message ids are 16 bit, one byte per id is cheaper than a map on every
+  // publish
+  inFlightQos = std::make_unique<std::atomic<uint8_t>[]>(65536);
+  resetInFlight();
+  messagePool = std::make_unique<MQTTMessagePool>();
+  setupRealtime();
 }
 
 MQTTConnection::MQTTConnection(MQTTConnection &&other)
     : Connection(std::move(other)),
-      queueSize(other.queueSize.load()),
+      inFlightQos(std::move(other.inFlightQos)),
+      sendWindow(other.sendWindow.load()),
       mosq(other.mosq),
-      mqttParameters(std::move(other.mqttParameters)) {
+      tlsContext(std::move(other.tlsContext)),
+      clientStale(other.clientStale),
+      loopRunning(other.loopRunning),
+      dialed(other.dialed),
+      mqttParameters(std::move(other.mqttParameters)),
+      messagePool(std::move(other.messagePool)) {
+  // The publisher thread is bound to its connection and may be using the
+  // handle, stopped before the handle changes owner; a new one is started
+  other.realtimePublisher = nullptr;
   // Set the moved-from object's mosq to nullptr to prevent double deletion
+  for (int qos = 0; qos < 3; qos++) inFlight[qos] = other.inFlight[qos].load();
+  // The handle's callbacks get their connection from its user data
+  if (mosq) mosquitto_user_data_set(mosq, this);
   other.mosq = nullptr;
+  other.loopRunning = false;
+  other.dialed = false;
+  other.messagePool = std::make_unique<MQTTMessagePool>();
+  other.inFlightQos = std::make_unique<std::atomic<uint8_t>[]>(65536);
+  other.resetInFlight();
+  setupRealtime();
 }
 MQTTConnection &MQTTConnection::operator=(MQTTConnection &&other) {
   if (this != &other) {
+    // Both publisher threads may be using their handle
+    realtimePublisher = nullptr;
+    other.realtimePublisher = nullptr;
+    destroyClient();
     mosq = other.mosq;
+    tlsContext = std::move(other.tlsContext);
+    clientStale = other.clientStale;
+    loopRunning = other.loopRunning;
+    dialed = other.dialed;
+    if (mosq) mosquitto_user_data_set(mosq, this);
     mqttParameters = std::move(other.mqttParameters);
-    queueSize = other.queueSize.load();
+    for (int qos = 0; qos < 3; qos++) inFlight[qos] = other.inFlight[qos].load();
+    inFlightQos.swap(other.inFlightQos);
+    sendWindow = other.sendWindow.load();
     other.mosq = nullptr;
+    other.loopRunning = false;
+    other.dialed = false;
+    other.resetInFlight();
+    {
+      std::unique_lock<std::mutex> lck(messageQueueMutex);
+      std::unique_lock<std::mutex> otherLck(other.messageQueueMutex);
+      messageQueue = std::move(other.messageQueue);
+      queueLength = other.queueLength.exchange(0);
+      messagePool.swap(other.messagePool);
+    }
+    setupRealtime();
   }
   return *this;
 }
 MQTTConnection::~MQTTConnection() {
-  disconnect();
+  realtimePublisher = nullptr;
+  destroyClient();
+  // Queued handles have to go back to the pool before it is destroyed
+  std::unique_lock<std::mutex> lck(messageQueueMutex);
+  while (!messageQueue.empty()) messageQueue.pop();
+  lck.unlock();
   mqttInstances--;
   if (mqttInstances == 0) libCleanup();
 }
 
 void MQTTConnection::setConnectionParameters(
     const ConnectionParameters &parameters_) {
-  if (typeid(parameters_) != typeid(MQTTConnectionParameters)) return;
+  if (parameters_.getType() != CONNECTION_TYPE_MQTT) return;
   mqttParameters =
-      reinterpret_cast<const MQTTConnectionParameters &>(parameters_);
-  parameters = mqttParameters;
+      static_cast<const MQTTConnectionParameters &>(parameters_);
+  // Applied on the next connect()
+  clientStale = mosq != NULL;
+  setupRealtime();
 }
 
-void MQTTConnection::connect() {
-  status = CONNECTION_STATUS_CONNECTING;
+void MQTTConnection::setupRealtime() {
+  if (!mqttParameters.realtime) {
+    realtimePublisher = nullptr;
+    return;
+  }
+  if (realtimePublisher &&
+      realtimePublisher->getCapacity() == mqttParameters.realtimeQueueSlots &&
+      realtimePublisher->getMaxTopicSize() == mqttParameters.realtimeMaxTopicSize &&
+      realtimePublisher->getMaxPayloadSize() == mqttParameters.realtimeMaxPayloadSize)
+    return;
+  realtimePublisher = nullptr;
+  realtimePublisher = std::make_unique<RealtimePublisher>(
+      mqttParameters.realtimeQueueSlots, mqttParameters.realtimeMaxTopicSize,
+      mqttParameters.realtimeMaxPayloadSize, MQTTConnection::publishRealtime, this);
+}
+
+bool MQTTConnection::setupClient() {
   int ret;
 
-  if (mosq) {
-    mosquitto_reinitialise(this->mosq, NULL, true, this);
-  } else {
+  {
+    std::unique_lock<std::shared_mutex> lck(clientMutex);
     mosq = mosquitto_new(NULL, true, this);
   }
-
+  // A new handle starts with nothing in flight
+  resetInFlight();
   if (!mosq) {
     status = CONNECTION_STATUS_ERROR;
-    MQTT_ERROR(this, MOSQ_ERR_NOMEM, "Error creating mosquitto instance: ")
-    return;
+    MQTT_ERROR(this, CONNECTION_ERROR_NOMEM, MOSQ_ERR_NOMEM)
+    return false;
+  }
+
+  ret = mosquitto_int_option(mosq, MOSQ_OPT_PROTOCOL_VERSION,
+                             mqttParameters.protocolVersion);
+  if (ret == MOSQ_ERR_SUCCESS)
+    ret = mosquitto_int_option(mosq, MOSQ_OPT_SEND_MAXIMUM,
+                               mqttParameters.sendMaximum);
+  if (ret == MOSQ_ERR_SUCCESS)
+    ret = mosquitto_int_option(mosq, MOSQ_OPT_RECEIVE_MAXIMUM,
+                               mqttParameters.receiveMaximum);
+  if (ret != MOSQ_ERR_SUCCESS) {
+    destroyClient();
+    status = CONNECTION_STATUS_ERROR;
+    MQTT_ERROR(this, CONNECTION_ERROR_CONNECT, ret)
+    return false;
   }
 
   if (!mqttParameters.username.empty() && !mqttParameters.password.empty()) {
     ret = mosquitto_username_pw_set(mosq, mqttParameters.username.c_str(),
                                     mqttParameters.password.c_str());
     if (ret != MOSQ_ERR_SUCCESS) {
+      destroyClient();
       status = CONNECTION_STATUS_ERROR;
-      MQTT_ERROR(this, ret, "Error setting username and password: ")
-      return;
+      MQTT_ERROR(this, CONNECTION_ERROR_AUTH, ret)
+      return false;
     }
   }
 
   if (mqttParameters.tls) {
-    ret = mosquitto_tls_set(
-        mosq,
-        mqttParameters.cafile.empty() ? nullptr : mqttParameters.cafile.c_str(),
-        mqttParameters.capath.empty() ? nullptr : mqttParameters.capath.c_str(),
-        mqttParameters.certfile.empty() ? nullptr
-                                        : mqttParameters.certfile.c_str(),
-        mqttParameters.keyfile.empty() ? nullptr
-                                       : mqttParameters.keyfile.c_str(),
-        nullptr);
-    if (ret) {
-      status = CONNECTION_STATUS_ERROR;
-      MQTT_ERROR(this, ret, "Error setting tls: ")
-      return;
+    // Our own SSL_CTX instead of mosquitto_tls_set(): it lives as long as
+    // the handle and keeps the session for the next reconnect
+    TLSOptions options;
+    options.cafile = mqttParameters.cafile;
+    options.capath = mqttParameters.capath;
+    options.certfile = mqttParameters.certfile;
+    options.keyfile = mqttParameters.keyfile;
+    options.keyPassword = mqttParameters.keyPassword;
+    options.tlsVersion = mqttParameters.tlsVersion;
+    options.ciphers = mqttParameters.ciphers;
+    options.ciphersuites = mqttParameters.ciphersuites;
+    options.sessionResumption = mqttParameters.tlsSessionResumption;
+    // The certificate name is not checked against a unix socket path
+    if (mqttParameters.socketPath.empty()) options.verifyHost = mqttParameters.host;
+    std::string error;
+    tlsContext = TLSClientContext::create(options, &error);
+    if (!tlsContext) {
+      LOG_ERROR("MQTTConnection {}: {}", id, error);
+      ret = MOSQ_ERR_TLS;
+    } else {
+      ret = mosquitto_int_option(mosq, MOSQ_OPT_SSL_CTX_WITH_DEFAULTS, 0);
+      if (ret == MOSQ_ERR_SUCCESS)
+        ret = mosquitto_void_option(mosq, MOSQ_OPT_SSL_CTX, tlsContext->get());
     }
-
-    ret = mosquitto_tls_insecure_set(mosq, false);
     if (ret) {
+      destroyClient();
       status = CONNECTION_STATUS_ERROR;
-      MQTT_ERROR(this, ret, "Setting TLS: ")
-      return;
+      MQTT_ERROR(this, CONNECTION_ERROR_TLS, ret)
+      return false;
     }
   }
 
@@ -150,88 +281,355 @@ void MQTTConnection::connect() {
     );
 
     if (ret) {
+      destroyClient();
       status = CONNECTION_STATUS_ERROR;
-      MQTT_ERROR(this, ret, "Error setting will message: ")
-      return;
+      MQTT_ERROR(this, CONNECTION_ERROR_WILL, ret)
+      return false;
     }
   }
 
-	ret = mosquitto_loop_start(mosq);
-	if (ret) {
-    std::cout << "Error connecting to broker: " << ret << std::endl;
-		status = CONNECTION_STATUS_ERROR;
-		MQTT_ERROR(this, ret, "Error starting mosquitto loop: ")
-		return;
-	}
-
-  ret = mosquitto_connect_async(mosq, mqttParameters.host.c_str(),
-                                mqttParameters.port, 5);
-  if (ret) {
-    status = CONNECTION_STATUS_ERROR;
-    MQTT_ERROR(this, ret, "Error connecting to broker: ")
-    return;
-  }
-
-  mosquitto_connect_callback_set(mosq, MQTTConnection::on_connect);
+  mosquitto_connect_v5_callback_set(mosq, MQTTConnection::on_connect);
   mosquitto_disconnect_callback_set(mosq, MQTTConnection::on_disconnect);
   mosquitto_message_callback_set(mosq, MQTTConnection::on_message);
   mosquitto_publish_callback_set(mosq, MQTTConnection::on_publish);
   mosquitto_subscribe_callback_set(mosq, MQTTConnection::on_subscribe);
   mosquitto_unsubscribe_callback_set(mosq, MQTTConnection::on_unsubscribe);
+  return true;
+}
+
+void MQTTConnection::destroyClient() {
+  if (!mosq) return;
+  if (loopRunning) {
+    mosquitto_disconnect(mosq);
+    mosquitto_loop_stop(mosq, false);
+  }
+  {
+    // Waits for the real-time publisher thread to be done with the handle
+    std::unique_lock<std::shared_mutex> lck(clientMutex);
+    mosquitto_destroy(mosq);
+    mosq = nullptr;
+  }
+  tlsContext = nullptr;
+  clientStale = false;
+  loopRunning = false;
+  dialed = false;
+}
+
+void MQTTConnection::connect() {
+  int ret;
+
+  if (clientStale) destroyClient();
+  if (loopRunning && dialed) {
+    // After a drop libmosquitto's loop keeps re-dialing on its own; stop it
+    // so the caller decides when to reconnect
+    mosquitto_disconnect(mosq);
+    mosquitto_loop_stop(mosq, false);
+    loopRunning = false;
+  }
+  status = CONNECTION_STATUS_CONNECTING;
+  if (!mosq && !setupClient()) return;
+  // A reused handle sends its unacknowledged messages again, they stay in
+  // flight; the window is the broker's to narrow again in on_connect()
+  resetSendWindow();
+
+  if (!loopRunning) {
+    ret = mosquitto_loop_start(mosq);
+    if (ret) {
+      LOG_ERROR("Error connecting to broker: {}", ret);
+      status = CONNECTION_STATUS_ERROR;
+      MQTT_ERROR(this, CONNECTION_ERROR_LOOP, ret)
+      return;
+    }
+    loopRunning = true;
+  }
+
+  if (dialed) {
+    // Same broker, same handle: only the socket is opened again
+    ret = mosquitto_reconnect_async(mosq);
+  } else if (mqttParameters.socketPath.empty()) {
+    ret = mosquitto_connect_async(mosq, mqttParameters.host.c_str(),
+                                  mqttParameters.port, mqttParameters.keepalive);
+  } else {
+    // libmosquitto takes port 0 as "host is a unix socket path"
+    ret = mosquitto_connect_async(mosq, mqttParameters.socketPath.c_str(),
+                                  0, mqttParameters.keepalive);
+  }
+  if (ret) {
+    status = CONNECTION_STATUS_ERROR;
+    MQTT_ERROR(this, CONNECTION_ERROR_CONNECT, ret)
+    return;
+  }
+  dialed = true;
 }
 
 void MQTTConnection::disconnect() {
-	mosquitto_disconnect(mosq);
-	mosquitto_loop_stop(mosq, false);
-	mosquitto_destroy(mosq);
-	mosq = nullptr;
-	status = CONNECTION_STATUS_DISCONNECTED;
+  if (mosq) {
+    mosquitto_disconnect(mosq);
+    if (loopRunning) mosquitto_loop_stop(mosq, false);
+    loopRunning = false;
+  }
+  status = CONNECTION_STATUS_DISCONNECTED;
 }
 
 bool MQTTConnection::send(const Message &message) {
-  if (typeid(message) != typeid(MQTTMessage)) return false;
-  if (queueSize.load() >= maxQueueSize) return false;
-  if (!mosq) return false;
+  if (message.getType() != CONNECTION_TYPE_MQTT) return false;
+  return publish(static_cast<const MQTTMessage &>(message));
+}
 
-  MQTTMessage *mqtt_message = (MQTTMessage *)&message;
-  mosquitto_publish(mosq, NULL, mqtt_message->topic.c_str(),
-                    mqtt_message->payload.size(), mqtt_message->payload.c_str(),
-                    mqtt_message->qos, mqtt_message->retain);
-  queueSize++;
+void MQTTConnection::reportPublishError(int err) {
+  MQTT_ERROR(this, CONNECTION_ERROR_PUBLISH, err)
+}
+
+bool MQTTConnection::sendShared(const SharedMessage &message) {
+  if (!mosq) return false;
+  if (!reserveInFlight(message.qos)) return false;
+
+  // libmosquitto copies into its own packet, the shared buffer is only read
+  int mid = 0;
+  int ret = mosquitto_publish(mosq, &mid, message.topic.data(),
+                              message.payload.size(), message.payload.data(),
+                              message.qos, message.retain);
+  if (ret != MOSQ_ERR_SUCCESS) {
+    releaseInFlight(message.qos);
+    MQTT_ERROR(this, CONNECTION_ERROR_PUBLISH, ret)
+    return false;
+  }
+  trackInFlight(mid, message.qos);
   return true;
 }
 
 void MQTTConnection::receive(Message &message) {}
 
-bool MQTTConnection::queueSend(const Message &message) { return send(message); }
+bool MQTTConnection::queueSend(const Message &message) {
+  if (message.getType() != CONNECTION_TYPE_MQTT) return false;
+  PoolHandle<MQTTMessage> pooled =
+      messagePool->acquire(static_cast<const MQTTMessage &>(message));
+  if (!pooled) return false;
+  return queueSend(pooled);
+}
+
+bool MQTTConnection::queueSend(const PoolHandle<MQTTMessage> &message) {
+  if (!message) return false;
+  {
+    std::unique_lock<std::mutex> lck(messageQueueMutex);
+    if (messageQueue.size() >= maxQueueSize) return false;
+    messageQueue.push(message);
+    queueLength.store(messageQueue.size(), std::memory_order_relaxed);
+  }
+  flushQueue(true);
+  updateWatermarks();
+  return true;
+}
 
-void MQTTConnection::subscribe(const std::string &topic) {
-  mosquitto_subscribe(mosq, NULL, topic.c_str(), 0);
+void MQTTConnection::flushQueue(bool wait) {
+  // The network thread does not wait for the lock. It leaves a request the
+  // holder checks after unlocking, so the room a completion freed is used
+  // even if the holder's pass had already stopped at a full window.
+  flushRequested.store(true);
+  std::unique_lock<std::mutex> lck(messageQueueMutex, std::defer_lock);
+  if (wait)
+    lck.lock();
+  else if (!lck.try_lock())
+    return;
+  do {
+    flushRequested.store(false);
+    while (!messageQueue.empty() && status == CONNECTION_STATUS_CONNECTED) {
+      const MQTTMessage &message =
+          static_cast<const MQTTMessage &>(*messageQueue.front());
+      if (!publish(message)) break;
+      messageQueue.pop();
+    }
+    queueLength.store(messageQueue.size(), std::memory_order_relaxed);
+    lck.unlock();
+  } while (flushRequested.load() && lck.try_lock());
+}
+
+bool MQTTConnection::sendRealtime(std::string_view topic, const void *payload,
+                                  size_t size, int qos, bool retain) {
+  if (!realtimePublisher) return false;
+  return realtimePublisher->push(topic, payload, size, qos, retain);
+}
+
+bool MQTTConnection::publishRealtime(void *obj, const char *topic,
+                                     const void *payload, size_t size, int qos,
+                                     bool retain) {
+  MQTTConnection *connection = (MQTTConnection *)obj;
+  // An invalid QoS is reported and dropped, a full window is retried
+  if (qos < 0 || qos > 2) {
+    MQTT_ERROR(connection, CONNECTION_ERROR_PUBLISH, MOSQ_ERR_INVAL)
+    return true;
+  }
+  int ret;
+  {
+    // Runs on the publisher thread, the handle may be destroyed meanwhile.
+    // Errors are reported once released, the callback may reconnect.
+    std::shared_lock<std::shared_mutex> lck(connection->clientMutex);
+    if (connection->status != CONNECTION_STATUS_CONNECTED || !connection->mosq)
+      return false;
+    if (!connection->reserveInFlight(qos)) return false;
+
+    int mid = 0;
+    ret = mosquitto_publish(connection->mosq, &mid, topic, size, payload, qos,
+                            retain);
+    if (ret == MOSQ_ERR_SUCCESS) {
+      connection->trackInFlight(mid, qos);
+      return true;
+    }
+    connection->releaseInFlight(qos);
+  }
+  if (ret == MOSQ_ERR_NO_CONN) return false;
+  // Not retriable (e.g. oversized payload), drop it
+  MQTT_ERROR(connection, CONNECTION_ERROR_PUBLISH, ret)
+  return true;
+}
+
+void MQTTConnection::subscribe(const std::string &topic, int qos) {
+  mosquitto_subscribe(mosq, NULL, topic.c_str(), qos);
 }
 
 void MQTTConnection::unsubscribe(const std::string &topic) {
   mosquitto_unsubscribe(mosq, NULL, topic.c_str());
 }
 
-size_t MQTTConnection::getQueueSize() { return queueSize; }
+int MQTTConnection::subscribeMany(const std::vector<std::string> &topics,
+                                  int qos, OnBatchCallback callback) {
+  return sendBatch(topics, qos, callback, true);
+}
+
+int MQTTConnection::unsubscribeMany(const std::vector<std::string> &topics,
+                                    OnBatchCallback callback) {
+  return sendBatch(topics, 0, callback, false);
+}
+
+int MQTTConnection::sendBatch(const std::vector<std::string> &topics, int qos,
+                              OnBatchCallback callback, bool subscribe) {
+  if (!mosq || topics.empty()) return -1;
+  std::vector<size_t> ends = chunkTopicFilters(
+      topics, mqttParameters.maxSubscribePacketSize, subscribe);
+  std::vector<char *> filters;
+  filters.reserve(topics.size());
+  for (const std::string &topic : topics)
+    filters.push_back(const_cast<char *>(topic.c_str()));
+
+  // Acknowledgements wait for the lock until every packet is registered
+  std::unique_lock<std::mutex> lck(batchMutex);
+  int batchId = batches.open(callback);
+  size_t begin = 0, sent = 0;
+  for (size_t end : ends) {
+    int mid = 0;
+    int count = end - begin;
+    int ret =
+        subscribe
+            ? mosquitto_subscribe_multiple(mosq, &mid, count, &filters[begin],
+                                           qos, 0, NULL)
+            : mosquitto_unsubscribe_multiple(mosq, &mid, count,
+                                             &filters[begin], NULL);
+    if (ret != MOSQ_ERR_SUCCESS) {
+      MQTT_ERROR(this,
+                 subscribe ? CONNECTION_ERROR_SUBSCRIBE
+                           : CONNECTION_ERROR_UNSUBSCRIBE,
+                 ret)
+      break;
+    }
+    batches.addPacket(batchId, mid, count);
+    sent++;
+    begin = end;
+  }
+  if (sent == 0) {
+    batches.discard(batchId);
+    return -1;
+  }
+  LOG_DEBUG("MQTTConnection {}: {} filters in {} packets", id, begin, sent);
+  return batchId;
+}
+
+void MQTTConnection::completeBatch(int mid, size_t refused) {
+  SubscriptionBatches<OnBatchCallback>::Result result;
+  {
+    std::unique_lock<std::mutex> lck(batchMutex);
+    if (!batches.acknowledge(mid, refused, result)) return;
+  }
+  if (result.callback)
+    result.callback(userData, id, result.batchId, result.count,
+                    result.refused);
+}
+
+size_t MQTTConnection::getQueueSize() {
+  return inFlight[0].load() + inFlight[1].load() + inFlight[2].load();
+}
+
+size_t MQTTConnection::getInFlight(int qos) const {
+  if (qos < 0 || qos > 2) return 0;
+  return inFlight[qos].load();
+}
+
+TLSStatistics MQTTConnection::getTLSStatistics() const {
+  return tlsContext ? tlsContext->getStatistics() : TLSStatistics();
+}
+
+// The publishing thread records the QoS of a message id after
+// mosquitto_publish returns, but the network thread may complete it first.
+// Whoever comes second releases the in-flight slot.
+static const uint8_t IN_FLIGHT_DONE = 0xff;
+
+void MQTTConnection::trackInFlight(int mid, int qos) {
+  std::atomic<uint8_t> &entry = inFlightQos[mid & 0xffff];
+  if (entry.exchange(qos + 1) == IN_FLIGHT_DONE) {
+    entry.store(0);
+    releaseInFlight(qos);
+  }
+}
+
+void MQTTConnection::releaseInFlight(int qos) { inFlight[qos].fetch_sub(1); }
+
+void MQTTConnection::resetInFlight() {
+  for (int qos = 0; qos < 3; qos++) inFlight[qos].store(0);
+  for (size_t mid = 0; mid < 65536; mid++) inFlightQos[mid].store(0, std::memory_order_relaxed);
+  resetSendWindow();
+}
+
+void MQTTConnection::resetSendWindow() {
+  sendWindow.store(mqttParameters.sendMaximum > 0 ? mqttParameters.sendMaximum : 65535);
+}
 
 void MQTTConnection::loop() {}
 
-void MQTTConnection::on_connect(struct mosquitto *mosq, void *obj, int rc) {
+void MQTTConnection::on_connect(struct mosquitto *mosq, void *obj, int rc,
+                                int flags,
+                                const mosquitto_property *properties) {
   MQTTConnection *connection = (MQTTConnection *)obj;
   if (rc == 0) {
+    // On MQTT v5 the broker may accept fewer QoS 1/2 messages than we would
+    // send
+    uint16_t receiveMaximum = 0;
+    if (properties &&
+        mosquitto_property_read_int16(properties, MQTT_PROP_RECEIVE_MAXIMUM,
+                                      &receiveMaximum, false) &&
+        receiveMaximum < connection->sendWindow.load())
+      connection->sendWindow.store(receiveMaximum);
     connection->status = CONNECTION_STATUS_CONNECTED;
     if (connection->onConnectCallback)
       connection->onConnectCallback(connection->userData, connection->id);
+    connection->flushQueue();
   } else {
     connection->status = CONNECTION_STATUS_ERROR;
-    MQTT_ERROR(connection, rc, "Error on_connect: ")
+    connection->reportError(CONNECTION_ERROR_REFUSED, rc, mosquitto_connack_string(rc));
   }
 }
 
 void MQTTConnection::on_disconnect(struct mosquitto *mosq, void *obj, int rc) {
   MQTTConnection *connection = (MQTTConnection *)obj;
   connection->status = CONNECTION_STATUS_DISCONNECTED;
+  // Batches still waiting for acknowledgements will not get them
+  std::vector<SubscriptionBatches<OnBatchCallback>::Result> lost;
+  {
+    std::unique_lock<std::mutex> lck(connection->batchMutex);
+    lost = connection->batches.drain();
+  }
+  for (auto &result : lost)
+    if (result.callback)
+      result.callback(connection->userData, connection->id, result.batchId,
+                      result.count, result.refused);
   if (connection->onDisconnectCallback && mosq)
     connection->onDisconnectCallback(connection->userData, connection->id);
 }
@@ -243,6 +641,8 @@ void MQTTConnection::on_message(struct mosquitto *mosq, void *obj,
   mqtt_message.topic = message->topic;
   mqtt_message.payload =
       std::string((char *)message->payload, message->payloadlen);
+  mqtt_message.qos = message->qos;
+  mqtt_message.retain = message->retain;
   mqtt_message.timestamp = std::chrono::system_clock::now();
   if (connection->onMessageCallback)
     connection->onMessageCallback(connection->userData, connection->id,
@@ -251,13 +651,31 @@ void MQTTConnection::on_message(struct mosquitto *mosq, void *obj,
 
 void MQTTConnection::on_publish(struct mosquitto *mosq, void *obj, int mid) {
   MQTTConnection *connection = (MQTTConnection *)obj;
-  connection->queueSize--;
+  uint8_t qos = connection->inFlightQos[mid & 0xffff].exchange(IN_FLIGHT_DONE);
+  if (qos != 0 && qos != IN_FLIGHT_DONE) {
+    connection->inFlightQos[mid & 0xffff].store(0);
+    connection->releaseInFlight(qos - 1);
+  }
+  if (connection->onPublishCallback)
+    connection->onPublishCallback(connection->userData, connection->id, mid);
+  connection->flushQueue();
+  connection->updateWatermarks();
 }
 
 void MQTTConnection::on_subscribe(struct mosquitto *mosq, void *obj, int mid,
-                                  int qos_count, const int *granted_qos) {}
+                                  int qos_count, const int *granted_qos) {
+  MQTTConnection *connection = (MQTTConnection *)obj;
+  // 0x80 and up are failure reason codes
+  size_t refused = 0;
+  for (int i = 0; i < qos_count; i++)
+    if (granted_qos[i] >= 0x80) refused++;
+  connection->completeBatch(mid, refused);
+}
 
-void MQTTConnection::on_unsubscribe(struct mosquitto *mosq, void *obj, int mid) {}
+void MQTTConnection::on_unsubscribe(struct mosquitto *mosq, void *obj, int mid) {
+  MQTTConnection *connection = (MQTTConnection *)obj;
+  connection->completeBatch(mid, 0);
+}
 
 MQTTConnectionParametersBuilder::MQTTConnectionParametersBuilder() {
   parameters = MQTTConnectionParameters::get_default();
@@ -279,6 +697,14 @@ MQTTConnectionParametersBuilder
   return *this;
 }
 
+MQTTConnectionParametersBuilder
+&MQTTConnectionParametersBuilder::socketPath(
+  const std::string &path
+) {
+  parameters.socketPath = path;
+  return *this;
+}
+
 MQTTConnectionParametersBuilder
 &MQTTConnectionParametersBuilder::username(
   const std::string &username
@@ -335,6 +761,164 @@ MQTTConnectionParametersBuilder
   return *this;
 }
 
+MQTTConnectionParametersBuilder
+&MQTTConnectionParametersBuilder::keyPassword(
+  const std::string &password
+) {
+  parameters.keyPassword = password;
+  return *this;
+}
+
+MQTTConnectionParametersBuilder
+&MQTTConnectionParametersBuilder::tlsVersion(
+  const std::string &version
+) {
+  parameters.tlsVersion = version;
+  return *this;
+}
+
+MQTTConnectionParametersBuilder
+&MQTTConnectionParametersBuilder::ciphers(
+  const std::string &ciphers
+) {
+  parameters.ciphers = ciphers;
+  return *this;
+}
+
+MQTTConnectionParametersBuilder
+&MQTTConnectionParametersBuilder::ciphersuites(
+  const std::string &ciphersuites
+) {
+  parameters.ciphersuites = ciphersuites;
+  return *this;
+}
+
+MQTTConnectionParametersBuilder
+&MQTTConnectionParametersBuilder::tlsSessionResumption(
+  bool enabled
+) {
+  parameters.tlsSessionResumption = enabled;
+  return *this;
+}
+
+MQTTConnectionParametersBuilder
+&MQTTConnectionParametersBuilder::protocolVersion(
+  int version
+) {
+  parameters.protocolVersion = version;
+  return *this;
+}
+
+MQTTConnectionParametersBuilder
+&MQTTConnectionParametersBuilder::keepalive(
+  int seconds
+) {
+  parameters.keepalive = seconds;
+  return *this;
+}
+
+MQTTConnectionParametersBuilder
+&MQTTConnectionParametersBuilder::sendMaximum(
+  int count
+) {
+  parameters.sendMaximum = count;
+  return *this;
+}
+
+MQTTConnectionParametersBuilder
+&MQTTConnectionParametersBuilder::receiveMaximum(
+  int count
+) {
+  parameters.receiveMaximum = count;
+  return *this;
+}
+
+MQTTConnectionParametersBuilder
+&MQTTConnectionParametersBuilder::maxSubscribePacketSize(
+  size_t size
+) {
+  parameters.maxSubscribePacketSize = size;
+  return *this;
+}
+
+MQTTConnectionParametersBuilder
+&MQTTConnectionParametersBuilder::endpoint(
+  const std::string &host,
+  int port
+) {
+  MQTTEndpoint endpoint;
+  endpoint.host = host;
+  endpoint.port = port;
+  parameters.endpoints.push_back(endpoint);
+  return *this;
+}
+
+MQTTConnectionParametersBuilder
+&MQTTConnectionParametersBuilder::socketEndpoint(
+  const std::string &path
+) {
+  MQTTEndpoint endpoint;
+  endpoint.socketPath = path;
+  parameters.endpoints.push_back(endpoint);
+  return *this;
+}
+
+MQTTConnectionParametersBuilder
+&MQTTConnectionParametersBuilder::probeInterval(
+  std::chrono::milliseconds interval
+) {
+  parameters.probeInterval = interval;
+  return *this;
+}
+
+MQTTConnectionParametersBuilder
+&MQTTConnectionParametersBuilder::failoverLatency(
+  std::chrono::milliseconds latency
+) {
+  parameters.failoverLatency = latency;
+  return *this;
+}
+
+MQTTConnectionParametersBuilder
+&MQTTConnectionParametersBuilder::failbackProbes(
+  int probes
+) {
+  parameters.failbackProbes = probes;
+  return *this;
+}
+
+MQTTConnectionParametersBuilder
+&MQTTConnectionParametersBuilder::rateControl(
+  const RateControlOptions &options
+) {
+  parameters.rateControl = options;
+  parameters.rateControl.enabled = true;
+  return *this;
+}
+
+MQTTConnectionParametersBuilder
+&MQTTConnectionParametersBuilder::lastValueCache(
+  size_t topics,
+  size_t maxTopicSize,
+  size_t maxPayloadSize
+) {
+  parameters.lastValueCache = true;
+  parameters.lastValueCacheTopics = topics;
+  parameters.lastValueCacheMaxTopicSize = maxTopicSize;
+  parameters.lastValueCacheMaxPayloadSize = maxPayloadSize;
+  return *this;
+}
+
+MQTTConnectionParametersBuilder
+&MQTTConnectionParametersBuilder::capture(
+  const std::string &path,
+  size_t size
+) {
+  parameters.capturePath = path;
+  parameters.captureSize = size;
+  return *this;
+}
+
 MQTTConnectionParametersBuilder
 &MQTTConnectionParametersBuilder::will(
   const MQTTMessage &will
@@ -344,6 +928,17 @@ MQTTConnectionParametersBuilder
   return *this;
 }
 
+MQTTConnectionParametersBuilder
+&MQTTConnectionParametersBuilder::realtime(
+  size_t slots, size_t maxTopicSize, size_t maxPayloadSize
+) {
+  parameters.realtime = true;
+  parameters.realtimeQueueSlots = slots;
+  parameters.realtimeMaxTopicSize = maxTopicSize;
+  parameters.realtimeMaxPayloadSize = maxPayloadSize;
+  return *this;
+}
+
 MQTTConnectionParameters
 MQTTConnectionParametersBuilder::build() {
   return parameters;
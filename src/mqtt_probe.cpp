@@ -0,0 +1,159 @@
+#include "mqtt_probe.h"
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+using Clock = std::chrono::steady_clock;
+
+static int remainingMs(Clock::time_point deadline) {
+  auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+  return left > 0 ? (int)left : 0;
+}
+
+static bool waitFor(int fd, short events, Clock::time_point deadline) {
+  struct pollfd pfd = {fd, events, 0};
+  int ret;
+  do {
+    ret = poll(&pfd, 1, remainingMs(deadline));
+  } while (ret < 0 && errno == EINTR);
+  return ret > 0 && !(pfd.revents & (POLLERR | POLLNVAL));
+}
+
+// Non-blocking connect bounded by the deadline
+static int dial(const MQTTEndpoint &endpoint, Clock::time_point deadline) {
+  if (!endpoint.socketPath.empty()) {
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (endpoint.socketPath.size() >= sizeof(address.sun_path)) return -1;
+    memcpy(address.sun_path, endpoint.socketPath.c_str(), endpoint.socketPath.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+      close(fd);
+      return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+  }
+
+  struct addrinfo hints = {}, *addresses = nullptr;
+  hints.ai_socktype = SOCK_STREAM;
+  std::string port = std::to_string(endpoint.port);
+  if (getaddrinfo(endpoint.host.c_str(), port.c_str(), &hints, &addresses) != 0) return -1;
+  int fd = -1;
+  for (struct addrinfo *address = addresses; address && fd < 0; address = address->ai_next) {
+    fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address->ai_protocol);
+    if (fd < 0) continue;
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (connect(fd, address->ai_addr, address->ai_addrlen) != 0 &&
+        (errno != EINPROGRESS || !waitFor(fd, POLLOUT, deadline) ||
+         getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0)) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addresses);
+  return fd;
+}
+
+static bool writeAll(int fd, const std::string &data, Clock::time_point deadline) {
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t ret = send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+    if (ret > 0) {
+      written += ret;
+    } else if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+      if (!waitFor(fd, POLLOUT, deadline)) return false;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool readExact(int fd, uint8_t *buffer, size_t size, Clock::time_point deadline) {
+  size_t read = 0;
+  while (read < size) {
+    ssize_t ret = recv(fd, buffer + read, size - read, 0);
+    if (ret > 0) {
+      read += ret;
+    } else if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+      if (!waitFor(fd, POLLIN, deadline)) return false;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void appendString(std::string &packet, const std::string &value) {
+  packet.push_back((char)(value.size() >> 8));
+  packet.push_back((char)(value.size() & 0xff));
+  packet += value;
+}
+
+static std::string connectPacket(const MQTTConnectionParameters &parameters, std::chrono::milliseconds timeout) {
+  uint8_t flags = 0x02;  // clean session
+  std::string body;
+  appendString(body, "MQTT");
+  body.push_back(4);  // 3.1.1
+  bool credentials = !parameters.username.empty() && !parameters.password.empty();
+  if (credentials) flags |= 0x80 | 0x40;
+  body.push_back((char)flags);
+  // The broker drops the probe itself if we vanish
+  int keepalive = std::max<int>(1, (int)std::chrono::duration_cast<std::chrono::seconds>(timeout).count() + 1);
+  body.push_back((char)(keepalive >> 8));
+  body.push_back((char)(keepalive & 0xff));
+  appendString(body, "");
+  if (credentials) {
+    appendString(body, parameters.username);
+    appendString(body, parameters.password);
+  }
+
+  std::string packet(1, (char)0x10);
+  size_t length = body.size();
+  do {
+    uint8_t byte = length % 128;
+    length /= 128;
+    if (length > 0) byte |= 0x80;
+    packet.push_back((char)byte);
+  } while (length > 0);
+  return packet + body;
+}
+
+int64_t probeMQTTEndpoint(const MQTTEndpoint &endpoint, const MQTTConnectionParameters &parameters, bool tcpOnly,
+                          std::chrono::milliseconds timeout) {
+  Clock::time_point start = Clock::now();
+  Clock::time_point deadline = start + timeout;
+  int fd = dial(endpoint, deadline);
+  if (fd < 0) return -1;
+  if (tcpOnly) {
+    close(fd);
+    return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+  }
+
+  int64_t rtt = -1;
+  uint8_t reply[4];
+  static const std::string pingreq("\xc0\x00", 2);
+  static const std::string disconnect("\xe0\x00", 2);
+  if (writeAll(fd, connectPacket(parameters, timeout), deadline) && readExact(fd, reply, 4, deadline) &&
+      reply[0] == 0x20 && reply[1] == 0x02 && reply[3] == 0) {
+    Clock::time_point pinged = Clock::now();
+    if (writeAll(fd, pingreq, deadline) && readExact(fd, reply, 2, deadline) && reply[0] == 0xd0 && reply[1] == 0) {
+      rtt = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - pinged).count();
+      writeAll(fd, disconnect, deadline);
+    }
+  }
+  close(fd);
+  return rtt;
+}
@@ -1,101 +1,115 @@
 #include "paho_connection_manager.h"
 
-#include <atomic>
-#include <condition_variable>
 #include <memory>
-#include <mutex>
 #include <paho_mqtt_connection.hpp>
-#include <thread>
 #include <vector>
 
 namespace PAHOConnectionManager {
-std::vector<std::weak_ptr<PAHOMQTTConnection>> connections;
-std::unique_ptr<std::thread> connectionThread = NULL;
-std::mutex connectionMutex;
-std::condition_variable connectionCondition;
-std::atomic<bool> connectionThreadRunning = false;
-
-void removeNonValidConnections() {
-  std::erase_if(connections, [](const std::weak_ptr<PAHOMQTTConnection> &w) {
-    return w.expired();
-  });
+Manager::Manager(const SupervisorOptions &options)
+    : supervisor([this]() { return tick(); }) {
+  supervisor.setOptions(options);
 }
 
-static void connectionThreadFunction() {
-  connectionThreadRunning = true;
-  while (connectionThreadRunning.load()) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
-
-    std::unique_lock<std::mutex> lck(connectionMutex);
-    removeNonValidConnections();
-    for (auto &weak_conn : connections) {
-      if (auto connection = weak_conn.lock()) {
-        if (connection->getStatus() == PAHOMQTTConnectionStatus::CONNECTED ||
-            connection->getStatus() == PAHOMQTTConnectionStatus::CONNECTING) {
-          continue;
-        }
-        connection->connect();
-      }
+Manager::~Manager() { stop(); }
+
+void Manager::setOptions(const SupervisorOptions &options) { supervisor.setOptions(options); }
+
+const SupervisorOptions &Manager::getOptions() const { return supervisor.getOptions(); }
+
+size_t Manager::tick() {
+  size_t reconnecting = 0;
+  auto snapshot = connections.snapshot();
+  for (auto &[id, weak_conn] : *snapshot) {
+    auto connection = weak_conn.lock();
+    if (!connection) {
+      expired.push_back(id);
+      continue;
+    }
+    connection->flushErrors();
+    if (connection->getStatus() == PAHOMQTTConnectionStatus::CONNECTED ||
+        connection->getStatus() == PAHOMQTTConnectionStatus::CONNECTING) {
+      continue;
     }
+    connection->connect();
+    reconnecting++;
   }
-}
 
-void start() {
-  if (connectionThreadRunning)
-    return;
-  connectionThread = std::make_unique<std::thread>(connectionThreadFunction);
+  // Only connections that actually went away cost a registry write
+  for (int id : expired) connections.remove(id);
+  expired.clear();
+  return reconnecting;
 }
 
-void stop() {
-  if (!connectionThreadRunning)
-    return;
-  connectionThreadRunning = false;
-  if (connectionThread != NULL && connectionThread->joinable())
-    connectionThread->join();
+void Manager::start() { supervisor.start(); }
+
+void Manager::stop() { supervisor.stop(); }
+
+bool Manager::addConnection(std::shared_ptr<PAHOMQTTConnection> connection) {
+  auto registered = connections.find(connection->getID());
+  if (registered && registered->expired()) connections.remove(connection->getID());
+  return connections.add(connection->getID(), connection);
 }
 
-bool addConnection(std::shared_ptr<PAHOMQTTConnection> connection) {
-  std::unique_lock<std::mutex> lck(connectionMutex);
-  for (const auto &weak_conn : connections) {
-    if (auto conn = weak_conn.lock()) {
-      if (conn == connection) {
-        return false;
-      }
-    }
-  }
-  connections.push_back(connection);
+bool Manager::removeConnection(std::shared_ptr<PAHOMQTTConnection> connection) {
+  auto registered = connections.find(connection->getID());
+  if (!registered || registered->lock() != connection) return false;
+  if (!connections.remove(connection->getID())) return false;
+  // A tick still iterating the previous snapshot would wait for itself
+  if (!supervisor.isCurrentThread()) connections.synchronize();
   return true;
 }
 
-bool removeConnection(std::shared_ptr<PAHOMQTTConnection> connection) {
-  std::unique_lock<std::mutex> lck(connectionMutex);
-  for (auto it = connections.begin(); it != connections.end(); ++it) {
-    if (auto conn = it->lock()) {
-      if (conn == connection) {
-        connections.erase(it);
-        return true;
-      }
+void Manager::connect_all() {
+  auto snapshot = connections.snapshot();
+  for (auto &[id, weak_conn] : *snapshot) {
+    if (auto connection = weak_conn.lock()) {
+      connection->connect();
     }
   }
-  return false;
 }
 
-void connect_all() {
-  std::unique_lock<std::mutex> lck(connectionMutex);
-  removeNonValidConnections();
-  for (auto &weak_conn : connections) {
+void Manager::disconnect_all() {
+  auto snapshot = connections.snapshot();
+  for (auto &[id, weak_conn] : *snapshot) {
     if (auto connection = weak_conn.lock()) {
-      connection->connect();
+      connection->disconnect();
     }
   }
 }
 
-void disconnect_all() {
-  std::unique_lock<std::mutex> lck(connectionMutex);
-  for (auto &weak_conn : connections) {
+size_t Manager::sendAll(const SharedMessage &message) {
+  size_t sent = 0;
+  auto snapshot = connections.snapshot();
+  for (auto &[id, weak_conn] : *snapshot) {
     if (auto connection = weak_conn.lock()) {
-      connection->disconnect();
+      if (connection->sendShared(message)) {
+        sent++;
+      }
     }
   }
+  return sent;
+}
+
+Manager &defaultManager() {
+  static Manager manager;
+  return manager;
+}
+
+void start() { defaultManager().start(); }
+
+void stop() { defaultManager().stop(); }
+
+bool addConnection(std::shared_ptr<PAHOMQTTConnection> connection) {
+  return defaultManager().addConnection(connection);
+}
+
+bool removeConnection(std::shared_ptr<PAHOMQTTConnection> connection) {
+  return defaultManager().removeConnection(connection);
 }
+
+void connect_all() { defaultManager().connect_all(); }
+
+void disconnect_all() { defaultManager().disconnect_all(); }
+
+size_t sendAll(const SharedMessage &message) { return defaultManager().sendAll(message); }
 } // namespace PAHOConnectionManager
@@ -0,0 +1,150 @@
+#include "paho_consumer_group.h"
+
+#include "logger.h"
+
+PAHOConsumerGroup::PAHOConsumerGroup(const PAHOMQTTConnectionParameters &parameters,
+                                     const PAHOConsumerGroupOptions &options)
+    : options(options), lastMetrics(std::chrono::steady_clock::now()) {
+  size_t count = options.members > 0 ? options.members : 1;
+  for (size_t i = 0; i < count; i++) {
+    auto member = std::make_unique<Member>();
+    member->group = this;
+    member->index = i;
+    PAHOMQTTConnectionParameters memberParameters = parameters;
+    // The broker would drop a member whose client id another one reuses
+    if (!parameters.clientId.empty()) memberParameters.clientId = parameters.clientId + "-" + std::to_string(i);
+    member->connection = std::make_shared<PAHOMQTTConnection>(memberParameters);
+    members.push_back(std::move(member));
+  }
+}
+
+PAHOConsumerGroup::~PAHOConsumerGroup() { stop(); }
+
+void PAHOConsumerGroup::setOnMessageCallback(on_group_message_callback callback, void *userData) {
+  onMessageCallback = callback;
+  this->userData = userData;
+}
+
+void PAHOConsumerGroup::start() {
+  if (started) return;
+  started = true;
+  for (auto &member : members) {
+    {
+      std::unique_lock<std::mutex> lck(member->mutex);
+      member->running = true;
+    }
+    member->thread = std::thread(&PAHOConsumerGroup::dispatch, this, std::ref(*member));
+    member->connection->setUserData(member.get());
+    member->connection->setOnMessageCallback(onMessage);
+  }
+  std::vector<std::string> shared;
+  for (const std::string &filter : options.filters) shared.push_back("$share/" + options.group + "/" + filter);
+  for (auto &member : members) {
+    // Remembered by the connection, sent once connected and after every
+    // reconnect
+    member->connection->subscribeMany(shared, options.qos);
+    member->connection->connect();
+  }
+  LOG_INFO("PAHOConsumerGroup {}: {} members on {} filters", options.group, members.size(), shared.size());
+}
+
+void PAHOConsumerGroup::stop() {
+  if (!started) return;
+  started = false;
+  // Not reconnected behind our back, and a connection someone still holds
+  // through getConnection() no longer calls into the group
+  if (manager)
+    for (auto &member : members) manager->removeConnection(member->connection);
+  manager = nullptr;
+  // Both wait for a message being delivered, no Member is used after
+  for (auto &member : members) {
+    member->connection->setOnMessageCallback(nullptr);
+    member->connection->setUserData(nullptr);
+    member->connection->disconnect();
+  }
+  for (auto &member : members) {
+    {
+      std::unique_lock<std::mutex> lck(member->mutex);
+      member->running = false;
+    }
+    member->condition.notify_one();
+    if (member->thread.joinable()) member->thread.join();
+  }
+}
+
+void PAHOConsumerGroup::supervise(PAHOConnectionManager::Manager &manager) {
+  this->manager = &manager;
+  for (auto &member : members) manager.addConnection(member->connection);
+}
+
+std::shared_ptr<PAHOMQTTConnection> PAHOConsumerGroup::getConnection(size_t member) const {
+  if (member >= members.size()) return nullptr;
+  return members[member]->connection;
+}
+
+size_t PAHOConsumerGroup::getConnectedCount() const {
+  size_t connected = 0;
+  for (auto &member : members)
+    if (member->connection->getStatus() == PAHOMQTTConnectionStatus::CONNECTED) connected++;
+  return connected;
+}
+
+PAHOConsumerGroupMetrics PAHOConsumerGroup::getMetrics() {
+  std::unique_lock<std::mutex> lck(metricsMutex);
+  auto now = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(now - lastMetrics).count();
+  lastMetrics = now;
+
+  PAHOConsumerGroupMetrics metrics = {0, 0, 0, 0, {}, {}};
+  for (auto &member : members) {
+    uint64_t dispatched = member->dispatched.load(std::memory_order_relaxed);
+    double rate = seconds > 0 ? (dispatched - member->lastDispatched) / seconds : 0;
+    member->lastDispatched = dispatched;
+    metrics.received += member->received.load(std::memory_order_relaxed);
+    metrics.dispatched += dispatched;
+    metrics.dropped += member->dropped.load(std::memory_order_relaxed);
+    metrics.rate += rate;
+    metrics.memberRates.push_back(rate);
+    metrics.memberDispatched.push_back(dispatched);
+  }
+  return metrics;
+}
+
+void PAHOConsumerGroup::onMessage(PAHOMQTTConnection *connection, void *userData, const PAHOMQTTMessage &message) {
+  Member *member = static_cast<Member *>(userData);
+  if (!member) return;
+  member->received.fetch_add(1, std::memory_order_relaxed);
+  bool wake;
+  {
+    std::unique_lock<std::mutex> lck(member->mutex);
+    if (member->queue.size() >= member->group->options.queueCapacity) {
+      member->dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    // Only an idle dispatch thread needs the notification
+    wake = member->queue.empty();
+    member->queue.push_back(message);
+  }
+  if (wake) member->condition.notify_one();
+}
+
+void PAHOConsumerGroup::dispatch(Member &member) {
+  if (!options.cpus.empty())
+    applyThreadPlacement({options.cpus[member.index % options.cpus.size()]}, options.schedulingPolicy,
+                         options.priority);
+  // Drained a batch at a time, Paho's thread only waits for the swap
+  std::deque<PAHOMQTTMessage> batch;
+  std::unique_lock<std::mutex> lck(member.mutex);
+  while (true) {
+    member.condition.wait(lck, [&]() { return !member.running || !member.queue.empty(); });
+    if (member.queue.empty()) break;
+    batch.swap(member.queue);
+    lck.unlock();
+    for (const PAHOMQTTMessage &message : batch) {
+      if (onMessageCallback) onMessageCallback(userData, member.index, message);
+      member.dispatched.fetch_add(1, std::memory_order_relaxed);
+    }
+    batch.clear();
+    lck.lock();
+  }
+}
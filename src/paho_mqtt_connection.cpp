@@ -1,34 +1,35 @@
 #include "paho_mqtt_connection.hpp"
 
 #include <assert.h>
+#include <cstring>
 
+#include <cstdint>
+#include <cstdio>
 #include <functional>
-#include <sstream>
 
+#include "logger.h"
 #include "mqtt/async_client.h"
 #include "mqtt/token.h"
 
 int PAHOMQTTConnection::instanceCounter = 0;
 
+// Made once per connection, the client keeps its id across reconnects
 std::string generateID(int instanceCounter) {
   auto now = std::chrono::system_clock::now();
   auto now_ms = std::chrono::time_point_cast<std::chrono::milliseconds>(now);
-  auto epoch = now_ms.time_since_epoch();
-  long long timestamp = epoch.count();
+  long long timestamp = now_ms.time_since_epoch().count();
 
-  std::stringstream ss;
-  ss << timestamp << instanceCounter;
-  std::string input = ss.str();
+  char input[48];
+  int length = snprintf(input, sizeof(input), "%lld%d", timestamp, instanceCounter);
 
   unsigned long hash = 5381;
-  for (char c : input) {
-    hash = ((hash << 5) + hash) + c;  // hash * 33 + c
+  for (int i = 0; i < length; i++) {
+    hash = ((hash << 5) + hash) + input[i];  // hash * 33 + c
   }
 
-  std::stringstream hashString;
-  hashString << std::hex << hash;
-
-  return hashString.str().substr(0, 30);
+  char hashString[32];
+  snprintf(hashString, sizeof(hashString), "%lx", hash);
+  return hashString;
 }
 
 PAHOMQTTMessage::PAHOMQTTMessage() : PAHOMQTTMessage("", "", 0, false) {};
@@ -53,78 +54,201 @@ PAHOMQTTConnectionParameters PAHOMQTTConnectionParameters::get_localhost_default
   return PAHOMQTTConnectionParameters();
 };
 
+// Paho takes tcp://, ssl://, ws://, wss:// and unix:// (a broker socket on
+// the same host, unix:///path). mqtt:// and mqtts:// are mapped onto tcp://
+// and ssl://, and tls upgrades tcp:// and ws:// to their TLS schemes.
+static std::string normalizeUri(const std::string &uri, bool tls) {
+  static const std::pair<const char *, const char *> aliases[] = {{"mqtt://", "tcp://"}, {"mqtts://", "ssl://"}};
+  std::string result = uri;
+  for (auto &[from, to] : aliases) {
+    if (result.find(from) == 0) result.replace(0, strlen(from), to);
+  }
+  if (tls && result.find("tcp://") == 0) result.replace(0, 6, "ssl://");
+  if (tls && result.find("ws://") == 0) result.replace(0, 5, "wss://");
+  if (tls && result.find("unix://") == 0) {
+    LOG_WARNING("TLS is not used over a unix socket: {}", result);
+  }
+  return result;
+}
+
+// Paho has no constant for TLS 1.3, which it negotiates when both ends
+// support it
+static int sslVersion(const std::string &version) {
+  if (version == "tlsv1") return MQTT_SSL_VERSION_TLS_1_0;
+  if (version == "tlsv1.1") return MQTT_SSL_VERSION_TLS_1_1;
+  if (version == "tlsv1.2") return MQTT_SSL_VERSION_TLS_1_2;
+  if (!version.empty()) {
+    LOG_WARNING("TLS version {} cannot be required with Paho, using tlsv1.2 as the minimum", version);
+    return MQTT_SSL_VERSION_TLS_1_2;
+  }
+  return MQTT_SSL_VERSION_DEFAULT;
+}
+
+// One slot is kept free: Paho refuses the publish that fills its buffer
+static size_t pendingLimitOf(size_t maxPendingMessages) {
+  return maxPendingMessages > 0 ? maxPendingMessages - 1 : SIZE_MAX;
+}
+
 PAHOMQTTConnection::PAHOMQTTConnection() : PAHOMQTTConnection(PAHOMQTTConnectionParameters::get_localhost_default()) {};
-PAHOMQTTConnection::PAHOMQTTConnection(const PAHOMQTTConnectionParameters &parameters) : mqttParameters(parameters) {
+PAHOMQTTConnection::PAHOMQTTConnection(const PAHOMQTTConnectionParameters &parameters)
+    : mqttParameters(parameters),
+      userData(nullptr),
+      onMessageCallback(nullptr),
+      onConnectCallback(nullptr),
+      onDisconnectCallback(nullptr),
+      onErrorCallback(nullptr),
+      onPublishCallback(nullptr) {
   instanceCounter++;
   id = instanceCounter;
+  generatedClientId = generateID(id);
   status.store(PAHOMQTTConnectionStatus::DISCONNECTED);
+  pendingLimit.store(pendingLimitOf(mqttParameters.maxPendingMessages));
+  setupRealtime();
 };
-PAHOMQTTConnection::~PAHOMQTTConnection() {};
+PAHOMQTTConnection::~PAHOMQTTConnection() { realtimePublisher = nullptr; };
 
 int PAHOMQTTConnection::getID() const { return id; }
 
 void PAHOMQTTConnection::setConnectionParameters(const PAHOMQTTConnectionParameters &parameters) {
+  // Only what the client is created with needs a new one, the rest is in
+  // the connect options
+  if (parameters.uri != mqttParameters.uri || parameters.tls != mqttParameters.tls ||
+      parameters.clientId != mqttParameters.clientId || parameters.persistDir != mqttParameters.persistDir ||
+      parameters.persistentSession != mqttParameters.persistentSession ||
+      parameters.maxPendingMessages != mqttParameters.maxPendingMessages) {
+    clientStale = true;
+  }
+  optionsStale = true;
   mqttParameters = parameters;
+  pendingLimit.store(pendingLimitOf(mqttParameters.maxPendingMessages));
+  setupRealtime();
 };
-const PAHOMQTTConnectionParameters &PAHOMQTTConnection::getMQTTConnectionParameters() const { return mqttParameters; };
 
-void PAHOMQTTConnection::connect() {
-  if (status == PAHOMQTTConnectionStatus::CONNECTING) {
+void PAHOMQTTConnection::setupRealtime() {
+  if (!mqttParameters.realtime) {
+    realtimePublisher = nullptr;
     return;
-  } else if (status == PAHOMQTTConnectionStatus::CONNECTED) {
+  }
+  if (realtimePublisher && realtimePublisher->getCapacity() == mqttParameters.realtimeQueueSlots &&
+      realtimePublisher->getMaxTopicSize() == mqttParameters.realtimeMaxTopicSize &&
+      realtimePublisher->getMaxPayloadSize() == mqttParameters.realtimeMaxPayloadSize) {
     return;
   }
-  status = PAHOMQTTConnectionStatus::CONNECTING;
+  realtimePublisher = nullptr;
+  realtimePublisher = std::make_unique<RealtimePublisher>(
+      mqttParameters.realtimeQueueSlots, mqttParameters.realtimeMaxTopicSize, mqttParameters.realtimeMaxPayloadSize,
+      PAHOMQTTConnection::publishRealtime, this);
+}
+const PAHOMQTTConnectionParameters &PAHOMQTTConnection::getMQTTConnectionParameters() const { return mqttParameters; };
 
+void PAHOMQTTConnection::setupClient() {
   mqtt::create_options createOpts = mqtt::create_options(MQTTVERSION_5);
   createOpts.set_max_buffered_messages(mqttParameters.maxPendingMessages);
   createOpts.set_send_while_disconnected(false);
 
-  std::string safeUri = mqttParameters.uri;
-  if (safeUri.find("mqtts://") == 0) {
-    safeUri.replace(0, 8, "ssl://");
-    std::cout << "Auto-corrected URI to: " << safeUri << std::endl;
+  clientUri = normalizeUri(mqttParameters.uri, mqttParameters.tls);
+  if (clientUri != mqttParameters.uri) {
+    LOG_INFO("Auto-corrected URI to: {}", clientUri);
   }
 
-  cli = std::make_shared<mqtt::async_client>(safeUri, generateID(id), createOpts);
-  mqtt::connect_options connOpts;
+  // The same client is used for every reconnect, so with a persistent
+  // session the messages Paho holds in flight are retransmitted on the new
+  // connection
+  std::string clientId = mqttParameters.clientId.empty() ? generatedClientId : mqttParameters.clientId;
+  std::shared_ptr<mqtt::async_client> client;
+  if (mqttParameters.persistentSession && !mqttParameters.persistDir.empty()) {
+    client = std::make_shared<mqtt::async_client>(clientUri, clientId, createOpts, mqttParameters.persistDir);
+  } else {
+    client = std::make_shared<mqtt::async_client>(clientUri, clientId, createOpts);
+  }
+  {
+    // The previous client lives on while the publisher thread holds it
+    std::unique_lock<std::shared_mutex> lck(clientMutex);
+    cli.swap(client);
+  }
+  cli->set_callback(*this);
+  cli->set_disconnected_handler(
+      std::bind(&PAHOMQTTConnection::on_disconnect, this, std::placeholders::_1, std::placeholders::_2));
+  clientStale = false;
+  optionsStale = true;
+}
 
-  connOpts.set_mqtt_version(MQTTVERSION_5);
+void PAHOMQTTConnection::buildConnectOptions() {
+  connectOptions = mqtt::connect_options();
+  connectOptions.set_mqtt_version(MQTTVERSION_5);
 
-  connOpts.set_clean_session(true);
-  connOpts.set_keep_alive_interval(60);
-  connOpts.set_automatic_reconnect(false);
-  connOpts.set_max_inflight(mqttParameters.maxPendingMessages);
+  if (mqttParameters.persistentSession) {
+    if (mqttParameters.clientId.empty()) {
+      LOG_WARNING("PAHOMQTTConnection {}: persistent session without a client id, it ends with the process", id);
+    }
+    connectOptions.set_clean_start(false);
+    connectOptions.set_properties(
+        {mqtt::property(mqtt::property::SESSION_EXPIRY_INTERVAL, (int32_t)mqttParameters.sessionExpiry.count())});
+  } else {
+    connectOptions.set_clean_session(true);
+  }
+  connectOptions.set_keep_alive_interval(60);
+  connectOptions.set_automatic_reconnect(false);
+  connectOptions.set_max_inflight(mqttParameters.maxPendingMessages);
 
   if (!mqttParameters.username.empty()) {
-    connOpts.set_user_name(mqttParameters.username);
+    connectOptions.set_user_name(mqttParameters.username);
   }
   if (!mqttParameters.password.empty()) {
-    connOpts.set_password(mqttParameters.password);
+    connectOptions.set_password(mqttParameters.password);
   }
   if (!will.topic.empty()) {
-    connOpts.set_will_message((mqtt::message_ptr)will);
+    connectOptions.set_will_message((mqtt::message_ptr)will);
   }
-  if (mqttParameters.tls) {
+  if (clientUri.find("ssl://") == 0 || clientUri.find("wss://") == 0) {
     mqtt::ssl_options sslOpts;
     sslOpts.set_trust_store(mqttParameters.cafile);
-    // sslOpts.set_key_store(mqttParameters.certfile);
-    // sslOpts.set_private_key(mqttParameters.keyfile);
-    connOpts.set_ssl(sslOpts);
+    if (!mqttParameters.capath.empty()) {
+      sslOpts.set_ca_path(mqttParameters.capath);
+    }
+    if (!mqttParameters.certfile.empty()) {
+      sslOpts.set_key_store(mqttParameters.certfile);
+    }
+    if (!mqttParameters.keyfile.empty()) {
+      sslOpts.set_private_key(mqttParameters.keyfile);
+    }
+    if (!mqttParameters.keyPassword.empty()) {
+      sslOpts.set_private_key_password(mqttParameters.keyPassword);
+    }
+    if (!mqttParameters.ciphers.empty()) {
+      sslOpts.set_enabled_cipher_suites(mqttParameters.ciphers);
+    }
+    sslOpts.set_ssl_version(sslVersion(mqttParameters.tlsVersion));
+    sslOpts.set_error_handler([id = id](const std::string &message) {
+      LOG_ERROR("PAHOMQTTConnection {}: TLS error: {}", id, message);
+    });
+    connectOptions.set_ssl(sslOpts);
   }
+  optionsStale = false;
+}
 
-  cli->set_callback(*this);
-  cli->set_disconnected_handler(
-      std::bind(&PAHOMQTTConnection::on_disconnect, this, std::placeholders::_1, std::placeholders::_2));
+void PAHOMQTTConnection::connect() {
+  if (status == PAHOMQTTConnectionStatus::CONNECTING) {
+    return;
+  } else if (status == PAHOMQTTConnectionStatus::CONNECTED) {
+    return;
+  }
+  status = PAHOMQTTConnectionStatus::CONNECTING;
+
+  if (cli == nullptr || clientStale) {
+    setupClient();
+  }
+  if (optionsStale) {
+    buildConnectOptions();
+  }
   try {
-    // std::cout << "Sending MQTT Connect request to EMQX..." << std::endl;
-    cli->connect(connOpts, nullptr, *this);
+    cli->connect(connectOptions, nullptr, *this);
 
   } catch (const mqtt::exception &exc) {
-    std::cerr << "\nMQTT CONNECTION REJECTED" << std::endl;
-    std::cerr << "Reason Code: " << exc.get_reason_code() << std::endl;
-    std::cerr << "Message: " << exc.get_message() << std::endl;
-    std::cerr << "What: " << exc.what() << std::endl;
+    LOG_ERROR("MQTT CONNECTION REJECTED, reason code: {}, message: {}, what: {}", exc.get_reason_code(),
+              exc.get_message(), exc.what());
+    status = PAHOMQTTConnectionStatus::DISCONNECTED;
+    reportError(CONNECTION_ERROR_CONNECT, exc.get_reason_code());
   }
 };
 
@@ -135,78 +259,317 @@ void PAHOMQTTConnection::disconnect() {
     try {
       cli->disconnect();
     } catch (std::exception &e) {
-      printf("MQTT: got exception in disconnect: %s\n", e.what());
+      LOG_ERROR("MQTT: got exception in disconnect: {}", e.what());
+      reportError(CONNECTION_ERROR_DISCONNECT, 0);
     }
   }
   status = PAHOMQTTConnectionStatus::DISCONNECTED;
-  cli = nullptr;
 };
 
-bool PAHOMQTTConnection::send(const PAHOMQTTMessage &message) {
+bool PAHOMQTTConnection::send(const PAHOMQTTMessage &message, int *messageId) {
   if (cli == nullptr) {
     return false;
   }
   if (!cli->is_connected()) {
     return false;
   }
-  if (cli->get_pending_delivery_tokens().size() >= mqttParameters.maxPendingMessages - 1) {
+  if (cli->get_pending_delivery_tokens().size() >= pendingLimit.load()) {
     return false;
   }
   try {
-    cli->publish((mqtt::message_ptr)message);
+    mqtt::delivery_token_ptr token = cli->publish((mqtt::message_ptr)message);
+    if (messageId) *messageId = token ? token->get_message_id() : 0;
   } catch (const std::exception &e) {
-    printf("MQTT: got exception in send: %s\n", e.what());
+    LOG_ERROR("MQTT: got exception in send: {}", e.what());
+    reportError(CONNECTION_ERROR_PUBLISH, 0);
     return false;
   }
   return true;
 };
 
-void PAHOMQTTConnection::setWillMessage(const PAHOMQTTMessage &message) { will = message; };
-void PAHOMQTTConnection::disableWillMessage() { will = PAHOMQTTMessage(); };
+bool PAHOMQTTConnection::sendShared(const SharedMessage &message) {
+  if (cli == nullptr) {
+    return false;
+  }
+  if (!cli->is_connected()) {
+    return false;
+  }
+  if (cli->get_pending_delivery_tokens().size() >= pendingLimit.load()) {
+    return false;
+  }
+  try {
+    cli->publish(mqtt::message::create(mqtt::string_ref(message.topic.getBuffer()),
+                                       mqtt::binary_ref(message.payload.getBuffer()), message.qos, message.retain));
+  } catch (const std::exception &e) {
+    LOG_ERROR("MQTT: got exception in send: {}", e.what());
+    reportError(CONNECTION_ERROR_PUBLISH, 0);
+    return false;
+  }
+  return true;
+}
+
+bool PAHOMQTTConnection::sendRealtime(std::string_view topic, const void *payload, size_t size, int qos, bool retain) {
+  if (!realtimePublisher) {
+    return false;
+  }
+  return realtimePublisher->push(topic, payload, size, qos, retain);
+}
+
+bool PAHOMQTTConnection::publishRealtime(void *obj, const char *topic, const void *payload, size_t size, int qos,
+                                         bool retain) {
+  PAHOMQTTConnection *connection = (PAHOMQTTConnection *)obj;
+  std::shared_ptr<mqtt::async_client> cli;
+  {
+    // Runs on the publisher thread, setupClient() may replace the client
+    std::shared_lock<std::shared_mutex> lck(connection->clientMutex);
+    cli = connection->cli;
+  }
+  if (cli == nullptr || connection->status != PAHOMQTTConnectionStatus::CONNECTED || !cli->is_connected()) {
+    return false;
+  }
+  if (cli->get_pending_delivery_tokens().size() >= connection->pendingLimit.load()) {
+    return false;
+  }
+  try {
+    cli->publish(topic, payload, size, qos, retain);
+  } catch (const std::exception &e) {
+    LOG_ERROR("MQTT: got exception in realtime send: {}", e.what());
+    connection->reportError(CONNECTION_ERROR_PUBLISH, 0);
+  }
+  return true;
+}
+
+void PAHOMQTTConnection::setWillMessage(const PAHOMQTTMessage &message) {
+  will = message;
+  optionsStale = true;
+};
+void PAHOMQTTConnection::disableWillMessage() {
+  will = PAHOMQTTMessage();
+  optionsStale = true;
+};
 
 void PAHOMQTTConnection::subscribe(const std::string &topic, int qos) {
+  {
+    std::unique_lock<std::mutex> lck(subscriptionsMutex);
+    subscriptions[topic] = qos;
+  }
   if (cli == nullptr || status != PAHOMQTTConnectionStatus::CONNECTED) {
     return;
   }
   try {
     cli->subscribe(topic, qos);
   } catch (const std::exception &e) {
-    printf("PAHOMQTTConnection: got exception in subscribe: %s\n", e.what());
+    LOG_ERROR("PAHOMQTTConnection: got exception in subscribe: {}", e.what());
+    reportError(CONNECTION_ERROR_SUBSCRIBE, 0);
   }
 }
 
 void PAHOMQTTConnection::unsubscribe(const std::string &topic) {
+  {
+    std::unique_lock<std::mutex> lck(subscriptionsMutex);
+    subscriptions.erase(topic);
+  }
   if (cli == nullptr || status != PAHOMQTTConnectionStatus::CONNECTED) {
     return;
   }
   try {
     cli->unsubscribe(topic);
   } catch (const std::exception &e) {
-    printf("PAHOMQTTConnection: got exception in unsubscribe: %s\n", e.what());
+    LOG_ERROR("PAHOMQTTConnection: got exception in unsubscribe: {}", e.what());
+    reportError(CONNECTION_ERROR_UNSUBSCRIBE, 0);
+  }
+}
+
+void PAHOMQTTConnection::resubscribe() {
+  std::vector<std::string> topics;
+  mqtt::qos_collection qos;
+  {
+    std::unique_lock<std::mutex> lck(subscriptionsMutex);
+    for (auto &[topic, topicQos] : subscriptions) {
+      topics.push_back(topic);
+      qos.push_back(topicQos);
+    }
+  }
+  sendBatch(topics, qos, nullptr, true);
+}
+
+int PAHOMQTTConnection::subscribeMany(const std::vector<std::string> &topics, int qos, on_batch_callback callback) {
+  {
+    std::unique_lock<std::mutex> lck(subscriptionsMutex);
+    for (const std::string &topic : topics) {
+      subscriptions[topic] = qos;
+    }
+  }
+  return sendBatch(topics, mqtt::qos_collection(topics.size(), qos), callback, true);
+}
+
+int PAHOMQTTConnection::unsubscribeMany(const std::vector<std::string> &topics, on_batch_callback callback) {
+  {
+    std::unique_lock<std::mutex> lck(subscriptionsMutex);
+    for (const std::string &topic : topics) {
+      subscriptions.erase(topic);
+    }
+  }
+  return sendBatch(topics, mqtt::qos_collection(), callback, false);
+}
+
+int PAHOMQTTConnection::sendBatch(const std::vector<std::string> &topics, const mqtt::qos_collection &qos,
+                                  on_batch_callback callback, bool subscribe) {
+  auto client = cli;
+  if (client == nullptr || status != PAHOMQTTConnectionStatus::CONNECTED || topics.empty()) {
+    return -1;
+  }
+  std::vector<size_t> ends = chunkTopicFilters(topics, mqttParameters.maxSubscribePacketSize, subscribe);
+
+  // Tokens complete through on_success/on_failure, which wait for the lock
+  // until every packet is registered. The token context is our packet id.
+  std::unique_lock<std::mutex> lck(batchMutex);
+  int batchId = batches.open(callback);
+  size_t begin = 0, sent = 0;
+  for (size_t end : ends) {
+    auto chunk = std::make_shared<mqtt::string_collection>();
+    for (size_t i = begin; i < end; i++) {
+      chunk->push_back(topics[i]);
+    }
+    int packetId = nextPacketId++;
+    void *context = (void *)(intptr_t)packetId;
+    try {
+      if (subscribe) {
+        client->subscribe(chunk, mqtt::qos_collection(qos.begin() + begin, qos.begin() + end), context, *this);
+      } else {
+        client->unsubscribe(chunk, context, *this);
+      }
+    } catch (const std::exception &e) {
+      LOG_ERROR("PAHOMQTTConnection: got exception in {}: {}", subscribe ? "subscribeMany" : "unsubscribeMany",
+                e.what());
+      reportError(subscribe ? CONNECTION_ERROR_SUBSCRIBE : CONNECTION_ERROR_UNSUBSCRIBE, 0);
+      break;
+    }
+    batches.addPacket(batchId, packetId, end - begin);
+    sent++;
+    begin = end;
+  }
+  if (sent == 0) {
+    batches.discard(batchId);
+    return -1;
   }
+  LOG_DEBUG("PAHOMQTTConnection {}: {} filters in {} packets", id, begin, sent);
+  return batchId;
 }
 
-void PAHOMQTTConnection::setUserData(void *userData) { this->userData = userData; }
+void PAHOMQTTConnection::completeBatch(const mqtt::token &tok, bool success) {
+  size_t refused = SIZE_MAX;
+  if (success) {
+    // 0x80 and up are failure reason codes
+    refused = 0;
+    for (mqtt::ReasonCode code : tok.get_reason_codes()) {
+      if (code >= 0x80) {
+        refused++;
+      }
+    }
+  }
+  SubscriptionBatches<on_batch_callback>::Result result;
+  {
+    std::unique_lock<std::mutex> lck(batchMutex);
+    if (!batches.acknowledge((int)(intptr_t)tok.get_user_context(), refused, result)) {
+      return;
+    }
+  }
+  if (result.callback) {
+    result.callback(this, userData, result.batchId, result.count, result.refused);
+  }
+}
+
+void PAHOMQTTConnection::drainBatches() {
+  std::vector<SubscriptionBatches<on_batch_callback>::Result> lost;
+  {
+    std::unique_lock<std::mutex> lck(batchMutex);
+    lost = batches.drain();
+  }
+  for (auto &result : lost) {
+    if (result.callback) {
+      result.callback(this, userData, result.batchId, result.count, result.refused);
+    }
+  }
+}
+
+// The connection whose message callback this thread is running, so a setter
+// called from the callback does not wait for itself
+static thread_local const PAHOMQTTConnection *dispatchingConnection = nullptr;
+
+void PAHOMQTTConnection::waitForDispatch() {
+  if (dispatchingConnection == this) return;
+  // A call that counted itself after the store reads the new values, one
+  // that counted itself before is waited for
+  int count;
+  while ((count = dispatching.load()) != 0) dispatching.wait(count);
+}
+
+void PAHOMQTTConnection::setUserData(void *userData) {
+  this->userData.store(userData);
+  waitForDispatch();
+}
+void PAHOMQTTConnection::setOnMessageCallback(on_message_callback callback) {
+  onMessageCallback.store(callback);
+  waitForDispatch();
+}
 void PAHOMQTTConnection::setOnConnectCallback(on_connect_callback callback) { onConnectCallback = callback; }
 void PAHOMQTTConnection::setOnDisconnectCallback(on_disconnect_callback callback) { onDisconnectCallback = callback; }
-void PAHOMQTTConnection::setOnMessageCallback(on_message_callback callback) { onMessageCallback = callback; }
 void PAHOMQTTConnection::setOnErrorCallback(on_error_callback callback) { onErrorCallback = callback; }
+void PAHOMQTTConnection::setOnPublishCallback(on_publish_callback callback) { onPublishCallback = callback; }
+void PAHOMQTTConnection::setErrorRateLimit(std::chrono::milliseconds interval) { errorLimiter.setInterval(interval); }
+
+void PAHOMQTTConnection::reportError(ConnectionErrorCode code, int backendCode) {
+  if (!onErrorCallback) return;
+  ConnectionError error = {code, backendCode, connectionErrorString(code), nullptr, id, 1};
+  if (!errorLimiter.admit(error)) return;
+  onErrorCallback(this, userData, error);
+}
+
+void PAHOMQTTConnection::flushErrors() {
+  if (!onErrorCallback) return;
+  ConnectionError errors[CONNECTION_ERROR_COUNT];
+  size_t count = errorLimiter.flush(errors, CONNECTION_ERROR_COUNT, id);
+  for (size_t i = 0; i < count; i++) onErrorCallback(this, userData, errors[i]);
+}
 
 PAHOMQTTConnectionStatus PAHOMQTTConnection::getStatus() const { return status.load(); };
-void PAHOMQTTConnection::on_failure(const mqtt::token &tok) {
-  std::cerr << "\nASYNC CONNECTION REJECTED" << std::endl;
 
+size_t PAHOMQTTConnection::getPendingCount() const {
+  if (cli == nullptr) return 0;
+  return cli->get_pending_delivery_tokens().size();
+}
+void PAHOMQTTConnection::on_failure(const mqtt::token &tok) {
+  if (tok.get_type() == mqtt::token::SUBSCRIBE || tok.get_type() == mqtt::token::UNSUBSCRIBE) {
+    reportError(tok.get_type() == mqtt::token::SUBSCRIBE ? CONNECTION_ERROR_SUBSCRIBE : CONNECTION_ERROR_UNSUBSCRIBE,
+                tok.get_return_code());
+    completeBatch(tok, false);
+    return;
+  }
   // The token contains the exact reason the broker dropped you
-  std::cerr << "Return Code: " << tok.get_return_code() << std::endl;
-
   if (tok.get_reason_code() != 0) {
-    std::cerr << "MQTT v5 Reason Code: " << tok.get_reason_code() << std::endl;
+    LOG_ERROR("ASYNC CONNECTION REJECTED, return code: {}, MQTT v5 reason code: {}", tok.get_return_code(),
+              tok.get_reason_code());
+  } else {
+    LOG_ERROR("ASYNC CONNECTION REJECTED, return code: {}", tok.get_return_code());
   }
   status = PAHOMQTTConnectionStatus::DISCONNECTED;
+  reportError(CONNECTION_ERROR_REFUSED, tok.get_reason_code() != 0 ? tok.get_reason_code() : tok.get_return_code());
 };
 void PAHOMQTTConnection::on_success(const mqtt::token &tok) {
-  std::cout << "\nMQTT SUCCESSFULLY CONNECTED!" << std::endl;
+  if (tok.get_type() == mqtt::token::SUBSCRIBE || tok.get_type() == mqtt::token::UNSUBSCRIBE) {
+    completeBatch(tok, true);
+    return;
+  }
+  LOG_INFO("MQTT SUCCESSFULLY CONNECTED!");
   status = PAHOMQTTConnectionStatus::CONNECTED;
+  if (tok.get_type() != mqtt::token::CONNECT) {
+    return;
+  }
+  bool sessionPresent = mqttParameters.persistentSession && tok.get_connect_response().is_session_present();
+  if (!sessionPresent) {
+    resubscribe();
+  }
 };
 void PAHOMQTTConnection::connected(const std::string &cause) {
   status = PAHOMQTTConnectionStatus::CONNECTED;
@@ -216,6 +579,7 @@ void PAHOMQTTConnection::connected(const std::string &cause) {
 };
 void PAHOMQTTConnection::connection_lost(const std::string &cause) {
   status = PAHOMQTTConnectionStatus::DISCONNECTED;
+  drainBatches();
   if (onDisconnectCallback) {
     onDisconnectCallback(this, userData);
   }
@@ -223,15 +587,26 @@ void PAHOMQTTConnection::connection_lost(const std::string &cause) {
 
 void PAHOMQTTConnection::on_disconnect(const mqtt::properties &prop, mqtt::ReasonCode code) {
   status = PAHOMQTTConnectionStatus::DISCONNECTED;
-  std::cerr << "\nMQTT DISCONNECTED" << std::endl;
-  std::cerr << "Reason Code: " << code << std::endl;
+  drainBatches();
+  LOG_WARNING("MQTT DISCONNECTED, reason code: {}", code);
   if (onDisconnectCallback) {
     onDisconnectCallback(this, userData);
   }
 }
-void PAHOMQTTConnection::delivery_complete(mqtt::delivery_token_ptr token) {};
+void PAHOMQTTConnection::delivery_complete(mqtt::delivery_token_ptr token) {
+  if (onPublishCallback && token) {
+    onPublishCallback(this, userData, token->get_message_id());
+  }
+};
 void PAHOMQTTConnection::message_arrived(mqtt::const_message_ptr msg) {
-  if (onMessageCallback) {
-    onMessageCallback(this, userData, PAHOMQTTMessage(msg));
+  // Counted before the callback is read, see waitForDispatch()
+  dispatching.fetch_add(1);
+  on_message_callback callback = onMessageCallback.load();
+  if (callback) {
+    const PAHOMQTTConnection *outer = dispatchingConnection;
+    dispatchingConnection = this;
+    callback(this, userData.load(), PAHOMQTTMessage(msg));
+    dispatchingConnection = outer;
   }
+  if (dispatching.fetch_sub(1) == 1) dispatching.notify_all();
 };
@@ -0,0 +1,119 @@
+#include "rate_controller.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Multiplicative decrease, gentler than halving since the delay signal comes
+// before any loss
+static const double DECREASE_FACTOR = 0.7;
+// Acks over which the delivery rate is sampled, at least
+static const size_t RATE_SAMPLE_ACKS = 8;
+
+RateController::RateController(const RateControlOptions &options) : options(options) { reset(); }
+
+void RateController::setOptions(const RateControlOptions &options) {
+  {
+    std::unique_lock<std::mutex> lck(mutex);
+    this->options = options;
+    this->options.minWindow = std::max<size_t>(1, options.minWindow);
+    this->options.maxWindow = std::max(this->options.minWindow, options.maxWindow);
+  }
+  reset();
+}
+
+void RateController::reset() {
+  std::unique_lock<std::mutex> lck(mutex);
+  congestionWindow = options.minWindow;
+  smoothedLatencyUs = -1;
+  minLatencyUs = -1;
+  minLatencyTime = Clock::time_point();
+  recoveryEnd = Clock::time_point();
+  measuredRate = -1;
+  ackedSinceSample = 0;
+  sampleStart = Clock::time_point();
+  publish();
+}
+
+void RateController::onAck(int64_t latencyUs, Clock::time_point now) {
+  if (latencyUs < 0) return;
+  std::unique_lock<std::mutex> lck(mutex);
+  double latency = (double)latencyUs;
+  smoothedLatencyUs = smoothedLatencyUs < 0 ? latency : smoothedLatencyUs * 7 / 8 + latency / 8;
+  if (minLatencyUs < 0 || latency <= minLatencyUs || now - minLatencyTime > options.minLatencyWindow) {
+    minLatencyUs = latency;
+    minLatencyTime = now;
+  }
+
+  // Acks per second, sampled over at least a round trip
+  if (ackedSinceSample++ == 0) sampleStart = now;
+  double sampleUs = std::chrono::duration<double, std::micro>(now - sampleStart).count();
+  if (ackedSinceSample >= RATE_SAMPLE_ACKS && sampleUs >= smoothedLatencyUs && sampleUs > 0) {
+    double rate = (ackedSinceSample - 1) * 1e6 / sampleUs;
+    measuredRate = measuredRate < 0 ? rate : measuredRate * 3 / 4 + rate / 4;
+    ackedSinceSample = 0;
+  }
+
+  double queueingDelayUs = smoothedLatencyUs - minLatencyUs;
+  double targetUs = (double)options.targetDelay.count();
+  if (queueingDelayUs > targetUs) {
+    decrease(now);
+  } else if (queueingDelayUs < targetUs / 2) {
+    // Room on the link: doubles every round trip, so a link that got 100
+    // times faster is filled in a few round trips
+    congestionWindow += 1;
+  } else {
+    congestionWindow += 1 / congestionWindow;
+  }
+  congestionWindow = std::clamp(congestionWindow, (double)options.minWindow, (double)options.maxWindow);
+  publish();
+}
+
+void RateController::onLoss(Clock::time_point now) {
+  std::unique_lock<std::mutex> lck(mutex);
+  decrease(now);
+  publish();
+}
+
+void RateController::decrease(Clock::time_point now) {
+  // Once per round trip, the acks that follow a cut still carry the queue
+  // that caused it
+  if (now < recoveryEnd) return;
+  congestionWindow = std::max((double)options.minWindow, congestionWindow * DECREASE_FACTOR);
+  recoveryEnd = now + std::chrono::microseconds((int64_t)std::max(0.0, smoothedLatencyUs));
+}
+
+void RateController::publish() {
+  size_t current = (size_t)congestionWindow;
+  window.store(current, std::memory_order_relaxed);
+
+  int64_t batchDelay = 0;
+  double rate = -1;
+  if (smoothedLatencyUs > 0) {
+    batchDelay = std::min<int64_t>((int64_t)(smoothedLatencyUs / congestionWindow), options.maxBatchDelay.count());
+    rate = congestionWindow * 1e6 / smoothedLatencyUs;
+  }
+  batchDelayUs.store(batchDelay, std::memory_order_relaxed);
+  targetRate.store(rate, std::memory_order_relaxed);
+  deliveryRate.store(measuredRate, std::memory_order_relaxed);
+
+  // How far the window is from its maximum, on a log scale since links vary
+  // by orders of magnitude. Compressing only pays off under a real squeeze.
+  int level = 0;
+  if (options.maxWindow > options.minWindow) {
+    double pressure = 1 - std::log(congestionWindow / options.minWindow) /
+                              std::log((double)options.maxWindow / options.minWindow);
+    if (pressure > 0.25) level = std::clamp((int)std::lround(pressure * 9), 1, 9);
+  }
+  compressionLevel.store(level, std::memory_order_relaxed);
+}
+
+RateControlSignal RateController::getSignal() const {
+  std::unique_lock<std::mutex> lck(mutex);
+  return {window.load(std::memory_order_relaxed),
+          std::chrono::microseconds(batchDelayUs.load(std::memory_order_relaxed)),
+          compressionLevel.load(std::memory_order_relaxed),
+          targetRate.load(std::memory_order_relaxed),
+          deliveryRate.load(std::memory_order_relaxed),
+          smoothedLatencyUs < 0 ? -1 : smoothedLatencyUs / 1000,
+          minLatencyUs < 0 ? -1 : minLatencyUs / 1000};
+}
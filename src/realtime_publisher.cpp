@@ -0,0 +1,112 @@
+#include "realtime_publisher.h"
+
+#include <chrono>
+#include <cstring>
+#include <new>
+
+static size_t alignUp(size_t value, size_t alignment) { return (value + alignment - 1) & ~(alignment - 1); }
+
+RealtimePublisher::RealtimePublisher(size_t slots, size_t maxTopicSize, size_t maxPayloadSize,
+                                     RealtimePublishFunction publish, void *context)
+    : slots(slots),
+      maxTopicSize(maxTopicSize),
+      maxPayloadSize(maxPayloadSize),
+      // topic is stored NUL terminated right after the header, payload follows
+      stride(alignUp(sizeof(SlotHeader) + maxTopicSize + 1 + maxPayloadSize, alignof(SlotHeader))),
+      arena(new char[stride * slots]),
+      enqueuePosition(0),
+      dequeuePosition(0),
+      pending(0),
+      publish(publish),
+      context(context),
+      running(true) {
+  // Touch the whole arena now so steady state never page faults on it
+  memset(arena.get(), 0, stride * slots);
+  for (size_t i = 0; i < slots; i++) {
+    SlotHeader *header = new (arena.get() + i * stride) SlotHeader();
+    header->sequence.store(i, std::memory_order_relaxed);
+  }
+  thread = std::make_unique<std::thread>(&RealtimePublisher::threadFunction, this);
+}
+
+RealtimePublisher::~RealtimePublisher() {
+  running = false;
+  wake();
+  if (thread != NULL && thread->joinable()) thread->join();
+  for (size_t i = 0; i < slots; i++) slot(i)->~SlotHeader();
+}
+
+RealtimePublisher::SlotHeader *RealtimePublisher::slot(size_t position) const {
+  return reinterpret_cast<SlotHeader *>(arena.get() + (position % slots) * stride);
+}
+
+bool RealtimePublisher::push(std::string_view topic, const void *payload, size_t size, int qos, bool retain) {
+  if (topic.size() > maxTopicSize || size > maxPayloadSize) return false;
+
+  size_t pos = enqueuePosition.load(std::memory_order_relaxed);
+  SlotHeader *header;
+  while (true) {
+    header = slot(pos);
+    size_t seq = header->sequence.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (enqueuePosition.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = enqueuePosition.load(std::memory_order_relaxed);
+    }
+  }
+
+  char *data = reinterpret_cast<char *>(header + 1);
+  memcpy(data, topic.data(), topic.size());
+  data[topic.size()] = '\0';
+  if (size > 0) memcpy(data + topic.size() + 1, payload, size);
+  header->topicSize = topic.size();
+  header->payloadSize = size;
+  header->qos = qos;
+  header->retain = retain;
+  header->sequence.store(pos + 1, std::memory_order_release);
+
+  // Only reaches the kernel if the publisher thread is actually sleeping
+  pending.fetch_add(1, std::memory_order_release);
+  pending.notify_one();
+  return true;
+}
+
+size_t RealtimePublisher::getQueueSize() const {
+  return enqueuePosition.load(std::memory_order_relaxed) - dequeuePosition.load(std::memory_order_relaxed);
+}
+
+void RealtimePublisher::wake() {
+  pending.fetch_add(1, std::memory_order_release);
+  pending.notify_one();
+}
+
+void RealtimePublisher::threadFunction() {
+  while (running.load()) {
+    uint32_t seen = pending.load(std::memory_order_acquire);
+    bool refused = false;
+
+    while (true) {
+      size_t pos = dequeuePosition.load(std::memory_order_relaxed);
+      SlotHeader *header = slot(pos);
+      if (header->sequence.load(std::memory_order_acquire) != pos + 1) break;
+      const char *topic = reinterpret_cast<const char *>(header + 1);
+      if (!publish(context, topic, topic + header->topicSize + 1, header->payloadSize, header->qos,
+                   header->retain)) {
+        refused = true;
+        break;
+      }
+      header->sequence.store(pos + slots, std::memory_order_release);
+      dequeuePosition.store(pos + 1, std::memory_order_relaxed);
+    }
+
+    if (refused) {
+      // The backend is not ready, poll until it is (or someone wakes us)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      continue;
+    }
+    pending.wait(seen, std::memory_order_acquire);
+  }
+}
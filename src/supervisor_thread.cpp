@@ -0,0 +1,96 @@
+#include "supervisor_thread.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "logger.h"
+
+bool applyThreadPlacement(const std::vector<int> &cpuAffinity, SupervisorSchedulingPolicy policy, int priority) {
+  bool ok = true;
+#ifdef __linux__
+  if (!cpuAffinity.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpuAffinity) CPU_SET(cpu, &set);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0) {
+      LOG_WARNING("Could not set thread affinity: {}", ret);
+      ok = false;
+    }
+  }
+#else
+  if (!cpuAffinity.empty()) {
+    LOG_WARNING("Thread affinity is not supported on this platform");
+    ok = false;
+  }
+#endif
+
+  if (policy == SUPERVISOR_SCHED_FIFO) {
+    sched_param param = {};
+    param.sched_priority = priority;
+    int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (ret != 0) {
+      LOG_WARNING("Could not set SCHED_FIFO priority {}: {}", priority, ret);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+SupervisorThread::SupervisorThread(std::function<size_t()> tick)
+    : tick(std::move(tick)), running(false), woken(false) {}
+
+SupervisorThread::~SupervisorThread() { stop(); }
+
+void SupervisorThread::setOptions(const SupervisorOptions &options) { this->options = options; }
+
+const SupervisorOptions &SupervisorThread::getOptions() const { return options; }
+
+void SupervisorThread::start() {
+  if (running.exchange(true)) return;
+  thread = std::make_unique<std::thread>(&SupervisorThread::threadFunction, this);
+}
+
+void SupervisorThread::stop() {
+  {
+    // Under the mutex, as wake(): the thread either sees running cleared
+    // when it checks the predicate or is already waiting for the notify
+    std::unique_lock<std::mutex> lck(mutex);
+    if (!running.exchange(false)) return;
+  }
+  condition.notify_all();
+  if (thread != NULL && thread->joinable()) thread->join();
+  thread = NULL;
+}
+
+bool SupervisorThread::isRunning() const { return running.load(); }
+
+void SupervisorThread::wake() {
+  {
+    std::unique_lock<std::mutex> lck(mutex);
+    woken = true;
+  }
+  condition.notify_all();
+}
+
+void SupervisorThread::threadFunction() {
+  threadId.store(std::this_thread::get_id(), std::memory_order_release);
+  applyThreadPlacement(options.cpuAffinity, options.schedulingPolicy, options.priority);
+
+  std::chrono::milliseconds interval = options.tickInterval;
+  while (running.load()) {
+    {
+      std::unique_lock<std::mutex> lck(mutex);
+      condition.wait_for(lck, interval, [this]() { return woken || !running.load(); });
+      woken = false;
+    }
+    if (!running.load()) break;
+
+    size_t reconnecting = tick();
+    if (options.tickPolicy == SUPERVISOR_TICK_BACKOFF && reconnecting > 0)
+      interval = std::min(interval * 2, options.maxTickInterval);
+    else
+      interval = options.tickInterval;
+  }
+  threadId.store(std::thread::id(), std::memory_order_release);
+}
@@ -0,0 +1,153 @@
+#include "tls_context.h"
+
+#include <arpa/inet.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+// Where a context finds its TLSClientContext from OpenSSL's callbacks
+static int contextIndex() {
+  static int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+  return index;
+}
+
+// Set on an SSL object once its handshake was counted
+static int countedIndex() {
+  static int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+  return index;
+}
+
+// A broker addressed by an IPv4 or IPv6 literal is checked against the
+// certificate's IP address SANs, not its DNS names
+static bool isIPLiteral(const std::string &host) {
+  unsigned char address[sizeof(struct in6_addr)];
+  return inet_pton(AF_INET, host.c_str(), address) == 1 || inet_pton(AF_INET6, host.c_str(), address) == 1;
+}
+
+static std::string opensslError(const char *what) {
+  char buffer[256];
+  unsigned long code = ERR_get_error();
+  ERR_clear_error();
+  if (code == 0) return what;
+  ERR_error_string_n(code, buffer, sizeof(buffer));
+  return std::string(what) + ": " + buffer;
+}
+
+// Same names as libmosquitto's tls_version, 0 for the default and -1 when
+// unknown
+static int parseVersion(const std::string &version) {
+  if (version.empty()) return 0;
+  if (version == "tlsv1") return TLS1_VERSION;
+  if (version == "tlsv1.1") return TLS1_1_VERSION;
+  if (version == "tlsv1.2") return TLS1_2_VERSION;
+  if (version == "tlsv1.3") return TLS1_3_VERSION;
+  return -1;
+}
+
+std::unique_ptr<TLSClientContext> TLSClientContext::create(const TLSOptions &options, std::string *error) {
+  std::string message;
+  SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+  if (!ctx) {
+    if (error) *error = opensslError("SSL_CTX_new");
+    return nullptr;
+  }
+
+  const char *cafile = options.cafile.empty() ? nullptr : options.cafile.c_str();
+  const char *capath = options.capath.empty() ? nullptr : options.capath.c_str();
+  int version = parseVersion(options.tlsVersion);
+  if (version < 0) {
+    message = "unknown TLS version " + options.tlsVersion;
+  } else if (version > 0 && !SSL_CTX_set_min_proto_version(ctx, version)) {
+    message = opensslError("tlsVersion");
+  } else if (!options.ciphers.empty() && !SSL_CTX_set_cipher_list(ctx, options.ciphers.c_str())) {
+    message = opensslError("ciphers");
+  } else if (!options.ciphersuites.empty() && !SSL_CTX_set_ciphersuites(ctx, options.ciphersuites.c_str())) {
+    message = opensslError("ciphersuites");
+  } else if (cafile || capath ? !SSL_CTX_load_verify_locations(ctx, cafile, capath)
+                              : !SSL_CTX_set_default_verify_paths(ctx)) {
+    message = opensslError("cafile/capath");
+  } else if (!options.certfile.empty() && !SSL_CTX_use_certificate_chain_file(ctx, options.certfile.c_str())) {
+    message = opensslError("certfile");
+  } else if (!options.keyfile.empty()) {
+    // Only needed while the key is read
+    SSL_CTX_set_default_passwd_cb_userdata(ctx, (void *)options.keyPassword.c_str());
+    if (!SSL_CTX_use_PrivateKey_file(ctx, options.keyfile.c_str(), SSL_FILETYPE_PEM))
+      message = opensslError("keyfile");
+    else if (!SSL_CTX_check_private_key(ctx))
+      message = opensslError("keyfile does not match certfile");
+    SSL_CTX_set_default_passwd_cb_userdata(ctx, nullptr);
+  }
+  if (message.empty() && !options.verifyHost.empty()) {
+    X509_VERIFY_PARAM *param = SSL_CTX_get0_param(ctx);
+    if (isIPLiteral(options.verifyHost) ? !X509_VERIFY_PARAM_set1_ip_asc(param, options.verifyHost.c_str())
+                                        : !X509_VERIFY_PARAM_set1_host(param, options.verifyHost.c_str(), 0))
+      message = opensslError("verifyHost");
+  }
+  if (!message.empty()) {
+    SSL_CTX_free(ctx);
+    if (error) *error = message;
+    return nullptr;
+  }
+
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+  // Sessions are kept by TLSClientContext, not in OpenSSL's cache
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, TLSClientContext::onNewSession);
+  SSL_CTX_set_info_callback(ctx, TLSClientContext::onInfo);
+  return std::unique_ptr<TLSClientContext>(new TLSClientContext(options, ctx));
+}
+
+TLSClientContext::TLSClientContext(const TLSOptions &options, SSL_CTX *ctx)
+    : options(options), ctx(ctx), session(nullptr), handshakes(0), resumed(0) {
+  SSL_CTX_set_ex_data(ctx, contextIndex(), this);
+}
+
+TLSClientContext::~TLSClientContext() {
+  forgetSession();
+  // libmosquitto holds its own reference, its SSL objects may outlive us
+  SSL_CTX_set_ex_data(ctx, contextIndex(), nullptr);
+  SSL_CTX_free(ctx);
+}
+
+void TLSClientContext::forgetSession() {
+  std::unique_lock<std::mutex> lck(sessionMutex);
+  if (session) SSL_SESSION_free(session);
+  session = nullptr;
+}
+
+TLSStatistics TLSClientContext::getStatistics() const {
+  TLSStatistics statistics;
+  statistics.handshakes = handshakes.load();
+  statistics.resumed = resumed.load();
+  return statistics;
+}
+
+int TLSClientContext::onNewSession(SSL *ssl, SSL_SESSION *newSession) {
+  TLSClientContext *context = (TLSClientContext *)SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), contextIndex());
+  if (!context || !context->options.sessionResumption) return 0;
+  // TLS 1.3 servers may send several tickets, the last one is kept
+  std::unique_lock<std::mutex> lck(context->sessionMutex);
+  if (context->session) SSL_SESSION_free(context->session);
+  context->session = newSession;
+  return 1;
+}
+
+void TLSClientContext::onInfo(const SSL *ssl, int where, int ret) {
+  TLSClientContext *context = (TLSClientContext *)SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), contextIndex());
+  if (!context) return;
+  if ((where & SSL_CB_HANDSHAKE_START) && SSL_in_before(ssl)) {
+    // Before the ClientHello is written, the only point libmosquitto leaves
+    // to attach a session to an SSL object it created
+    std::unique_lock<std::mutex> lck(context->sessionMutex);
+    if (context->session && SSL_SESSION_is_resumable(context->session))
+      SSL_set_session(const_cast<SSL *>(ssl), context->session);
+  }
+  // Also signalled for TLS 1.3 post-handshake messages (session tickets,
+  // key updates) and renegotiations: each connection counts once, when its
+  // first handshake is over
+  if ((where & SSL_CB_HANDSHAKE_DONE) && SSL_is_init_finished(ssl) && !SSL_get_ex_data(ssl, countedIndex())) {
+    SSL_set_ex_data(const_cast<SSL *>(ssl), countedIndex(), (void *)1);
+    context->handshakes++;
+    if (SSL_session_reused(ssl)) context->resumed++;
+  }
+}
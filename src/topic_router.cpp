@@ -0,0 +1,62 @@
+#include "topic_router.h"
+
+bool topicMatches(std::string_view filter, std::string_view topic) {
+  // Wildcards at the first level never match topics starting with $
+  if (!topic.empty() && topic[0] == '$' && !filter.empty() && (filter[0] == '+' || filter[0] == '#'))
+    return false;
+
+  // Walk both level by level, npos marks that every level was consumed
+  size_t f = 0, t = 0;
+  while (f != std::string_view::npos) {
+    size_t fEnd = filter.find('/', f);
+    std::string_view level = filter.substr(f, fEnd == std::string_view::npos ? fEnd : fEnd - f);
+
+    // '#' also matches the parent level, "a/#" matches "a"
+    if (level == "#") return true;
+    if (t == std::string_view::npos) return false;
+
+    size_t tEnd = topic.find('/', t);
+    if (level != "+" && level != topic.substr(t, tEnd == std::string_view::npos ? tEnd : tEnd - t)) return false;
+
+    f = fEnd == std::string_view::npos ? fEnd : fEnd + 1;
+    t = tEnd == std::string_view::npos ? tEnd : tEnd + 1;
+  }
+  return t == std::string_view::npos;
+}
+
+TopicRouter::TopicRouter() : nextRouteId(0), routes(std::make_shared<const RouteTable>()) {}
+
+int TopicRouter::addRoute(const std::string &filter, OnMessageCallback callback, void *userData) {
+  std::unique_lock<std::mutex> lck(writeMutex);
+  auto next = std::make_shared<RouteTable>(*routes.load());
+  int id = nextRouteId++;
+  next->push_back({id, filter, callback, userData});
+  routes.store(std::move(next));
+  return id;
+}
+
+bool TopicRouter::removeRoute(int routeId) {
+  std::unique_lock<std::mutex> lck(writeMutex);
+  auto next = std::make_shared<RouteTable>(*routes.load());
+  size_t before = next->size();
+  std::erase_if(*next, [routeId](const Route &route) { return route.id == routeId; });
+  if (next->size() == before) return false;
+  routes.store(std::move(next));
+  return true;
+}
+
+void TopicRouter::clear() {
+  std::unique_lock<std::mutex> lck(writeMutex);
+  routes.store(std::make_shared<const RouteTable>());
+}
+
+size_t TopicRouter::dispatch(int connectionId, std::string_view topic, const Message &message) const {
+  size_t matched = 0;
+  auto table = routes.load(std::memory_order_acquire);
+  for (const Route &route : *table) {
+    if (!topicMatches(route.filter, topic)) continue;
+    route.callback(route.userData, connectionId, message);
+    matched++;
+  }
+  return matched;
+}
@@ -0,0 +1,563 @@
+#include "udp_connection.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "logger.h"
+
+#if defined(__linux__) && !defined(UDP_SEGMENT)
+#define UDP_SEGMENT 103
+#endif
+
+static const uint8_t UDP_FRAME_VERSION = 1;
+static const size_t UDP_HEADER_SIZE = 8;
+// Datagrams per sendmmsg/recvmmsg call, and per GSO buffer
+static const size_t UDP_MAX_BATCH = 64;
+static const size_t UDP_MAX_GSO_BYTES = 65000;
+// A jump in sequence numbers larger than this is a restarted sender
+static const int32_t UDP_SEQUENCE_WINDOW = 1 << 16;
+
+#ifdef __linux__
+typedef struct mmsghdr BatchMessage;
+#else
+struct BatchMessage {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+#endif
+
+// sendmmsg/recvmmsg where available, one call per datagram elsewhere
+static int sendBatch(int fd, BatchMessage *messages, unsigned int count) {
+#ifdef __linux__
+  return sendmmsg(fd, messages, count, 0);
+#else
+  unsigned int sent = 0;
+  for (; sent < count; sent++) {
+    ssize_t ret = sendmsg(fd, &messages[sent].msg_hdr, 0);
+    if (ret < 0) return sent > 0 ? (int)sent : -1;
+    messages[sent].msg_len = ret;
+  }
+  return sent;
+#endif
+}
+
+static int receiveBatch(int fd, BatchMessage *messages, unsigned int count) {
+#ifdef __linux__
+  return recvmmsg(fd, messages, count, MSG_DONTWAIT, nullptr);
+#else
+  unsigned int received = 0;
+  for (; received < count; received++) {
+    ssize_t ret = recvmsg(fd, &messages[received].msg_hdr, MSG_DONTWAIT);
+    if (ret < 0) return received > 0 ? (int)received : -1;
+    messages[received].msg_len = ret;
+  }
+  return received;
+#endif
+}
+
+static void writeHeader(uint8_t *header, uint16_t topicId, uint32_t sequence) {
+  header[0] = UDP_FRAME_VERSION;
+  header[1] = 0;  // flags, reserved
+  header[2] = topicId >> 8;
+  header[3] = topicId;
+  header[4] = sequence >> 24;
+  header[5] = sequence >> 16;
+  header[6] = sequence >> 8;
+  header[7] = sequence;
+}
+
+static bool waitWritable(int fd) {
+  struct pollfd pfd = {fd, POLLOUT, 0};
+  return poll(&pfd, 1, 10) > 0;
+}
+
+UDPMessage::UDPMessage() : Message(CONNECTION_TYPE_UDP), topicId(0), sequence(0) {}
+UDPMessage::UDPMessage(uint16_t topicId, const std::string &payload)
+    : Message(CONNECTION_TYPE_UDP), topicId(topicId), sequence(0), payload(payload) {}
+
+UDPConnection::UDPConnection(const UDPConnectionParameters &parameters)
+    : Connection(parameters),
+      udpParameters(parameters),
+      running(false),
+      fd(-1),
+      wakeFds{-1, -1},
+      wakePending(false),
+      boundPort(0),
+      remoteLength(0),
+      nextSequence(0),
+      queueSize(0),
+      sent(0),
+      received(0),
+      lost(0),
+      reordered(0),
+      duplicates(0),
+      malformed(0),
+      sendErrors(0) {}
+
+UDPConnection::~UDPConnection() { disconnect(); }
+
+void UDPConnection::setConnectionParameters(const ConnectionParameters &parameters_) {
+  if (parameters_.getType() != CONNECTION_TYPE_UDP) return;
+  udpParameters = static_cast<const UDPConnectionParameters &>(parameters_);
+}
+
+void UDPConnection::connect() {
+  if (running) return;
+  status = CONNECTION_STATUS_CONNECTING;
+  if (!openSocket()) {
+    closeSocket();
+    status = CONNECTION_STATUS_ERROR;
+    return;
+  }
+  udpParameters.batchSize = std::clamp<size_t>(udpParameters.batchSize, 1, UDP_MAX_BATCH);
+  receiveBuffer.resize(udpParameters.batchSize * udpParameters.maxDatagramSize);
+  sources.clear();
+
+  running = true;
+  ioThread = std::make_unique<std::thread>(&UDPConnection::loop, this);
+  // Nothing to handshake, the connection is up once the socket is bound
+  status = CONNECTION_STATUS_CONNECTED;
+  LOG_INFO("UDPConnection {}: bound to port {}", id, boundPort.load());
+  if (onConnectCallback) onConnectCallback(userData, id);
+}
+
+void UDPConnection::disconnect() {
+  bool wasConnected = status == CONNECTION_STATUS_CONNECTED;
+  running = false;
+  if (ioThread) {
+    wake();
+    ioThread->join();
+    ioThread = NULL;
+  }
+  closeSocket();
+  {
+    std::unique_lock<std::mutex> lck(queueMutex);
+    queue.clear();
+    queueSize = 0;
+  }
+  status = CONNECTION_STATUS_DISCONNECTED;
+  if (wasConnected && onDisconnectCallback) onDisconnectCallback(userData, id);
+}
+
+bool UDPConnection::openSocket() {
+  int family = AF_UNSPEC;
+  remoteLength = 0;
+  if (!udpParameters.remoteHost.empty()) {
+    struct addrinfo hints = {}, *result = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    std::string port = std::to_string(udpParameters.remotePort);
+    int ret = getaddrinfo(udpParameters.remoteHost.c_str(), port.c_str(), &hints, &result);
+    if (ret != 0) {
+      reportError(CONNECTION_ERROR_CONNECT, ret, gai_strerror(ret));
+      return false;
+    }
+    memcpy(&remote, result->ai_addr, result->ai_addrlen);
+    remoteLength = result->ai_addrlen;
+    family = result->ai_family;
+    freeaddrinfo(result);
+  }
+
+  struct addrinfo hints = {}, *local = nullptr;
+  hints.ai_family = family;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_PASSIVE;
+  std::string port = std::to_string(udpParameters.localPort);
+  const char *address = udpParameters.localAddress.empty() ? nullptr : udpParameters.localAddress.c_str();
+  int ret = getaddrinfo(address, port.c_str(), &hints, &local);
+  if (ret != 0) {
+    reportError(CONNECTION_ERROR_CONNECT, ret, gai_strerror(ret));
+    return false;
+  }
+  family = local->ai_family;
+  fd = socket(family, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    freeaddrinfo(local);
+    reportError(CONNECTION_ERROR_CONNECT, errno, strerror(errno));
+    return false;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+  int one = 1;
+  if (!udpParameters.multicastGroup.empty()) {
+    // Several receivers on the host may listen to the same group
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  }
+  if (udpParameters.socketBufferSize > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &udpParameters.socketBufferSize, sizeof(int));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &udpParameters.socketBufferSize, sizeof(int));
+  }
+  ret = bind(fd, local->ai_addr, local->ai_addrlen);
+  freeaddrinfo(local);
+  if (ret != 0) {
+    reportError(CONNECTION_ERROR_CONNECT, errno, strerror(errno));
+    return false;
+  }
+
+  struct sockaddr_storage bound;
+  socklen_t length = sizeof(bound);
+  if (getsockname(fd, (struct sockaddr *)&bound, &length) == 0)
+    boundPort = ntohs(family == AF_INET6 ? ((struct sockaddr_in6 *)&bound)->sin6_port
+                                         : ((struct sockaddr_in *)&bound)->sin_port);
+
+  // Sending options only matter towards a group, receiving needs the join
+  int ttl = udpParameters.multicastTtl;
+  int loop = udpParameters.multicastLoop ? 1 : 0;
+  if (family == AF_INET) {
+    struct in_addr interface = {htonl(INADDR_ANY)};
+    if (!udpParameters.multicastInterface.empty())
+      inet_pton(AF_INET, udpParameters.multicastInterface.c_str(), &interface);
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    if (!udpParameters.multicastInterface.empty())
+      setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof(interface));
+    if (!udpParameters.multicastGroup.empty()) {
+      struct ip_mreq request = {};
+      request.imr_interface = interface;
+      if (inet_pton(AF_INET, udpParameters.multicastGroup.c_str(), &request.imr_multiaddr) != 1 ||
+          setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &request, sizeof(request)) != 0) {
+        reportError(CONNECTION_ERROR_CONNECT, errno, "Could not join the multicast group");
+        return false;
+      }
+    }
+  } else if (family == AF_INET6) {
+    unsigned int interface = 0;
+    if (!udpParameters.multicastInterface.empty())
+      interface = if_nametoindex(udpParameters.multicastInterface.c_str());
+    setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl));
+    setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop, sizeof(loop));
+    if (interface != 0) setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &interface, sizeof(interface));
+    if (!udpParameters.multicastGroup.empty()) {
+      struct ipv6_mreq request = {};
+      request.ipv6mr_interface = interface;
+      if (inet_pton(AF_INET6, udpParameters.multicastGroup.c_str(), &request.ipv6mr_multiaddr) != 1 ||
+          setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &request, sizeof(request)) != 0) {
+        reportError(CONNECTION_ERROR_CONNECT, errno, "Could not join the multicast group");
+        return false;
+      }
+    }
+  }
+
+#ifndef UDP_SEGMENT
+  if (udpParameters.gso) {
+    LOG_WARNING("UDPConnection {}: no UDP segmentation offload on this platform", id);
+    udpParameters.gso = false;
+  }
+#endif
+
+  if (pipe(wakeFds) != 0) {
+    reportError(CONNECTION_ERROR_NOMEM, errno, strerror(errno));
+    return false;
+  }
+  fcntl(wakeFds[0], F_SETFL, fcntl(wakeFds[0], F_GETFL, 0) | O_NONBLOCK);
+  fcntl(wakeFds[1], F_SETFL, fcntl(wakeFds[1], F_GETFL, 0) | O_NONBLOCK);
+  return true;
+}
+
+void UDPConnection::closeSocket() {
+  if (fd >= 0) close(fd);
+  fd = -1;
+  for (int &wakeFd : wakeFds) {
+    if (wakeFd >= 0) close(wakeFd);
+    wakeFd = -1;
+  }
+}
+
+bool UDPConnection::send(const Message &message) {
+  if (message.getType() != CONNECTION_TYPE_UDP) return false;
+  const UDPMessage &udpMessage = static_cast<const UDPMessage &>(message);
+  return sendNow(udpMessage.topicId, udpMessage.payload.data(), udpMessage.payload.size());
+}
+
+bool UDPConnection::queueSend(const Message &message) {
+  if (message.getType() != CONNECTION_TYPE_UDP) return false;
+  const UDPMessage &udpMessage = static_cast<const UDPMessage &>(message);
+  return enqueue(udpMessage.topicId, udpMessage.payload.data(), udpMessage.payload.size());
+}
+
+bool UDPConnection::sendShared(const SharedMessage &message) {
+  auto topic = udpParameters.topicIds.find(std::string(message.topic.view()));
+  if (topic == udpParameters.topicIds.end()) return false;
+  return sendNow(topic->second, message.payload.data(), message.payload.size());
+}
+
+void UDPConnection::receive(Message &message) {}
+
+bool UDPConnection::sendNow(uint16_t topicId, const char *data, size_t size) {
+  if (status != CONNECTION_STATUS_CONNECTED || remoteLength == 0) return false;
+  if (UDP_HEADER_SIZE + size > udpParameters.maxDatagramSize) return false;
+
+  uint8_t header[UDP_HEADER_SIZE];
+  writeHeader(header, topicId, nextSequence++);
+  struct iovec iov[2] = {{header, UDP_HEADER_SIZE}, {(void *)data, size}};
+  struct msghdr msg = {};
+  msg.msg_name = &remote;
+  msg.msg_namelen = remoteLength;
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  if (sendmsg(fd, &msg, 0) < 0) {
+    sendErrors++;
+    return false;
+  }
+  sent++;
+  return true;
+}
+
+bool UDPConnection::enqueue(uint16_t topicId, const char *data, size_t size) {
+  if (status != CONNECTION_STATUS_CONNECTED || remoteLength == 0) return false;
+  if (UDP_HEADER_SIZE + size > udpParameters.maxDatagramSize) return false;
+  {
+    std::unique_lock<std::mutex> lck(queueMutex);
+    if (queue.size() >= maxQueueSize) return false;
+    // Numbered when queued, so the receiver sees the queue's order
+    queue.emplace_back();
+    writeHeader(queue.back().header, topicId, nextSequence++);
+    queue.back().payload.assign(data, size);
+    queueSize = queue.size();
+  }
+  wake();
+  updateWatermarks();
+  return true;
+}
+
+size_t UDPConnection::getQueueSize() { return queueSize.load(); }
+
+UDPStatistics UDPConnection::getStatistics() const {
+  UDPStatistics statistics;
+  statistics.sent = sent.load();
+  statistics.received = received.load();
+  statistics.lost = lost.load();
+  statistics.reordered = reordered.load();
+  statistics.duplicates = duplicates.load();
+  statistics.malformed = malformed.load();
+  statistics.sendErrors = sendErrors.load();
+  return statistics;
+}
+
+void UDPConnection::wake() {
+  if (wakeFds[1] >= 0 && !wakePending.exchange(true)) {
+    char byte = 0;
+    if (write(wakeFds[1], &byte, 1) < 0 && errno != EAGAIN) LOG_WARNING("UDPConnection {}: wake failed", id);
+  }
+}
+
+void UDPConnection::loop() {
+  std::vector<Datagram> sending;
+  struct pollfd fds[2] = {{wakeFds[0], POLLIN, 0}, {fd, POLLIN, 0}};
+  while (running) {
+    if (poll(fds, 2, 100) < 0 && errno != EINTR) {
+      LOG_ERROR("UDPConnection {}: poll failed: {}", id, strerror(errno));
+      break;
+    }
+    if (fds[0].revents & POLLIN) {
+      wakePending = false;
+      char buffer[64];
+      while (read(wakeFds[0], buffer, sizeof(buffer)) > 0) {
+      }
+      // The queue is swapped out so senders only wait for the swap
+      {
+        std::unique_lock<std::mutex> lck(queueMutex);
+        sending.swap(queue);
+        queueSize = 0;
+      }
+      flushQueue(sending);
+      sending.clear();
+      updateWatermarks();
+    }
+    if (fds[1].revents & POLLIN) readDatagrams();
+  }
+}
+
+void UDPConnection::flushQueue(std::vector<Datagram> &datagrams) {
+  size_t next = 0;
+  while (next < datagrams.size() && running) {
+    if (udpParameters.gso) {
+      next += sendSegmented(datagrams, next);
+      continue;
+    }
+
+    BatchMessage messages[UDP_MAX_BATCH];
+    struct iovec iov[2 * UDP_MAX_BATCH];
+    unsigned int count = std::min(datagrams.size() - next, udpParameters.batchSize);
+    for (unsigned int i = 0; i < count; i++) {
+      Datagram &datagram = datagrams[next + i];
+      iov[2 * i] = {datagram.header, UDP_HEADER_SIZE};
+      iov[2 * i + 1] = {datagram.payload.data(), datagram.payload.size()};
+      messages[i] = {};
+      messages[i].msg_hdr.msg_name = &remote;
+      messages[i].msg_hdr.msg_namelen = remoteLength;
+      messages[i].msg_hdr.msg_iov = &iov[2 * i];
+      messages[i].msg_hdr.msg_iovlen = 2;
+    }
+    int ret = sendBatch(fd, messages, count);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && waitWritable(fd)) continue;
+    if (ret <= 0) {
+      // Loss tolerant: the rest of the queue is dropped and counted
+      sendErrors += datagrams.size() - next;
+      LOG_DEBUG("UDPConnection {}: dropped {} datagrams: {}", id, datagrams.size() - next, strerror(errno));
+      return;
+    }
+    sent += ret;
+    next += ret;
+  }
+}
+
+size_t UDPConnection::sendSegmented(std::vector<Datagram> &datagrams, size_t first) {
+  // The kernel splits the buffer every segmentSize bytes, so only datagrams
+  // of the same size can share one
+  size_t segmentSize = datagrams[first].size();
+  size_t count = 1;
+  while (first + count < datagrams.size() && count < UDP_MAX_BATCH && datagrams[first + count].size() == segmentSize &&
+         (count + 1) * segmentSize <= UDP_MAX_GSO_BYTES)
+    count++;
+
+  struct iovec iov[2 * UDP_MAX_BATCH];
+  for (size_t i = 0; i < count; i++) {
+    Datagram &datagram = datagrams[first + i];
+    iov[2 * i] = {datagram.header, UDP_HEADER_SIZE};
+    iov[2 * i + 1] = {datagram.payload.data(), datagram.payload.size()};
+  }
+  struct msghdr msg = {};
+  msg.msg_name = &remote;
+  msg.msg_namelen = remoteLength;
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2 * count;
+
+#ifdef UDP_SEGMENT
+  char control[CMSG_SPACE(sizeof(uint16_t))] = {};
+  if (count > 1) {
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = IPPROTO_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t size = segmentSize;
+    memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+  }
+#endif
+
+  ssize_t ret = sendmsg(fd, &msg, 0);
+  if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && waitWritable(fd)) ret = sendmsg(fd, &msg, 0);
+  if (ret < 0 && count > 1 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+    // No offload on this device or kernel, batch with sendmmsg instead
+    LOG_WARNING("UDPConnection {}: UDP segmentation offload unavailable: {}", id, strerror(errno));
+    udpParameters.gso = false;
+    return 0;
+  }
+  if (ret < 0) {
+    sendErrors += count;
+    return count;
+  }
+  sent += count;
+  return count;
+}
+
+void UDPConnection::readDatagrams() {
+  size_t batchSize = udpParameters.batchSize;
+  size_t datagramSize = udpParameters.maxDatagramSize;
+  BatchMessage messages[UDP_MAX_BATCH];
+  struct iovec iov[UDP_MAX_BATCH];
+  struct sockaddr_storage addresses[UDP_MAX_BATCH];
+  UDPMessage message;
+
+  while (running) {
+    for (size_t i = 0; i < batchSize; i++) {
+      iov[i] = {receiveBuffer.data() + i * datagramSize, datagramSize};
+      messages[i] = {};
+      messages[i].msg_hdr.msg_name = &addresses[i];
+      messages[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+      messages[i].msg_hdr.msg_iov = &iov[i];
+      messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    int count = receiveBatch(fd, messages, batchSize);
+    if (count <= 0) return;
+
+    auto timestamp = std::chrono::system_clock::now();
+    for (int i = 0; i < count; i++) {
+      const uint8_t *data = (const uint8_t *)iov[i].iov_base;
+      size_t length = messages[i].msg_len;
+      if (length < UDP_HEADER_SIZE || data[0] != UDP_FRAME_VERSION || (messages[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+        malformed++;
+        continue;
+      }
+      received++;
+      message.topicId = ((uint16_t)data[2] << 8) | data[3];
+      message.sequence = ((uint32_t)data[4] << 24) | ((uint32_t)data[5] << 16) | ((uint32_t)data[6] << 8) | data[7];
+      trackSequence(addresses[i], message.sequence);
+      message.payload.assign((const char *)data + UDP_HEADER_SIZE, length - UDP_HEADER_SIZE);
+      message.timestamp = timestamp;
+      if (onMessageCallback) onMessageCallback(userData, id, message);
+    }
+    if ((size_t)count < batchSize) return;
+  }
+}
+
+size_t UDPConnection::SourceAddressHash::operator()(const SourceAddress &source) const {
+  uint64_t words[2];
+  memcpy(words, source.address, sizeof(words));
+  uint64_t hash = words[0] * 0x9e3779b97f4a7c15ULL ^ words[1];
+  hash = (hash ^ ((uint64_t)source.port << 16 | source.family)) * 0xff51afd7ed558ccdULL;
+  return (size_t)(hash ^ (hash >> 32));
+}
+
+void UDPConnection::trackSequence(const struct sockaddr_storage &address, uint32_t sequence) {
+  SourceAddress key = {};
+  key.family = address.ss_family;
+  if (address.ss_family == AF_INET) {
+    const struct sockaddr_in &in = (const struct sockaddr_in &)address;
+    memcpy(key.address, &in.sin_addr, sizeof(in.sin_addr));
+    key.port = in.sin_port;
+  } else if (address.ss_family == AF_INET6) {
+    const struct sockaddr_in6 &in6 = (const struct sockaddr_in6 &)address;
+    memcpy(key.address, &in6.sin6_addr, sizeof(in6.sin6_addr));
+    key.port = in6.sin6_port;
+  }
+
+  auto [entry, inserted] = sources.try_emplace(key, Source{sequence + 1, {}});
+  Source &state = entry->second;
+  if (inserted) {
+    state.seen.set(sequence % Source::HISTORY);
+    return;
+  }
+  int32_t gap = (int32_t)(sequence - state.nextSequence);
+  if (gap >= 0 && gap < UDP_SEQUENCE_WINDOW) {
+    lost += gap;
+    // The skipped numbers are not seen yet
+    if ((uint32_t)gap >= Source::HISTORY)
+      state.seen.reset();
+    else
+      for (uint32_t skipped = state.nextSequence; skipped != sequence; skipped++)
+        state.seen.reset(skipped % Source::HISTORY);
+    state.seen.set(sequence % Source::HISTORY);
+    state.nextSequence = sequence + 1;
+  } else if (gap < 0 && gap >= -(int32_t)Source::HISTORY) {
+    if (state.seen.test(sequence % Source::HISTORY)) {
+      duplicates++;
+      return;
+    }
+    // Counted as lost when the gap was seen
+    state.seen.set(sequence % Source::HISTORY);
+    reordered++;
+    if (lost.load() > 0) lost--;
+  } else if (gap < 0 && gap > -UDP_SEQUENCE_WINDOW) {
+    // Too old to tell from a duplicate: reordered, the gap stays lost
+    reordered++;
+  } else {
+    state.seen.reset();
+    state.seen.set(sequence % Source::HISTORY);
+    state.nextSequence = sequence + 1;
+  }
+}
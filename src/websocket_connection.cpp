@@ -0,0 +1,911 @@
+#include "websocket_connection.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <random>
+
+#ifdef COMMUNICATION_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+#include "logger.h"
+
+enum WebSocketOpcode {
+  WS_OPCODE_CONTINUATION = 0x0,
+  WS_OPCODE_TEXT = 0x1,
+  WS_OPCODE_BINARY = 0x2,
+  WS_OPCODE_CLOSE = 0x8,
+  WS_OPCODE_PING = 0x9,
+  WS_OPCODE_PONG = 0xa
+};
+
+enum WebSocketCloseCode {
+  WS_CLOSE_NORMAL = 1000,
+  WS_CLOSE_GOING_AWAY = 1001,
+  WS_CLOSE_PROTOCOL_ERROR = 1002,
+  WS_CLOSE_TOO_BIG = 1009
+};
+
+enum WebSocketPeerState { WS_PEER_CONNECTING, WS_PEER_HANDSHAKE, WS_PEER_OPEN, WS_PEER_CLOSING, WS_PEER_CLOSED };
+
+static const char *WS_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+static const char *WS_DEFLATE_EXTENSION =
+    "permessage-deflate; server_no_context_takeover; client_no_context_takeover";
+// Frames per gather write, two iovecs each and well under IOV_MAX
+static const size_t WS_MAX_WRITE_FRAMES = 256;
+static const size_t WS_READ_SIZE = 64 * 1024;
+static const size_t WS_MAX_HANDSHAKE_SIZE = 8192;
+
+#ifdef MSG_NOSIGNAL
+#define WS_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define WS_SEND_FLAGS 0
+#endif
+
+// Header and payload are written with the same gather write, the payload is
+// never copied into a send buffer
+struct WebSocketConnection::Frame {
+  uint8_t header[14];
+  uint8_t headerSize;
+  SharedPayload payload;
+
+  size_t size() const { return headerSize + payload.size(); }
+};
+
+struct WebSocketConnection::Peer {
+  int fd = -1;
+  int id = 0;
+  // Written by the I/O thread, read by senders under peersMutex
+  std::atomic<WebSocketPeerState> state{WS_PEER_HANDSHAKE};
+  bool deflate = false;
+  // Whether the peer compresses each message on its own, otherwise its
+  // inflate window carries over between messages
+  bool peerNoContextTakeover = false;
+  bool closeAfterFlush = false;
+  std::string key;
+  std::string input;
+
+  std::deque<Frame> pending;  // under peersMutex
+  std::deque<Frame> writing;  // I/O thread only
+  size_t writeOffset = 0;
+  std::atomic<size_t> queued{0};
+
+  std::string fragments;
+  int fragmentOpcode = 0;
+  bool fragmentCompressed = false;
+
+#ifdef COMMUNICATION_WITH_ZLIB
+  z_stream inflater;
+  bool inflaterReady = false;
+#endif
+
+  ~Peer() {
+    if (fd >= 0) close(fd);
+#ifdef COMMUNICATION_WITH_ZLIB
+    if (inflaterReady) inflateEnd(&inflater);
+#endif
+  }
+};
+
+// Compresses whole messages for permessage-deflate without context takeover
+class WebSocketConnection::Deflater {
+ public:
+#ifdef COMMUNICATION_WITH_ZLIB
+  Deflater() {
+    memset(&stream, 0, sizeof(stream));
+    // Raw deflate with a 32 KiB window, favouring speed over ratio
+    ready = deflateInit2(&stream, Z_BEST_SPEED, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+  }
+  ~Deflater() {
+    if (ready) deflateEnd(&stream);
+  }
+
+  bool compress(const char *data, size_t size, std::string &out) {
+    if (!ready || deflateReset(&stream) != Z_OK) return false;
+    out.resize(deflateBound(&stream, size) + 16);
+    stream.next_in = (Bytef *)data;
+    stream.avail_in = size;
+    stream.next_out = (Bytef *)out.data();
+    stream.avail_out = out.size();
+    if (deflate(&stream, Z_SYNC_FLUSH) != Z_OK || stream.avail_in != 0 || stream.avail_out == 0) return false;
+    // The sync flush ends with 00 00 ff ff, which the extension leaves out
+    size_t produced = out.size() - stream.avail_out;
+    if (produced < 4) return false;
+    out.resize(produced - 4);
+    return true;
+  }
+
+ private:
+  z_stream stream;
+  bool ready;
+#else
+  bool compress(const char *data, size_t size, std::string &out) { return false; }
+#endif
+};
+
+static std::mt19937 &randomGenerator() {
+  thread_local std::mt19937 generator(std::random_device{}());
+  return generator;
+}
+
+static std::string base64(const unsigned char *data, size_t size) {
+  std::string out(4 * ((size + 2) / 3), '\0');
+  int written = EVP_EncodeBlock((unsigned char *)out.data(), data, size);
+  out.resize(written > 0 ? written : 0);
+  return out;
+}
+
+static std::string acceptKey(const std::string &key) {
+  std::string input = key + WS_GUID;
+  unsigned char digest[SHA_DIGEST_LENGTH];
+  SHA1((const unsigned char *)input.data(), input.size(), digest);
+  return base64(digest, sizeof(digest));
+}
+
+static std::string toLower(std::string value) {
+  std::transform(value.begin(), value.end(), value.begin(), [](unsigned char c) { return std::tolower(c); });
+  return value;
+}
+
+// Header names lowercased, values trimmed
+static std::map<std::string, std::string> parseHeaders(const std::string &head, std::string &firstLine) {
+  std::map<std::string, std::string> headers;
+  size_t lineEnd = head.find("\r\n");
+  firstLine = head.substr(0, lineEnd);
+  size_t pos = lineEnd == std::string::npos ? head.size() : lineEnd + 2;
+  while (pos < head.size()) {
+    lineEnd = head.find("\r\n", pos);
+    if (lineEnd == std::string::npos) lineEnd = head.size();
+    std::string line = head.substr(pos, lineEnd - pos);
+    pos = lineEnd + 2;
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) continue;
+    size_t valueStart = line.find_first_not_of(" \t", colon + 1);
+    std::string value = valueStart == std::string::npos ? "" : line.substr(valueStart);
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) value.pop_back();
+    std::string &entry = headers[toLower(line.substr(0, colon))];
+    entry = entry.empty() ? value : entry + ", " + value;
+  }
+  return headers;
+}
+
+static void buildHeader(uint8_t *header, uint8_t &headerSize, int opcode, bool compressed, size_t size,
+                        const uint8_t *mask) {
+  header[0] = 0x80 | (compressed ? 0x40 : 0) | opcode;
+  if (size < 126) {
+    header[1] = size;
+    headerSize = 2;
+  } else if (size <= 0xffff) {
+    header[1] = 126;
+    header[2] = size >> 8;
+    header[3] = size;
+    headerSize = 4;
+  } else {
+    header[1] = 127;
+    for (int i = 0; i < 8; i++) header[2 + i] = (uint64_t)size >> (56 - 8 * i);
+    headerSize = 10;
+  }
+  if (mask) {
+    header[1] |= 0x80;
+    memcpy(header + headerSize, mask, 4);
+    headerSize += 4;
+  }
+}
+
+static void setNonBlocking(int fd) { fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK); }
+
+static void setSocketOptions(int fd) {
+  setNonBlocking(fd);
+  int one = 1;
+  // Telemetry frames are small and latency bound
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+}
+
+WebSocketMessage::WebSocketMessage() : Message(CONNECTION_TYPE_WEBSOCKET), binary(false), peer(-1) {}
+WebSocketMessage::WebSocketMessage(const std::string &payload, bool binary, int peer)
+    : Message(CONNECTION_TYPE_WEBSOCKET), payload(payload), binary(binary), peer(peer) {}
+
+WebSocketConnection::WebSocketConnection(const WebSocketConnectionParameters &parameters)
+    : Connection(parameters),
+      wsParameters(parameters),
+      running(false),
+      listenFd(-1),
+      wakeFds{-1, -1},
+      wakePending(false),
+      boundPort(0),
+      peerCount(0),
+      queuedFrames(0),
+      deflatePeers(0),
+      closeRequested(false),
+      nextPeerId(0) {
+#ifdef COMMUNICATION_WITH_ZLIB
+  if (wsParameters.deflate) deflater = std::make_unique<Deflater>();
+#endif
+}
+
+WebSocketConnection::~WebSocketConnection() { stop(); }
+
+void WebSocketConnection::setConnectionParameters(const ConnectionParameters &parameters_) {
+  if (parameters_.getType() != CONNECTION_TYPE_WEBSOCKET) return;
+  wsParameters = static_cast<const WebSocketConnectionParameters &>(parameters_);
+  std::unique_lock<std::mutex> lck(deflateMutex);
+  deflater = nullptr;
+#ifdef COMMUNICATION_WITH_ZLIB
+  if (wsParameters.deflate) deflater = std::make_unique<Deflater>();
+#endif
+}
+
+void WebSocketConnection::connect() {
+  stop();
+  status = CONNECTION_STATUS_CONNECTING;
+  closeRequested = false;
+
+  if (pipe(wakeFds) != 0) {
+    status = CONNECTION_STATUS_ERROR;
+    reportError(CONNECTION_ERROR_NOMEM, errno, strerror(errno));
+    return;
+  }
+  setNonBlocking(wakeFds[0]);
+  setNonBlocking(wakeFds[1]);
+
+  bool started = wsParameters.mode == WEBSOCKET_MODE_SERVER ? startServer() : startClient();
+  if (!started) {
+    status = CONNECTION_STATUS_ERROR;
+    stop();
+    return;
+  }
+  running = true;
+  ioThread = std::make_unique<std::thread>(&WebSocketConnection::loop, this);
+}
+
+void WebSocketConnection::disconnect() {
+  if (ioThread && running) {
+    // The I/O thread sends the close frames and waits a little for the
+    // peers to answer
+    closeRequested = true;
+    wake();
+    ioThread->join();
+    ioThread = NULL;
+  }
+  stop();
+  status = CONNECTION_STATUS_DISCONNECTED;
+}
+
+void WebSocketConnection::stop() {
+  running = false;
+  if (ioThread) {
+    wake();
+    ioThread->join();
+    ioThread = NULL;
+  }
+  if (listenFd >= 0) close(listenFd);
+  listenFd = -1;
+  for (int &fd : wakeFds) {
+    if (fd >= 0) close(fd);
+    fd = -1;
+  }
+  std::unique_lock<std::mutex> lck(peersMutex);
+  peers.clear();
+  peerCount = 0;
+  queuedFrames = 0;
+  deflatePeers = 0;
+}
+
+bool WebSocketConnection::startServer() {
+  struct addrinfo hints = {}, *result = nullptr;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  std::string port = std::to_string(wsParameters.port);
+  int ret = getaddrinfo(wsParameters.host.empty() ? nullptr : wsParameters.host.c_str(), port.c_str(), &hints, &result);
+  if (ret != 0) {
+    reportError(CONNECTION_ERROR_CONNECT, ret, gai_strerror(ret));
+    return false;
+  }
+  for (struct addrinfo *ai = result; ai && listenFd < 0; ai = ai->ai_next) {
+    listenFd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (listenFd < 0) continue;
+    int one = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(listenFd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(listenFd, wsParameters.maxPeers) != 0) {
+      close(listenFd);
+      listenFd = -1;
+    }
+  }
+  freeaddrinfo(result);
+  if (listenFd < 0) {
+    reportError(CONNECTION_ERROR_CONNECT, errno, strerror(errno));
+    return false;
+  }
+  setNonBlocking(listenFd);
+
+  struct sockaddr_storage address;
+  socklen_t length = sizeof(address);
+  if (getsockname(listenFd, (struct sockaddr *)&address, &length) == 0)
+    boundPort = ntohs(address.ss_family == AF_INET6 ? ((struct sockaddr_in6 *)&address)->sin6_port
+                                                    : ((struct sockaddr_in *)&address)->sin_port);
+
+  LOG_INFO("WebSocketConnection {}: listening on port {}", id, boundPort.load());
+  status = CONNECTION_STATUS_CONNECTED;
+  if (onConnectCallback) onConnectCallback(userData, id);
+  return true;
+}
+
+bool WebSocketConnection::startClient() {
+  struct addrinfo hints = {}, *result = nullptr;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  std::string port = std::to_string(wsParameters.port);
+  int ret = getaddrinfo(wsParameters.host.c_str(), port.c_str(), &hints, &result);
+  if (ret != 0) {
+    reportError(CONNECTION_ERROR_CONNECT, ret, gai_strerror(ret));
+    return false;
+  }
+  auto peer = std::make_unique<Peer>();
+  peer->id = nextPeerId++;
+  for (struct addrinfo *ai = result; ai && peer->fd < 0; ai = ai->ai_next) {
+    peer->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (peer->fd < 0) continue;
+    setSocketOptions(peer->fd);
+    if (::connect(peer->fd, ai->ai_addr, ai->ai_addrlen) != 0 && errno != EINPROGRESS) {
+      close(peer->fd);
+      peer->fd = -1;
+    }
+  }
+  freeaddrinfo(result);
+  if (peer->fd < 0) {
+    reportError(CONNECTION_ERROR_CONNECT, errno, strerror(errno));
+    return false;
+  }
+
+  unsigned char nonce[16];
+  for (unsigned char &byte : nonce) byte = randomGenerator()();
+  peer->key = base64(nonce, sizeof(nonce));
+  std::string request = "GET " + wsParameters.path + " HTTP/1.1\r\n" + "Host: " + wsParameters.host + ":" + port +
+                        "\r\n" + "Upgrade: websocket\r\nConnection: Upgrade\r\n" + "Sec-WebSocket-Key: " + peer->key +
+                        "\r\nSec-WebSocket-Version: 13\r\n";
+  if (deflater) request += std::string("Sec-WebSocket-Extensions: ") + WS_DEFLATE_EXTENSION + "\r\n";
+  request += "\r\n";
+  // Written as soon as the TCP connection is up
+  peer->writing.push_back({{}, 0, SharedPayload(std::move(request))});
+  peer->state = WS_PEER_CONNECTING;
+
+  std::unique_lock<std::mutex> lck(peersMutex);
+  peers.push_back(std::move(peer));
+  peerCount = 1;
+  return true;
+}
+
+void WebSocketConnection::wake() {
+  if (wakeFds[1] >= 0 && !wakePending.exchange(true)) {
+    char byte = 0;
+    if (write(wakeFds[1], &byte, 1) < 0 && errno != EAGAIN) LOG_WARNING("WebSocketConnection {}: wake failed", id);
+  }
+}
+
+bool WebSocketConnection::send(const Message &message) {
+  if (message.getType() != CONNECTION_TYPE_WEBSOCKET) return false;
+  const WebSocketMessage &wsMessage = static_cast<const WebSocketMessage &>(message);
+  return sendFrame(wsMessage.binary ? WS_OPCODE_BINARY : WS_OPCODE_TEXT, SharedPayload(wsMessage.payload),
+                   wsMessage.peer);
+}
+
+bool WebSocketConnection::queueSend(const Message &message) { return send(message); }
+
+bool WebSocketConnection::sendShared(const SharedMessage &message) {
+  return sendFrame(WS_OPCODE_BINARY, message.payload, -1);
+}
+
+bool WebSocketConnection::sendBinary(const SharedPayload &payload, int peer) {
+  return sendFrame(WS_OPCODE_BINARY, payload, peer);
+}
+
+bool WebSocketConnection::sendText(const SharedPayload &payload, int peer) {
+  return sendFrame(WS_OPCODE_TEXT, payload, peer);
+}
+
+bool WebSocketConnection::sendFrame(int opcode, const SharedPayload &payload, int peerId) {
+  if (status != CONNECTION_STATUS_CONNECTED || !running) return false;
+
+  // Compressed once for every peer that negotiated the extension
+  SharedPayload compressed;
+  if (deflatePeers.load() > 0 && payload.size() >= wsParameters.deflateThreshold) {
+    std::string out;
+    std::unique_lock<std::mutex> lck(deflateMutex);
+    if (deflater && deflater->compress(payload.data(), payload.size(), out) && out.size() < payload.size())
+      compressed = SharedPayload(std::move(out));
+  }
+
+  bool client = wsParameters.mode == WEBSOCKET_MODE_CLIENT;
+  size_t queued = 0;
+  {
+    std::unique_lock<std::mutex> lck(peersMutex);
+    for (auto &peer : peers) {
+      if (peer->state != WS_PEER_OPEN || (peerId >= 0 && peer->id != peerId)) continue;
+      if (peer->queued.load() >= maxQueueSize) continue;
+
+      bool useCompressed = peer->deflate && !compressed.empty();
+      Frame frame;
+      frame.payload = useCompressed ? compressed : payload;
+      if (client) {
+        // Client frames are masked, which needs a copy of the payload
+        uint8_t mask[4];
+        uint32_t key = randomGenerator()();
+        memcpy(mask, &key, 4);
+        std::string masked(frame.payload.data(), frame.payload.size());
+        for (size_t i = 0; i < masked.size(); i++) masked[i] ^= mask[i & 3];
+        buildHeader(frame.header, frame.headerSize, opcode, useCompressed, masked.size(), mask);
+        frame.payload = SharedPayload(std::move(masked));
+      } else {
+        buildHeader(frame.header, frame.headerSize, opcode, useCompressed, frame.payload.size(), nullptr);
+      }
+      peer->pending.push_back(std::move(frame));
+      peer->queued++;
+      queued++;
+    }
+  }
+  if (queued == 0) return false;
+  queuedFrames += queued;
+  wake();
+  updateWatermarks();
+  return true;
+}
+
+void WebSocketConnection::receive(Message &message) {}
+
+size_t WebSocketConnection::getQueueSize() { return queuedFrames.load(); }
+
+void WebSocketConnection::loop() {
+  std::vector<struct pollfd> fds;
+  auto lastFlush = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point closeDeadline;
+  bool closing = false;
+  int pollError = 0;
+
+  while (running) {
+    if (closeRequested && !closing) {
+      closing = true;
+      closeDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+      for (auto &peer : peers) closePeer(*peer, WS_CLOSE_GOING_AWAY);
+      if (listenFd >= 0) close(listenFd);
+      listenFd = -1;
+    }
+    if (closing && (peers.empty() || std::chrono::steady_clock::now() > closeDeadline)) break;
+
+    // Frames are flushed right away unless batching asks to wait
+    auto now = std::chrono::steady_clock::now();
+    bool flushNow = wsParameters.batchDelay.count() == 0 || now - lastFlush >= wsParameters.batchDelay;
+    int timeout = 100;
+    bool hasPending = queuedFrames.load() > 0;
+    if (hasPending && !flushNow)
+      timeout = std::max<int>(
+          1, std::chrono::duration_cast<std::chrono::milliseconds>(lastFlush + wsParameters.batchDelay - now).count());
+
+    fds.clear();
+    fds.push_back({wakeFds[0], POLLIN, 0});
+    if (listenFd >= 0) fds.push_back({listenFd, POLLIN, 0});
+    size_t firstPeer = fds.size();
+    size_t polledPeers = peers.size();
+    for (auto &peer : peers) {
+      short events = POLLIN;
+      if (peer->state == WS_PEER_CONNECTING || !peer->writing.empty()) events |= POLLOUT;
+      fds.push_back({peer->fd, events, 0});
+    }
+
+    if (poll(fds.data(), fds.size(), hasPending && flushNow ? 0 : timeout) < 0 && errno != EINTR) {
+      pollError = errno;
+      LOG_ERROR("WebSocketConnection {}: poll failed: {}", id, strerror(pollError));
+      break;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      wakePending = false;
+      char buffer[64];
+      while (read(wakeFds[0], buffer, sizeof(buffer)) > 0) {
+      }
+    }
+    if (listenFd >= 0 && (fds[1].revents & POLLIN)) acceptPeers();
+
+    for (size_t i = 0; i < polledPeers; i++) {
+      Peer &peer = *peers[i];
+      short revents = fds[firstPeer + i].revents;
+      if (peer.state == WS_PEER_CONNECTING && (revents & (POLLOUT | POLLERR | POLLHUP))) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(peer.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0) {
+          reportError(CONNECTION_ERROR_CONNECT, error, strerror(error));
+          peer.state = WS_PEER_CLOSED;
+          continue;
+        }
+        peer.state = WS_PEER_HANDSHAKE;
+      }
+      if (revents & (POLLIN | POLLHUP | POLLERR)) readPeer(peer);
+    }
+
+    if (flushNow || hasPending == false) {
+      for (auto &peer : peers) {
+        if (peer->state == WS_PEER_CONNECTING || peer->state == WS_PEER_CLOSED) continue;
+        {
+          std::unique_lock<std::mutex> lck(peersMutex);
+          while (!peer->pending.empty()) {
+            peer->writing.push_back(std::move(peer->pending.front()));
+            peer->pending.pop_front();
+          }
+        }
+        flushPeer(*peer);
+      }
+      lastFlush = std::chrono::steady_clock::now();
+    }
+
+    removeClosedPeers();
+    updateWatermarks();
+    if (wsParameters.mode == WEBSOCKET_MODE_CLIENT && peers.empty()) break;
+  }
+
+  // Client mode ends with its only peer, and either mode when polling
+  // fails: nothing is read or sent anymore. The supervisor reconnects.
+  if (pollError != 0) {
+    status = CONNECTION_STATUS_ERROR;
+    reportError(CONNECTION_ERROR_LOOP, pollError, strerror(pollError));
+    if (onDisconnectCallback) onDisconnectCallback(userData, id);
+  } else if (!closing && running && wsParameters.mode == WEBSOCKET_MODE_CLIENT) {
+    status = CONNECTION_STATUS_DISCONNECTED;
+    if (onDisconnectCallback) onDisconnectCallback(userData, id);
+  }
+  running = false;
+}
+
+void WebSocketConnection::acceptPeers() {
+  while (true) {
+    int fd = accept(listenFd, nullptr, nullptr);
+    if (fd < 0) return;
+    if ((int)peers.size() >= wsParameters.maxPeers) {
+      LOG_WARNING("WebSocketConnection {}: refusing peer, {} peers connected", id, peers.size());
+      close(fd);
+      continue;
+    }
+    setSocketOptions(fd);
+    auto peer = std::make_unique<Peer>();
+    peer->fd = fd;
+    peer->id = nextPeerId++;
+    std::unique_lock<std::mutex> lck(peersMutex);
+    peers.push_back(std::move(peer));
+    peerCount = peers.size();
+  }
+}
+
+void WebSocketConnection::readPeer(Peer &peer) {
+  char buffer[WS_READ_SIZE];
+  while (peer.state != WS_PEER_CLOSED) {
+    ssize_t received = recv(peer.fd, buffer, sizeof(buffer), 0);
+    if (received > 0) {
+      peer.input.append(buffer, received);
+      continue;
+    }
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (received < 0 && errno == EINTR) continue;
+    peer.state = WS_PEER_CLOSED;
+  }
+
+  if (peer.state == WS_PEER_HANDSHAKE && !processHandshake(peer)) return;
+  if (peer.state == WS_PEER_OPEN || peer.state == WS_PEER_CLOSING) processFrames(peer);
+}
+
+bool WebSocketConnection::processHandshake(Peer &peer) {
+  size_t end = peer.input.find("\r\n\r\n");
+  if (end == std::string::npos) {
+    if (peer.input.size() > WS_MAX_HANDSHAKE_SIZE) peer.state = WS_PEER_CLOSED;
+    return false;
+  }
+  std::string firstLine;
+  auto headers = parseHeaders(peer.input.substr(0, end), firstLine);
+  peer.input.erase(0, end + 4);
+  std::string extensions = toLower(headers["sec-websocket-extensions"]);
+
+  if (wsParameters.mode == WEBSOCKET_MODE_CLIENT) {
+    if (firstLine.find(" 101") == std::string::npos || headers["sec-websocket-accept"] != acceptKey(peer.key)) {
+      LOG_ERROR("WebSocketConnection {}: handshake refused: {}", id, firstLine);
+      reportError(CONNECTION_ERROR_REFUSED, 0, "WebSocket handshake refused");
+      peer.state = WS_PEER_CLOSED;
+      return false;
+    }
+    peer.deflate = deflater && extensions.find("permessage-deflate") != std::string::npos;
+    peer.peerNoContextTakeover = extensions.find("server_no_context_takeover") != std::string::npos;
+  } else {
+    std::string key = headers["sec-websocket-key"];
+    if (firstLine.compare(0, 4, "GET ") != 0 || key.empty() ||
+        toLower(headers["upgrade"]).find("websocket") == std::string::npos ||
+        headers["sec-websocket-version"] != "13") {
+      std::string response = "HTTP/1.1 400 Bad Request\r\nSec-WebSocket-Version: 13\r\nContent-Length: 0\r\n\r\n";
+      peer.writing.push_back({{}, 0, SharedPayload(std::move(response))});
+      peer.closeAfterFlush = true;
+      peer.state = WS_PEER_CLOSING;
+      return false;
+    }
+    // A window smaller than ours cannot be honoured, deflate is declined
+    peer.deflate = deflater && extensions.find("permessage-deflate") != std::string::npos &&
+                   extensions.find("server_max_window_bits") == std::string::npos;
+    peer.peerNoContextTakeover = true;
+
+    std::string response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                           "Sec-WebSocket-Accept: " +
+                           acceptKey(key) + "\r\n";
+    if (peer.deflate) response += std::string("Sec-WebSocket-Extensions: ") + WS_DEFLATE_EXTENSION + "\r\n";
+    response += "\r\n";
+    peer.writing.push_back({{}, 0, SharedPayload(std::move(response))});
+  }
+
+#ifdef COMMUNICATION_WITH_ZLIB
+  if (peer.deflate) {
+    memset(&peer.inflater, 0, sizeof(peer.inflater));
+    peer.inflaterReady = inflateInit2(&peer.inflater, -15) == Z_OK;
+    peer.deflate = peer.inflaterReady;
+  }
+#endif
+  if (peer.deflate) deflatePeers++;
+  {
+    std::unique_lock<std::mutex> lck(peersMutex);
+    peer.state = WS_PEER_OPEN;
+  }
+  LOG_DEBUG("WebSocketConnection {}: peer {} open{}", id, peer.id, peer.deflate ? ", deflate" : "");
+
+  if (wsParameters.mode == WEBSOCKET_MODE_CLIENT) {
+    status = CONNECTION_STATUS_CONNECTED;
+    if (onConnectCallback) onConnectCallback(userData, id);
+  }
+  return true;
+}
+
+void WebSocketConnection::processFrames(Peer &peer) {
+  bool server = wsParameters.mode == WEBSOCKET_MODE_SERVER;
+  size_t pos = 0;
+  while (peer.state == WS_PEER_OPEN || peer.state == WS_PEER_CLOSING) {
+    size_t available = peer.input.size() - pos;
+    if (available < 2) break;
+    uint8_t *data = (uint8_t *)peer.input.data() + pos;
+    bool fin = data[0] & 0x80;
+    bool rsv1 = data[0] & 0x40;
+    int opcode = data[0] & 0x0f;
+    bool masked = data[1] & 0x80;
+    uint64_t length = data[1] & 0x7f;
+    size_t headerSize = 2;
+    if (length == 126) {
+      if (available < 4) break;
+      length = ((uint64_t)data[2] << 8) | data[3];
+      headerSize = 4;
+    } else if (length == 127) {
+      if (available < 10) break;
+      length = 0;
+      for (int i = 0; i < 8; i++) length = (length << 8) | data[2 + i];
+      headerSize = 10;
+    }
+    if (masked) headerSize += 4;
+
+    // Clients must mask, servers must not
+    if (masked != server || (data[0] & 0x30) || (rsv1 && !peer.deflate)) {
+      closePeer(peer, WS_CLOSE_PROTOCOL_ERROR);
+      break;
+    }
+    if (length > wsParameters.maxMessageSize) {
+      closePeer(peer, WS_CLOSE_TOO_BIG);
+      break;
+    }
+    if (available < headerSize + length) break;
+
+    uint8_t *payload = data + headerSize;
+    if (masked) {
+      const uint8_t *mask = data + headerSize - 4;
+      for (size_t i = 0; i < length; i++) payload[i] ^= mask[i & 3];
+    }
+    pos += headerSize + length;
+
+    if (opcode & 0x08) {
+      if (!fin || length > 125) {
+        closePeer(peer, WS_CLOSE_PROTOCOL_ERROR);
+        break;
+      }
+      if (opcode == WS_OPCODE_PING) {
+        queueControl(peer, WS_OPCODE_PONG, std::string((char *)payload, length));
+      } else if (opcode == WS_OPCODE_CLOSE) {
+        if (peer.state == WS_PEER_OPEN) {
+          // Echo the status code and close once it is written
+          queueControl(peer, WS_OPCODE_CLOSE, std::string((char *)payload, std::min<size_t>(length, 2)));
+          peer.state = WS_PEER_CLOSING;
+          peer.closeAfterFlush = true;
+        } else {
+          peer.state = WS_PEER_CLOSED;
+        }
+      }
+      continue;
+    }
+
+    if (opcode == WS_OPCODE_CONTINUATION) {
+      if (peer.fragmentOpcode == 0) {
+        closePeer(peer, WS_CLOSE_PROTOCOL_ERROR);
+        break;
+      }
+      peer.fragments.append((char *)payload, length);
+    } else if (opcode == WS_OPCODE_TEXT || opcode == WS_OPCODE_BINARY) {
+      if (peer.fragmentOpcode != 0) {
+        closePeer(peer, WS_CLOSE_PROTOCOL_ERROR);
+        break;
+      }
+      peer.fragmentOpcode = opcode;
+      peer.fragmentCompressed = rsv1;
+      peer.fragments.assign((char *)payload, length);
+    } else {
+      closePeer(peer, WS_CLOSE_PROTOCOL_ERROR);
+      break;
+    }
+    if (peer.fragments.size() > wsParameters.maxMessageSize) {
+      closePeer(peer, WS_CLOSE_TOO_BIG);
+      break;
+    }
+    if (fin) {
+      if (peer.state == WS_PEER_OPEN) handleMessage(peer, peer.fragmentOpcode, peer.fragments, peer.fragmentCompressed);
+      peer.fragmentOpcode = 0;
+      peer.fragments.clear();
+    }
+  }
+  peer.input.erase(0, std::min(pos, peer.input.size()));
+}
+
+void WebSocketConnection::handleMessage(Peer &peer, int opcode, std::string &payload, bool compressed) {
+  WebSocketMessage message;
+  if (compressed) {
+#ifdef COMMUNICATION_WITH_ZLIB
+    // Put back the trailer the sender left out
+    payload.append("\x00\x00\xff\xff", 4);
+    if (peer.peerNoContextTakeover) inflateReset(&peer.inflater);
+    peer.inflater.next_in = (Bytef *)payload.data();
+    peer.inflater.avail_in = payload.size();
+    char buffer[16 * 1024];
+    int ret = Z_OK;
+    while (peer.inflater.avail_in > 0 && ret == Z_OK) {
+      peer.inflater.next_out = (Bytef *)buffer;
+      peer.inflater.avail_out = sizeof(buffer);
+      ret = inflate(&peer.inflater, Z_SYNC_FLUSH);
+      message.payload.append(buffer, sizeof(buffer) - peer.inflater.avail_out);
+      if (message.payload.size() > wsParameters.maxMessageSize) {
+        closePeer(peer, WS_CLOSE_TOO_BIG);
+        return;
+      }
+      if (ret == Z_BUF_ERROR && peer.inflater.avail_out != 0) break;
+      if (ret == Z_BUF_ERROR) ret = Z_OK;
+    }
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+      closePeer(peer, WS_CLOSE_PROTOCOL_ERROR);
+      return;
+    }
+#else
+    closePeer(peer, WS_CLOSE_PROTOCOL_ERROR);
+    return;
+#endif
+  } else {
+    message.payload.swap(payload);
+  }
+  message.binary = opcode == WS_OPCODE_BINARY;
+  message.peer = wsParameters.mode == WEBSOCKET_MODE_SERVER ? peer.id : -1;
+  message.timestamp = std::chrono::system_clock::now();
+  if (onMessageCallback) onMessageCallback(userData, id, message);
+}
+
+void WebSocketConnection::queueControl(Peer &peer, int opcode, const std::string &payload) {
+  Frame frame;
+  if (wsParameters.mode == WEBSOCKET_MODE_CLIENT) {
+    uint8_t mask[4];
+    uint32_t key = randomGenerator()();
+    memcpy(mask, &key, 4);
+    std::string masked = payload;
+    for (size_t i = 0; i < masked.size(); i++) masked[i] ^= mask[i & 3];
+    buildHeader(frame.header, frame.headerSize, opcode, false, masked.size(), mask);
+    frame.payload = SharedPayload(std::move(masked));
+  } else {
+    buildHeader(frame.header, frame.headerSize, opcode, false, payload.size(), nullptr);
+    frame.payload = SharedPayload(std::string_view(payload));
+  }
+  peer.writing.push_back(std::move(frame));
+  peer.queued++;
+  queuedFrames++;
+}
+
+void WebSocketConnection::closePeer(Peer &peer, uint16_t code) {
+  if (peer.state != WS_PEER_OPEN) {
+    if (peer.state != WS_PEER_CLOSING) peer.state = WS_PEER_CLOSED;
+    return;
+  }
+  std::string payload = {(char)(code >> 8), (char)(code & 0xff)};
+  queueControl(peer, WS_OPCODE_CLOSE, payload);
+  std::unique_lock<std::mutex> lck(peersMutex);
+  peer.state = WS_PEER_CLOSING;
+  // On errors the close frame is the last thing sent; on an orderly close
+  // the peer's answer ends it
+  peer.closeAfterFlush = code != WS_CLOSE_GOING_AWAY && code != WS_CLOSE_NORMAL;
+}
+
+bool WebSocketConnection::flushPeer(Peer &peer) {
+  while (!peer.writing.empty()) {
+    struct iovec iov[2 * WS_MAX_WRITE_FRAMES];
+    int count = 0;
+    size_t offset = peer.writeOffset, requested = 0;
+    for (size_t i = 0; i < peer.writing.size() && i < WS_MAX_WRITE_FRAMES; i++) {
+      Frame &frame = peer.writing[i];
+      if (offset < frame.headerSize) {
+        iov[count++] = {frame.header + offset, frame.headerSize - offset};
+        requested += frame.headerSize - offset;
+        offset = 0;
+      } else {
+        offset -= frame.headerSize;
+      }
+      if (offset < frame.payload.size()) {
+        iov[count++] = {(void *)(frame.payload.data() + offset), frame.payload.size() - offset};
+        requested += frame.payload.size() - offset;
+      }
+      offset = 0;
+    }
+
+    // sendmsg is writev with flags, so a dropped peer cannot raise SIGPIPE
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    ssize_t written = sendmsg(peer.fd, &msg, WS_SEND_FLAGS);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+      peer.state = WS_PEER_CLOSED;
+      return false;
+    }
+
+    size_t consumed = written + peer.writeOffset;
+    while (!peer.writing.empty() && consumed >= peer.writing.front().size()) {
+      consumed -= peer.writing.front().size();
+      // Raw handshake bytes are not counted as queued frames
+      if (peer.writing.front().headerSize > 0) {
+        peer.queued--;
+        queuedFrames--;
+      }
+      peer.writing.pop_front();
+    }
+    peer.writeOffset = consumed;
+    if ((size_t)written < requested) return true;
+  }
+  if (peer.closeAfterFlush) {
+    shutdown(peer.fd, SHUT_RDWR);
+    peer.state = WS_PEER_CLOSED;
+  }
+  return true;
+}
+
+void WebSocketConnection::removeClosedPeers() {
+  std::unique_lock<std::mutex> lck(peersMutex);
+  for (size_t i = 0; i < peers.size();) {
+    Peer &peer = *peers[i];
+    if (peer.state != WS_PEER_CLOSED) {
+      i++;
+      continue;
+    }
+    LOG_DEBUG("WebSocketConnection {}: peer {} closed", id, peer.id);
+    size_t dropped = peer.queued.load();
+    queuedFrames -= std::min(dropped, queuedFrames.load());
+    if (peer.deflate) deflatePeers--;
+    peers.erase(peers.begin() + i);
+  }
+  peerCount = peers.size();
+}
@@ -0,0 +1,88 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "async.h"
+#include "mqtt_client.h"
+
+// Thousands of concurrent publish flows on two executor threads against a
+// broker on localhost:1883. Every flow awaits the PUBACK of each QoS 1
+// message before sending the next one, and one stream receives them all
+// back: no thread per flow and no polling loop.
+
+static const size_t FLOWS = 10000;
+static const size_t MESSAGES_PER_FLOW = 10;
+static const size_t EXECUTOR_THREADS = 2;
+
+static std::atomic<size_t> acknowledged = 0;
+static std::atomic<size_t> failed = 0;
+
+static Task<void> publishFlow(MQTTClient &client, size_t flow) {
+  MQTTMessage message("benchmark/async/" + std::to_string(flow % 64), "flow " + std::to_string(flow), 1, false);
+  for (size_t i = 0; i < MESSAGES_PER_FLOW; i++) {
+    if (co_await client.publishAsync(message))
+      acknowledged++;
+    else
+      failed++;
+  }
+}
+
+static Task<size_t> consume(MQTTMessageStream &stream, size_t expected) {
+  size_t received = 0;
+  while (received < expected) {
+    std::optional<MQTTMessage> message = co_await stream.next();
+    if (!message) break;
+    received++;
+  }
+  co_return received;
+}
+
+static Task<void> run(MQTTClient &client, Executor &executor) {
+  co_await executor.schedule();
+  if (!co_await client.connectAsync()) {
+    printf("no broker on localhost:1883\n");
+    co_return;
+  }
+
+  size_t total = FLOWS * MESSAGES_PER_FLOW;
+  MQTTMessageStream stream = client.subscribeAsync("benchmark/async/#", 1, total);
+  // Let the subscription settle before publishing
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  // Ends the stream if messages go missing, so the benchmark cannot hang
+  std::mutex watchdogMutex;
+  std::condition_variable watchdogCondition;
+  bool finished = false;
+  std::thread watchdog([&]() {
+    std::unique_lock<std::mutex> lck(watchdogMutex);
+    if (!watchdogCondition.wait_for(lck, std::chrono::seconds(60), [&]() { return finished; })) stream.close();
+  });
+
+  auto start = std::chrono::steady_clock::now();
+  for (size_t flow = 0; flow < FLOWS; flow++) spawn(executor, publishFlow(client, flow));
+  size_t received = co_await consume(stream, total);
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  {
+    std::unique_lock<std::mutex> lck(watchdogMutex);
+    finished = true;
+  }
+  watchdogCondition.notify_one();
+  watchdog.join();
+
+  printf("%zu flows on %zu threads: %zu acknowledged, %zu failed, %zu received in %.2f s (%.0f msgs/s), %zu dropped\n",
+         FLOWS, EXECUTOR_THREADS, acknowledged.load(), failed.load(), received, seconds, received / seconds,
+         stream.getDropped());
+  client.disconnect();
+}
+
+int main() {
+  ThreadPoolExecutor executor(EXECUTOR_THREADS);
+  MQTTClient client(MQTTConnectionParametersBuilder().host("localhost").port(1883).sendMaximum(100).build());
+  client.setExecutor(&executor);
+  syncWait(run(client, executor));
+  return 0;
+}
@@ -0,0 +1,97 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mqtt_client.h"
+
+// Runs the same publish/subscribe round trip through MQTTClient on each
+// backend against a broker on localhost:1883: every message carries its send
+// time, the client is subscribed to its own topic and records the latency
+// when the message comes back.
+
+static const size_t MESSAGES = 100000;
+static const size_t PAYLOAD_SIZE = 64;
+
+struct Run {
+  std::atomic<size_t> received{0};
+  std::vector<double> latenciesUs;
+};
+
+static int64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static void onMessage(void *userData, int id, const Message &message) {
+  Run *run = (Run *)userData;
+  const MQTTMessage &mqttMessage = static_cast<const MQTTMessage &>(message);
+  int64_t sent = 0;
+  if (mqttMessage.payload.size() < sizeof(sent)) return;
+  memcpy(&sent, mqttMessage.payload.data(), sizeof(sent));
+  size_t index = run->received.fetch_add(1);
+  if (index < run->latenciesUs.size()) run->latenciesUs[index] = (nowNs() - sent) / 1000.0;
+}
+
+static bool waitFor(std::chrono::seconds timeout, auto condition) {
+  auto end = std::chrono::steady_clock::now() + timeout;
+  while (!condition()) {
+    if (std::chrono::steady_clock::now() > end) return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return true;
+}
+
+static void run(const char *name, MQTTBackendType backendType, int qos) {
+  MQTTClient client(MQTTConnectionParametersBuilder().host("localhost").port(1883).build(), backendType);
+  client.setMaxQueueSize(MESSAGES);
+
+  Run run;
+  run.latenciesUs.resize(MESSAGES);
+  std::string topic = std::string("benchmark/") + name;
+  client.addRoute(topic, onMessage, &run);
+  client.subscribe(topic, qos);
+
+  client.connect();
+  if (!waitFor(std::chrono::seconds(5), [&]() { return client.getStatus() == CONNECTION_STATUS_CONNECTED; })) {
+    printf("%-10s qos %d: no broker on localhost:1883\n", name, qos);
+    return;
+  }
+  // Let the subscription settle before publishing
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  MQTTMessage message(topic, std::string(PAYLOAD_SIZE, 'x'), qos, false);
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < MESSAGES; i++) {
+    int64_t sent = nowNs();
+    memcpy(message.payload.data(), &sent, sizeof(sent));
+    while (!client.sendFor(message, std::chrono::seconds(1))) {
+    }
+  }
+  bool complete = waitFor(std::chrono::seconds(30), [&]() { return run.received.load() >= MESSAGES; });
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  size_t received = std::min(run.received.load(), MESSAGES);
+  std::vector<double> &latencies = run.latenciesUs;
+  latencies.resize(received);
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p) { return latencies.empty() ? 0.0 : latencies[(size_t)(p * (latencies.size() - 1))]; };
+
+  MQTTClientMetrics metrics = client.getMetrics();
+  printf("%-10s qos %d: %zu/%zu%s, %9.0f msgs/s, rtt p50 %8.1f us p99 %8.1f us max %8.1f us, %lu errors\n", name,
+         qos, received, MESSAGES, complete ? "" : " (timeout)", received / seconds, percentile(0.5), percentile(0.99),
+         percentile(1.0), (unsigned long)metrics.errors);
+  client.disconnect();
+}
+
+int main() {
+  for (int qos : {0, 1}) {
+    run("mosquitto", MQTT_BACKEND_MOSQUITTO, qos);
+    run("paho", MQTT_BACKEND_PAHO, qos);
+  }
+  return 0;
+}
@@ -0,0 +1,101 @@
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+#include "udp_connection.h"
+
+// A producer outrunning a UDPConnection on loopback, its queue full most of
+// the time. Compares retrying queueSend() with yield(), parking in sendFor(),
+// and trySend() with the watermarks' writable event fd: throughput and the
+// CPU time the producer thread burns.
+
+static const size_t MESSAGES = 500000;
+static const size_t PAYLOAD_SIZE = 64;
+static const size_t QUEUE_SIZE = 4096;
+
+enum Mode { MODE_SPIN = 0, MODE_SEND_FOR, MODE_EVENT_FD };
+
+static std::atomic<size_t> blockedCount{0};
+
+static void onBackpressure(void *userData, int id, bool blocked) {
+  if (blocked) blockedCount++;
+}
+
+static double threadCpuSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char *name, Mode mode) {
+  UDPConnectionParameters receiverParameters;
+  receiverParameters.remoteHost = "";
+  receiverParameters.localAddress = "127.0.0.1";
+  UDPConnection receiver(receiverParameters);
+  receiver.connect();
+
+  UDPConnectionParameters senderParameters;
+  senderParameters.remoteHost = "127.0.0.1";
+  senderParameters.remotePort = receiver.getBoundPort();
+  senderParameters.localAddress = "127.0.0.1";
+  UDPConnection sender(senderParameters);
+  sender.setMaxQueueSize(QUEUE_SIZE);
+  sender.setOnBackpressureCallback(onBackpressure);
+  if (mode == MODE_EVENT_FD) sender.setWatermarks(QUEUE_SIZE * 3 / 4, QUEUE_SIZE / 4);
+  sender.connect();
+  if (receiver.getStatus() != CONNECTION_STATUS_CONNECTED || sender.getStatus() != CONNECTION_STATUS_CONNECTED) {
+    printf("could not bind on 127.0.0.1\n");
+    exit(1);
+  }
+
+  blockedCount = 0;
+  size_t retries = 0;
+  UDPMessage message(1, std::string(PAYLOAD_SIZE, 'b'));
+  auto start = std::chrono::steady_clock::now();
+  double cpuStart = threadCpuSeconds();
+  for (size_t i = 0; i < MESSAGES; i++) {
+    switch (mode) {
+      case MODE_SPIN:
+        while (!sender.queueSend(message)) {
+          retries++;
+          std::this_thread::yield();
+        }
+        break;
+      case MODE_SEND_FOR:
+        while (!sender.sendFor(message, std::chrono::seconds(1))) retries++;
+        break;
+      case MODE_EVENT_FD:
+        while (!sender.trySend(message)) {
+          retries++;
+          struct pollfd pfd = {sender.getWritableEventFd(), POLLIN, 0};
+          if (poll(&pfd, 1, 100) > 0) {
+            uint64_t count;
+            ssize_t ret = read(pfd.fd, &count, sizeof(count));
+            (void)ret;
+          }
+        }
+        break;
+    }
+  }
+  double cpu = threadCpuSeconds() - cpuStart;
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  printf("%-9s: %9.0f msgs/s, producer cpu %6.3f s (%5.1f%% of wall), %8zu retries, %6zu times blocked\n", name,
+         MESSAGES / seconds, cpu, 100 * cpu / seconds, retries, blockedCount.load());
+  sender.disconnect();
+  receiver.disconnect();
+}
+
+int main() {
+  run("spin", MODE_SPIN);
+  run("sendFor", MODE_SEND_FOR);
+  run("event fd", MODE_EVENT_FD);
+  return 0;
+}
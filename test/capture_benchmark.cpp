@@ -0,0 +1,165 @@
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "capture.h"
+#include "capture_replayer.h"
+#include "udp_connection.h"
+
+// Capture cost on the tapped threads, read back and seek through the index,
+// then replay through a UDPConnection on loopback: as fast as possible, and
+// at the captured timing (how late messages go out).
+
+static const size_t WRITERS = 4;
+static const size_t MESSAGES_PER_WRITER = 250000;
+static const size_t TOPICS = 200;
+static const size_t PAYLOAD_SIZE = 64;
+
+static const size_t TIMED_MESSAGES = 1000;
+static const auto TIMED_SPACING = std::chrono::milliseconds(1);
+
+static std::atomic<size_t> received{0};
+
+static void onMessage(void *userData, int id, const Message &message) { received++; }
+
+// The topic index and sequence number repeated over the payload, so a record
+// read back with the wrong topic or a torn payload shows
+static void fillPayload(std::string &payload, size_t topic, uint64_t sequence) {
+  uint64_t word = (uint64_t)topic << 32 | (sequence & 0xffffffff);
+  payload.resize(PAYLOAD_SIZE);
+  for (size_t i = 0; i < PAYLOAD_SIZE / sizeof(word); i++) memcpy(payload.data() + i * sizeof(word), &word, sizeof(word));
+}
+
+static bool consistent(const CaptureRecord &record) {
+  uint64_t first, word;
+  if (record.payload.size() != PAYLOAD_SIZE) return false;
+  memcpy(&first, record.payload.data(), sizeof(first));
+  if (record.topic != "car/" + std::to_string(first >> 32) + "/signal") return false;
+  for (size_t i = 1; i < PAYLOAD_SIZE / sizeof(word); i++) {
+    memcpy(&word, record.payload.data() + i * sizeof(word), sizeof(word));
+    if (word != first) return false;
+  }
+  return true;
+}
+
+static void writeCapture(const std::string &path) {
+  CaptureWriter writer(path);
+  if (!writer.isOpen()) {
+    printf("cannot create %s\n", path.c_str());
+    exit(1);
+  }
+  std::vector<std::string> topics;
+  for (size_t i = 0; i < TOPICS; i++) topics.push_back("car/" + std::to_string(i) + "/signal");
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t w = 0; w < WRITERS; w++) {
+    threads.emplace_back([&, w]() {
+      std::string payload;
+      for (size_t i = 0; i < MESSAGES_PER_WRITER; i++) {
+        size_t topic = (i * WRITERS + w) % TOPICS;
+        fillPayload(payload, topic, i);
+        writer.write(w % 2 ? CAPTURE_SENT : CAPTURE_RECEIVED, topics[topic], payload, 1, false);
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  size_t total = WRITERS * MESSAGES_PER_WRITER;
+  printf("capture: %zu messages from %zu threads, %6.1f ns each, %5.1f M msg/s, %.1f MB, %llu dropped\n", total,
+         WRITERS, seconds * 1e9 / total, total / seconds / 1e6, writer.getSize() / 1e6,
+         (unsigned long long)writer.getDropped());
+  writer.close();
+}
+
+static void readCapture(const std::string &path) {
+  CaptureReader reader(path);
+  auto start = std::chrono::steady_clock::now();
+  CaptureRecord record;
+  uint64_t count = 0, bad = 0, sent = 0;
+  int64_t middleNs = 0;
+  while (reader.next(record)) {
+    if (!consistent(record)) bad++;
+    if (record.direction == CAPTURE_SENT) sent++;
+    if (++count == reader.getRecordCount() / 2) middleNs = record.timestampNs;
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("read:    %llu messages (%llu sent), %zu topics, %llu inconsistent, %5.1f M msg/s, complete %d\n",
+         (unsigned long long)count, (unsigned long long)sent, reader.getTopicCount(), (unsigned long long)bad,
+         count / seconds / 1e6, reader.isComplete());
+
+  auto middle = std::chrono::system_clock::time_point(
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(middleNs)));
+  start = std::chrono::steady_clock::now();
+  reader.seek(middle);
+  double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+  uint64_t after = 0;
+  while (reader.next(record)) after++;
+  printf("seek:    to the middle in %.1f us, %llu messages after it\n", us, (unsigned long long)after);
+}
+
+static void replay(const std::string &path, const char *name, CaptureReplayMode mode) {
+  UDPConnectionParameters receiverParameters;
+  receiverParameters.remoteHost = "";
+  receiverParameters.localAddress = "127.0.0.1";
+  UDPConnection receiver(receiverParameters);
+  receiver.setOnMessageCallback(onMessage);
+  receiver.connect();
+
+  UDPConnectionParameters senderParameters;
+  senderParameters.remoteHost = "127.0.0.1";
+  senderParameters.remotePort = receiver.getBoundPort();
+  senderParameters.localAddress = "127.0.0.1";
+  UDPConnection sender(senderParameters);
+  sender.connect();
+  if (receiver.getStatus() != CONNECTION_STATUS_CONNECTED || sender.getStatus() != CONNECTION_STATUS_CONNECTED) {
+    printf("could not bind on 127.0.0.1\n");
+    exit(1);
+  }
+
+  received = 0;
+  CaptureReader reader(path);
+  CaptureReplayOptions options;
+  options.mode = mode;
+  CaptureReplayer replayer(reader, sender, options);
+  CaptureReplayResult result = replayer.run();
+  // Let the receiver drain
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  printf("%-8s %llu sent, %llu failed in %.2f s, %9.0f msg/s, %zu received", name, (unsigned long long)result.sent,
+         (unsigned long long)result.failed, result.seconds, result.rate, received.load());
+  if (mode == CAPTURE_REPLAY_TIMED) printf(", lag mean %.1f us max %.1f us", result.meanLagUs, result.maxLagUs);
+  printf("\n");
+  sender.disconnect();
+  receiver.disconnect();
+}
+
+int main() {
+  std::string path = "/tmp/capture_benchmark_" + std::to_string(getpid()) + ".cap";
+  writeCapture(path);
+  readCapture(path);
+  replay(path, "max:", CAPTURE_REPLAY_MAX_SPEED);
+
+  // A session at a steady rate, captured timestamps set by hand
+  std::string timedPath = path + ".timed";
+  {
+    CaptureWriter writer(timedPath);
+    std::string payload;
+    auto timestamp = std::chrono::system_clock::now();
+    for (size_t i = 0; i < TIMED_MESSAGES; i++) {
+      fillPayload(payload, i % TOPICS, i);
+      writer.write(CAPTURE_RECEIVED, "car/" + std::to_string(i % TOPICS) + "/signal", payload, 0, false, timestamp);
+      timestamp += TIMED_SPACING;
+    }
+  }
+  replay(timedPath, "timed:", CAPTURE_REPLAY_TIMED);
+
+  unlink(path.c_str());
+  unlink(timedPath.c_str());
+  return 0;
+}
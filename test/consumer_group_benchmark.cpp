@@ -0,0 +1,94 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "paho_consumer_group.h"
+#include "paho_mqtt_connection.hpp"
+
+// Ingest rate of a shared-subscription consumer group against the number of
+// members, on a broker on localhost:1883. A publisher floods telemetry while
+// every message costs the consumer WORK_US of processing, so one Paho
+// callback thread is the limit that more members should lift.
+
+static const size_t MESSAGES = 100000;
+static const auto WORK_US = std::chrono::microseconds(20);
+
+static std::atomic<size_t> consumed = 0;
+
+static void onMessage(void *userData, size_t member, const PAHOMQTTMessage &message) {
+  // Stands in for decoding and storing the sample
+  auto end = std::chrono::steady_clock::now() + WORK_US;
+  while (std::chrono::steady_clock::now() < end) {
+  }
+  consumed.fetch_add(1, std::memory_order_relaxed);
+}
+
+static bool waitFor(std::chrono::seconds timeout, auto condition) {
+  auto end = std::chrono::steady_clock::now() + timeout;
+  while (!condition()) {
+    if (std::chrono::steady_clock::now() > end) return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return true;
+}
+
+static bool run(size_t members) {
+  PAHOMQTTConnectionParameters parameters;
+  parameters.uri = "tcp://localhost:1883";
+
+  PAHOConsumerGroupOptions options;
+  options.group = "telemetry";
+  options.filters = {"bench/group/#"};
+  options.qos = 0;
+  options.members = members;
+  for (size_t i = 0; i < members; i++) options.cpus.push_back((int)(i % std::thread::hardware_concurrency()));
+  options.queueCapacity = MESSAGES;
+
+  PAHOConsumerGroup group(parameters, options);
+  group.setOnMessageCallback(onMessage, nullptr);
+  group.start();
+  if (!waitFor(std::chrono::seconds(5), [&]() { return group.getConnectedCount() == members; })) {
+    printf("no broker on localhost:1883\n");
+    return false;
+  }
+  // Let the subscriptions reach the broker
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  PAHOMQTTConnection publisher(parameters);
+  publisher.connect();
+  if (!waitFor(std::chrono::seconds(5),
+               [&]() { return publisher.getStatus() == PAHOMQTTConnectionStatus::CONNECTED; })) {
+    printf("no broker on localhost:1883\n");
+    return false;
+  }
+
+  consumed = 0;
+  group.getMetrics();
+  auto start = std::chrono::steady_clock::now();
+  std::string payload(64, 'x');
+  for (size_t i = 0; i < MESSAGES; i++) {
+    PAHOMQTTMessage message("bench/group/car" + std::to_string(i % 20), payload, 0, false);
+    while (!publisher.send(message)) std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+  bool complete = waitFor(std::chrono::seconds(60), []() { return consumed.load() >= MESSAGES; });
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  PAHOConsumerGroupMetrics metrics = group.getMetrics();
+
+  printf("%zu members: %9.0f msg/s ingested, %zu/%zu consumed, %llu dropped%s\n", members, consumed.load() / seconds,
+         consumed.load(), MESSAGES, (unsigned long long)metrics.dropped, complete ? "" : " (timeout)");
+  for (size_t i = 0; i < metrics.memberDispatched.size(); i++)
+    printf("  member %zu: %llu messages\n", i, (unsigned long long)metrics.memberDispatched[i]);
+
+  publisher.disconnect();
+  group.stop();
+  return true;
+}
+
+int main() {
+  for (size_t members : {(size_t)1, (size_t)2, (size_t)4, (size_t)8})
+    if (!run(members)) return 1;
+  return 0;
+}
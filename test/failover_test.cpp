@@ -0,0 +1,153 @@
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "connection_manager.h"
+#include "mqtt_client.h"
+#include "mqtt_probe.h"
+
+// Two local brokers (mosquitto in PATH), a publisher failing over between
+// them and one subscriber on each. The preferred broker is killed in the
+// middle of the stream and started again later: prints the longest gap
+// between two received messages, what went missing, and whether the
+// publisher failed back.
+
+static const int PORTS[2] = {18831, 18832};
+static const auto DURATION = std::chrono::seconds(8);
+static const auto KILL_AT = std::chrono::seconds(2);
+static const auto RESTART_AT = std::chrono::seconds(4);
+static const auto SEND_INTERVAL = std::chrono::milliseconds(1);
+
+struct Received {
+  std::mutex mutex;
+  std::vector<std::pair<int, std::chrono::steady_clock::time_point>> messages;
+};
+
+static pid_t startBroker(int port) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    std::string portString = std::to_string(port);
+    execlp("mosquitto", "mosquitto", "-p", portString.c_str(), (char *)nullptr);
+    _exit(127);
+  }
+  MQTTEndpoint endpoint;
+  endpoint.host = "127.0.0.1";
+  endpoint.port = port;
+  MQTTConnectionParameters parameters;
+  for (int i = 0; i < 50; i++) {
+    if (probeMQTTEndpoint(endpoint, parameters, false, std::chrono::milliseconds(100)) >= 0) return pid;
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  printf("mosquitto did not start on port %d, is it in PATH?\n", port);
+  kill(pid, SIGKILL);
+  exit(1);
+}
+
+static void stopBroker(pid_t pid) {
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+}
+
+static void onMessage(void *userData, int id, const Message &message) {
+  Received *received = (Received *)userData;
+  const MQTTMessage &mqttMessage = static_cast<const MQTTMessage &>(message);
+  std::unique_lock<std::mutex> lck(received->mutex);
+  received->messages.push_back({std::stoi(mqttMessage.payload), std::chrono::steady_clock::now()});
+}
+
+int main() {
+  pid_t brokers[2] = {startBroker(PORTS[0]), startBroker(PORTS[1])};
+
+  Received received;
+  std::vector<std::unique_ptr<MQTTClient>> subscribers;
+  for (int port : PORTS) {
+    subscribers.push_back(
+        std::make_unique<MQTTClient>(MQTTConnectionParametersBuilder().host("127.0.0.1").port(port).build()));
+    subscribers.back()->setUserData(&received);
+    subscribers.back()->setOnMessageCallback(onMessage);
+    subscribers.back()->subscribe("failover/test", 1);
+    ConnectionManager::addConnection(subscribers.back().get());
+  }
+
+  MQTTClient publisher(MQTTConnectionParametersBuilder()
+                           .endpoint("127.0.0.1", PORTS[0])
+                           .endpoint("127.0.0.1", PORTS[1])
+                           .probeInterval(std::chrono::milliseconds(200))
+                           .failoverLatency(std::chrono::milliseconds(200))
+                           .sendMaximum(100)
+                           .build());
+  publisher.setMaxQueueSize(100000);
+  ConnectionManager::addConnection(&publisher);
+  ConnectionManager::start();
+  publisher.waitForStatus(CONNECTION_STATUS_CONNECTED, std::chrono::seconds(5));
+  for (auto &subscriber : subscribers)
+    subscriber->waitForStatus(CONNECTION_STATUS_CONNECTED, std::chrono::seconds(5));
+
+  auto start = std::chrono::steady_clock::now();
+  bool killed = false, restarted = false;
+  int sent = 0;
+  while (std::chrono::steady_clock::now() - start < DURATION) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    if (!killed && elapsed >= KILL_AT) {
+      stopBroker(brokers[0]);
+      killed = true;
+      printf("killed the broker on %d after %d messages\n", PORTS[0], sent);
+    }
+    if (!restarted && elapsed >= RESTART_AT) {
+      brokers[0] = startBroker(PORTS[0]);
+      restarted = true;
+      printf("restarted the broker on %d, active endpoint %zu\n", PORTS[0], publisher.getActiveEndpoint());
+    }
+    MQTTMessage message("failover/test", std::to_string(sent), 1, false);
+    if (publisher.queueSend(message)) sent++;
+    std::this_thread::sleep_for(SEND_INTERVAL);
+  }
+  // Room for the last acknowledgements
+  std::this_thread::sleep_for(std::chrono::seconds(2));
+
+  std::vector<std::pair<int, std::chrono::steady_clock::time_point>> messages;
+  {
+    std::unique_lock<std::mutex> lck(received.mutex);
+    messages = received.messages;
+  }
+  std::sort(messages.begin(), messages.end(), [](auto &a, auto &b) { return a.second < b.second; });
+  double longestGapMs = 0;
+  for (size_t i = 1; i < messages.size(); i++)
+    longestGapMs = std::max(
+        longestGapMs, std::chrono::duration<double, std::milli>(messages[i].second - messages[i - 1].second).count());
+  std::vector<bool> seen(sent, false);
+  size_t duplicates = 0;
+  for (auto &[sequence, time] : messages) {
+    if (sequence < 0 || sequence >= sent) continue;
+    if (seen[sequence]) duplicates++;
+    seen[sequence] = true;
+  }
+  size_t missing = std::count(seen.begin(), seen.end(), false);
+
+  MQTTClientMetrics metrics = publisher.getMetrics();
+  printf("%d sent, %zu received, %zu missing, %zu duplicates, longest gap %.1f ms, %lu failovers, "
+         "active endpoint %zu\n",
+         sent, messages.size(), missing, duplicates, longestGapMs, (unsigned long)metrics.failovers,
+         publisher.getActiveEndpoint());
+  for (const MQTTEndpointStatus &status : publisher.getEndpointStatus())
+    printf("  %s:%d %s%s ping %.2f ms\n", status.endpoint.host.c_str(), status.endpoint.port,
+           status.healthy ? "healthy" : "down", status.active ? ", active" : "", status.pingMs);
+  // Messages the killed broker had acknowledged but not yet delivered are
+  // gone with it; only unacknowledged ones are sent again
+
+  ConnectionManager::stop();
+  ConnectionManager::removeConnection(&publisher);
+  for (auto &subscriber : subscribers) ConnectionManager::removeConnection(subscriber.get());
+  publisher.disconnect();
+  for (auto &subscriber : subscribers) subscriber->disconnect();
+  for (pid_t broker : brokers) stopBroker(broker);
+  return 0;
+}
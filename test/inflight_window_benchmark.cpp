@@ -0,0 +1,65 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+#include "mqtt_connection.h"
+
+// QoS 1 publish throughput against a broker on localhost:1883 for a range of
+// in-flight windows (sendMaximum), on MQTT 3.1.1 and 5. Messages go through
+// sendFor(), so the connection's queue holds whatever the window refuses and
+// the producer parks while it is full.
+
+static const size_t MESSAGES = 50000;
+static const size_t PAYLOAD_SIZE = 128;
+
+static std::atomic<size_t> completed = 0;
+
+static void onPublish(void *userData, int id, int messageId) { completed++; }
+
+static bool waitFor(std::chrono::seconds timeout, auto condition) {
+  auto end = std::chrono::steady_clock::now() + timeout;
+  while (!condition()) {
+    if (std::chrono::steady_clock::now() > end) return false;
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  return true;
+}
+
+static void run(int protocolVersion, int window) {
+  MQTTConnection connection(MQTTConnectionParametersBuilder()
+                                .host("localhost")
+                                .port(1883)
+                                .protocolVersion(protocolVersion)
+                                .sendMaximum(window)
+                                .receiveMaximum(window)
+                                .build());
+  connection.setMaxQueueSize(MESSAGES);
+  connection.setOnPublishCallback(onPublish);
+  completed = 0;
+
+  connection.connect();
+  if (!waitFor(std::chrono::seconds(5), [&]() { return connection.getStatus() == CONNECTION_STATUS_CONNECTED; })) {
+    printf("no broker on localhost:1883\n");
+    exit(0);
+  }
+
+  MQTTMessage message("benchmark/window", std::string(PAYLOAD_SIZE, 'w'), 1, false);
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < MESSAGES; i++)
+    while (!connection.sendFor(message, std::chrono::seconds(1))) {
+    }
+  bool complete = waitFor(std::chrono::seconds(60), [&]() { return completed.load() >= MESSAGES; });
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  printf("v%s window %5d (effective %5zu): %9.0f msgs/s%s\n", protocolVersion == MQTT_PROTOCOL_V5 ? "5  " : "311",
+         window, connection.getSendWindow(), completed.load() / seconds, complete ? "" : " (timeout)");
+  connection.disconnect();
+}
+
+int main() {
+  for (int protocolVersion : {MQTT_PROTOCOL_V311, MQTT_PROTOCOL_V5})
+    for (int window : {1, 2, 5, 10, 20, 50, 100, 500, 2000}) run(protocolVersion, window);
+  return 0;
+}
@@ -0,0 +1,146 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "last_value_cache.h"
+
+// One writer updating 500 signals, as a receive thread would, while readers
+// poll them. Compares LastValueCache with a mutex-guarded unordered_map:
+// update and read cost, and whether readers ever see a torn value (every
+// payload repeats the topic index and the update number).
+
+static const size_t TOPICS = 500;
+static const size_t READERS = 3;
+static const auto DURATION = std::chrono::seconds(2);
+
+static const size_t WORDS = 6;
+
+// The same word (topic index, update number) repeated, so a torn copy that
+// mixes two updates shows
+static void fillPayload(std::string &payload, size_t topic, uint64_t update) {
+  uint64_t word = (uint64_t)topic << 32 | (update & 0xffffffff);
+  payload.resize(WORDS * sizeof(word));
+  for (size_t i = 0; i < WORDS; i++) memcpy(payload.data() + i * sizeof(word), &word, sizeof(word));
+}
+
+static bool consistent(size_t topic, const std::string &payload) {
+  uint64_t first, word;
+  if (payload.size() != WORDS * sizeof(first)) return false;
+  memcpy(&first, payload.data(), sizeof(first));
+  if (first >> 32 != topic) return false;
+  for (size_t i = 1; i < WORDS; i++) {
+    memcpy(&word, payload.data() + i * sizeof(word), sizeof(word));
+    if (word != first) return false;
+  }
+  return true;
+}
+
+struct MutexCache {
+  std::mutex mutex;
+  std::unordered_map<std::string, std::string> values;
+
+  void update(const std::string &topic, const std::string &payload) {
+    std::unique_lock<std::mutex> lck(mutex);
+    values[topic] = payload;
+  }
+  bool getLast(const std::string &topic, std::string &payload) {
+    std::unique_lock<std::mutex> lck(mutex);
+    auto found = values.find(topic);
+    if (found == values.end()) return false;
+    payload = found->second;
+    return true;
+  }
+};
+
+template <typename Update, typename Read>
+static void run(const char *name, Update update, Read read) {
+  std::vector<std::string> topics, payloads;
+  for (size_t i = 0; i < TOPICS; i++) {
+    topics.push_back("car/signal/" + std::to_string(i));
+    payloads.emplace_back();
+    fillPayload(payloads[i], i, 0);
+    update(i, topics[i], payloads[i]);
+  }
+
+  std::atomic<bool> running{true};
+  std::atomic<uint64_t> reads{0}, torn{0};
+  std::vector<std::thread> readers;
+  for (size_t r = 0; r < READERS; r++) {
+    readers.emplace_back([&, r]() {
+      std::string payload;
+      uint64_t count = 0, bad = 0;
+      for (size_t i = r; running.load(std::memory_order_relaxed); i = (i + 7) % TOPICS) {
+        if (read(i, topics[i], payload) && !consistent(i, payload)) bad++;
+        count++;
+      }
+      reads += count;
+      torn += bad;
+    });
+  }
+
+  uint64_t updates = 0;
+  auto start = std::chrono::steady_clock::now();
+  while (std::chrono::steady_clock::now() - start < DURATION) {
+    for (size_t i = 0; i < TOPICS; i++) {
+      fillPayload(payloads[i], i, updates);
+      update(i, topics[i], payloads[i]);
+    }
+    updates++;
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  running = false;
+  for (auto &reader : readers) reader.join();
+
+  printf("%-18s: %8.1f M updates/s, %8.1f M reads/s over %zu readers, %llu torn reads\n", name,
+         updates * TOPICS / seconds / 1e6, reads.load() / seconds / 1e6, READERS, (unsigned long long)torn.load());
+}
+
+int main() {
+  {
+    LastValueCache cache(TOPICS, 64, 128);
+    auto now = std::chrono::system_clock::now();
+    run(
+        "LastValueCache",
+        [&](size_t, const std::string &topic, const std::string &payload) { cache.update(topic, payload, 0, false, now); },
+        [&](size_t, const std::string &topic, std::string &payload) {
+          thread_local LastValue value;
+          if (!cache.getLast(topic, value)) return false;
+          payload.swap(value.payload);
+          return true;
+        });
+    auto start = std::chrono::steady_clock::now();
+    size_t total = 0;
+    for (int i = 0; i < 1000; i++) total += cache.snapshot("car/signal/#").size();
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / 1000;
+    printf("snapshot of %zu topics: %.1f us\n", total / 1000, us);
+  }
+  {
+    LastValueCache cache(TOPICS, 64, 128);
+    auto now = std::chrono::system_clock::now();
+    std::vector<int> ids;
+    for (size_t i = 0; i < TOPICS; i++) ids.push_back(cache.intern("car/signal/" + std::to_string(i)));
+    run(
+        "LastValueCache ids",
+        [&](size_t, const std::string &topic, const std::string &payload) { cache.update(topic, payload, 0, false, now); },
+        [&](size_t i, const std::string &, std::string &payload) {
+          thread_local LastValue value;
+          if (!cache.getLast(ids[i], value)) return false;
+          payload.swap(value.payload);
+          return true;
+        });
+  }
+  {
+    MutexCache cache;
+    run(
+        "mutex + map",
+        [&](size_t, const std::string &topic, const std::string &payload) { cache.update(topic, payload); },
+        [&](size_t, const std::string &topic, std::string &payload) { return cache.getLast(topic, payload); });
+  }
+  return 0;
+}
@@ -23,8 +23,8 @@ int main() {
         MQTTMessage *msg = (MQTTMessage *) &message;
         std::cout << msg->topic << ": " << msg->payload << std::endl;
     };
-    OnErrorCallback onErrorCallback = [](void *data, int id, const char *error) {
-        std::cout << "Error: " << error << std::endl;
+    OnErrorCallback onErrorCallback = [](void *data, int id, const ConnectionError &error) {
+        std::cout << "Error: " << error.message << " (" << error.backendCode << ")" << std::endl;
     };
 
     MQTTConnectionParameters parameters = MQTTConnectionParametersBuilder()
@@ -50,10 +50,8 @@ int main() {
 
         conn->connect();
 
-        while (conn->getStatus() == ConnectionStatus::CONNECTION_STATUS_CONNECTING) {
-            std::cout << "Connecting..." << std::endl;
-            usleep(100000);
-        }
+        std::cout << "Connecting..." << std::endl;
+        conn->waitForStatusChange(ConnectionStatus::CONNECTION_STATUS_CONNECTING, std::chrono::seconds(10));
 
         std::cout << "Connected (?)" << std::endl;
 
@@ -0,0 +1,106 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+#include "mqtt_connection.h"
+
+// Producer/consumer through a mutex protected queue, the way Connection
+// queues messages: once with a heap allocated MQTTMessage per message, once
+// with MQTTMessagePool handles. Runs unpaced for throughput and paced at
+// 200k msgs/s for RSS.
+
+static const size_t RATE = 200000;
+static const auto DURATION = std::chrono::seconds(3);
+
+static long rssKb() {
+  long pages = 0, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f) return -1;
+  if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = -1;
+  fclose(f);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Mostly small telemetry frames, one in a hundred is large
+static std::vector<std::string> makePayloads() {
+  std::mt19937 rng(42);
+  std::vector<std::string> payloads;
+  for (int i = 0; i < 1000; i++) {
+    size_t size = i % 100 == 0 ? 2048 : 16 + rng() % 240;
+    payloads.emplace_back(size, 'a' + i % 26);
+  }
+  return payloads;
+}
+
+template <typename Item, typename Make>
+void run(const char *name, bool paced, Make make) {
+  static const std::vector<std::string> payloads = makePayloads();
+  std::mutex mutex;
+  std::condition_variable condition;
+  std::queue<Item> queue;
+  bool done = false;
+  size_t consumed = 0;
+
+  std::thread consumer([&]() {
+    while (true) {
+      std::unique_lock<std::mutex> lck(mutex);
+      condition.wait(lck, [&]() { return done || !queue.empty(); });
+      if (queue.empty() && done) break;
+      while (!queue.empty()) {
+        queue.pop();
+        consumed++;
+      }
+    }
+  });
+
+  long rssBefore = rssKb();
+  auto start = std::chrono::steady_clock::now();
+  auto end = start + DURATION;
+  size_t produced = 0;
+  while (std::chrono::steady_clock::now() < end) {
+    if (paced) {
+      auto due = start + std::chrono::nanoseconds(produced * 1000000000ull / RATE);
+      while (std::chrono::steady_clock::now() < due) {
+      }
+    }
+    Item item = make("car/telemetry/frame", payloads[produced % payloads.size()]);
+    {
+      std::unique_lock<std::mutex> lck(mutex);
+      queue.push(std::move(item));
+    }
+    condition.notify_one();
+    produced++;
+  }
+  {
+    std::unique_lock<std::mutex> lck(mutex);
+    done = true;
+  }
+  condition.notify_one();
+  consumer.join();
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("%-6s %-8s %10.0f msgs/s  rss %6ld kB -> %6ld kB\n", name, paced ? "paced" : "unpaced",
+         consumed / seconds, rssBefore, rssKb());
+}
+
+int main() {
+  MQTTMessagePool pool;
+  pool.reserve(4096);
+
+  for (bool paced : {false, true}) {
+    run<std::unique_ptr<MQTTMessage>>("heap", paced, [](const std::string &topic, const std::string &payload) {
+      return std::make_unique<MQTTMessage>(topic, payload);
+    });
+    run<PoolHandle<Message>>("pool", paced, [&](const std::string &topic, const std::string &payload) {
+      return PoolHandle<Message>(pool.acquire(topic, payload));
+    });
+  }
+  printf("pool capacity %zu, available %zu\n", pool.capacity(), pool.available());
+  return 0;
+}
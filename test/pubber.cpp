@@ -16,8 +16,8 @@ int main() {
         MQTTMessage *msg = (MQTTMessage *) &message;
         std::cout << id << " " << msg->topic << ": " << msg->payload << std::endl;
     };
-    OnErrorCallback onErrorCallback = [](void *data, int id, const char *error) {
-        std::cout << id << " Error: " << error << std::endl;
+    OnErrorCallback onErrorCallback = [](void *data, int id, const ConnectionError &error) {
+        std::cout << id << " Error: " << error.message << " (" << error.backendCode << ")" << std::endl;
     };
 
     MQTTConnectionParameters parameters1;
@@ -49,17 +49,11 @@ int main() {
     std::cout << ConnectionManager::addConnection(conn2) << std::endl;
 
     ConnectionManager::start();
-    usleep(1e5);
 
-    while (conn1->getStatus() == CONNECTION_STATUS_CONNECTING) {
-        std::cout << "1 Connecting..." << std::endl;
-        usleep(100000);
-    }
-
-    while (conn2->getStatus() == CONNECTION_STATUS_CONNECTING) {
-        std::cout << "2 Connecting..." << std::endl;
-        usleep(100000);
-    }
+    std::cout << "1 Connecting..." << std::endl;
+    conn1->waitForStatus(CONNECTION_STATUS_CONNECTED, std::chrono::seconds(10));
+    std::cout << "2 Connecting..." << std::endl;
+    conn2->waitForStatus(CONNECTION_STATUS_CONNECTED, std::chrono::seconds(10));
 
     MQTTMessage msg;
     msg.topic = "test_topic";
@@ -0,0 +1,106 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <deque>
+#include <vector>
+
+#include "rate_controller.h"
+
+// Simulated uplink whose bandwidth swings 100x over a 60 s lap (100 to
+// 10000 messages per second, 20 ms base round trip), saturated by a sender
+// with an endless backlog. Compares fixed in-flight windows with the
+// RateController: throughput, acknowledgement latency, and how closely the
+// target rate follows the link. Simulated time, no broker needed.
+
+using Clock = RateController::Clock;
+
+static const double LAP_SECONDS = 60;
+static const double DURATION_SECONDS = 120;
+static const double BASE_RTT_SECONDS = 0.020;
+
+static double bandwidth(double t) {
+  // log10 of the rate goes 2 -> 4 -> 2 over a lap, with a few sharp drops
+  double phase = std::fmod(t, LAP_SECONDS) / LAP_SECONDS;
+  double exponent = 3 - std::cos(phase * 2 * M_PI);
+  if (std::fmod(t, 13.0) < 1.5) exponent -= 1;  // tunnel
+  return std::pow(10, exponent);
+}
+
+struct Result {
+  size_t delivered = 0;
+  std::vector<double> latenciesMs;
+  double rateErrorSum = 0;
+  size_t rateSamples = 0;
+};
+
+static Result run(size_t fixedWindow, RateController *controller) {
+  Result result;
+  Clock::time_point epoch = Clock::time_point() + std::chrono::hours(1);
+  double now = 0, linkFree = 0;
+  // Messages in flight, served in order by the link: (ack time, send time)
+  std::deque<std::pair<double, double>> acks;
+
+  auto window = [&]() { return controller ? controller->getWindow() : fixedWindow; };
+  auto fill = [&]() {
+    while (acks.size() < window()) {
+      double start = std::max(now, linkFree);
+      linkFree = start + 1 / bandwidth(start);
+      acks.push_back({linkFree + BASE_RTT_SECONDS, now});
+    }
+  };
+
+  fill();
+  double nextSample = 0;
+  while (!acks.empty() && now < DURATION_SECONDS) {
+    auto [ackTime, sendTime] = acks.front();
+    acks.pop_front();
+    now = ackTime;
+    double latency = ackTime - sendTime;
+    result.delivered++;
+    if (result.latenciesMs.size() < 10000000) result.latenciesMs.push_back(latency * 1000);
+    if (controller) {
+      controller->onAck((int64_t)(latency * 1e6), epoch + std::chrono::microseconds((int64_t)(now * 1e6)));
+      if (now >= nextSample && controller->getTargetRate() > 0) {
+        result.rateErrorSum += std::fabs(std::log10(controller->getTargetRate() / bandwidth(now)));
+        result.rateSamples++;
+        nextSample = now + 0.1;
+      }
+    }
+    fill();
+  }
+  return result;
+}
+
+static void report(const char *name, Result &result) {
+  std::sort(result.latenciesMs.begin(), result.latenciesMs.end());
+  auto percentile = [&](double p) {
+    return result.latenciesMs.empty() ? 0.0 : result.latenciesMs[(size_t)(p * (result.latenciesMs.size() - 1))];
+  };
+  printf("%-22s %10.0f msg/s  latency p50 %8.1f ms  p99 %8.1f ms", name, result.delivered / DURATION_SECONDS,
+         percentile(0.5), percentile(0.99));
+  if (result.rateSamples > 0)
+    printf("  target rate off by %.2fx on average", std::pow(10, result.rateErrorSum / result.rateSamples));
+  printf("\n");
+}
+
+int main() {
+  double capacity = 0;
+  for (double t = 0; t < DURATION_SECONDS; t += 0.001) capacity += bandwidth(t) * 0.001;
+  printf("link capacity %.0f msg/s on average\n", capacity / DURATION_SECONDS);
+
+  for (size_t window : {20, 200, 2000}) {
+    Result result = run(window, nullptr);
+    char name[32];
+    snprintf(name, sizeof(name), "fixed window %zu", window);
+    report(name, result);
+  }
+
+  RateControlOptions options;
+  options.enabled = true;
+  options.maxWindow = 2000;
+  RateController controller(options);
+  Result result = run(0, &controller);
+  report("rate controller", result);
+  return 0;
+}
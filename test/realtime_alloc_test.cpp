@@ -0,0 +1,113 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include "mqtt_connection.h"
+#include "realtime_publisher.h"
+
+// Interposes the allocator and counts every heap allocation made by a thread
+// while it is "armed". The real-time publish path must not make any.
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+extern "C" void *__libc_memalign(size_t alignment, size_t size);
+
+static thread_local bool armed = false;
+static std::atomic<size_t> forbiddenAllocations = 0;
+
+static inline void check() {
+  if (armed) forbiddenAllocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+extern "C" void *malloc(size_t size) {
+  check();
+  return __libc_malloc(size);
+}
+extern "C" void *calloc(size_t count, size_t size) {
+  check();
+  return __libc_calloc(count, size);
+}
+extern "C" void *realloc(void *ptr, size_t size) {
+  check();
+  return __libc_realloc(ptr, size);
+}
+extern "C" void *memalign(size_t alignment, size_t size) {
+  check();
+  return __libc_memalign(alignment, size);
+}
+extern "C" int posix_memalign(void **ptr, size_t alignment, size_t size) {
+  check();
+  *ptr = __libc_memalign(alignment, size);
+  return *ptr ? 0 : ENOMEM;
+}
+extern "C" void *aligned_alloc(size_t alignment, size_t size) {
+  check();
+  return __libc_memalign(alignment, size);
+}
+
+static const size_t MESSAGES = 1000000;
+static std::atomic<size_t> published = 0;
+
+static bool countingPublish(void *context, const char *topic, const void *payload, size_t size, int qos,
+                            bool retain) {
+  published.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+static bool publisherSteadyState() {
+  RealtimePublisher publisher(256, 64, 256, countingPublish, nullptr);
+  char payload[200];
+  memset(payload, 0xab, sizeof(payload));
+
+  size_t full = 0;
+  std::thread producer([&]() {
+    armed = true;
+    for (size_t i = 0; i < MESSAGES; i++) {
+      payload[0] = (char)i;
+      while (!publisher.push("vehicle/imu", payload, sizeof(payload), 0, false)) full++;
+    }
+    armed = false;
+  });
+  producer.join();
+  while (published.load() < MESSAGES) std::this_thread::yield();
+
+  size_t allocations = forbiddenAllocations.exchange(0);
+  printf("publisher: %zu messages, %zu full retries, %zu allocations\n", published.load(), full, allocations);
+  return allocations == 0;
+}
+
+static bool connectionSteadyState() {
+  MQTTConnection connection(
+      MQTTConnectionParametersBuilder().host("localhost").realtime(128, 64, 256).build());
+  char payload[100];
+  memset(payload, 0xcd, sizeof(payload));
+
+  // Not connected: the slots fill up and further sends are refused, neither
+  // may allocate on the caller's thread
+  size_t accepted = 0, refused = 0;
+  std::thread producer([&]() {
+    armed = true;
+    for (size_t i = 0; i < 1000; i++) {
+      if (connection.sendRealtime("vehicle/can", payload, sizeof(payload), 1, false))
+        accepted++;
+      else
+        refused++;
+    }
+    armed = false;
+  });
+  producer.join();
+
+  size_t allocations = forbiddenAllocations.exchange(0);
+  printf("connection: %zu accepted, %zu refused, %zu allocations\n", accepted, refused, allocations);
+  return allocations == 0 && accepted == 128;
+}
+
+int main() {
+  bool ok = publisherSteadyState();
+  ok = connectionSteadyState() && ok;
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,138 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+
+#include "mqtt_connection.h"
+#include "paho_mqtt_connection.hpp"
+
+// Reconnect time and heap allocations per reconnect against a broker on
+// localhost:1883, for both backends: a connection that keeps its client
+// handle and only re-dials, against a new connection (client, options and
+// callbacks built again) for every cycle as before.
+
+static const int CYCLES = 200;
+
+// Every malloc in the process is counted, libmosquitto's, Paho's and
+// OpenSSL's included
+static std::atomic<size_t> allocations = 0;
+
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+extern "C" void *malloc(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+extern "C" void *calloc(size_t count, size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+extern "C" void *realloc(void *ptr, size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+#endif
+
+static int64_t nowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static void report(const char *name, int cycles, int64_t elapsedUs, size_t allocated) {
+  if (cycles == 0) {
+    printf("%-16s: no broker on localhost:1883\n", name);
+    return;
+  }
+  printf("%-16s: %8.1f us per reconnect, %8.1f allocations per reconnect\n", name, (double)elapsedUs / cycles,
+         (double)allocated / cycles);
+}
+
+static MQTTConnectionParameters mosquittoParameters() {
+  return MQTTConnectionParametersBuilder().host("localhost").port(1883).build();
+}
+
+static bool mosquittoCycle(MQTTConnection &connection) {
+  connection.connect();
+  bool connected = connection.waitForStatus(CONNECTION_STATUS_CONNECTED, std::chrono::seconds(5));
+  connection.disconnect();
+  return connected;
+}
+
+static void runMosquitto(bool reuse) {
+  MQTTConnection reused(mosquittoParameters());
+  int cycles = 0;
+  int64_t start = nowUs();
+  size_t before = allocations.load();
+  for (; cycles < CYCLES; cycles++) {
+    if (reuse) {
+      if (!mosquittoCycle(reused)) break;
+    } else {
+      MQTTConnection fresh(mosquittoParameters());
+      if (!mosquittoCycle(fresh)) break;
+    }
+  }
+  report(reuse ? "mosquitto reuse" : "mosquitto fresh", cycles, nowUs() - start, allocations.load() - before);
+}
+
+struct PahoWait {
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool connected = false;
+};
+
+static void onPahoConnect(PAHOMQTTConnection *connection, void *userData) {
+  PahoWait *wait = (PahoWait *)userData;
+  std::unique_lock<std::mutex> lck(wait->mutex);
+  wait->connected = true;
+  wait->condition.notify_one();
+}
+
+static bool pahoCycle(PAHOMQTTConnection &connection, PahoWait &wait) {
+  {
+    std::unique_lock<std::mutex> lck(wait.mutex);
+    wait.connected = false;
+  }
+  connection.setUserData(&wait);
+  connection.setOnConnectCallback(onPahoConnect);
+  connection.connect();
+  bool connected;
+  {
+    std::unique_lock<std::mutex> lck(wait.mutex);
+    connected = wait.condition.wait_for(lck, std::chrono::seconds(5), [&]() { return wait.connected; });
+  }
+  connection.disconnect();
+  return connected;
+}
+
+static void runPaho(bool reuse) {
+  PAHOMQTTConnectionParameters parameters;
+  parameters.uri = "tcp://localhost:1883";
+  PahoWait wait;
+  PAHOMQTTConnection reused(parameters);
+  int cycles = 0;
+  int64_t start = nowUs();
+  size_t before = allocations.load();
+  for (; cycles < CYCLES; cycles++) {
+    if (reuse) {
+      if (!pahoCycle(reused, wait)) break;
+    } else {
+      PAHOMQTTConnection fresh(parameters);
+      if (!pahoCycle(fresh, wait)) break;
+    }
+  }
+  report(reuse ? "paho reuse" : "paho fresh", cycles, nowUs() - start, allocations.load() - before);
+}
+
+int main() {
+  runMosquitto(false);
+  runMosquitto(true);
+  runPaho(false);
+  runPaho(true);
+  return 0;
+}
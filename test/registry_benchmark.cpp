@@ -0,0 +1,117 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "connection_registry.h"
+
+// Compares the snapshot registry against the previous vector + mutex layout:
+// a supervisor thread iterates every 100 us while writer threads keep adding
+// and removing connections.
+
+static const int CONNECTIONS = 5000;
+static const int WRITERS = 4;
+static const auto DURATION = std::chrono::seconds(2);
+
+struct Dummy {
+  std::atomic<int> status{0};
+};
+
+struct VectorRegistry {
+  std::mutex mutex;
+  std::vector<Dummy *> connections;
+
+  bool add(Dummy *connection) {
+    std::unique_lock<std::mutex> lck(mutex);
+    for (auto *conn : connections)
+      if (conn == connection) return false;
+    connections.push_back(connection);
+    return true;
+  }
+  bool remove(Dummy *connection) {
+    std::unique_lock<std::mutex> lck(mutex);
+    for (size_t i = 0; i < connections.size(); i++) {
+      if (connections[i] == connection) {
+        connections.erase(connections.begin() + i);
+        return true;
+      }
+    }
+    return false;
+  }
+  size_t iterate() {
+    std::unique_lock<std::mutex> lck(mutex);
+    size_t visited = 0;
+    for (auto *conn : connections) visited += conn->status.load() == 0;
+    return visited;
+  }
+};
+
+struct SnapshotRegistry {
+  ConnectionRegistry<Dummy *> registry;
+  std::vector<Dummy> *pool;
+
+  bool add(Dummy *connection) { return registry.add(connection - pool->data(), connection); }
+  bool remove(Dummy *connection) { return registry.remove(connection - pool->data()); }
+  size_t iterate() {
+    size_t visited = 0;
+    auto snapshot = registry.snapshot();
+    for (auto &[id, conn] : *snapshot) visited += conn->status.load() == 0;
+    return visited;
+  }
+};
+
+template <typename Registry>
+void run(const char *name, Registry &registry, std::vector<Dummy> &pool) {
+  for (int i = 0; i < CONNECTIONS; i++) registry.add(&pool[i]);
+
+  std::atomic<bool> running = true;
+  std::atomic<size_t> writes = 0;
+  std::vector<std::thread> writers;
+  for (int w = 0; w < WRITERS; w++) {
+    writers.emplace_back([&, w]() {
+      // Each writer churns its own slice of the connections
+      size_t i = w;
+      while (running.load()) {
+        Dummy *conn = &pool[i % CONNECTIONS];
+        registry.remove(conn);
+        registry.add(conn);
+        writes += 2;
+        i += WRITERS;
+      }
+    });
+  }
+
+  size_t ticks = 0;
+  double worstUs = 0, totalUs = 0;
+  auto end = std::chrono::steady_clock::now() + DURATION;
+  while (std::chrono::steady_clock::now() < end) {
+    auto t0 = std::chrono::steady_clock::now();
+    registry.iterate();
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+    totalUs += us;
+    worstUs = std::max(worstUs, us);
+    ticks++;
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  running = false;
+  for (auto &t : writers) t.join();
+
+  std::cout << name << ": " << ticks << " ticks, avg " << totalUs / ticks << " us, worst " << worstUs
+            << " us, " << writes.load() / std::chrono::duration<double>(DURATION).count() << " add/remove per s"
+            << std::endl;
+}
+
+int main() {
+  std::vector<Dummy> pool(CONNECTIONS);
+  std::cout << CONNECTIONS << " connections, " << WRITERS << " writer threads" << std::endl;
+
+  VectorRegistry vectorRegistry;
+  run("vector + mutex", vectorRegistry, pool);
+
+  SnapshotRegistry snapshotRegistry;
+  snapshotRegistry.pool = &pool;
+  run("snapshot registry", snapshotRegistry, pool);
+  return 0;
+}
@@ -0,0 +1,62 @@
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "connection.h"
+
+// Time from a CONNECTING -> CONNECTED change to the waiting thread noticing
+// it: the getStatus() + usleep polling loops the examples used, against
+// waitForStatus() and poll() on the status event fd.
+
+static const int ROUNDS = 200;
+
+static int64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+template <typename Wait>
+static void run(const char *name, Wait wait) {
+  std::vector<double> latenciesUs;
+  std::mt19937 random(42);
+  std::uniform_int_distribution<int> delayUs(500, 5000);
+
+  for (int i = 0; i < ROUNDS; i++) {
+    ConnectionState state(CONNECTION_STATUS_CONNECTING);
+    int64_t changed = 0;
+    std::thread connector([&]() {
+      std::this_thread::sleep_for(std::chrono::microseconds(delayUs(random)));
+      changed = nowNs();
+      state = CONNECTION_STATUS_CONNECTED;
+    });
+    wait(state);
+    int64_t noticed = nowNs();
+    connector.join();
+    latenciesUs.push_back((noticed - changed) / 1000.0);
+  }
+
+  std::sort(latenciesUs.begin(), latenciesUs.end());
+  printf("%-16s: p50 %9.1f us, p99 %9.1f us\n", name, latenciesUs[latenciesUs.size() / 2],
+         latenciesUs[latenciesUs.size() * 99 / 100]);
+}
+
+int main() {
+  run("poll 10ms", [](ConnectionState &state) {
+    while (state.load() == CONNECTION_STATUS_CONNECTING) usleep(10000);
+  });
+  run("poll 1ms", [](ConnectionState &state) {
+    while (state.load() == CONNECTION_STATUS_CONNECTING) usleep(1000);
+  });
+  run("waitFor", [](ConnectionState &state) { state.waitFor(CONNECTION_STATUS_CONNECTED, std::chrono::seconds(1)); });
+  run("event fd", [](ConnectionState &state) {
+    struct pollfd pfd = {state.getEventFd(), POLLIN, 0};
+    while (state.load() == CONNECTION_STATUS_CONNECTING) poll(&pfd, 1, 1000);
+  });
+  return 0;
+}
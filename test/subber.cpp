@@ -16,8 +16,8 @@ int main() {
         MQTTMessage *msg = (MQTTMessage *) &message;
         std::cout << msg->timestamp.time_since_epoch().count() << " " << msg->topic << ": " << msg->payload << std::endl;
     };
-    OnErrorCallback onErrorCallback = [](void *data, int id, const char *error) {
-        std::cout << "Error: " << error << std::endl;
+    OnErrorCallback onErrorCallback = [](void *data, int id, const ConnectionError &error) {
+        std::cout << "Error: " << error.message << " (" << error.backendCode << ")" << std::endl;
     };
 
     MQTTConnectionParameters parameters;
@@ -35,10 +35,8 @@ int main() {
     conn->connect();
     connection.subscribe("test_topic");
 
-    while (conn->getStatus() == CONNECTION_STATUS_CONNECTING) {
-        std::cout << "Connecting..." << std::endl;
-        usleep(100000);
-    }
+    std::cout << "Connecting..." << std::endl;
+    conn->waitForStatusChange(CONNECTION_STATUS_CONNECTING, std::chrono::seconds(10));
 
     int count = 0;
     while (true) {
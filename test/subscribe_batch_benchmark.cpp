@@ -0,0 +1,96 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mqtt_connection.h"
+#include "paho_mqtt_connection.hpp"
+
+// Time until 800 filters are acknowledged by a broker on localhost:1883, the
+// pit dashboard startup: one filter per packet (maxSubscribePacketSize 1)
+// against the default batching, on both backends.
+
+static const size_t FILTERS = 800;
+
+static std::atomic<bool> done = false;
+static std::atomic<size_t> refused = 0;
+
+static void onBatch(void *userData, int id, int batchId, size_t count, size_t batchRefused) {
+  refused = batchRefused;
+  done = true;
+}
+
+static void onPahoBatch(PAHOMQTTConnection *connection, void *userData, int batchId, size_t count,
+                        size_t batchRefused) {
+  refused = batchRefused;
+  done = true;
+}
+
+static bool waitFor(std::chrono::seconds timeout, auto condition) {
+  auto end = std::chrono::steady_clock::now() + timeout;
+  while (!condition()) {
+    if (std::chrono::steady_clock::now() > end) return false;
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+  return true;
+}
+
+static std::vector<std::string> makeFilters() {
+  std::vector<std::string> filters;
+  for (size_t i = 0; i < FILTERS; i++)
+    filters.push_back("pit/car" + std::to_string(i % 20) + "/sensor/" + std::to_string(i) + "/#");
+  return filters;
+}
+
+static void report(const char *name, size_t packetSize, double ms, bool complete) {
+  printf("%-10s packet %6zu B: %8.2f ms to all subscribed, %zu refused%s\n", name, packetSize, ms, refused.load(),
+         complete ? "" : " (timeout)");
+}
+
+static void runMosquitto(const std::vector<std::string> &filters, size_t packetSize) {
+  MQTTConnection connection(
+      MQTTConnectionParametersBuilder().host("localhost").port(1883).maxSubscribePacketSize(packetSize).build());
+  connection.connect();
+  if (!waitFor(std::chrono::seconds(5), [&]() { return connection.getStatus() == CONNECTION_STATUS_CONNECTED; })) {
+    printf("mosquitto: no broker on localhost:1883\n");
+    return;
+  }
+  done = false;
+  auto start = std::chrono::steady_clock::now();
+  connection.subscribeMany(filters, 1, onBatch);
+  bool complete = waitFor(std::chrono::seconds(30), []() { return done.load(); });
+  report("mosquitto", packetSize,
+         std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(), complete);
+  connection.disconnect();
+}
+
+static void runPaho(const std::vector<std::string> &filters, size_t packetSize) {
+  PAHOMQTTConnectionParameters parameters;
+  parameters.uri = "tcp://localhost:1883";
+  parameters.maxSubscribePacketSize = packetSize;
+  PAHOMQTTConnection connection(parameters);
+  connection.connect();
+  if (!waitFor(std::chrono::seconds(5),
+               [&]() { return connection.getStatus() == PAHOMQTTConnectionStatus::CONNECTED; })) {
+    printf("paho: no broker on localhost:1883\n");
+    return;
+  }
+  done = false;
+  auto start = std::chrono::steady_clock::now();
+  connection.subscribeMany(filters, 1, onPahoBatch);
+  bool complete = waitFor(std::chrono::seconds(30), []() { return done.load(); });
+  report("paho", packetSize,
+         std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(), complete);
+  connection.disconnect();
+}
+
+int main() {
+  std::vector<std::string> filters = makeFilters();
+  for (size_t packetSize : {(size_t)1, (size_t)1024, (size_t)65536}) {
+    runMosquitto(filters, packetSize);
+    runPaho(filters, packetSize);
+  }
+  return 0;
+}
@@ -0,0 +1,112 @@
+#include <fcntl.h>
+#include <netdb.h>
+#include <openssl/ssl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tls_context.h"
+
+// Full against resumed TLS handshakes with the TLSClientContext the
+// mosquitto backend uses, against a TLS enabled broker (by default
+// mosquitto's listener on localhost:8883):
+//
+//   tls_resumption_benchmark [host] [port] [cafile] [certfile keyfile]
+//
+// Only the TCP connect and the handshake are timed. To see what a cellular
+// link costs, add latency to loopback first, e.g.
+// tc qdisc add dev lo root netem delay 75ms
+
+static const int HANDSHAKES = 100;
+
+static int dial(const std::string &host, const std::string &port) {
+  struct addrinfo hints = {}, *addresses = nullptr;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0) return -1;
+  int fd = -1;
+  for (struct addrinfo *address = addresses; address; address = address->ai_next) {
+    fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (fd < 0) continue;
+    if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addresses);
+  return fd;
+}
+
+static void run(const char *name, const TLSOptions &options, int maxVersion, const std::string &host,
+                const std::string &port) {
+  std::string error;
+  std::unique_ptr<TLSClientContext> context = TLSClientContext::create(options, &error);
+  if (!context) {
+    printf("%-8s: %s\n", name, error.c_str());
+    exit(1);
+  }
+  SSL_CTX_set_max_proto_version(context->get(), maxVersion);
+
+  std::vector<double> timesUs;
+  for (int i = 0; i < HANDSHAKES; i++) {
+    auto start = std::chrono::steady_clock::now();
+    int fd = dial(host, port);
+    if (fd < 0) {
+      printf("%-8s: cannot connect to %s:%s\n", name, host.c_str(), port.c_str());
+      exit(1);
+    }
+    SSL *ssl = SSL_new(context->get());
+    SSL_set_fd(ssl, fd);
+    SSL_set_tlsext_host_name(ssl, host.c_str());
+    if (SSL_connect(ssl) != 1) {
+      printf("%-8s: handshake failed (is %s the broker's CA?)\n", name, options.cafile.c_str());
+      exit(1);
+    }
+    timesUs.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+    // TLS 1.3 tickets arrive after the handshake, read them before closing
+    if (SSL_version(ssl) == TLS1_3_VERSION) {
+      struct pollfd pfd = {fd, POLLIN, 0};
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+      char byte;
+      if (poll(&pfd, 1, 100) > 0) SSL_peek(ssl, &byte, 1);
+    }
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(fd);
+  }
+
+  std::sort(timesUs.begin(), timesUs.end());
+  TLSStatistics statistics = context->getStatistics();
+  printf("%-8s: %3zu of %3zu resumed, p50 %8.1f us, p99 %8.1f us\n", name, statistics.resumed,
+         statistics.handshakes, timesUs[timesUs.size() / 2], timesUs[timesUs.size() * 99 / 100]);
+}
+
+int main(int argc, char **argv) {
+  std::string host = argc > 1 ? argv[1] : "localhost";
+  std::string port = argc > 2 ? argv[2] : "8883";
+  TLSOptions options;
+  options.cafile = argc > 3 ? argv[3] : "";
+  if (argc > 5) {
+    options.certfile = argv[4];
+    options.keyfile = argv[5];
+  }
+  options.verifyHost = host;
+
+  // tlsVersion is a minimum, the maximum is pinned too so each pass
+  // measures one protocol version
+  for (auto [version, number] : {std::make_pair("tlsv1.2", TLS1_2_VERSION), std::make_pair("tlsv1.3", TLS1_3_VERSION)}) {
+    options.tlsVersion = version;
+    printf("%s\n", version);
+    options.sessionResumption = false;
+    run("full", options, number, host, port);
+    options.sessionResumption = true;
+    run("resumed", options, number, host, port);
+  }
+  return 0;
+}
@@ -0,0 +1,107 @@
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mqtt_client.h"
+
+// Round trip latency and CPU time per message through a broker on the same
+// host, over TCP on localhost:1883 against its unix socket, on each backend.
+// One message is in flight at a time. The broker needs a unix socket
+// listener, e.g. "listener 0 /tmp/mosquitto.sock" in mosquitto.conf; the
+// path can be passed as the first argument.
+
+static const size_t MESSAGES = 20000;
+static const size_t PAYLOAD_SIZE = 64;
+
+static std::mutex receivedMutex;
+static std::condition_variable receivedCondition;
+// Sequence number at the start of the last payload received, a late
+// message never completes the round trip of the next one
+static uint64_t received = UINT64_MAX;
+
+// The sender blocks instead of spinning, so CPU time counts only the work
+// done for each message
+static void onMessage(void *userData, int id, const Message &message) {
+  const std::string &payload = static_cast<const MQTTMessage &>(message).payload;
+  if (payload.size() < sizeof(uint64_t)) return;
+  std::unique_lock<std::mutex> lck(receivedMutex);
+  memcpy(&received, payload.data(), sizeof(received));
+  receivedCondition.notify_one();
+}
+
+static bool waitFor(std::chrono::seconds timeout, auto condition) {
+  auto end = std::chrono::steady_clock::now() + timeout;
+  while (!condition()) {
+    if (std::chrono::steady_clock::now() > end) return false;
+    std::this_thread::yield();
+  }
+  return true;
+}
+
+// User and system time of the whole process, broker excluded
+static double cpuSeconds() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void run(const char *backendName, MQTTBackendType backendType, const std::string &socketPath) {
+  const char *transport = socketPath.empty() ? "tcp" : "unix";
+  MQTTClient client(
+      MQTTConnectionParametersBuilder().host("localhost").port(1883).socketPath(socketPath).build(), backendType);
+  std::string topic = std::string("benchmark/transport/") + backendName + "/" + transport;
+  client.addRoute(topic, onMessage, nullptr);
+  client.subscribe(topic, 0);
+
+  client.connect();
+  if (!waitFor(std::chrono::seconds(5), [&]() { return client.getStatus() == CONNECTION_STATUS_CONNECTED; })) {
+    printf("%-10s %-4s: no broker\n", backendName, transport);
+    return;
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  MQTTMessage message(topic, std::string(PAYLOAD_SIZE, 't'), 0, false);
+  std::vector<double> latencies;
+  latencies.reserve(MESSAGES);
+  {
+    std::unique_lock<std::mutex> lck(receivedMutex);
+    received = UINT64_MAX;
+  }
+  double cpuStart = cpuSeconds();
+  auto start = std::chrono::steady_clock::now();
+  for (uint64_t sequence = 0; sequence < MESSAGES; sequence++) {
+    memcpy(message.payload.data(), &sequence, sizeof(sequence));
+    auto sent = std::chrono::steady_clock::now();
+    if (!client.send(message)) continue;
+    std::unique_lock<std::mutex> lck(receivedMutex);
+    if (!receivedCondition.wait_for(lck, std::chrono::seconds(1), [&]() { return received == sequence; })) break;
+    latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - sent).count());
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  double cpuUs = (cpuSeconds() - cpuStart) * 1e6 / std::max<size_t>(latencies.size(), 1);
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p) { return latencies.empty() ? 0.0 : latencies[(size_t)(p * (latencies.size() - 1))]; };
+  printf("%-10s %-4s: %6zu round trips in %5.2f s, rtt p50 %6.1f us p99 %7.1f us, cpu %6.1f us/msg\n", backendName,
+         transport, latencies.size(), seconds, percentile(0.5), percentile(0.99), cpuUs);
+  client.disconnect();
+}
+
+int main(int argc, char **argv) {
+  std::string socketPath = argc > 1 ? argv[1] : "/tmp/mosquitto.sock";
+  for (auto [name, backend] : {std::pair{"mosquitto", MQTT_BACKEND_MOSQUITTO}, std::pair{"paho", MQTT_BACKEND_PAHO}}) {
+    run(name, backend, "");
+    run(name, backend, socketPath);
+  }
+  return 0;
+}
@@ -0,0 +1,101 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "udp_connection.h"
+
+// Loopback throughput, latency and loss of UDPConnection: one connection
+// sends to another on 127.0.0.1, with a datagram per send() call, batched
+// with sendmmsg through queueSend(), and batched with GSO. Every payload
+// carries its send time.
+
+static const size_t MESSAGES = 200000;
+static const size_t PAYLOAD_SIZE = 64;
+
+struct Run {
+  std::atomic<size_t> received{0};
+  std::vector<double> latenciesUs;
+};
+
+static int64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static void onMessage(void *userData, int id, const Message &message) {
+  Run *run = (Run *)userData;
+  const UDPMessage &udpMessage = static_cast<const UDPMessage &>(message);
+  int64_t sent = 0;
+  if (udpMessage.payload.size() < sizeof(sent)) return;
+  memcpy(&sent, udpMessage.payload.data(), sizeof(sent));
+  size_t index = run->received.fetch_add(1);
+  if (index < run->latenciesUs.size()) run->latenciesUs[index] = (nowNs() - sent) / 1000.0;
+}
+
+static void run(const char *name, bool queued, bool gso) {
+  UDPConnectionParameters receiverParameters;
+  receiverParameters.remoteHost = "";
+  receiverParameters.localAddress = "127.0.0.1";
+  receiverParameters.socketBufferSize = 8 * 1024 * 1024;
+  UDPConnection receiver(receiverParameters);
+  Run run;
+  run.latenciesUs.resize(MESSAGES);
+  receiver.setUserData(&run);
+  receiver.setOnMessageCallback(onMessage);
+  receiver.connect();
+
+  UDPConnectionParameters senderParameters;
+  senderParameters.remoteHost = "127.0.0.1";
+  senderParameters.remotePort = receiver.getBoundPort();
+  senderParameters.localAddress = "127.0.0.1";
+  senderParameters.gso = gso;
+  UDPConnection sender(senderParameters);
+  sender.setMaxQueueSize(4096);
+  sender.connect();
+  if (receiver.getStatus() != CONNECTION_STATUS_CONNECTED || sender.getStatus() != CONNECTION_STATUS_CONNECTED) {
+    printf("could not bind on 127.0.0.1\n");
+    exit(1);
+  }
+
+  UDPMessage message(1, std::string(PAYLOAD_SIZE, 'u'));
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < MESSAGES; i++) {
+    int64_t sent = nowNs();
+    memcpy(message.payload.data(), &sent, sizeof(sent));
+    if (queued) {
+      while (!sender.queueSend(message)) std::this_thread::yield();
+    } else {
+      sender.send(message);
+    }
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  // Whatever has not arrived by then is lost
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+  UDPStatistics sent = sender.getStatistics();
+  UDPStatistics statistics = receiver.getStatistics();
+  size_t received = std::min(run.received.load(), MESSAGES);
+  std::vector<double> &latencies = run.latenciesUs;
+  latencies.resize(received);
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p) { return latencies.empty() ? 0.0 : latencies[(size_t)(p * (latencies.size() - 1))]; };
+  printf("%-9s: %9.0f msgs/s sent, %6zu received, %5zu lost, %4zu reordered, %4zu duplicates, %4zu send errors, "
+         "latency p50 %7.1f us p99 %8.1f us\n",
+         name, sent.sent / seconds, statistics.received, statistics.lost, statistics.reordered, statistics.duplicates,
+         sent.sendErrors, percentile(0.5), percentile(0.99));
+
+  sender.disconnect();
+  receiver.disconnect();
+}
+
+int main() {
+  run("send", false, false);
+  run("sendmmsg", true, false);
+  run("gso", true, true);
+  return 0;
+}
@@ -0,0 +1,112 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "websocket_connection.h"
+
+// Throughput and round trip latency of WebSocketConnection against a local
+// echo peer (a server mode WebSocketConnection on an ephemeral port), with
+// and without permessage-deflate and frame batching.
+
+static const size_t MESSAGES = 100000;
+static const size_t PINGS = 2000;
+static const size_t PAYLOAD_SIZE = 1024;
+
+static std::atomic<size_t> echoed = 0;
+
+static void onEcho(void *userData, int id, const Message &message) {
+  const WebSocketMessage &wsMessage = static_cast<const WebSocketMessage &>(message);
+  WebSocketConnection *server = static_cast<WebSocketConnection *>(userData);
+  server->sendBinary(SharedPayload(std::string_view(wsMessage.payload)), wsMessage.peer);
+}
+
+static void onReply(void *userData, int id, const Message &message) { echoed++; }
+
+static bool waitFor(std::chrono::seconds timeout, auto condition) {
+  auto end = std::chrono::steady_clock::now() + timeout;
+  while (!condition()) {
+    if (std::chrono::steady_clock::now() > end) return false;
+    std::this_thread::yield();
+  }
+  return true;
+}
+
+// JSON-like telemetry, compressible the way the real payloads are
+static std::string makePayload() {
+  std::string payload;
+  for (size_t i = 0; payload.size() < PAYLOAD_SIZE; i++)
+    payload += "{\"sensor\":\"tyre_temp_" + std::to_string(i % 4) + "\",\"value\":" + std::to_string(80 + i % 7) + "},";
+  payload.resize(PAYLOAD_SIZE);
+  return payload;
+}
+
+static void run(bool deflate, std::chrono::milliseconds batchDelay) {
+  WebSocketConnectionParameters serverParameters;
+  serverParameters.mode = WEBSOCKET_MODE_SERVER;
+  serverParameters.host = "127.0.0.1";
+  serverParameters.port = 0;
+  serverParameters.deflate = deflate;
+  serverParameters.batchDelay = batchDelay;
+  WebSocketConnection server(serverParameters);
+  server.setMaxQueueSize(MESSAGES);
+  server.setUserData(&server);
+  server.setOnMessageCallback(onEcho);
+  server.connect();
+  if (server.getStatus() != CONNECTION_STATUS_CONNECTED) {
+    printf("could not listen on 127.0.0.1\n");
+    exit(1);
+  }
+
+  WebSocketConnectionParameters clientParameters;
+  clientParameters.host = "127.0.0.1";
+  clientParameters.port = server.getBoundPort();
+  clientParameters.deflate = deflate;
+  clientParameters.batchDelay = batchDelay;
+  WebSocketConnection client(clientParameters);
+  client.setMaxQueueSize(MESSAGES);
+  client.setOnMessageCallback(onReply);
+  client.connect();
+  if (!waitFor(std::chrono::seconds(5), [&]() { return client.getStatus() == CONNECTION_STATUS_CONNECTED; })) {
+    printf("handshake timed out\n");
+    exit(1);
+  }
+
+  SharedPayload payload(makePayload());
+
+  // Round trips, one message in flight
+  std::vector<double> latencies;
+  echoed = 0;
+  for (size_t i = 0; i < PINGS; i++) {
+    auto start = std::chrono::steady_clock::now();
+    client.sendBinary(payload);
+    if (!waitFor(std::chrono::seconds(5), [&]() { return echoed.load() > i; })) break;
+    latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  // Throughput, as many messages in flight as the queues hold
+  echoed = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < MESSAGES; i++)
+    while (!client.sendBinary(payload)) std::this_thread::yield();
+  bool complete = waitFor(std::chrono::seconds(60), [&]() { return echoed.load() >= MESSAGES; });
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  auto percentile = [&](double p) { return latencies.empty() ? 0.0 : latencies[(size_t)(p * (latencies.size() - 1))]; };
+  printf("deflate %-3s batch %2lld ms: %9.0f msgs/s, rtt p50 %7.1f us p99 %7.1f us%s\n", deflate ? "on" : "off",
+         (long long)batchDelay.count(), echoed.load() / seconds, percentile(0.5), percentile(0.99),
+         complete ? "" : " (timeout)");
+
+  client.disconnect();
+  server.disconnect();
+}
+
+int main() {
+  for (bool deflate : {false, true})
+    for (int delay : {0, 1, 5}) run(deflate, std::chrono::milliseconds(delay));
+  return 0;
+}